@@ -0,0 +1,68 @@
+//
+// Capture files of MQTT messages as seen by a subscriber, for replay.
+//
+// Layout: "WITCAP01" then records of
+//   int64 ts_us | uint16 topic_len | uint32 payload_len | topic | payload
+// in host byte order (the tools only run on little endian Linux).
+//
+
+#ifndef WIT_HUB_HOST_CAPTURE_H
+#define WIT_HUB_HOST_CAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+namespace host {
+struct CaptureRecord {
+  int64_t ts_us = 0;
+  std::string_view topic;
+  const uint8_t *data = nullptr;
+  size_t len          = 0;
+};
+
+class CaptureWriter {
+  std::FILE *_file = nullptr;
+
+public:
+  CaptureWriter() = default;
+  CaptureWriter(const CaptureWriter &)            = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+  ~CaptureWriter() {
+    close();
+  }
+
+  bool open(const std::string &path);
+  bool write(int64_t ts_us, std::string_view topic, const uint8_t *data, size_t len);
+  void close();
+};
+
+/**
+ * @brief read a capture through a read only mapping; records point into it
+ */
+class CaptureReader {
+  const uint8_t *_map = nullptr;
+  size_t _size        = 0;
+  size_t _pos         = 0;
+
+public:
+  CaptureReader() = default;
+  CaptureReader(const CaptureReader &)            = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+  CaptureReader(CaptureReader &&other) noexcept;
+  ~CaptureReader() {
+    close();
+  }
+
+  bool open(const std::string &path);
+  /**
+   * @return false at the end of the file or on a truncated record
+   */
+  bool next(CaptureRecord &record);
+  void rewind();
+  void close();
+};
+}
+
+#endif // WIT_HUB_HOST_CAPTURE_H
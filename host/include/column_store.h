@@ -0,0 +1,181 @@
+//
+// Memory-mapped columnar time series file, one per device.
+//
+// Layout:
+//   FileHeader (one page)
+//   Block 0, Block 1, ...   (all of `block_size` bytes)
+// and each block is
+//   BlockHeader | int64 ts[capacity] | int16 col_0[capacity] ... col_8[capacity]
+//
+// A block only holds samples of one time chunk (`chunk_us`), so its
+// [t_min, t_max] plus per column min/max let a range scan skip whole blocks
+// without touching the columns.
+//
+
+#ifndef WIT_HUB_HOST_COLUMN_STORE_H
+#define WIT_HUB_HOST_COLUMN_STORE_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "wit_protocol.h"
+
+namespace host {
+constexpr size_t COLUMNS = wit::DATA_FIELDS;
+
+struct FileHeader {
+  std::array<char, 4> magic;
+  uint32_t version;
+  std::array<uint8_t, 6> addr;
+  uint16_t _reserved0;
+  uint32_t block_capacity;
+  uint32_t block_size;
+  int64_t chunk_us;
+  uint64_t block_count;
+};
+
+struct BlockHeader {
+  int64_t t_min;
+  int64_t t_max;
+  uint32_t count;
+  uint32_t _reserved0;
+  std::array<int16_t, COLUMNS> min;
+  std::array<int16_t, COLUMNS> max;
+  uint32_t _reserved1;
+};
+static_assert(sizeof(BlockHeader) == 64);
+
+class ColumnStore {
+public:
+  struct Options {
+    // samples per block, rounded up to a multiple of 32
+    uint32_t block_capacity = 1024;
+    // time span of a block
+    int64_t chunk_us = 10'000'000;
+    // how many blocks to grow the file by at once
+    uint32_t grow_blocks = 16;
+  };
+
+private:
+  static constexpr size_t HEADER_SIZE = 4096;
+  static constexpr uint32_t VERSION   = 1;
+
+  int _fd            = -1;
+  bool _writable     = false;
+  uint8_t *_map      = nullptr;
+  size_t _map_size   = 0;
+  size_t _blocks_cap = 0;
+  Options _opts{};
+
+  FileHeader &header() const {
+    return *reinterpret_cast<FileHeader *>(_map);
+  }
+  uint8_t *block_ptr(size_t i) const {
+    return _map + HEADER_SIZE + i * header().block_size;
+  }
+  BlockHeader &mut_block(size_t i) const {
+    return *reinterpret_cast<BlockHeader *>(block_ptr(i));
+  }
+  int64_t *mut_ts(size_t i) const {
+    return reinterpret_cast<int64_t *>(block_ptr(i) + sizeof(BlockHeader));
+  }
+  int16_t *mut_col(size_t i, size_t col) const {
+    auto cap = header().block_capacity;
+    return reinterpret_cast<int16_t *>(block_ptr(i) + sizeof(BlockHeader) + cap * sizeof(int64_t)) + col * cap;
+  }
+  bool map_file(size_t size);
+  bool ensure_blocks(size_t n);
+  bool open_block(int64_t ts);
+
+public:
+  ColumnStore() = default;
+  ColumnStore(const ColumnStore &)            = delete;
+  ColumnStore &operator=(const ColumnStore &) = delete;
+  ColumnStore(ColumnStore &&other) noexcept;
+  ~ColumnStore() {
+    close();
+  }
+
+  /**
+   * @brief open (or create) a store for writing
+   * @note options are only applied when the file is created
+   */
+  bool open(const std::string &path, const std::array<uint8_t, 6> &addr, const Options &opts);
+  bool open(const std::string &path, const std::array<uint8_t, 6> &addr) {
+    return open(path, addr, Options{});
+  }
+
+  bool open_readonly(const std::string &path);
+
+  /**
+   * @brief append `n` samples
+   * @param ts sample time in microseconds; a timestamp older than the last
+   * one is clamped to it so blocks stay sorted
+   * @param cols `COLUMNS` pointers of `n` values each
+   * @return false if the file can't grow
+   */
+  bool append(const int64_t *ts, const int16_t *const *cols, size_t n);
+
+  /**
+   * @note a reader's mapping may predate the writer growing the file, so the
+   * count is clamped to the blocks this mapping covers
+   */
+  [[nodiscard]] size_t block_count() const {
+    return _map == nullptr ? 0 : std::min<size_t>(header().block_count, _blocks_cap);
+  }
+  [[nodiscard]] const FileHeader &file_header() const {
+    return header();
+  }
+  [[nodiscard]] const BlockHeader &block(size_t i) const {
+    return mut_block(i);
+  }
+  [[nodiscard]] const int64_t *block_ts(size_t i) const {
+    return mut_ts(i);
+  }
+  [[nodiscard]] const int16_t *block_col(size_t i, size_t col) const {
+    return mut_col(i, col);
+  }
+
+  /**
+   * @brief visit the rows with `from <= ts <= to`
+   * @param on_rows `on_rows(size_t block, size_t first, size_t last, bool whole)`,
+   * called once per overlapping block with the half open row range `[first, last)`;
+   * `whole` is true when the entire block is inside the range, so its header
+   * min/max can be used as is
+   */
+  template <typename F>
+  void scan(int64_t from, int64_t to, F &&on_rows) const {
+    auto n = block_count();
+    for (size_t b = 0; b < n; ++b) {
+      const auto &blk = block(b);
+      if (blk.count == 0 || blk.t_max < from || blk.t_min > to) {
+        continue;
+      }
+      if (blk.t_min >= from && blk.t_max <= to) {
+        on_rows(b, size_t{0}, static_cast<size_t>(blk.count), true);
+        continue;
+      }
+      const auto *ts = block_ts(b);
+      size_t first   = 0;
+      while (first < blk.count && ts[first] < from) {
+        ++first;
+      }
+      size_t last = first;
+      while (last < blk.count && ts[last] <= to) {
+        ++last;
+      }
+      if (first < last) {
+        on_rows(b, first, last, false);
+      }
+    }
+  }
+
+  void sync(bool blocking = false);
+
+  void close();
+};
+}
+
+#endif // WIT_HUB_HOST_COLUMN_STORE_H
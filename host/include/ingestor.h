@@ -0,0 +1,101 @@
+//
+// Turn `/wit/<addr>/data` messages into per-device column stores.
+//
+
+#ifndef WIT_HUB_HOST_INGESTOR_H
+#define WIT_HUB_HOST_INGESTOR_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "column_store.h"
+#include "wit_protocol.h"
+
+namespace host {
+using addr_t = std::array<uint8_t, 6>;
+
+/**
+ * @brief parse the address out of a `/wit/<addr>/data` topic
+ * @note `<addr>` is formatted by `utils::toHex` on the hub, 12 lower case hex chars
+ */
+std::optional<addr_t> parse_data_topic(std::string_view topic);
+
+std::string addr_to_hex(const addr_t &addr);
+
+class Ingestor {
+public:
+  struct Stats {
+    uint64_t messages       = 0;
+    uint64_t bytes          = 0;
+    uint64_t frames         = 0;
+    uint64_t other_frames   = 0;
+    uint64_t dropped_bytes  = 0;
+    uint64_t unknown_topics = 0;
+    uint64_t store_errors   = 0;
+  };
+
+private:
+  struct Device {
+    addr_t addr{};
+    wit::FrameReassembler reassembler{};
+    ColumnStore store{};
+    // frames waiting for the next batched decode, `FRAME_SIZE` bytes each
+    std::vector<uint8_t> frames;
+    std::vector<int64_t> ts;
+  };
+
+  // a store that failed to open, retried no earlier than `retry_us`
+  struct Failed {
+    int64_t retry_us;
+    int64_t backoff_us;
+  };
+  static constexpr int64_t RETRY_MIN_US = 1'000'000;
+  static constexpr int64_t RETRY_MAX_US = 60'000'000;
+
+  std::string _dir;
+  ColumnStore::Options _opts;
+  size_t _batch;
+  std::unordered_map<uint64_t, std::unique_ptr<Device>> _devices;
+  std::unordered_map<uint64_t, Failed> _failed;
+  std::array<std::vector<int16_t>, COLUMNS> _cols;
+  Stats _stats{};
+
+  /**
+   * @return nullptr if the store can't be opened; messages are dropped until
+   * the retry, which backs off up to `RETRY_MAX_US`
+   */
+  Device *device(const addr_t &addr, int64_t ts_us);
+  void flush(Device &device);
+
+public:
+  /**
+   * @param dir where `<addr>.witc` files are created
+   * @param batch frames to collect per device before decoding them at once
+   */
+  Ingestor(std::string dir, const ColumnStore::Options &opts, size_t batch = 256);
+
+  /**
+   * @param ts_us arrival time, used for every frame in the message
+   */
+  void on_message(int64_t ts_us, std::string_view topic, const uint8_t *data, size_t len);
+
+  void flush();
+
+  void sync();
+
+  [[nodiscard]] const Stats &stats() const {
+    return _stats;
+  }
+
+  [[nodiscard]] size_t device_count() const {
+    return _devices.size();
+  }
+};
+}
+
+#endif // WIT_HUB_HOST_INGESTOR_H
@@ -0,0 +1,143 @@
+//
+// In-process stand-in for an MQTT broker, to run several simulated hubs
+// against each other without a network.
+//
+
+#ifndef WIT_HUB_HOST_LOCAL_BROKER_H
+#define WIT_HUB_HOST_LOCAL_BROKER_H
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace host {
+/**
+ * @brief the parts of MQTT the hubs rely on: topic filters with `+` and `#`,
+ * QoS 0 delivery after a fixed latency and last wills
+ *
+ * Time is driven by the caller; nothing is delivered until `run_until`.
+ */
+class LocalBroker {
+public:
+  using on_message_t = std::function<void(std::string_view topic, const uint8_t *data, size_t len)>;
+
+private:
+  struct Client {
+    bool connected = false;
+    on_message_t on_message;
+    std::vector<std::string> filters;
+    std::string will_topic;
+    std::vector<uint8_t> will;
+  };
+  struct Pending {
+    int64_t due_ms;
+    uint64_t order;
+    std::string topic;
+    std::vector<uint8_t> payload;
+
+    bool operator>(const Pending &other) const {
+      return due_ms != other.due_ms ? due_ms > other.due_ms : order > other.order;
+    }
+  };
+
+  int64_t _latency_ms    = 0;
+  int64_t _will_delay_ms = 0;
+  uint64_t _order        = 0;
+  std::vector<Client> _clients;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<>> _pending;
+  uint64_t _delivered = 0;
+
+public:
+  /**
+   * @param will_delay_ms how long the broker takes to notice a lost client
+   * (about 1.5 keepalive intervals)
+   */
+  explicit LocalBroker(int64_t latency_ms = 0, int64_t will_delay_ms = 0)
+      : _latency_ms(latency_ms), _will_delay_ms(will_delay_ms) {}
+
+  static bool matches(std::string_view filter, std::string_view topic) {
+    while (true) {
+      auto f_end   = filter.find('/');
+      auto t_end   = topic.find('/');
+      auto f_level = filter.substr(0, f_end);
+      auto t_level = topic.substr(0, t_end);
+      if (f_level == "#") {
+        return true;
+      }
+      if (f_level != "+" && f_level != t_level) {
+        return false;
+      }
+      if (f_end == std::string_view::npos || t_end == std::string_view::npos) {
+        return f_end == t_end;
+      }
+      filter.remove_prefix(f_end + 1);
+      topic.remove_prefix(t_end + 1);
+    }
+  }
+
+  /**
+   * @return client id
+   */
+  int connect(on_message_t on_message, std::string will_topic = {}, std::vector<uint8_t> will = {}) {
+    _clients.push_back(Client{
+        .connected  = true,
+        .on_message = std::move(on_message),
+        .filters    = {},
+        .will_topic = std::move(will_topic),
+        .will       = std::move(will),
+    });
+    return static_cast<int>(_clients.size() - 1);
+  }
+
+  void subscribe(int client, std::string filter) {
+    _clients.at(client).filters.push_back(std::move(filter));
+  }
+
+  void publish(std::string topic, const uint8_t *data, size_t len, int64_t now_ms) {
+    _pending.push(Pending{now_ms + _latency_ms, _order++, std::move(topic), {data, data + len}});
+  }
+
+  /**
+   * @param graceful a clean DISCONNECT discards the last will
+   */
+  void disconnect(int client, bool graceful, int64_t now_ms) {
+    auto &c     = _clients.at(client);
+    c.connected = false;
+    c.filters.clear();
+    if (!graceful && !c.will_topic.empty()) {
+      _pending.push(Pending{now_ms + _will_delay_ms + _latency_ms, _order++, c.will_topic, c.will});
+    }
+  }
+
+  /**
+   * @brief deliver every message due by `now_ms`
+   */
+  void run_until(int64_t now_ms) {
+    while (!_pending.empty() && _pending.top().due_ms <= now_ms) {
+      auto msg = _pending.top();
+      _pending.pop();
+      for (auto &c : _clients) {
+        if (!c.connected) {
+          continue;
+        }
+        for (const auto &f : c.filters) {
+          if (matches(f, msg.topic)) {
+            c.on_message(msg.topic, msg.payload.data(), msg.payload.size());
+            _delivered += 1;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  [[nodiscard]] uint64_t delivered() const {
+    return _delivered;
+  }
+};
+}
+
+#endif // WIT_HUB_HOST_LOCAL_BROKER_H
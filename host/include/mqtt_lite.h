@@ -0,0 +1,82 @@
+//
+// Minimal MQTT 3.1.1 client over a blocking TCP socket.
+//
+// Just enough for the host tools: CONNECT, SUBSCRIBE, QoS 0/1 PUBLISH in both
+// directions and keep alive. No TLS, no QoS 2, no persistence.
+//
+
+#ifndef WIT_HUB_HOST_MQTT_LITE_H
+#define WIT_HUB_HOST_MQTT_LITE_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace host {
+class MqttLite {
+  int _fd                = -1;
+  uint16_t _next_id      = 1;
+  uint16_t _keepalive_s  = 30;
+  int64_t _last_send_ms  = 0;
+  std::vector<uint8_t> _rx;
+  size_t _rx_begin = 0;
+  std::vector<uint8_t> _tx;
+
+  bool send_packet(uint8_t header, const std::vector<uint8_t> &body);
+  bool send_all(const uint8_t *data, size_t len);
+  /**
+   * @return number of bytes available in `_rx` after the call, 0 on EOF/error,
+   * -1 on timeout
+   */
+  int fill(int timeout_ms);
+  enum class Take : uint8_t {
+    packet,
+    // the buffer doesn't hold a complete packet yet
+    incomplete,
+    // the remaining length is longer than 4 bytes; the stream can't be resynced
+    malformed,
+  };
+
+  /**
+   * @brief try to take one complete packet out of `_rx`
+   */
+  Take take_packet(uint8_t &header, const uint8_t *&body, size_t &len);
+
+public:
+  using on_publish_t = std::function<void(std::string_view topic, const uint8_t *data, size_t len)>;
+
+  MqttLite() = default;
+  MqttLite(const MqttLite &)            = delete;
+  MqttLite &operator=(const MqttLite &) = delete;
+  ~MqttLite() {
+    close();
+  }
+
+  [[nodiscard]] bool is_connected() const {
+    return _fd >= 0;
+  }
+
+  /**
+   * @brief open the socket and wait for CONNACK
+   * @return false on any failure (reason printed to stderr)
+   */
+  bool connect(const std::string &host, uint16_t port, const std::string &client_id, uint16_t keepalive_s = 30);
+
+  bool subscribe(const std::string &topic, uint8_t qos = 0);
+
+  bool publish(std::string_view topic, const uint8_t *data, size_t len, uint8_t qos = 0, bool retain = false);
+
+  /**
+   * @brief read and dispatch incoming packets for at most `timeout_ms`
+   * @note send PINGREQ when the keep alive is due
+   * @return false if the connection is lost
+   */
+  bool poll(int timeout_ms, const on_publish_t &on_publish);
+
+  void close();
+};
+}
+
+#endif // WIT_HUB_HOST_MQTT_LITE_H
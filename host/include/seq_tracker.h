@@ -0,0 +1,106 @@
+//
+// Loss, reordering and jitter of a sequence-numbered datagram stream.
+//
+
+#ifndef WIT_HUB_HOST_SEQ_TRACKER_H
+#define WIT_HUB_HOST_SEQ_TRACKER_H
+
+#include <bitset>
+#include <cstdint>
+#include <cstdlib>
+
+namespace host {
+/**
+ * @brief RFC 3550 style receiver statistics
+ *
+ * Loss is `expected - received`, where `expected` spans the lowest to the
+ * highest sequence number seen, so a late (reordered) datagram that arrives
+ * after its gap was counted reduces the loss again. Duplicates are detected
+ * within the last `WINDOW` sequence numbers.
+ */
+class SeqTracker {
+public:
+  static constexpr uint32_t WINDOW = 4096;
+
+  struct Stats {
+    uint64_t received   = 0;
+    uint64_t expected   = 0;
+    uint64_t reordered  = 0;
+    uint64_t duplicates = 0;
+    // sequence number jumps forward by more than one
+    uint64_t gaps = 0;
+    // interarrival jitter, microseconds
+    double jitter_us = 0;
+
+    [[nodiscard]] int64_t lost() const {
+      return static_cast<int64_t>(expected) - static_cast<int64_t>(received);
+    }
+  };
+
+private:
+  bool _started         = false;
+  uint32_t _base        = 0;
+  uint32_t _max         = 0;
+  int64_t _prev_transit = 0;
+  std::bitset<WINDOW> _seen{};
+  Stats _stats{};
+
+public:
+  /**
+   * @param sent_us sender clock when the datagram was sent
+   * @param arrival_us receiver clock when it arrived
+   */
+  void on_datagram(uint32_t seq, int64_t sent_us, int64_t arrival_us) {
+    auto transit = arrival_us - sent_us;
+    if (!_started) {
+      _started      = true;
+      _base         = seq;
+      _max          = seq;
+      _prev_transit = transit;
+      _seen.reset();
+      _seen.set(seq % WINDOW);
+      _stats.received = 1;
+      _stats.expected = 1;
+      return;
+    }
+    auto ahead = static_cast<int32_t>(seq - _max);
+    if (ahead > 0) {
+      if (ahead > 1) {
+        _stats.gaps += 1;
+      }
+      // forget what falls out of the window
+      for (uint32_t s = _max + 1; s != seq; ++s) {
+        _seen.reset(s % WINDOW);
+        if (s - _max > WINDOW) {
+          break;
+        }
+      }
+      _max = seq;
+      _seen.set(seq % WINDOW);
+      _stats.expected = static_cast<uint64_t>(_max - _base) + 1;
+    } else {
+      if (static_cast<uint32_t>(-ahead) >= WINDOW || seq - _base > _max - _base) {
+        // too old to tell, or before the first one seen
+        _stats.reordered += 1;
+        return;
+      }
+      if (_seen.test(seq % WINDOW)) {
+        _stats.duplicates += 1;
+        return;
+      }
+      _seen.set(seq % WINDOW);
+      _stats.reordered += 1;
+    }
+    _stats.received += 1;
+    auto d = std::llabs(transit - _prev_transit);
+    _prev_transit = transit;
+    _stats.jitter_us += (static_cast<double>(d) - _stats.jitter_us) / 16.0;
+  }
+
+  [[nodiscard]] const Stats &stats() const {
+    return _stats;
+  }
+};
+}
+
+#endif // WIT_HUB_HOST_SEQ_TRACKER_H
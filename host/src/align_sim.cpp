@@ -0,0 +1,271 @@
+//
+// align_sim: checks the time alignment stage of main/include/time_align.h
+// against simulated sensors with known clocks and signals.
+//
+// usage: align_sim [-n devices] [-R rate_hz] [-d max_drift_ppm] [-c conn_interval_ms]
+//                  [-F frame_rate_hz] [-L latency_ms] [-s seconds] [-x seed]
+//
+// Every sensor samples at `rate` off by up to `-d` ppm, with a random phase.
+// Its samples are delivered in bursts at its BLE connection events every
+// `conn_interval_ms`, one of which is lost now and then (the samples move on
+// to the next event). The last sensor goes silent for a while to check the
+// missing flag, and the one before it disconnects for good two thirds in, to
+// check that it's left out of the frames once stale. Frames are taken at
+// `frame_rate` and compared with the true signals at the frame time.
+//
+// Reported: how well the sample times and the drift are estimated, the error
+// of the interpolated values and the status counts. The exit code is 1 if the
+// sensors are not aligned within a sample period, silence isn't flagged, a
+// disconnected sensor is still in the frames (or flagged missing) after
+// `stale_us`, or a
+// drift estimate is further off than `ClockTracker::drift_bound_ppm` (a
+// sample period over the samples it was estimated from: 83 ppm after 120 s at
+// 100 Hz, 8 ppm after 1200 s) or comes on the wire before it's within
+// `drift_bound_ppm` of the options.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <unistd.h>
+#include <vector>
+#include "time_align.h"
+
+namespace {
+struct Config {
+  int devices          = 12;
+  double rate_hz       = 100;
+  double max_drift_ppm = 100;
+  double conn_ms       = 30;
+  double frame_rate_hz = 50;
+  double latency_ms    = 60;
+  double seconds       = 120;
+  uint32_t seed        = 1;
+};
+
+struct SimDevice {
+  align::addr_t addr{};
+  double drift_ppm  = 0;
+  double period_us  = 0;
+  double phase_us   = 0;
+  double conn_phase = 0;
+  uint64_t k        = 0;
+  // samples produced but not delivered yet: true time and fields
+  std::deque<std::pair<double, align::fields_t>> queue{};
+  align::ClockTracker clock{};
+  // estimated - true sample time
+  double err_sum    = 0;
+  double err_sq_sum = 0;
+  uint64_t err_n    = 0;
+};
+
+// raw values of the signals at true time `t_us`; yaw spins around to exercise
+// the ±180° wrap
+align::fields_t signal(int d, double t_us) {
+  auto t   = t_us / 1e6;
+  auto res = align::fields_t{};
+  for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+    auto w = 2 * M_PI * (0.5 + 0.25 * f + 0.05 * d);
+    res[f] = static_cast<int16_t>(std::lround(8000 * std::sin(w * t)));
+  }
+  auto yaw = std::fmod(t * 90.0 + d * 10.0, 360.0) - 180.0;
+  res[static_cast<size_t>(wit::Field::Yaw)] = static_cast<int16_t>(std::lround(yaw / wit::ANGLE_SCALE));
+  return res;
+}
+}
+
+int main(int argc, char **argv) {
+  auto cfg = Config{};
+  int opt  = 0;
+  while ((opt = ::getopt(argc, argv, "n:R:d:c:F:L:s:x:")) != -1) {
+    switch (opt) {
+      case 'n': cfg.devices = std::clamp(std::atoi(optarg), 1, static_cast<int>(align::MAX_DEVICES)); break;
+      case 'R': cfg.rate_hz = std::atof(optarg); break;
+      case 'd': cfg.max_drift_ppm = std::atof(optarg); break;
+      case 'c': cfg.conn_ms = std::atof(optarg); break;
+      case 'F': cfg.frame_rate_hz = std::atof(optarg); break;
+      case 'L': cfg.latency_ms = std::atof(optarg); break;
+      case 's': cfg.seconds = std::atof(optarg); break;
+      case 'x': cfg.seed = static_cast<uint32_t>(std::atoi(optarg)); break;
+      default:
+        std::fprintf(stderr,
+                     "usage: %s [-n devices] [-R rate_hz] [-d max_drift_ppm] [-c conn_interval_ms]\n"
+                     "          [-F frame_rate_hz] [-L latency_ms] [-s seconds] [-x seed]\n",
+                     argv[0]);
+        return 2;
+    }
+  }
+
+  auto rng     = std::mt19937{cfg.seed};
+  auto uniform = std::uniform_real_distribution<double>{0, 1};
+  auto opts    = align::Aligner::Options{.latency_us = static_cast<int64_t>(cfg.latency_ms * 1000)};
+  auto aligner = align::Aligner{opts};
+  auto devices = std::vector<SimDevice>(cfg.devices);
+  auto conn_us = cfg.conn_ms * 1000;
+  for (int d = 0; d < cfg.devices; ++d) {
+    auto &dev      = devices[d];
+    dev.addr       = {0xc0, 0xff, 0x57, 0x49, 0x54, static_cast<uint8_t>(d)};
+    dev.drift_ppm  = (2 * uniform(rng) - 1) * cfg.max_drift_ppm;
+    dev.period_us  = 1e6 / cfg.rate_hz / (1 + dev.drift_ppm * 1e-6);
+    dev.phase_us   = uniform(rng) * dev.period_us;
+    dev.conn_phase = uniform(rng) * conn_us;
+    dev.clock      = align::ClockTracker{opts.clock};
+  }
+  // the last device is silent in the middle third
+  auto silent_from = cfg.seconds * 1e6 / 3;
+  auto silent_to   = 2 * silent_from;
+  auto silent      = [&](int d, double t_us) {
+    return d == cfg.devices - 1 && cfg.devices > 1 && t_us >= silent_from && t_us < silent_to;
+  };
+  // the one before it disconnects in the last third and doesn't come back
+  auto gone_dev  = cfg.devices > 2 ? cfg.devices - 2 : -1;
+  auto gone_from = static_cast<int64_t>(silent_to + cfg.seconds * 1e6 / 6);
+  auto gone      = false;
+
+  constexpr int64_t STEP_US = 250;
+  auto frame_us             = static_cast<int64_t>(1e6 / cfg.frame_rate_hz);
+  auto end_us               = static_cast<int64_t>(cfg.seconds * 1e6);
+  auto next_frame           = frame_us;
+  auto frame                = align::Frame{};
+  uint8_t buf[align::MAX_FRAME];
+  // skip the warmup of the fits
+  auto settle_us          = static_cast<int64_t>(2e6);
+  double value_sq_sum     = 0;
+  uint64_t value_n        = 0;
+  uint64_t ok             = 0;
+  uint64_t late           = 0;
+  uint64_t missing        = 0;
+  uint64_t flagged_silent = 0;
+  uint64_t silent_frames  = 0;
+  uint64_t malformed      = 0;
+  // drifts on the wire further off than the options allow
+  uint64_t wire_drift_off = 0;
+  // entries of the disconnected device, or missing ones, once it's stale
+  uint64_t gone_entries   = 0;
+  uint64_t gone_missing   = 0;
+  for (int64_t now = 0; now <= end_us; now += STEP_US) {
+    if (gone_dev >= 0 && !gone && now >= gone_from) {
+      gone = true;
+      devices[gone_dev].queue.clear();
+      aligner.disconnect(devices[gone_dev].addr, now);
+    }
+    for (int d = 0; d < cfg.devices; ++d) {
+      auto &dev = devices[d];
+      if (gone && d == gone_dev) {
+        continue;
+      }
+      // sample
+      while (dev.phase_us + dev.k * dev.period_us <= now) {
+        auto t = dev.phase_us + dev.k * dev.period_us;
+        dev.k += 1;
+        if (!silent(d, t)) {
+          dev.queue.emplace_back(t, signal(d, t));
+        }
+      }
+      // connection event, 1 in 20 lost
+      auto event = std::fmod(now - dev.conn_phase + conn_us * 1e6, conn_us) < STEP_US;
+      if (event && uniform(rng) >= 0.05) {
+        while (!dev.queue.empty()) {
+          auto [t, fields] = dev.queue.front();
+          dev.queue.pop_front();
+          aligner.push(dev.addr, now, fields);
+          auto est = dev.clock.on_sample(now);
+          if (now >= settle_us && dev.clock.locked()) {
+            dev.err_sum += est - t;
+            dev.err_sq_sum += (est - t) * (est - t);
+            dev.err_n += 1;
+          }
+        }
+      }
+    }
+    if (now >= next_frame) {
+      next_frame += frame_us;
+      aligner.frame(now, frame);
+      // through the wire format, as a consumer would see it
+      auto len = align::encode(frame, buf, sizeof(buf));
+      if (len == 0 || !align::parse(buf, len, frame)) {
+        malformed += 1;
+        continue;
+      }
+      auto t          = static_cast<double>(frame.t_us);
+      auto in_silence = silent(cfg.devices - 1, t);
+      auto gone_stale = gone && now - gone_from > opts.stale_us;
+      silent_frames += in_silence ? 1 : 0;
+      for (size_t i = 0; i < frame.count; ++i) {
+        const auto &e = frame.entries[i];
+        auto d        = e.addr[5];
+        if (gone_stale) {
+          gone_entries += d == gone_dev ? 1 : 0;
+          gone_missing += e.status == align::Status::missing ? 1 : 0;
+        }
+        if (e.drift_ppm != align::DRIFT_UNKNOWN &&
+            std::fabs(e.drift_ppm - devices[d].drift_ppm) > opts.clock.drift_bound_ppm + 1) {
+          wire_drift_off += 1;
+        }
+        ok += e.status == align::Status::ok ? 1 : 0;
+        late += e.status == align::Status::late ? 1 : 0;
+        missing += e.status == align::Status::missing ? 1 : 0;
+        if (d == cfg.devices - 1 && in_silence && e.status == align::Status::missing) {
+          flagged_silent += 1;
+        }
+        if (e.status != align::Status::ok || now < settle_us) {
+          continue;
+        }
+        // compared at the frame time shifted by the device's mean delay,
+        // which is common to all the devices on the same connection interval
+        const auto &dev = devices[d];
+        auto bias       = dev.err_n == 0 ? 0 : dev.err_sum / dev.err_n;
+        auto truth      = signal(d, t - bias);
+        auto err        = static_cast<double>(e.fields[0]) - truth[0];
+        value_sq_sum += err * err;
+        value_n += 1;
+      }
+    }
+  }
+
+  std::printf("%d devices at %.0f Hz (drift up to %.0f ppm), conn interval %.1f ms, frames at %.0f Hz, latency %.0f ms\n",
+              cfg.devices, cfg.rate_hz, cfg.max_drift_ppm, cfg.conn_ms, cfg.frame_rate_hz, cfg.latency_ms);
+  std::printf("%6s %10s %10s %10s %10s %12s %8s\n", "device", "drift", "estimate", "bound", "bias_ms", "jitter_ms",
+              "resyncs");
+  double min_bias   = 1e18;
+  double max_bias   = -1e18;
+  double max_jitter = 0;
+  auto drift_ok     = true;
+  for (int d = 0; d < cfg.devices; ++d) {
+    const auto &dev = devices[d];
+    auto bias       = dev.err_n == 0 ? 0 : dev.err_sum / dev.err_n;
+    auto jitter     = dev.err_n == 0 ? 0 : std::sqrt(std::max(0.0, dev.err_sq_sum / dev.err_n - bias * bias));
+    min_bias        = std::min(min_bias, bias);
+    max_bias        = std::max(max_bias, bias);
+    max_jitter      = std::max(max_jitter, jitter);
+    auto bound      = dev.clock.drift_bound_ppm();
+    auto off        = std::fabs(dev.clock.drift_ppm() - dev.drift_ppm) > bound;
+    drift_ok        = drift_ok && !off;
+    std::printf("%6d %10.1f %10.1f %10.1f %10.3f %12.3f %8u%s\n", d, dev.drift_ppm, dev.clock.drift_ppm(), bound,
+                bias / 1000, jitter / 1000, dev.clock.resyncs(), off ? " FAIL" : "");
+  }
+  auto period_us = 1e6 / cfg.rate_hz;
+  auto skew_us   = max_bias - min_bias;
+  std::printf("skew between devices %.3f ms, max jitter %.3f ms, acc x rms error %.1f raw (of 8000)\n",
+              skew_us / 1000, max_jitter / 1000, value_n == 0 ? 0 : std::sqrt(value_sq_sum / value_n));
+  std::printf("entries: ok %lu, late %lu, missing %lu; silence flagged in %lu of %lu frames; %lu malformed; aligner %zu bytes\n",
+              ok, late, missing, flagged_silent, silent_frames, malformed, sizeof(aligner));
+  std::printf("drift on the wire once within %.0f ppm: %lu entries further off\n", opts.clock.drift_bound_ppm,
+              wire_drift_off);
+  if (gone_dev >= 0) {
+    std::printf("device %d disconnected at %.0f s: %lu entries of it and %lu missing ones after %.0f ms\n", gone_dev,
+                gone_from / 1e6, gone_entries, gone_missing, opts.stale_us / 1e3);
+  }
+
+  auto pass = skew_us < period_us && max_jitter < period_us && malformed == 0 && drift_ok && wire_drift_off == 0 &&
+              gone_entries == 0 && gone_missing == 0;
+  // it takes `stale_us` (and the samples still in flight) to call a sensor missing
+  auto stale_frames = static_cast<uint64_t>((opts.stale_us + 2 * conn_us) / frame_us) + 1;
+  if (cfg.devices > 1) {
+    pass = pass && flagged_silent + stale_frames >= silent_frames;
+  }
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+//
+// Capture files, see capture.h
+//
+
+#include "capture.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace host {
+namespace {
+  constexpr char MAGIC[8]       = {'W', 'I', 'T', 'C', 'A', 'P', '0', '1'};
+  constexpr size_t RECORD_HEAD = sizeof(int64_t) + sizeof(uint16_t) + sizeof(uint32_t);
+}
+
+bool CaptureWriter::open(const std::string &path) {
+  close();
+  _file = std::fopen(path.c_str(), "wb");
+  if (_file == nullptr) {
+    std::fprintf(stderr, "capture: open %s failed: %s\n", path.c_str(), std::strerror(errno));
+    return false;
+  }
+  return std::fwrite(MAGIC, sizeof(MAGIC), 1, _file) == 1;
+}
+
+bool CaptureWriter::write(int64_t ts_us, std::string_view topic, const uint8_t *data, size_t len) {
+  if (_file == nullptr || topic.size() > UINT16_MAX || len > UINT32_MAX) {
+    return false;
+  }
+  uint8_t head[RECORD_HEAD];
+  auto topic_len   = static_cast<uint16_t>(topic.size());
+  auto payload_len = static_cast<uint32_t>(len);
+  std::memcpy(head, &ts_us, sizeof(ts_us));
+  std::memcpy(head + 8, &topic_len, sizeof(topic_len));
+  std::memcpy(head + 10, &payload_len, sizeof(payload_len));
+  return std::fwrite(head, sizeof(head), 1, _file) == 1 &&
+         std::fwrite(topic.data(), 1, topic.size(), _file) == topic.size() &&
+         std::fwrite(data, 1, len, _file) == len;
+}
+
+void CaptureWriter::close() {
+  if (_file != nullptr) {
+    std::fclose(_file);
+    _file = nullptr;
+  }
+}
+
+CaptureReader::CaptureReader(CaptureReader &&other) noexcept
+    : _map(other._map), _size(other._size), _pos(other._pos) {
+  other._map  = nullptr;
+  other._size = 0;
+}
+
+bool CaptureReader::open(const std::string &path) {
+  close();
+  auto fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::fprintf(stderr, "capture: open %s failed: %s\n", path.c_str(), std::strerror(errno));
+    return false;
+  }
+  struct stat st {};
+  ::fstat(fd, &st);
+  if (static_cast<size_t>(st.st_size) < sizeof(MAGIC)) {
+    std::fprintf(stderr, "capture: %s is too short\n", path.c_str());
+    ::close(fd);
+    return false;
+  }
+  auto p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    std::fprintf(stderr, "capture: mmap %s failed: %s\n", path.c_str(), std::strerror(errno));
+    return false;
+  }
+  _map  = static_cast<const uint8_t *>(p);
+  _size = st.st_size;
+  if (std::memcmp(_map, MAGIC, sizeof(MAGIC)) != 0) {
+    std::fprintf(stderr, "capture: %s is not a capture\n", path.c_str());
+    close();
+    return false;
+  }
+  ::madvise(p, _size, MADV_SEQUENTIAL);
+  _pos = sizeof(MAGIC);
+  return true;
+}
+
+bool CaptureReader::next(CaptureRecord &record) {
+  if (_map == nullptr || _pos + RECORD_HEAD > _size) {
+    return false;
+  }
+  uint16_t topic_len   = 0;
+  uint32_t payload_len = 0;
+  std::memcpy(&record.ts_us, _map + _pos, sizeof(int64_t));
+  std::memcpy(&topic_len, _map + _pos + 8, sizeof(topic_len));
+  std::memcpy(&payload_len, _map + _pos + 10, sizeof(payload_len));
+  auto body = _pos + RECORD_HEAD;
+  if (body + topic_len + payload_len > _size) {
+    return false;
+  }
+  record.topic = std::string_view{reinterpret_cast<const char *>(_map + body), topic_len};
+  record.data  = _map + body + topic_len;
+  record.len   = payload_len;
+  _pos         = body + topic_len + payload_len;
+  return true;
+}
+
+void CaptureReader::rewind() {
+  _pos = sizeof(MAGIC);
+}
+
+void CaptureReader::close() {
+  if (_map != nullptr) {
+    ::munmap(const_cast<uint8_t *>(_map), _size);
+    _map  = nullptr;
+    _size = 0;
+  }
+}
+}
@@ -0,0 +1,208 @@
+//
+// Memory-mapped columnar time series file, see column_store.h
+//
+
+#include "column_store.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace host {
+namespace {
+  constexpr std::array<char, 4> MAGIC = {'W', 'I', 'T', 'C'};
+
+  size_t block_size_for(uint32_t capacity) {
+    return sizeof(BlockHeader) + capacity * (sizeof(int64_t) + COLUMNS * sizeof(int16_t));
+  }
+}
+
+ColumnStore::ColumnStore(ColumnStore &&other) noexcept
+    : _fd(other._fd), _writable(other._writable), _map(other._map), _map_size(other._map_size),
+      _blocks_cap(other._blocks_cap), _opts(other._opts) {
+  other._fd       = -1;
+  other._map      = nullptr;
+  other._map_size = 0;
+}
+
+bool ColumnStore::map_file(size_t size) {
+  auto prot = PROT_READ | (_writable ? PROT_WRITE : 0);
+  void *p   = nullptr;
+  if (_map == nullptr) {
+    p = ::mmap(nullptr, size, prot, MAP_SHARED, _fd, 0);
+  } else {
+    p = ::mremap(_map, _map_size, size, MREMAP_MAYMOVE);
+  }
+  if (p == MAP_FAILED) {
+    std::fprintf(stderr, "column_store: mmap failed: %s\n", std::strerror(errno));
+    return false;
+  }
+  _map      = static_cast<uint8_t *>(p);
+  _map_size = size;
+  if (_map_size >= HEADER_SIZE && header().block_size > 0) {
+    _blocks_cap = (_map_size - HEADER_SIZE) / header().block_size;
+  }
+  return true;
+}
+
+bool ColumnStore::ensure_blocks(size_t n) {
+  if (n <= _blocks_cap) {
+    return true;
+  }
+  auto blocks = std::max(n, _blocks_cap + _opts.grow_blocks);
+  auto size   = HEADER_SIZE + blocks * header().block_size;
+  if (::ftruncate(_fd, static_cast<off_t>(size)) != 0) {
+    std::fprintf(stderr, "column_store: ftruncate failed: %s\n", std::strerror(errno));
+    return false;
+  }
+  return map_file(size);
+}
+
+bool ColumnStore::open(const std::string &path, const std::array<uint8_t, 6> &addr, const Options &opts) {
+  close();
+  _opts     = opts;
+  _writable = true;
+  _fd       = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (_fd < 0) {
+    std::fprintf(stderr, "column_store: open %s failed: %s\n", path.c_str(), std::strerror(errno));
+    return false;
+  }
+  struct stat st {};
+  ::fstat(_fd, &st);
+  if (st.st_size == 0) {
+    auto capacity = (std::max<uint32_t>(opts.block_capacity, 32) + 31) / 32 * 32;
+    if (::ftruncate(_fd, HEADER_SIZE) != 0 || !map_file(HEADER_SIZE)) {
+      close();
+      return false;
+    }
+    auto &h          = header();
+    h.magic          = MAGIC;
+    h.version        = VERSION;
+    h.addr           = addr;
+    h.block_capacity = capacity;
+    h.block_size     = block_size_for(capacity);
+    h.chunk_us       = std::max<int64_t>(opts.chunk_us, 1);
+    h.block_count    = 0;
+    _blocks_cap      = 0;
+    return true;
+  }
+  if (!map_file(st.st_size) || header().magic != MAGIC || header().version != VERSION || header().addr != addr) {
+    std::fprintf(stderr, "column_store: %s is not a store of this device\n", path.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool ColumnStore::open_readonly(const std::string &path) {
+  close();
+  _writable = false;
+  _fd       = ::open(path.c_str(), O_RDONLY);
+  if (_fd < 0) {
+    std::fprintf(stderr, "column_store: open %s failed: %s\n", path.c_str(), std::strerror(errno));
+    return false;
+  }
+  struct stat st {};
+  ::fstat(_fd, &st);
+  if (static_cast<size_t>(st.st_size) < HEADER_SIZE || !map_file(st.st_size) ||
+      header().magic != MAGIC || header().version != VERSION) {
+    std::fprintf(stderr, "column_store: %s is not a column store\n", path.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool ColumnStore::open_block(int64_t ts) {
+  auto n = header().block_count;
+  if (!ensure_blocks(n + 1)) {
+    return false;
+  }
+  auto &blk = mut_block(n);
+  blk       = BlockHeader{};
+  blk.t_min = ts;
+  blk.t_max = ts;
+  blk.min.fill(std::numeric_limits<int16_t>::max());
+  blk.max.fill(std::numeric_limits<int16_t>::min());
+  header().block_count = n + 1;
+  return true;
+}
+
+bool ColumnStore::append(const int64_t *ts, const int16_t *const *cols, size_t n) {
+  if (!_writable || _map == nullptr) {
+    return false;
+  }
+  const auto cap   = header().block_capacity;
+  const auto chunk = header().chunk_us;
+  size_t i         = 0;
+  while (i < n) {
+    auto count = header().block_count;
+    auto cur   = count == 0 ? nullptr : &mut_block(count - 1);
+    auto t0    = cur == nullptr ? ts[i] : std::max(ts[i], cur->t_max);
+    if (cur == nullptr || cur->count >= cap || t0 / chunk != cur->t_min / chunk) {
+      if (!open_block(t0)) {
+        return false;
+      }
+      count = header().block_count;
+      cur   = &mut_block(count - 1);
+    }
+    // longest run that fits in the current block and its time chunk
+    auto room     = std::min<size_t>(cap - cur->count, n - i);
+    auto chunk_id = cur->t_min / chunk;
+    auto *out_ts  = mut_ts(count - 1) + cur->count;
+    auto last     = cur->t_max;
+    size_t run    = 0;
+    for (; run < room; ++run) {
+      auto t = std::max(ts[i + run], last);
+      if (t / chunk != chunk_id) {
+        break;
+      }
+      out_ts[run] = t;
+      last        = t;
+    }
+    for (size_t c = 0; c < COLUMNS; ++c) {
+      const auto *src = cols[c] + i;
+      auto *dst       = mut_col(count - 1, c) + cur->count;
+      std::memcpy(dst, src, run * sizeof(int16_t));
+      int16_t lo = cur->min[c];
+      int16_t hi = cur->max[c];
+      for (size_t k = 0; k < run; ++k) {
+        lo = std::min(lo, src[k]);
+        hi = std::max(hi, src[k]);
+      }
+      cur->min[c] = lo;
+      cur->max[c] = hi;
+    }
+    cur->t_max = last;
+    // publish the rows last so a concurrent reader never sees garbage
+    cur->count += run;
+    i += run;
+  }
+  return true;
+}
+
+void ColumnStore::sync(bool blocking) {
+  if (_map != nullptr && _writable) {
+    ::msync(_map, _map_size, blocking ? MS_SYNC : MS_ASYNC);
+  }
+}
+
+void ColumnStore::close() {
+  if (_map != nullptr) {
+    sync(true);
+    ::munmap(_map, _map_size);
+    _map      = nullptr;
+    _map_size = 0;
+  }
+  _blocks_cap = 0;
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+}
@@ -0,0 +1,401 @@
+//
+// connect_sim: drives the connection state machine of
+// main/include/connect_flow.h against a simulated BLE stack and sensors
+// that misbehave.
+//
+// usage: connect_sim [-n sensors] [-s seconds] [-x seed]
+//
+// The stack completes every step after a random delay, as NimBLE's callbacks
+// would, and checks that the machine uses it right: one connection attempt at
+// a time, no more links than NimBLE is configured for, steps only on live
+// connections, in order and one at a time, and a disconnection reported for
+// every sensor reported connected before. The sensors are of a few kinds,
+// round robin:
+//
+//  - good: every step works;
+//  - flaky: a third of the connection attempts fail;
+//  - mute: never answers the discovery of characteristics (step timeout);
+//  - dropping: the link drops now and then, also in the middle of the setup;
+//  - absent: never connectable, the stack gives up on the attempts.
+//
+// Like the scan would, idle sensors are requested again every few seconds,
+// and now and then one is cancelled, as a hand over to another hub would. In
+// the last quarter the chaos stops and every good, flaky and dropping sensor
+// has to end up subscribed. The exit code is 1 if the stack was misused, a
+// flow got stuck past its deadline or a sensor that should be up isn't.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <unistd.h>
+#include <vector>
+#include "connect_flow.h"
+
+namespace {
+// the links of the hub, CONFIG_BT_NIMBLE_MAX_CONNECTIONS in sdkconfig
+constexpr size_t MAX_SENSORS = 9;
+
+enum class Kind { good, flaky, mute, dropping, absent };
+
+const char *to_str(Kind k) {
+  switch (k) {
+    case Kind::good: return "good";
+    case Kind::flaky: return "flaky";
+    case Kind::mute: return "mute";
+    case Kind::dropping: return "dropping";
+    case Kind::absent: return "absent";
+  }
+  return "?";
+}
+
+struct SimStack;
+using machine_t = flow::Machine<SimStack, MAX_SENSORS>;
+
+enum class Completion { connected, connect_failed, done, failed, disconnected };
+
+struct Pending {
+  size_t flow;
+  uint8_t gen;
+  Completion what;
+  uint16_t conn;
+};
+
+/**
+ * @brief what the stack knows of a connection
+ */
+struct Link {
+  size_t sensor;
+  // the last step started, `idle` for none
+  flow::State step = flow::State::idle;
+  bool busy        = false;
+  bool alive       = true;
+};
+
+struct SimStack {
+  machine_t *machine = nullptr;
+  std::mt19937 rng;
+  std::vector<Kind> kinds;
+  int64_t now = 0;
+  bool chaos  = true;
+  std::multimap<int64_t, Pending> queue{};
+  std::map<uint16_t, Link> links{};
+  uint16_t next_conn = 1;
+  // the connection attempt in flight
+  bool attempt          = false;
+  int64_t attempt_done  = 0;
+  size_t attempt_flow   = 0;
+  uint32_t violations   = 0;
+  uint32_t ready_events = 0;
+  std::vector<int64_t> first_ready;
+  // as the owner was told, `on_ready` then `on_closed` of a subscribed flow
+  std::vector<bool> connected;
+  // links to drop, by time
+  std::multimap<int64_t, uint16_t> drops{};
+
+  explicit SimStack(uint32_t seed) : rng(seed) {}
+
+  int64_t delay(int64_t lo, int64_t hi) {
+    return std::uniform_int_distribution<int64_t>{lo, hi}(rng);
+  }
+
+  bool chance(double p) {
+    return std::uniform_real_distribution<double>{0, 1}(rng) < p;
+  }
+
+  void violation(const char *what, const flow::Flow &f) {
+    violations += 1;
+    std::fprintf(stderr, "%8.3f s: %s (sensor %u, %s)\n", now / 1e3, what, f.addr[5], flow::to_str(f.state));
+  }
+
+  void schedule(int64_t at, const flow::Flow &f, Completion what) {
+    queue.emplace(at, Pending{machine->index_of(f), f.gen, what, f.conn});
+  }
+
+  int start_connect(const flow::Flow &f, uint32_t timeout_ms) {
+    if (attempt) {
+      violation("second connection attempt", f);
+      return 1;
+    }
+    if (links.size() >= MAX_SENSORS) {
+      // NimBLE has no connection left (BLE_HS_ENOMEM)
+      violation("more links than the stack has", f);
+      return 1;
+    }
+    auto sensor  = f.addr[5];
+    auto kind    = kinds[sensor];
+    attempt      = true;
+    attempt_flow = machine->index_of(f);
+    if (kind == Kind::absent || (kind == Kind::flaky && chance(1.0 / 3))) {
+      // the stack gives up after `timeout_ms`, or the link fails to establish
+      attempt_done = now + (kind == Kind::absent ? timeout_ms : delay(50, 500));
+      schedule(attempt_done, f, Completion::connect_failed);
+    } else {
+      attempt_done = now + delay(30, 400);
+      schedule(attempt_done, f, Completion::connected);
+    }
+    return 0;
+  }
+
+  int cancel_connect(const flow::Flow &f) {
+    if (!attempt || attempt_flow != machine->index_of(f)) {
+      violation("cancel without an attempt", f);
+      return 1;
+    }
+    // confirmed a bit later, unless the attempt completes first
+    if (attempt_done > now + 5) {
+      for (auto it = queue.begin(); it != queue.end(); ++it) {
+        auto &p = it->second;
+        if (p.flow == attempt_flow &&
+            (p.what == Completion::connected || p.what == Completion::connect_failed)) {
+          auto moved = p;
+          queue.erase(it);
+          moved.what   = Completion::connect_failed;
+          attempt_done = now + 5;
+          queue.emplace(attempt_done, moved);
+          break;
+        }
+      }
+    }
+    return 0;
+  }
+
+  int step(const flow::Flow &f, flow::State s) {
+    auto it = links.find(f.conn);
+    if (it == links.end() || !it->second.alive) {
+      return 1;
+    }
+    auto &link = it->second;
+    if (link.busy) {
+      violation("step while another is in flight", f);
+    }
+    if (static_cast<uint8_t>(s) != static_cast<uint8_t>(link.step) + 1 &&
+        !(s == flow::State::exchanging_mtu && link.step == flow::State::idle)) {
+      violation("step out of order", f);
+    }
+    link.step = s;
+    link.busy = true;
+    auto kind = kinds[link.sensor];
+    if (kind == Kind::mute && s == flow::State::discovering_chars) {
+      // never answers
+      return 0;
+    }
+    schedule(now + delay(10, 150), f, Completion::done);
+    return 0;
+  }
+
+  int exchange_mtu(const flow::Flow &f) {
+    return step(f, flow::State::exchanging_mtu);
+  }
+
+  int discover_services(const flow::Flow &f) {
+    return step(f, flow::State::discovering_services);
+  }
+
+  int discover_chars(const flow::Flow &f) {
+    return step(f, flow::State::discovering_chars);
+  }
+
+  int discover_dscs(const flow::Flow &f) {
+    return step(f, flow::State::discovering_dscs);
+  }
+
+  int subscribe(const flow::Flow &f) {
+    return step(f, flow::State::subscribing);
+  }
+
+  int terminate(const flow::Flow &f) {
+    auto it = links.find(f.conn);
+    if (it == links.end() || !it->second.alive) {
+      return 1;
+    }
+    schedule(now + delay(10, 60), f, Completion::disconnected);
+    return 0;
+  }
+
+  void on_ready(const flow::Flow &f) {
+    ready_events += 1;
+    violations += connected[f.addr[5]] ? 1 : 0;
+    connected[f.addr[5]] = true;
+    auto &first = first_ready[f.addr[5]];
+    first       = first < 0 ? now : first;
+  }
+
+  void on_closed(const flow::Flow &f, flow::Reason) {
+    if (f.subscribed) {
+      violations += connected[f.addr[5]] ? 0 : 1;
+      connected[f.addr[5]] = false;
+    }
+    if (f.conn != flow::NO_CONN) {
+      links.erase(f.conn);
+    }
+  }
+
+  /**
+   * @brief the link of `conn` drops: steps in flight fail, then the
+   * disconnection is reported, as NimBLE does
+   */
+  void drop(uint16_t conn) {
+    auto it = links.find(conn);
+    if (it == links.end() || !it->second.alive) {
+      return;
+    }
+    it->second.alive = false;
+    auto i           = machine->find_conn(conn);
+    if (i == MAX_SENSORS) {
+      return;
+    }
+    const auto &f = machine->flow(i);
+    if (it->second.busy) {
+      queue.emplace(now, Pending{i, f.gen, Completion::failed, conn});
+    }
+    queue.emplace(now, Pending{i, f.gen, Completion::disconnected, conn});
+  }
+
+  void deliver(const Pending &p) {
+    auto &f = machine->flow(p.flow);
+    switch (p.what) {
+      case Completion::connected: {
+        attempt = false;
+        if (f.gen != p.gen) {
+          // the flow was closed without waiting for the stack; drop the link
+          return;
+        }
+        auto conn = next_conn++;
+        links.emplace(conn, Link{.sensor = f.addr[5]});
+        f.conn = conn;
+        machine->on_event(p.flow, p.gen, flow::Event::connected, now);
+        // a dropping sensor loses the link within a few seconds, sometimes
+        // during the setup
+        if (chaos && kinds[f.addr[5]] == Kind::dropping) {
+          drops.emplace(now + delay(100, 8'000), conn);
+        }
+        return;
+      }
+      case Completion::connect_failed:
+        attempt = false;
+        machine->on_event(p.flow, p.gen, flow::Event::connect_failed, now);
+        return;
+      case Completion::done:
+      case Completion::failed: {
+        auto it = links.find(p.conn);
+        if (it != links.end()) {
+          it->second.busy = false;
+        }
+        machine->on_event(p.flow, p.gen, p.what == Completion::done ? flow::Event::done : flow::Event::failed, now);
+        return;
+      }
+      case Completion::disconnected:
+        links.erase(p.conn);
+        machine->on_event(p.flow, p.gen, flow::Event::disconnected, now);
+        return;
+    }
+  }
+};
+
+flow::addr_t address(size_t s) {
+  return {0xc0, 0xff, 0x57, 0x49, 0x54, static_cast<uint8_t>(s)};
+}
+}
+
+int main(int argc, char **argv) {
+  size_t sensors  = MAX_SENSORS;
+  double seconds  = 600;
+  uint32_t seed   = 1;
+  int opt         = 0;
+  while ((opt = ::getopt(argc, argv, "n:s:x:")) != -1) {
+    switch (opt) {
+      case 'n': sensors = std::clamp<size_t>(std::atoi(optarg), 1, MAX_SENSORS); break;
+      case 's': seconds = std::atof(optarg); break;
+      case 'x': seed = static_cast<uint32_t>(std::atoi(optarg)); break;
+      default:
+        std::fprintf(stderr, "usage: %s [-n sensors] [-s seconds] [-x seed]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  auto stack    = SimStack{seed};
+  auto machine  = machine_t{stack};
+  stack.machine = &machine;
+  constexpr Kind KINDS[] = {Kind::good, Kind::flaky, Kind::good, Kind::mute, Kind::dropping, Kind::absent};
+  for (size_t s = 0; s < sensors; ++s) {
+    stack.kinds.push_back(KINDS[s % std::size(KINDS)]);
+  }
+  stack.first_ready.assign(sensors, -1);
+  stack.connected.assign(sensors, false);
+
+  auto end_ms        = static_cast<int64_t>(seconds * 1000);
+  auto calm_ms       = end_ms * 3 / 4;
+  int64_t next_scan  = 0;
+  int64_t stuck      = 0;
+  uint32_t cancels   = 0;
+  int64_t t_all      = -1;
+  for (int64_t now = 0; now <= end_ms; now += 1) {
+    stack.now   = now;
+    stack.chaos = now < calm_ms;
+    while (!stack.queue.empty() && stack.queue.begin()->first <= now) {
+      auto p = stack.queue.begin()->second;
+      stack.queue.erase(stack.queue.begin());
+      stack.deliver(p);
+    }
+    while (!stack.drops.empty() && stack.drops.begin()->first <= now) {
+      auto conn = stack.drops.begin()->second;
+      stack.drops.erase(stack.drops.begin());
+      stack.drop(conn);
+    }
+    if (machine.next_deadline() <= now) {
+      machine.tick(now);
+    }
+    // the scan sees the idle sensors again
+    if (now >= next_scan) {
+      next_scan = now + 5'000;
+      for (size_t s = 0; s < sensors; ++s) {
+        machine.request(address(s), 0, now);
+      }
+    }
+    // a hand over now and then
+    if (stack.chaos && now % 1000 == 0 && stack.chance(0.1)) {
+      cancels += machine.cancel(address(stack.delay(0, sensors - 1)), now) ? 1 : 0;
+    }
+    // nothing may linger past its deadline
+    for (size_t i = 0; i < MAX_SENSORS; ++i) {
+      const auto &f = machine.flow(i);
+      if (f.state != flow::State::idle && f.state != flow::State::ready && f.deadline_ms < now) {
+        stuck += 1;
+      }
+    }
+    if (t_all < 0) {
+      auto ready = 0u;
+      for (size_t s = 0; s < sensors; ++s) {
+        auto kind = stack.kinds[s];
+        ready += kind == Kind::good && stack.first_ready[s] >= 0 ? 1 : 0;
+      }
+      auto goods = static_cast<unsigned>(std::count(stack.kinds.begin(), stack.kinds.end(), Kind::good));
+      t_all      = ready == goods ? now : -1;
+    }
+  }
+
+  std::printf("%zu sensors for %.0f s (seed %u)\n", sensors, seconds, seed);
+  std::printf("%6s %9s %22s %14s\n", "sensor", "kind", "state", "first_ready_ms");
+  auto missing = 0;
+  for (size_t s = 0; s < sensors; ++s) {
+    auto i     = machine.find(address(s));
+    auto state = i == MAX_SENSORS ? flow::State::idle : machine.flow(i).state;
+    auto kind  = stack.kinds[s];
+    auto want  = kind == Kind::good || kind == Kind::flaky || kind == Kind::dropping;
+    missing += want && state != flow::State::ready ? 1 : 0;
+    stack.violations += stack.connected[s] != (state == flow::State::ready) ? 1 : 0;
+    std::printf("%6zu %9s %22s %14lld\n", s, to_str(kind), flow::to_str(state),
+                static_cast<long long>(stack.first_ready[s]));
+  }
+  const auto &st = machine.stats();
+  std::printf("requests %u, ready %u, closed %u, timeouts %u, stray events %u, cancels %u\n",
+              st.requests, st.ready, st.closed, st.timeouts, st.stray, cancels);
+  std::printf("all good sensors up after %lld ms; misuse of the stack %u, flow-ms past a deadline %lld, "
+              "not up at the end %d\n",
+              static_cast<long long>(t_all), stack.violations, static_cast<long long>(stuck), missing);
+  std::printf("flow %zu bytes, machine of %zu flows %zu bytes\n", sizeof(flow::Flow), MAX_SENSORS, sizeof(machine));
+  return stack.violations == 0 && stuck == 0 && missing == 0 ? 0 : 1;
+}
@@ -0,0 +1,334 @@
+//
+// fleet_sim: several simulated hubs sharing sensors through a local broker
+// stand-in, with and without the fleet coordination of main/include/fleet.h.
+//
+// usage: fleet_sim [-H hubs] [-n sensors] [-c capacity] [-s seconds]
+//                  [-k kill_s] [-r revive_s] [-C clustered] [-l latency_ms]
+//                  [-w will_delay_ms] [-x seed]
+//
+// Hubs sit along a line and scan every 5 s with a random phase; a connection
+// takes 1 s and a sensor accepts only one, so two hubs going for the same
+// sensor is a lost race. `-C` is the fraction of sensors placed around the
+// first hub, to make it fill up. Hub 0 crashes at `-k` (its last will is
+// published `-w` later) and comes back at `-r`.
+//
+// The coordinated run must end with every sensor served that the capacity
+// allows, with no hub over capacity, and recover from the crash; the exit
+// code is 1 otherwise.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "fleet.h"
+#include "ingestor.h"
+#include "local_broker.h"
+
+namespace {
+constexpr int64_t STEP_MS        = 100;
+constexpr int64_t SCAN_PERIOD_MS = 5'000;
+constexpr int64_t CONNECT_MS     = 1'000;
+constexpr int RSSI_FLOOR         = -95;
+constexpr double AREA_LENGTH_M   = 30;
+constexpr double AREA_WIDTH_M    = 6;
+
+struct Config {
+  int hubs           = 3;
+  int sensors        = 30;
+  // what an ESP32 hub can hold (CONFIG_BT_NIMBLE_MAX_CONNECTIONS)
+  int capacity       = 9;
+  double seconds     = 300;
+  double kill_s      = 100;
+  double revive_s    = 200;
+  double clustered   = 0.5;
+  int64_t latency_ms = 20;
+  int64_t will_ms    = 5'000;
+  uint32_t seed      = 1;
+};
+
+struct Sensor {
+  double x = 0;
+  double y = 0;
+  fleet::addr_t addr{};
+  // hub holding the connection, -1 while advertising
+  int holder = -1;
+};
+
+struct Hub {
+  double x                 = 0;
+  fleet::hub_id_t id{};
+  bool online              = true;
+  int client               = -1;
+  fleet::Coordinator coordinator{};
+  int64_t next_scan_ms     = 0;
+  int64_t next_announce_ms = 0;
+  // sensor index, when the connection completes
+  std::vector<std::pair<int, int64_t>> connecting{};
+  int held                 = 0;
+};
+
+struct Result {
+  uint64_t attempts       = 0;
+  uint64_t races          = 0;
+  uint64_t releases       = 0;
+  int served              = 0;
+  int optimal             = 0;
+  int max_over            = 0;
+  double mean_rssi        = 0;
+  // -1 if it never got back to optimal
+  double recover_kill_s   = -1;
+  double recover_revive_s = -1;
+  std::vector<int> loads_before_kill{};
+  std::vector<int> loads{};
+};
+
+int rssi_at(double d, double noise) {
+  auto v = -50 - 20 * std::log10(std::max(d, 0.5)) + noise;
+  return std::clamp(static_cast<int>(std::lround(v)), -127, 0);
+}
+
+Result run(const Config &cfg, bool coordinated) {
+  auto rng    = std::mt19937{cfg.seed};
+  auto noise  = std::normal_distribution<double>{0, 3};
+  auto broker = host::LocalBroker{cfg.latency_ms, cfg.will_ms};
+  auto hubs   = std::vector<Hub>(cfg.hubs);
+  auto opts   = fleet::Options{.capacity = static_cast<uint8_t>(cfg.capacity)};
+
+  auto sensors = std::vector<Sensor>(cfg.sensors);
+  auto uniform = std::uniform_real_distribution<double>{0, 1};
+  for (int i = 0; i < cfg.sensors; ++i) {
+    auto &s = sensors[i];
+    if (i < cfg.sensors * cfg.clustered) {
+      s.x = uniform(rng) * AREA_LENGTH_M / cfg.hubs;
+    } else {
+      s.x = uniform(rng) * AREA_LENGTH_M;
+    }
+    s.y    = uniform(rng) * AREA_WIDTH_M;
+    s.addr = {0xc0, 0xff, 0x57, 0x49, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+  }
+
+  // what the hubs see as the time a message arrives
+  int64_t clock = 0;
+  auto topic_of = [](const fleet::hub_id_t &id) {
+    return std::string{fleet::TOPIC_PREFIX} + host::addr_to_hex(id);
+  };
+  auto boot = [&](int h, int64_t now) {
+    auto &hub       = hubs[h];
+    hub.online      = true;
+    hub.coordinator = fleet::Coordinator{hub.id, opts, now};
+    uint8_t will[fleet::HEADER_SIZE];
+    fleet::encode(hub.coordinator.offline(), will, sizeof(will));
+    auto on_message = [&hub, &clock](std::string_view, const uint8_t *data, size_t len) {
+      hub.coordinator.on_announcement(data, len, clock);
+    };
+    hub.client = broker.connect(on_message, topic_of(hub.id), {will, will + sizeof(will)});
+    broker.subscribe(hub.client, std::string{fleet::TOPIC_PREFIX} + "+");
+    hub.next_scan_ms     = now + static_cast<int64_t>(uniform(rng) * SCAN_PERIOD_MS);
+    hub.next_announce_ms = now + static_cast<int64_t>(uniform(rng) * opts.announce_ms);
+  };
+  for (int h = 0; h < cfg.hubs; ++h) {
+    hubs[h].x  = (h + 0.5) * AREA_LENGTH_M / cfg.hubs;
+    hubs[h].id = {0x24, 0x0a, 0xc4, 0x00, 0x00, static_cast<uint8_t>(h)};
+    boot(h, 0);
+  }
+
+  auto result       = Result{};
+  auto kill_ms      = static_cast<int64_t>(cfg.kill_s * 1000);
+  auto revive_ms    = static_cast<int64_t>(cfg.revive_s * 1000);
+  auto end_ms       = static_cast<int64_t>(cfg.seconds * 1000);
+  // when the last crash or restart happened, -1 once recovered
+  int64_t disturbed = -1;
+  double *recovery  = nullptr;
+  for (int64_t now = 0; now <= end_ms; now += STEP_MS) {
+    clock = now;
+    broker.run_until(now);
+
+    if (now == kill_ms && cfg.hubs > 1) {
+      auto &hub = hubs[0];
+      hub.connecting.clear();
+      broker.disconnect(hub.client, false, now);
+      for (auto &s : sensors) {
+        if (s.holder == 0) {
+          s.holder = -1;
+        }
+      }
+      result.loads_before_kill.clear();
+      for (const auto &other : hubs) {
+        result.loads_before_kill.push_back(other.held);
+      }
+      hub.online = false;
+      hub.held   = 0;
+      disturbed  = now;
+      recovery   = &result.recover_kill_s;
+    }
+    if (now == revive_ms && cfg.hubs > 1 && !hubs[0].online) {
+      boot(0, now);
+      disturbed = now;
+      recovery  = &result.recover_revive_s;
+    }
+
+    for (int h = 0; h < cfg.hubs; ++h) {
+      auto &hub = hubs[h];
+      if (!hub.online) {
+        continue;
+      }
+      // connections that completed
+      auto done = std::partition(hub.connecting.begin(), hub.connecting.end(), [now](const auto &c) {
+        return c.second > now;
+      });
+      for (auto it = done; it != hub.connecting.end(); ++it) {
+        auto &s = sensors[it->first];
+        if (s.holder == -1) {
+          s.holder = h;
+          hub.held += 1;
+          hub.coordinator.set_held(s.addr, true, now);
+        } else {
+          result.races += 1;
+        }
+      }
+      hub.connecting.erase(done, hub.connecting.end());
+
+      if (now >= hub.next_scan_ms) {
+        hub.next_scan_ms += SCAN_PERIOD_MS;
+        for (int i = 0; i < cfg.sensors; ++i) {
+          auto &s = sensors[i];
+          if (s.holder != -1) {
+            continue;
+          }
+          auto already = std::any_of(hub.connecting.begin(), hub.connecting.end(), [i](const auto &c) {
+            return c.first == i;
+          });
+          auto rssi = rssi_at(std::hypot(s.x - hub.x, s.y), noise(rng));
+          if (already || rssi < RSSI_FLOOR) {
+            continue;
+          }
+          // the firmware's device table (and the radio) limit every hub anyway
+          if (hub.held + static_cast<int>(hub.connecting.size()) >= cfg.capacity) {
+            continue;
+          }
+          auto go = true;
+          if (coordinated) {
+            hub.coordinator.observe(s.addr, static_cast<int8_t>(rssi), now);
+            go = hub.coordinator.should_connect(s.addr, now);
+          }
+          if (go) {
+            hub.connecting.emplace_back(i, now + CONNECT_MS);
+            result.attempts += 1;
+          }
+        }
+      }
+
+      if (coordinated && now >= hub.next_announce_ms) {
+        hub.next_announce_ms += opts.announce_ms;
+        hub.coordinator.for_each_conflict(now, [&](const fleet::addr_t &addr) {
+          for (auto &s : sensors) {
+            if (s.addr == addr && s.holder == h) {
+              s.holder = -1;
+              hub.held -= 1;
+              hub.coordinator.set_held(addr, false, now);
+              result.releases += 1;
+            }
+          }
+        });
+        uint8_t buf[fleet::MAX_ANNOUNCE];
+        auto a   = hub.coordinator.announcement(now);
+        auto len = fleet::encode(a, buf, sizeof(buf));
+        broker.publish(topic_of(hub.id), buf, len, now);
+        hub.coordinator.mark_announced(a);
+      }
+    }
+
+    int served   = 0;
+    int capacity = 0;
+    for (const auto &s : sensors) {
+      served += s.holder != -1 ? 1 : 0;
+    }
+    for (const auto &hub : hubs) {
+      capacity += hub.online ? cfg.capacity : 0;
+      result.max_over = std::max(result.max_over, hub.held - cfg.capacity);
+    }
+    result.served  = served;
+    result.optimal = std::min(cfg.sensors, capacity);
+    if (disturbed >= 0 && served == result.optimal) {
+      *recovery = (now - disturbed) / 1000.0;
+      disturbed = -1;
+    }
+  }
+
+  double rssi_sum = 0;
+  for (const auto &s : sensors) {
+    if (s.holder != -1) {
+      rssi_sum += rssi_at(std::hypot(s.x - hubs[s.holder].x, s.y), 0);
+    }
+  }
+  result.mean_rssi = result.served == 0 ? 0 : rssi_sum / result.served;
+  for (const auto &hub : hubs) {
+    result.loads.push_back(hub.held);
+  }
+  return result;
+}
+
+void print(const char *mode, const Result &r) {
+  std::printf("%-14s %8lu %6lu %8lu %4d/%-4d %9.1f %10.1f %10.1f  ",
+              mode, r.attempts, r.races, r.releases, r.served, r.optimal, r.mean_rssi,
+              r.recover_kill_s, r.recover_revive_s);
+  auto print_loads = [](const std::vector<int> &loads) {
+    for (size_t i = 0; i < loads.size(); ++i) {
+      std::printf("%s%d", i == 0 ? "" : ",", loads[i]);
+    }
+  };
+  print_loads(r.loads_before_kill);
+  std::printf(" -> ");
+  print_loads(r.loads);
+  std::printf("\n");
+}
+}
+
+int main(int argc, char **argv) {
+  auto cfg = Config{};
+  int opt  = 0;
+  while ((opt = ::getopt(argc, argv, "H:n:c:s:k:r:C:l:w:x:")) != -1) {
+    switch (opt) {
+      case 'H': cfg.hubs = std::max(1, std::atoi(optarg)); break;
+      case 'n': cfg.sensors = std::clamp(std::atoi(optarg), 1, 65535); break;
+      case 'c': cfg.capacity = std::clamp(std::atoi(optarg), 1, 255); break;
+      case 's': cfg.seconds = std::atof(optarg); break;
+      case 'k': cfg.kill_s = std::atof(optarg); break;
+      case 'r': cfg.revive_s = std::atof(optarg); break;
+      case 'C': cfg.clustered = std::clamp(std::atof(optarg), 0.0, 1.0); break;
+      case 'l': cfg.latency_ms = std::atoll(optarg); break;
+      case 'w': cfg.will_ms = std::atoll(optarg); break;
+      case 'x': cfg.seed = static_cast<uint32_t>(std::atoi(optarg)); break;
+      default:
+        std::fprintf(stderr,
+                     "usage: %s [-H hubs] [-n sensors] [-c capacity] [-s seconds] [-k kill_s] [-r revive_s]\n"
+                     "          [-C clustered] [-l latency_ms] [-w will_delay_ms] [-x seed]\n",
+                     argv[0]);
+        return 2;
+    }
+  }
+  std::printf("%d hubs x %d capacity, %d sensors (%.0f%% around hub 0), hub 0 down %.0f-%.0f s\n",
+              cfg.hubs, cfg.capacity, cfg.sensors, cfg.clustered * 100, cfg.kill_s, cfg.revive_s);
+  std::printf("%-14s %8s %6s %8s %9s %9s %10s %10s  %s\n",
+              "mode", "attempts", "races", "releases", "served", "rssi", "kill_s", "revive_s", "loads (before kill -> end)");
+  auto baseline = run(cfg, false);
+  print("uncoordinated", baseline);
+  auto r = run(cfg, true);
+  print("coordinated", r);
+
+  auto ok = r.served == r.optimal && r.max_over <= 0;
+  if (cfg.hubs > 1 && cfg.kill_s < cfg.seconds) {
+    ok = ok && r.recover_kill_s >= 0;
+  }
+  if (!ok) {
+    std::fprintf(stderr, "coordinated run failed: served %d of %d, max over capacity %d, recovery %.1f s\n",
+                 r.served, r.optimal, r.max_over, r.recover_kill_s);
+    return 1;
+  }
+  return 0;
+}
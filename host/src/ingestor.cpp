@@ -0,0 +1,149 @@
+//
+// Turn `/wit/<addr>/data` messages into per-device column stores.
+//
+
+#include "ingestor.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace host {
+namespace {
+  int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  uint64_t addr_key(const addr_t &addr) {
+    uint64_t key = 0;
+    for (auto b : addr) {
+      key = key << 8 | b;
+    }
+    return key;
+  }
+}
+
+std::optional<addr_t> parse_data_topic(std::string_view topic) {
+  constexpr std::string_view PREFIX = "/wit/";
+  constexpr std::string_view SUFFIX = "/data";
+  if (topic.size() != PREFIX.size() + 12 + SUFFIX.size() ||
+      !topic.starts_with(PREFIX) || !topic.ends_with(SUFFIX)) {
+    return std::nullopt;
+  }
+  auto hex  = topic.substr(PREFIX.size(), 12);
+  auto addr = addr_t{};
+  for (size_t i = 0; i < addr.size(); ++i) {
+    auto hi = hex_value(hex[i * 2]);
+    auto lo = hex_value(hex[i * 2 + 1]);
+    if (hi < 0 || lo < 0) {
+      return std::nullopt;
+    }
+    addr[i] = static_cast<uint8_t>(hi << 4 | lo);
+  }
+  return addr;
+}
+
+std::string addr_to_hex(const addr_t &addr) {
+  constexpr auto DIGITS = "0123456789abcdef";
+  auto res              = std::string(addr.size() * 2, '\0');
+  for (size_t i = 0; i < addr.size(); ++i) {
+    res[i * 2]     = DIGITS[addr[i] >> 4];
+    res[i * 2 + 1] = DIGITS[addr[i] & 0x0f];
+  }
+  return res;
+}
+
+Ingestor::Ingestor(std::string dir, const ColumnStore::Options &opts, size_t batch)
+    : _dir(std::move(dir)), _opts(opts), _batch(batch == 0 ? 1 : batch) {
+  for (auto &col : _cols) {
+    col.resize(_batch);
+  }
+}
+
+Ingestor::Device *Ingestor::device(const addr_t &addr, int64_t ts_us) {
+  auto key = addr_key(addr);
+  auto it  = _devices.find(key);
+  if (it != _devices.end()) {
+    return it->second.get();
+  }
+  auto failed = _failed.find(key);
+  if (failed != _failed.end() && ts_us < failed->second.retry_us) {
+    return nullptr;
+  }
+  auto dev  = std::make_unique<Device>();
+  dev->addr = addr;
+  dev->frames.reserve(_batch * wit::FRAME_SIZE);
+  dev->ts.reserve(_batch);
+  auto path = _dir + "/" + addr_to_hex(addr) + ".witc";
+  if (!dev->store.open(path, addr, _opts)) {
+    _stats.store_errors += 1;
+    auto backoff = failed == _failed.end() ? RETRY_MIN_US : std::min(failed->second.backoff_us * 2, RETRY_MAX_US);
+    _failed[key] = Failed{ts_us + backoff, backoff};
+    return nullptr;
+  }
+  if (failed != _failed.end()) {
+    _failed.erase(failed);
+  }
+  auto *res = dev.get();
+  _devices.emplace(key, std::move(dev));
+  return res;
+}
+
+void Ingestor::on_message(int64_t ts_us, std::string_view topic, const uint8_t *data, size_t len) {
+  _stats.messages += 1;
+  _stats.bytes += len;
+  auto addr = parse_data_topic(topic);
+  if (!addr) {
+    _stats.unknown_topics += 1;
+    return;
+  }
+  auto *dev = device(*addr, ts_us);
+  if (dev == nullptr) {
+    return;
+  }
+  auto dropped_before = dev->reassembler.dropped();
+  dev->reassembler.feed(data, len, [this, dev, ts_us](const uint8_t *frame) {
+    if (frame[1] != wit::FLAG_DATA) {
+      _stats.other_frames += 1;
+      return;
+    }
+    dev->frames.insert(dev->frames.end(), frame, frame + wit::FRAME_SIZE);
+    dev->ts.push_back(ts_us);
+    if (dev->ts.size() >= _batch) {
+      flush(*dev);
+    }
+  });
+  _stats.dropped_bytes += dev->reassembler.dropped() - dropped_before;
+}
+
+void Ingestor::flush(Device &device) {
+  auto n = device.ts.size();
+  if (n == 0) {
+    return;
+  }
+  int16_t *cols[COLUMNS];
+  for (size_t c = 0; c < COLUMNS; ++c) {
+    cols[c] = _cols[c].data();
+  }
+  wit::decode_data_columns(device.frames.data(), n, cols);
+  if (!device.store.append(device.ts.data(), cols, n)) {
+    _stats.store_errors += 1;
+  }
+  _stats.frames += n;
+  device.frames.clear();
+  device.ts.clear();
+}
+
+void Ingestor::flush() {
+  for (auto &[_, dev] : _devices) {
+    flush(*dev);
+  }
+}
+
+void Ingestor::sync() {
+  for (auto &[_, dev] : _devices) {
+    dev->store.sync();
+  }
+}
+}
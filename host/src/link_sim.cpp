@@ -0,0 +1,213 @@
+//
+// link_sim: checks the BLE link policy of main/include/link_policy.h against
+// a simulated central serving the connection events of every sensor.
+//
+// usage: link_sim [-n devices] [-R rate_hz] [-b frames_per_notification]
+//                 [-L max_interval_ms] [-u max_utilization_pct] [-s seconds]
+//
+// For 1 to `n` sensors it compares the NimBLE defaults (30 ms interval, no
+// DLE) with the planned parameters. The central spreads the anchors of the
+// links evenly over the interval and an event runs until the sensor has
+// nothing left or the next link's anchor; a sensor sends a notification once
+// it has `-b` frames. Reported per fleet size: the interval, the expected
+// radio utilization, the share of the frames delivered and the worst delay
+// from sample to delivery.
+//
+// Then the sensors join one by one and leave again, to check every plan on
+// the way: within the utilization limit, events fitting their share of the
+// interval and a supervision timeout the spec accepts. The exit code is 1 if
+// a feasible plan doesn't deliver every frame in time or breaks one of these.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <unistd.h>
+#include <vector>
+#include "link_policy.h"
+
+namespace {
+struct Config {
+  int devices          = 12;
+  float rate_hz        = 50;
+  int batch            = 1;
+  float max_interval   = 50;
+  float max_util_pct   = 50;
+  double seconds       = 20;
+};
+
+struct Result {
+  uint16_t interval      = 0;
+  float utilization      = 0;
+  uint64_t produced      = 0;
+  uint64_t delivered     = 0;
+  double max_delay_us    = 0;
+  size_t backlog         = 0;
+};
+
+/**
+ * @brief every link at `interval` with what it agreed to
+ */
+Result simulate(const Config &cfg, int devices, uint16_t interval, const radio::Agreed &agreed,
+                uint32_t overhead_us) {
+  auto res          = Result{};
+  res.interval      = interval;
+  auto interval_us  = static_cast<double>(interval) * radio::INTERVAL_UNIT_US;
+  auto slot_us      = interval_us / devices;
+  auto period_us    = 1e6 / cfg.rate_hz;
+  auto notify_bytes = std::min<uint32_t>(cfg.batch * wit::FRAME_SIZE, agreed.mtu - radio::ATT_NOTIFY_HEADER);
+  auto frames       = std::max<uint32_t>(1, notify_bytes / wit::FRAME_SIZE);
+  auto cost_us      = static_cast<double>(radio::notify_us(frames * wit::FRAME_SIZE, agreed.tx_octets));
+  auto end_us       = cfg.seconds * 1e6;
+  // sample times of the frames not delivered yet, per sensor
+  auto queues       = std::vector<std::deque<double>>(devices);
+  auto next_sample  = std::vector<double>(devices);
+  for (int d = 0; d < devices; ++d) {
+    next_sample[d] = period_us * d / devices;
+  }
+  for (double anchor = 0; anchor < end_us; anchor += interval_us) {
+    for (int d = 0; d < devices; ++d) {
+      auto start = anchor + slot_us * d;
+      auto &q    = queues[d];
+      while (next_sample[d] <= start) {
+        q.push_back(next_sample[d]);
+        next_sample[d] += period_us;
+        res.produced += 1;
+      }
+      auto t = start + overhead_us;
+      // only whole notifications are sent
+      while (q.size() >= frames && t + cost_us <= start + slot_us) {
+        t += cost_us;
+        for (uint32_t f = 0; f < frames; ++f) {
+          res.max_delay_us = std::max(res.max_delay_us, t - q.front());
+          q.pop_front();
+          res.delivered += 1;
+        }
+      }
+    }
+  }
+  for (const auto &q : queues) {
+    res.backlog = std::max(res.backlog, q.size());
+  }
+  return res;
+}
+
+radio::Options options(const Config &cfg) {
+  auto opts            = radio::Options{};
+  opts.max_interval_us = static_cast<uint32_t>(cfg.max_interval * 1000);
+  opts.max_utilization = cfg.max_util_pct / 100;
+  return opts;
+}
+
+radio::Demand demand(const Config &cfg) {
+  return radio::Demand{.rate_hz = cfg.rate_hz, .notify_bytes = static_cast<uint16_t>(cfg.batch * wit::FRAME_SIZE)};
+}
+
+radio::addr_t address(int d) {
+  return {0xc0, 0xff, 0x57, 0x49, 0x54, static_cast<uint8_t>(d)};
+}
+
+/**
+ * @brief frames a sensor may still hold at the end: a batch being filled and
+ * what it sampled during the last interval
+ */
+bool in_time(const Config &cfg, const Result &r, const radio::Params &p) {
+  auto period_us   = 1e6 / cfg.rate_hz;
+  auto interval_us = static_cast<double>(p.interval_max) * radio::INTERVAL_UNIT_US;
+  auto max_delay   = cfg.batch * period_us + 2 * interval_us;
+  auto backlog     = static_cast<size_t>(cfg.batch + interval_us / period_us + 1);
+  return r.max_delay_us <= max_delay && r.backlog <= backlog;
+}
+}
+
+int main(int argc, char **argv) {
+  auto cfg = Config{};
+  int opt  = 0;
+  while ((opt = ::getopt(argc, argv, "n:R:b:L:u:s:")) != -1) {
+    switch (opt) {
+      case 'n': cfg.devices = std::clamp(std::atoi(optarg), 1, static_cast<int>(radio::MAX_LINKS)); break;
+      case 'R': cfg.rate_hz = static_cast<float>(std::atof(optarg)); break;
+      case 'b': cfg.batch = std::clamp(std::atoi(optarg), 1, 12); break;
+      case 'L': cfg.max_interval = static_cast<float>(std::atof(optarg)); break;
+      case 'u': cfg.max_util_pct = static_cast<float>(std::atof(optarg)); break;
+      case 's': cfg.seconds = std::atof(optarg); break;
+      default:
+        std::fprintf(stderr,
+                     "usage: %s [-n devices] [-R rate_hz] [-b frames_per_notification]\n"
+                     "          [-L max_interval_ms] [-u max_utilization_pct] [-s seconds]\n",
+                     argv[0]);
+        return 2;
+    }
+  }
+
+  auto opts = options(cfg);
+  auto pass = true;
+  std::printf("%.0f Hz per sensor, %d frame(s) per notification, interval up to %.1f ms, utilization up to %.0f%%\n",
+              cfg.rate_hz, cfg.batch, cfg.max_interval, cfg.max_util_pct);
+  std::printf("%3s | %-38s | %-38s\n", "", "NimBLE defaults", "policy");
+  std::printf("%3s | %8s %6s %9s %12s | %8s %6s %9s %12s %s\n", "n",
+              "interval", "util", "delivered", "max_delay_ms", "interval", "util", "delivered", "max_delay_ms", "mtu/dle");
+  for (int n = 1; n <= cfg.devices; ++n) {
+    // NimBLE connects at 30-50 ms and exchanges the MTU, but doesn't ask for DLE
+    auto defaults     = radio::Agreed{.mtu = 256, .tx_octets = radio::DEFAULT_TX_OCTETS};
+    constexpr uint16_t DEFAULT_INTERVAL = 24;
+    auto d            = simulate(cfg, n, DEFAULT_INTERVAL, defaults, opts.event_overhead_us);
+    double d_util     = 0;
+    for (int i = 0; i < n; ++i) {
+      d_util += static_cast<double>(radio::event_us(demand(cfg), defaults, DEFAULT_INTERVAL * radio::INTERVAL_UNIT_US,
+                                                    opts.event_overhead_us)) /
+                (DEFAULT_INTERVAL * radio::INTERVAL_UNIT_US);
+    }
+
+    auto policy = radio::Policy{opts};
+    for (int i = 0; i < n; ++i) {
+      policy.join(address(i), demand(cfg));
+    }
+    const auto &p = policy.params();
+    // assume every sensor takes what is asked for
+    auto agreed   = radio::Agreed{.mtu = p.mtu, .tx_octets = p.tx_octets, .interval = p.interval_min};
+    for (int i = 0; i < n; ++i) {
+      policy.on_agreed(address(i), agreed);
+    }
+    const auto &q = policy.params();
+    auto r        = simulate(cfg, n, q.interval_min, agreed, opts.event_overhead_us);
+    auto ok       = !q.feasible || (r.delivered + n * (cfg.batch + 1) >= r.produced && in_time(cfg, r, q));
+    pass          = pass && ok;
+    std::printf("%3d | %6.2fms %5.0f%% %8.1f%% %12.1f | %6.2fms %5.0f%% %8.1f%% %12.1f %u/%u%s%s\n", n,
+                DEFAULT_INTERVAL * 1.25, d_util * 100, 100.0 * d.delivered / std::max<uint64_t>(1, d.produced),
+                d.max_delay_us / 1000,
+                q.interval_min * 1.25, q.utilization * 100, 100.0 * r.delivered / std::max<uint64_t>(1, r.produced),
+                r.max_delay_us / 1000, q.mtu, q.tx_octets, q.feasible ? "" : " (over the limit)", ok ? "" : " FAIL");
+  }
+
+  // join one by one, then leave
+  auto policy  = radio::Policy{opts};
+  auto checks  = 0;
+  auto broken  = 0;
+  auto check   = [&](const radio::Params &p) {
+    checks += 1;
+    auto [lo, hi] = std::pair{p.interval_min, p.interval_max};
+    auto ok       = radio::INTERVAL_MIN <= lo && lo <= hi && hi <= radio::INTERVAL_MAX;
+    ok            = ok && static_cast<uint64_t>(p.timeout) * radio::TIMEOUT_UNIT_MS * 1000 >
+                   2ull * (1 + p.latency) * hi * radio::INTERVAL_UNIT_US;
+    ok            = ok && (!p.feasible || p.utilization <= opts.max_utilization);
+    broken += ok ? 0 : 1;
+  };
+  auto changes = 0;
+  for (int i = 0; i < cfg.devices; ++i) {
+    changes += policy.join(address(i), demand(cfg)) ? 1 : 0;
+    check(policy.params());
+  }
+  auto full = policy.params();
+  for (int i = cfg.devices - 1; i >= 0; --i) {
+    changes += policy.leave(address(i)) ? 1 : 0;
+    check(policy.params());
+  }
+  pass = pass && broken == 0 && policy.count() == 0;
+  std::printf("join/leave: %d plans checked, %d broken, %d renegotiations (%u counted); %d sensors at %.2f-%.2f ms, "
+              "timeout %u ms; policy %zu bytes\n",
+              checks, broken, changes, policy.replans(), cfg.devices, full.interval_min * 1.25,
+              full.interval_max * 1.25, full.timeout * radio::TIMEOUT_UNIT_MS, sizeof(policy));
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,294 @@
+//
+// Minimal MQTT 3.1.1 client, see mqtt_lite.h
+//
+
+#include "mqtt_lite.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace host {
+namespace {
+  enum PacketType : uint8_t {
+    CONNECT     = 1,
+    CONNACK     = 2,
+    PUBLISH     = 3,
+    PUBACK      = 4,
+    SUBSCRIBE   = 8,
+    SUBACK      = 9,
+    PINGREQ     = 12,
+    PINGRESP    = 13,
+    DISCONNECT  = 14,
+  };
+
+  int64_t now_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  void put_u16(std::vector<uint8_t> &out, uint16_t v) {
+    out.push_back(v >> 8);
+    out.push_back(v & 0xff);
+  }
+
+  void put_str(std::vector<uint8_t> &out, std::string_view s) {
+    put_u16(out, s.size());
+    out.insert(out.end(), s.begin(), s.end());
+  }
+}
+
+bool MqttLite::send_all(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    auto n = ::send(_fd, data, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::fprintf(stderr, "mqtt: send failed: %s\n", std::strerror(errno));
+      close();
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  _last_send_ms = now_ms();
+  return true;
+}
+
+bool MqttLite::send_packet(uint8_t header, const std::vector<uint8_t> &body) {
+  if (_fd < 0) {
+    return false;
+  }
+  _tx.clear();
+  _tx.push_back(header);
+  // remaining length, variable byte integer
+  auto remaining = body.size();
+  do {
+    uint8_t byte = remaining % 128;
+    remaining /= 128;
+    if (remaining > 0) {
+      byte |= 0x80;
+    }
+    _tx.push_back(byte);
+  } while (remaining > 0);
+  _tx.insert(_tx.end(), body.begin(), body.end());
+  return send_all(_tx.data(), _tx.size());
+}
+
+int MqttLite::fill(int timeout_ms) {
+  if (_rx_begin > 0) {
+    _rx.erase(_rx.begin(), _rx.begin() + _rx_begin);
+    _rx_begin = 0;
+  }
+  pollfd pfd{.fd = _fd, .events = POLLIN, .revents = 0};
+  auto ready = ::poll(&pfd, 1, timeout_ms);
+  if (ready == 0 || (ready < 0 && errno == EINTR)) {
+    return -1;
+  }
+  if (ready < 0) {
+    return 0;
+  }
+  constexpr size_t CHUNK = 64 * 1024;
+  auto old_size          = _rx.size();
+  _rx.resize(old_size + CHUNK);
+  auto n = ::recv(_fd, _rx.data() + old_size, CHUNK, 0);
+  if (n <= 0) {
+    _rx.resize(old_size);
+    return 0;
+  }
+  _rx.resize(old_size + n);
+  return static_cast<int>(_rx.size());
+}
+
+MqttLite::Take MqttLite::take_packet(uint8_t &header, const uint8_t *&body, size_t &len) {
+  auto avail = _rx.size() - _rx_begin;
+  if (avail < 2) {
+    return Take::incomplete;
+  }
+  const auto *p   = _rx.data() + _rx_begin;
+  size_t remaining = 0;
+  size_t mult      = 1;
+  size_t i         = 1;
+  for (;; ++i) {
+    if (i > 4) {
+      return Take::malformed;
+    }
+    if (i >= avail) {
+      return Take::incomplete;
+    }
+    remaining += (p[i] & 0x7f) * mult;
+    mult *= 128;
+    if ((p[i] & 0x80) == 0) {
+      break;
+    }
+  }
+  auto total = i + 1 + remaining;
+  if (avail < total) {
+    return Take::incomplete;
+  }
+  header = p[0];
+  body   = p + i + 1;
+  len    = remaining;
+  _rx_begin += total;
+  return Take::packet;
+}
+
+bool MqttLite::connect(const std::string &host, uint16_t port, const std::string &client_id, uint16_t keepalive_s) {
+  close();
+  addrinfo hints{};
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res     = nullptr;
+  auto port_str     = std::to_string(port);
+  auto err          = ::getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res);
+  if (err != 0) {
+    std::fprintf(stderr, "mqtt: resolve %s failed: %s\n", host.c_str(), gai_strerror(err));
+    return false;
+  }
+  for (auto *ai = res; ai != nullptr; ai = ai->ai_next) {
+    auto fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      _fd = fd;
+      break;
+    }
+    ::close(fd);
+  }
+  ::freeaddrinfo(res);
+  if (_fd < 0) {
+    std::fprintf(stderr, "mqtt: connect %s:%u failed: %s\n", host.c_str(), port, std::strerror(errno));
+    return false;
+  }
+  int one = 1;
+  ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  _rx.clear();
+  _rx_begin    = 0;
+  _keepalive_s = keepalive_s;
+
+  auto body = std::vector<uint8_t>{};
+  put_str(body, "MQTT");
+  body.push_back(4);    // protocol level 3.1.1
+  body.push_back(0x02); // clean session
+  put_u16(body, keepalive_s);
+  put_str(body, client_id);
+  if (!send_packet(CONNECT << 4, body)) {
+    return false;
+  }
+  auto deadline = now_ms() + 5000;
+  while (now_ms() < deadline) {
+    uint8_t header    = 0;
+    const uint8_t *p  = nullptr;
+    size_t len        = 0;
+    auto took         = take_packet(header, p, len);
+    if (took == Take::malformed) {
+      break;
+    }
+    if (took == Take::packet) {
+      if ((header >> 4) != CONNACK || len < 2 || p[1] != 0) {
+        std::fprintf(stderr, "mqtt: connection refused (code %d)\n", len >= 2 ? p[1] : -1);
+        close();
+        return false;
+      }
+      return true;
+    }
+    if (fill(static_cast<int>(deadline - now_ms())) == 0) {
+      break;
+    }
+  }
+  std::fprintf(stderr, "mqtt: no CONNACK\n");
+  close();
+  return false;
+}
+
+bool MqttLite::subscribe(const std::string &topic, uint8_t qos) {
+  auto body = std::vector<uint8_t>{};
+  put_u16(body, _next_id++);
+  put_str(body, topic);
+  body.push_back(qos);
+  return send_packet(SUBSCRIBE << 4 | 0x02, body);
+}
+
+bool MqttLite::publish(std::string_view topic, const uint8_t *data, size_t len, uint8_t qos, bool retain) {
+  auto body = std::vector<uint8_t>{};
+  body.reserve(topic.size() + len + 4);
+  put_str(body, topic);
+  if (qos > 0) {
+    put_u16(body, _next_id++);
+  }
+  body.insert(body.end(), data, data + len);
+  uint8_t header = PUBLISH << 4 | (qos > 0 ? 1 : 0) << 1 | (retain ? 1 : 0);
+  return send_packet(header, body);
+}
+
+bool MqttLite::poll(int timeout_ms, const on_publish_t &on_publish) {
+  if (_fd < 0) {
+    return false;
+  }
+  auto deadline = now_ms() + timeout_ms;
+  for (;;) {
+    uint8_t header   = 0;
+    const uint8_t *p = nullptr;
+    size_t len       = 0;
+    auto took        = Take::incomplete;
+    while ((took = take_packet(header, p, len)) == Take::packet) {
+      if ((header >> 4) != PUBLISH || len < 2) {
+        continue;
+      }
+      auto qos       = (header >> 1) & 0x03;
+      size_t topic_n = static_cast<size_t>(p[0]) << 8 | p[1];
+      auto offset    = 2 + topic_n + (qos > 0 ? 2 : 0);
+      if (offset > len) {
+        continue;
+      }
+      auto topic = std::string_view{reinterpret_cast<const char *>(p + 2), topic_n};
+      if (on_publish) {
+        on_publish(topic, p + offset, len - offset);
+      }
+      if (qos == 1) {
+        auto ack = std::vector<uint8_t>{p[2 + topic_n], p[3 + topic_n]};
+        if (!send_packet(PUBACK << 4, ack)) {
+          return false;
+        }
+      }
+    }
+    if (took == Take::malformed) {
+      std::fprintf(stderr, "mqtt: malformed packet, dropping the connection\n");
+      close();
+      return false;
+    }
+    auto now = now_ms();
+    if (_keepalive_s > 0 && now - _last_send_ms > _keepalive_s * 500) {
+      if (!send_packet(PINGREQ << 4, {})) {
+        return false;
+      }
+    }
+    if (now >= deadline) {
+      return true;
+    }
+    auto n = fill(static_cast<int>(deadline - now));
+    if (n == 0) {
+      std::fprintf(stderr, "mqtt: connection lost\n");
+      close();
+      return false;
+    }
+  }
+}
+
+void MqttLite::close() {
+  if (_fd >= 0) {
+    uint8_t bye[] = {DISCONNECT << 4, 0};
+    ::send(_fd, bye, sizeof(bye), MSG_NOSIGNAL);
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+}
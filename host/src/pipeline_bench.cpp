@@ -0,0 +1,430 @@
+//
+// pipeline_bench: runs the notifications of simulated sensors through every
+// composition of the hub's data path (main/include/pipeline.h) and reports
+// what each costs and what comes out of it.
+//
+// usage: pipeline_bench [-n sensors] [-s seconds] [-r rate_hz] [-m mtu] [-i iterations]
+//
+// Every sensor sends frames at `rate`, one in 25 a register reply and a stray
+// byte now and then, notified the way the BLE stack does it: mostly a frame
+// at a time, sometimes two, sometimes cut anywhere up to `mtu - 3` bytes. The
+// notifications of all the sensors are interleaved by time.
+//
+// Each composition is `pipeline::Hub` with the same stages the firmware gets
+// from `menuconfig`; decimation and batching are template arguments, so their
+// sizes are the constants below. The `std::function` row is the callback the
+// hub had before: formatting the topic and publishing from a lambda. The
+// `outbox` rows are batching as the firmware runs it, the messages handed
+// over to the transport after every poll.
+//
+// Reported per composition: the size of the pipeline, nanoseconds per
+// notification (best of `iterations`), messages and bytes handed to the
+// transport. The output is also checked as a receiver sees it, by reassembling
+// frames per topic: every register reply and every `decimate`th data frame, in
+// order, on the right topic. The exit code is 1 if one isn't.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+#include "pipeline.h"
+
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+constexpr uint32_t DECIMATE    = 4;
+constexpr size_t BATCH_BYTES   = 200;
+constexpr uint32_t BATCH_MS    = 100;
+constexpr int REGISTER_EVERY   = 25;
+constexpr int NOISE_EVERY      = 97;
+
+struct Options {
+  int sensors    = 12;
+  double seconds = 60;
+  double rate    = 50;
+  size_t mtu     = 247;
+  int iterations = 5;
+};
+
+struct Notification {
+  pipeline::addr_t addr{};
+  int64_t ts_us  = 0;
+  size_t offset  = 0;
+  size_t len     = 0;
+  size_t stream  = 0;
+};
+
+struct Workload {
+  // the bytes every sensor sends, in order
+  std::vector<std::vector<uint8_t>> streams;
+  std::vector<pipeline::addr_t> addrs;
+  std::vector<Notification> notifications;
+  std::vector<uint32_t> data_frames;
+  std::vector<uint32_t> register_frames;
+  size_t bytes = 0;
+};
+
+void put_frame(std::vector<uint8_t> &out, uint8_t flag, uint32_t seq) {
+  out.push_back(wit::FRAME_HEADER);
+  out.push_back(flag);
+  // the sequence number in the first two fields, the rest doesn't matter
+  out.push_back(seq & 0xff);
+  out.push_back((seq >> 8) & 0xff);
+  out.push_back((seq >> 16) & 0xff);
+  out.push_back((seq >> 24) & 0xff);
+  for (size_t i = 6; i < wit::FRAME_SIZE; ++i) {
+    out.push_back(static_cast<uint8_t>(seq * 31 + i));
+  }
+}
+
+uint32_t frame_seq(const uint8_t *frame) {
+  return frame[2] | frame[3] << 8 | frame[4] << 16 | static_cast<uint32_t>(frame[5]) << 24;
+}
+
+Workload make_workload(const Options &opts) {
+  auto rng    = std::mt19937{42};
+  auto res    = Workload{};
+  auto frames = static_cast<int64_t>(opts.seconds * opts.rate);
+  auto period = static_cast<int64_t>(1e6 / opts.rate);
+  auto max_len = opts.mtu - 3;
+  for (int s = 0; s < opts.sensors; ++s) {
+    res.addrs.push_back(pipeline::addr_t{0xc0, 0x01, 0x57, 0x49, 0x54, static_cast<uint8_t>(s)});
+    auto stream = std::vector<uint8_t>{};
+    // when the byte at an offset was sampled
+    auto sampled   = std::vector<int64_t>{};
+    uint32_t data  = 0;
+    uint32_t reg   = 0;
+    for (int64_t k = 0; k < frames; ++k) {
+      auto t = k * period + s * 1'013;
+      if (k % NOISE_EVERY == NOISE_EVERY - 1) {
+        stream.push_back(static_cast<uint8_t>(rng()) & 0x7f);
+      }
+      if (k % REGISTER_EVERY == REGISTER_EVERY - 1) {
+        put_frame(stream, wit::FLAG_REGISTER, reg++);
+      } else {
+        put_frame(stream, wit::FLAG_DATA, data++);
+      }
+      sampled.resize(stream.size(), t);
+    }
+    res.data_frames.push_back(data);
+    res.register_frames.push_back(reg);
+    size_t pos = 0;
+    while (pos < stream.size()) {
+      auto pick = rng() % 10;
+      size_t len = pick < 7 ? wit::FRAME_SIZE : (pick < 8 ? 2 * wit::FRAME_SIZE : 1 + rng() % max_len);
+      len        = std::min(len, stream.size() - pos);
+      res.notifications.push_back(Notification{res.addrs.back(), sampled[pos + len - 1], pos, len,
+                                               static_cast<size_t>(s)});
+      pos += len;
+    }
+    res.bytes += stream.size();
+    res.streams.push_back(std::move(stream));
+  }
+  std::stable_sort(res.notifications.begin(), res.notifications.end(),
+                   [](const auto &a, const auto &b) { return a.ts_us < b.ts_us; });
+  return res;
+}
+
+/**
+ * @brief the transport, counting what it's handed
+ */
+struct Count {
+  size_t messages   = 0;
+  size_t bytes      = 0;
+  uint64_t checksum = 0;
+
+  template <typename Next>
+  void push(const pipeline::Message &in, Next &) {
+    messages += 1;
+    bytes += in.len;
+    checksum += in.data[0] + in.data[in.len - 1] + in.topic[5];
+  }
+};
+
+/**
+ * @brief the transport, checking what it's handed as a receiver would
+ */
+struct Verify {
+  struct Stream {
+    std::string topic;
+    wit::FrameReassembler reassembler{};
+    uint32_t next_data = 0;
+    uint32_t next_reg  = 0;
+  };
+
+  const Workload *workload = nullptr;
+  uint32_t decimate        = 1;
+  std::vector<Stream> streams;
+  size_t errors = 0;
+
+  void init(const Workload &w, uint32_t n) {
+    workload = &w;
+    decimate = n;
+    for (const auto &addr : w.addrs) {
+      char hex[13];
+      for (size_t i = 0; i < addr.size(); ++i) {
+        std::snprintf(hex + i * 2, 3, "%02x", addr[i]);
+      }
+      streams.push_back(Stream{"/wit/" + std::string{hex} + "/data"});
+    }
+  }
+
+  template <typename Next>
+  void push(const pipeline::Message &in, Next &) {
+    auto it = std::find_if(streams.begin(), streams.end(), [&](const auto &s) { return s.topic == in.topic; });
+    if (it == streams.end()) {
+      errors += 1;
+      return;
+    }
+    it->reassembler.feed(in.data, in.len, [&](const uint8_t *frame) {
+      auto seq = frame_seq(frame);
+      if (frame[1] == wit::FLAG_REGISTER) {
+        errors += seq == it->next_reg ? 0 : 1;
+        it->next_reg = seq + 1;
+      } else {
+        errors += seq == it->next_data ? 0 : 1;
+        it->next_data = seq + decimate;
+      }
+    });
+  }
+
+  /**
+   * @brief whether everything came through
+   */
+  [[nodiscard]] bool complete() const {
+    for (size_t s = 0; s < streams.size(); ++s) {
+      auto data  = workload->data_frames[s];
+      auto whole = (data + decimate - 1) / decimate * decimate;
+      if (streams[s].next_reg != workload->register_frames[s] || streams[s].next_data != whole) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+template <typename P>
+void feed(P &p, const Workload &w) {
+  int64_t next_poll = 0;
+  for (const auto &n : w.notifications) {
+    if constexpr (P::polled) {
+      if (n.ts_us >= next_poll) {
+        p.poll(n.ts_us);
+        next_poll = n.ts_us + BATCH_MS * 1000 / 2;
+      }
+    }
+    p.push(pipeline::Chunk{n.addr, w.streams[n.stream].data() + n.offset, n.len, n.ts_us});
+  }
+  for (const auto &addr : w.addrs) {
+    p.disconnect(addr);
+  }
+}
+
+struct Result {
+  size_t size     = 0;
+  double ns       = std::numeric_limits<double>::infinity();
+  size_t messages = 0;
+  size_t bytes    = 0;
+  bool ok         = false;
+};
+
+template <typename Timed, typename Checked>
+Result measure(const Workload &w, const Options &opts, uint32_t decimate) {
+  auto res = Result{sizeof(Timed)};
+  for (int i = 0; i < opts.iterations; ++i) {
+    auto p     = std::make_unique<Timed>();
+    auto start = clock_type::now();
+    feed(*p, w);
+    auto ns  = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+    res.ns   = std::min(res.ns, ns / static_cast<double>(w.notifications.size()));
+    auto &c  = p->template stage<Count>();
+    res.messages = c.messages;
+    res.bytes    = c.bytes;
+    // keep the checksum alive
+    if (c.checksum == 1) {
+      std::printf(" ");
+    }
+  }
+  auto checked = std::make_unique<Checked>();
+  checked->template stage<Verify>().init(w, decimate);
+  feed(*checked, w);
+  auto &v = checked->template stage<Verify>();
+  res.ok  = v.errors == 0 && v.complete();
+  return res;
+}
+
+template <pipeline::Config C>
+Result measure(const Workload &w, const Options &opts) {
+  return measure<pipeline::Hub<C, pipeline::Skip, Count>, pipeline::Hub<C, pipeline::Skip, Verify>>(
+      w, opts, C.reassemble ? C.decimate : 1);
+}
+
+/**
+ * @brief the hub before the pipeline: a `std::function` formatting the topic
+ * of every notification
+ */
+template <typename Sink>
+class Callback {
+  Sink _sink{};
+  pipeline::Pipeline<> _end{};
+  std::function<void(const pipeline::addr_t &addr, const uint8_t *data, size_t len)> _on_data;
+
+public:
+  static constexpr bool polled = false;
+
+  Callback() {
+    _on_data = [this](const pipeline::addr_t &addr, const uint8_t *data, size_t len) {
+      // "/wit/" + hex address + "/data"
+      // as `utils::sprintHex` does it
+      char topic[5 + 12 + 5 + 1] = "/wit/";
+      for (size_t i = 0; i < addr.size() * 2; ++i) {
+        uint8_t nibble = i % 2 == 0 ? addr[i / 2] >> 4 : addr[i / 2] & 0x0f;
+        topic[5 + i]   = nibble < 10 ? '0' + nibble : 'a' + nibble - 10;
+      }
+      topic[5 + addr.size() * 2] = '\0';
+      std::strcat(topic, "/data");
+      _sink.push(pipeline::Message{topic, data, len}, _end);
+    };
+  }
+
+  void push(const pipeline::Chunk &in) {
+    _on_data(in.addr, in.data, in.len);
+  }
+
+  void poll(int64_t) {}
+
+  void disconnect(const pipeline::addr_t &) {}
+
+  template <typename S>
+  S &stage() {
+    return _sink;
+  }
+};
+
+/**
+ * @brief the batched hub of the firmware: into an `Outbox`, passed on to the
+ * transport after every poll or once it's half full, as `HubPipeline` does
+ */
+template <pipeline::Config C, typename Sink>
+class Handover {
+  using outbox_t = pipeline::Outbox<2 * pipeline::MAX_DEVICES, C.batch_bytes>;
+  pipeline::Hub<C, pipeline::Skip, outbox_t> _hub{};
+  Sink _sink{};
+  pipeline::Pipeline<> _end{};
+
+  void drain() {
+    auto &outbox = _hub.template stage<outbox_t>();
+    auto held    = outbox.held();
+    outbox.peek(held, [&](const pipeline::Message &msg) { _sink.push(msg, _end); });
+    outbox.pop(held);
+  }
+
+public:
+  static constexpr bool polled = true;
+
+  void push(const pipeline::Chunk &in) {
+    _hub.push(in);
+    if (_hub.template stage<outbox_t>().held() >= outbox_t::capacity() / 2) {
+      drain();
+    }
+  }
+
+  void poll(int64_t now_us) {
+    _hub.poll(now_us);
+    drain();
+  }
+
+  void disconnect(const pipeline::addr_t &addr) {
+    _hub.disconnect(addr);
+    drain();
+  }
+
+  template <typename S>
+  S &stage() {
+    return _sink;
+  }
+};
+
+// a stage that isn't configured isn't there
+static_assert(std::is_same_v<pipeline::Hub<pipeline::Config{}, pipeline::Skip, Count>,
+                             pipeline::Pipeline<pipeline::Encode, Count>>);
+
+void usage(const char *self) {
+  std::fprintf(stderr,
+               "usage: %s [-n sensors] [-s seconds] [-r rate_hz] [-m mtu] [-i iterations]\n"
+               "  -n  sensors (default 12)\n"
+               "  -s  length of the run, s (default 60)\n"
+               "  -r  frames per second per sensor (default 50)\n"
+               "  -m  ATT MTU, the longest notification is 3 bytes less (default 247)\n"
+               "  -i  runs per composition, the best one counts (default 5)\n",
+               self);
+}
+}
+
+int main(int argc, char **argv) {
+  auto opts = Options{};
+  int opt   = 0;
+  while ((opt = ::getopt(argc, argv, "n:s:r:m:i:")) != -1) {
+    switch (opt) {
+      case 'n': opts.sensors = std::atoi(optarg); break;
+      case 's': opts.seconds = std::atof(optarg); break;
+      case 'r': opts.rate = std::atof(optarg); break;
+      case 'm': opts.mtu = std::strtoul(optarg, nullptr, 10); break;
+      case 'i': opts.iterations = std::atoi(optarg); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (opts.sensors < 1 || opts.sensors > static_cast<int>(pipeline::MAX_DEVICES) || opts.seconds <= 0 ||
+      opts.rate <= 0 || opts.mtu < 4 || opts.iterations < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  auto w = make_workload(opts);
+  std::printf("%d sensors, %.0f s at %.0f Hz: %zu notifications, %.1f KiB\n", opts.sensors, opts.seconds,
+              opts.rate, w.notifications.size(), w.bytes / 1024.0);
+  std::printf("decimate %u, batch %zu bytes / %u ms\n\n", DECIMATE, BATCH_BYTES, BATCH_MS);
+
+  constexpr auto RAW        = pipeline::Config{};
+  constexpr auto FRAMES     = pipeline::Config{.reassemble = true};
+  constexpr auto DECIMATED  = pipeline::Config{.reassemble = true, .decimate = DECIMATE};
+  constexpr auto BATCHED    = pipeline::Config{.batch_bytes = BATCH_BYTES, .batch_ms = BATCH_MS};
+  constexpr auto FRAMES_B   = pipeline::Config{.reassemble = true, .batch_bytes = BATCH_BYTES, .batch_ms = BATCH_MS};
+  constexpr auto DECIMATED_B = pipeline::Config{
+      .reassemble = true, .decimate = DECIMATE, .batch_bytes = BATCH_BYTES, .batch_ms = BATCH_MS};
+
+  struct Row {
+    const char *name;
+    Result result;
+  };
+  const Row rows[] = {
+      {"std::function (before)", measure<Callback<Count>, Callback<Verify>>(w, opts, 1)},
+      {"raw", measure<RAW>(w, opts)},
+      {"reassemble", measure<FRAMES>(w, opts)},
+      {"reassemble+decimate", measure<DECIMATED>(w, opts)},
+      {"batch", measure<BATCHED>(w, opts)},
+      {"reassemble+batch", measure<FRAMES_B>(w, opts)},
+      {"reassemble+decimate+batch", measure<DECIMATED_B>(w, opts)},
+      {"reassemble+batch, outbox", measure<Handover<FRAMES_B, Count>, Handover<FRAMES_B, Verify>>(w, opts, 1)},
+      {"batch, outbox", measure<Handover<BATCHED, Count>, Handover<BATCHED, Verify>>(w, opts, 1)},
+  };
+  std::printf("%-26s | %7s %9s | %9s %10s | %s\n", "composition", "bytes", "ns/notif", "messages", "bytes out",
+              "check");
+  auto ok = true;
+  for (const auto &r : rows) {
+    std::printf("%-26s | %7zu %9.1f | %9zu %10zu | %s\n", r.name, r.result.size, r.result.ns, r.result.messages,
+                r.result.bytes, r.result.ok ? "ok" : "FAIL");
+    ok = ok && r.result.ok;
+  }
+  return ok ? 0 : 1;
+}
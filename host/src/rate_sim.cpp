@@ -0,0 +1,443 @@
+//
+// rate_sim: checks the output rate controller of main/include/rate_control.h
+// against a simulated hub whose uplink capacity changes over time.
+//
+// usage: rate_sim [-n sensors] [-C capacity_msg_s] [-Q queue_msgs] [-M max_hz]
+//                 [-w write_ms] [-W write_queue] [-p update_period_ms] [-s seconds]
+//
+// Every frame of a sensor is a message for the hub to publish; the hub gets
+// `capacity` of them out per second and queues up to `queue` more, the rest
+// is dropped. While messages are queued the publisher is blocked on the
+// uplink, for as long as it takes to get them out; that share of the time is
+// the backlog the controller gets, as `RateAgent` measures it. The links are planned by `radio::Policy` for the current rates,
+// and a radio past its time loses frames. The capacity drops to a quarter in
+// the second third of the run, as a poor Wi-Fi link would, and one sensor
+// disconnects and comes back in the middle. Sensor 0 may only go up to 5 Hz
+// and sensor 1 not below 20 Hz. A rate change is two writes (the unlock and
+// the register write) through the write queue of the hub, which holds `-W`
+// of them and writes one at a time, `-w` each; the rate takes effect once its
+// register write is done. A change that doesn't fit into the queue is
+// reverted, or tried again at the next update for a sensor that just
+// connected, as the hub does.
+//
+// The same run is done with every sensor fixed at its highest rate, fixed at
+// the nominal 10 Hz and under the controller. Reported per third: capacity,
+// offered and delivered messages per second, drops. The settled part of a
+// third is its second half, once the controller had time to react.
+//
+// The controller is also checked as it goes: rates within the limits, no
+// step up while congested, cuts `settle_ms` apart and step ups `hold_ms`
+// after the previous change, and once the write queue is empty every sensor
+// has to run at the rate the controller has for it. The exit code is 1 if one
+// of these breaks, or if
+// in a settled part it drops messages or delivers less than half of what the
+// capacity, the limits and the radio allow (unless even the minimum rates are
+// too much).
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <unistd.h>
+#include <vector>
+#include "link_policy.h"
+#include "rate_control.h"
+
+namespace {
+struct Config {
+  int sensors          = 8;
+  double capacity      = 400;
+  double queue         = 200;
+  float max_hz         = 50;
+  int64_t write_ms     = 150;
+  size_t write_queue   = 2 * rate::MAX_DEVICES;
+  int64_t period_ms    = 1000;
+  double seconds       = 360;
+};
+
+enum class Mode {
+  fixed_max,
+  fixed_nominal,
+  controlled,
+};
+
+const char *to_str(Mode m) {
+  switch (m) {
+    case Mode::fixed_max: return "fixed max";
+    case Mode::fixed_nominal: return "fixed 10 Hz";
+    case Mode::controlled: return "controlled";
+  }
+  return "?";
+}
+
+constexpr float NOMINAL_HZ = 10;
+constexpr int64_t TICK_MS  = 10;
+
+struct Phase {
+  double capacity  = 0;
+  double produced  = 0;
+  double delivered = 0;
+  double dropped   = 0;
+  // settled part
+  double settled_delivered = 0;
+  double settled_dropped   = 0;
+  double settled_s         = 0;
+  // what the capacity and the limits allow, per second
+  double allowed = 0;
+};
+
+struct Sensor {
+  rate::addr_t addr{};
+  rate::Limits limits{};
+  bool connected = false;
+  float hz       = 0;
+  double acc     = 0;
+};
+
+/**
+ * @brief a write to a sensor, in the write queue of the hub
+ */
+struct Write {
+  int sensor = 0;
+  // the register write rather than the unlock
+  bool rrate = false;
+  float hz   = 0;
+};
+
+struct Result {
+  std::array<Phase, 3> phases{};
+  uint32_t changes    = 0;
+  uint32_t violations = 0;
+  // changes that didn't fit into the write queue
+  uint32_t refused = 0;
+  // ticks with a sensor off the rate the controller has for it
+  uint32_t disagreements = 0;
+  rate::Stats stats{};
+};
+
+rate::addr_t address(int s) {
+  return {0xc0, 0xff, 0x57, 0x49, 0x54, static_cast<uint8_t>(s)};
+}
+
+rate::Limits limits(const Config &cfg, int s) {
+  switch (s) {
+    case 0: return {.min_hz = 1, .max_hz = 5};
+    case 1: return {.min_hz = 20, .max_hz = cfg.max_hz};
+    default: return {.min_hz = 1, .max_hz = cfg.max_hz};
+  }
+}
+
+radio::addr_t to_link(const rate::addr_t &addr) {
+  auto res = radio::addr_t{};
+  std::copy(addr.begin(), addr.end(), res.begin());
+  return res;
+}
+
+/**
+ * @brief every link takes what is asked for
+ */
+void settle(radio::Policy &links) {
+  const auto p = links.params();
+  links.for_each([&](const radio::addr_t &addr, const radio::Demand &, const radio::Agreed &) {
+    links.on_agreed(addr, radio::Agreed{.mtu = p.mtu, .tx_octets = p.tx_octets, .interval = p.interval_min});
+  });
+}
+
+int phase_of(const Config &cfg, int64_t t_ms) {
+  return std::min(2, static_cast<int>(3 * t_ms / (cfg.seconds * 1000)));
+}
+
+double capacity_at(const Config &cfg, int64_t t_ms) {
+  return phase_of(cfg, t_ms) == 1 ? cfg.capacity / 4 : cfg.capacity;
+}
+
+/**
+ * @brief expected radio utilization with the sensors at `steps`
+ */
+float utilization(const std::vector<Sensor> &sensors, const std::vector<size_t> &steps) {
+  auto links = radio::Policy{radio::Options{}};
+  for (size_t i = 0; i < sensors.size(); ++i) {
+    links.join(to_link(sensors[i].addr), radio::Demand{.rate_hz = wit::RATES[steps[i]].hz});
+  }
+  settle(links);
+  return links.utilization();
+}
+
+/**
+ * @brief highest total the sensors can run at within their limits, `budget`
+ * and the utilization limit of the controller, on the rate ladder
+ */
+double best_total(const std::vector<Sensor> &sensors, double budget, float max_utilization) {
+  auto steps   = std::vector<size_t>{};
+  double total = 0;
+  for (const auto &s : sensors) {
+    auto hi = wit::rate_index(s.limits.max_hz);
+    auto lo = std::min<size_t>(rate::rate_at_least(s.limits.min_hz), hi);
+    steps.push_back(lo);
+    total += wit::RATES[lo].hz;
+  }
+  // slowest first, as the controller does
+  for (;;) {
+    size_t best = steps.size();
+    for (size_t i = 0; i < steps.size(); ++i) {
+      auto hi = wit::rate_index(sensors[i].limits.max_hz);
+      if (steps[i] < hi && (best == steps.size() || steps[i] < steps[best])) {
+        best = i;
+      }
+    }
+    if (best == steps.size()) {
+      return total;
+    }
+    auto next = total + wit::RATES[steps[best] + 1].hz - wit::RATES[steps[best]].hz;
+    steps[best] += 1;
+    if (next > budget || utilization(sensors, steps) > max_utilization) {
+      return total;
+    }
+    total = next;
+  }
+}
+
+Result run(const Config &cfg, Mode mode) {
+  auto res        = Result{};
+  auto opts       = rate::Options{};
+  auto controller = rate::Controller{opts};
+  auto links      = radio::Policy{radio::Options{}};
+  auto sensors    = std::vector<Sensor>(cfg.sensors);
+  for (int s = 0; s < cfg.sensors; ++s) {
+    sensors[s].addr   = address(s);
+    sensors[s].limits = limits(cfg, s);
+  }
+  int64_t now         = 0;
+  int64_t last_cut    = std::numeric_limits<int64_t>::min() / 2;
+  int64_t last_change = std::numeric_limits<int64_t>::min() / 2;
+  auto congested      = false;
+  auto decided        = std::vector<rate::Change>{};
+  auto joins          = std::vector<rate::Change>{};
+  auto writes         = std::deque<Write>{};
+  int64_t write_done  = -1;
+  auto on_change      = [&](const rate::Change &c) {
+    res.changes += 1;
+    auto &s = sensors[c.addr[5]];
+    // the law, as seen from outside
+    auto hi = wit::rate_index(s.limits.max_hz);
+    auto lo = std::min<size_t>(rate::rate_at_least(s.limits.min_hz), hi);
+    auto up = c.to > c.from;
+    res.violations += c.to < lo || c.to > hi ? 1 : 0;
+    res.violations += up && (congested || now - last_change < opts.hold_ms) ? 1 : 0;
+    if (c.to < c.from) {
+      res.violations += now != last_cut && now - last_cut < opts.settle_ms ? 1 : 0;
+      last_cut = now;
+    }
+    last_change = now;
+    decided.push_back(c);
+  };
+  // as `RateAgent` does with what the controller decided
+  auto apply = [&]() {
+    for (const auto &c : decided) {
+      auto i = static_cast<int>(c.addr[5]);
+      if (writes.size() + 2 <= cfg.write_queue) {
+        writes.push_back(Write{i, false, 0});
+        writes.push_back(Write{i, true, c.to_hz()});
+        continue;
+      }
+      res.refused += 1;
+      if (c.cause != rate::Cause::join) {
+        controller.revert(c);
+      } else if (sensors[i].connected) {
+        joins.push_back(c);
+      }
+    }
+    decided.clear();
+  };
+  auto connect = [&](int i) {
+    auto &s     = sensors[i];
+    s.connected = true;
+    // what it was left at
+    s.hz = NOMINAL_HZ;
+    switch (mode) {
+      case Mode::fixed_max: s.hz = wit::RATES[wit::rate_index(s.limits.max_hz)].hz; break;
+      case Mode::fixed_nominal: break;
+      case Mode::controlled:
+        controller.join(s.addr, s.limits, NOMINAL_HZ, now, on_change);
+        apply();
+        break;
+    }
+    links.join(to_link(s.addr), radio::Demand{.rate_hz = s.hz});
+    settle(links);
+  };
+  auto disconnect = [&](int i) {
+    auto &s     = sensors[i];
+    s.connected = false;
+    // its queued writes fail, but for the one under way
+    auto first = writes.begin() + (write_done >= 0 ? 1 : 0);
+    writes.erase(std::remove_if(first, writes.end(), [&](const Write &w) { return w.sensor == i; }), writes.end());
+    joins.erase(std::remove_if(joins.begin(), joins.end(), [&](const rate::Change &c) { return c.addr == s.addr; }),
+                joins.end());
+    links.leave(to_link(s.addr));
+    settle(links);
+    controller.leave(s.addr);
+  };
+
+  double queue      = 0;
+  double out_credit = 0;
+  double hub_drops  = 0;
+  double blocked_ms = 0;
+  uint32_t reported = 0;
+  auto end_ms       = static_cast<int64_t>(cfg.seconds * 1000);
+  auto phase_ms     = end_ms / 3;
+  auto leaving      = cfg.sensors / 2;
+  for (now = 0; now < end_ms; now += TICK_MS) {
+    // sensors connect one by one, one leaves for a while in the middle
+    if (now % 500 == 0 && now / 500 < cfg.sensors) {
+      connect(static_cast<int>(now / 500));
+    }
+    if (now == end_ms / 2) {
+      disconnect(leaving);
+    }
+    if (now == end_ms / 2 + 5'000) {
+      connect(leaving);
+    }
+    auto &phase    = res.phases[phase_of(cfg, now)];
+    auto settled   = now % phase_ms >= phase_ms / 2;
+    auto capacity  = capacity_at(cfg, now);
+    phase.capacity = capacity;
+
+    // the write queue, one write at a time
+    if (write_done >= 0 && now >= write_done) {
+      auto w     = writes.front();
+      auto &s    = sensors[w.sensor];
+      write_done = -1;
+      writes.pop_front();
+      if (w.rrate && s.connected) {
+        s.hz = w.hz;
+        links.set_demand(to_link(s.addr), radio::Demand{.rate_hz = s.hz});
+        settle(links);
+      }
+    }
+    if (write_done < 0 && !writes.empty()) {
+      write_done = now + cfg.write_ms;
+    }
+    if (mode == Mode::controlled && writes.empty() && joins.empty()) {
+      for (const auto &s : sensors) {
+        if (s.connected && controller.rate_hz(s.addr) != s.hz) {
+          res.disagreements += 1;
+          break;
+        }
+      }
+    }
+    auto util   = static_cast<double>(links.utilization());
+    auto on_air = util > 1 ? 1 / util : 1.0;
+
+    double produced = 0;
+    for (auto &s : sensors) {
+      if (!s.connected) {
+        continue;
+      }
+      s.acc += s.hz * TICK_MS / 1000.0;
+      auto n = std::floor(s.acc);
+      s.acc -= n;
+      produced += n;
+    }
+    // the hub: queue, publish at capacity, drop what doesn't fit
+    auto arrivals = produced * on_air;
+    queue += arrivals;
+    out_credit = std::min(out_credit + capacity * TICK_MS / 1000.0, capacity * 0.1);
+    auto sent  = std::min(queue, out_credit);
+    out_credit -= sent;
+    queue -= sent;
+    auto lost = std::max(0.0, queue - cfg.queue);
+    queue -= lost;
+    hub_drops += lost;
+    blocked_ms += std::min<double>(TICK_MS, queue / capacity * 1000);
+    phase.produced += produced;
+    phase.delivered += sent;
+    phase.dropped += lost + produced - arrivals;
+    if (settled) {
+      phase.settled_delivered += sent;
+      phase.settled_dropped += lost + produced - arrivals;
+      phase.settled_s += TICK_MS / 1000.0;
+    }
+
+    if (mode == Mode::controlled && now % cfg.period_ms == 0) {
+      auto load        = rate::Load{};
+      load.backlog     = static_cast<float>(blocked_ms / cfg.period_ms);
+      load.drops       = static_cast<uint32_t>(hub_drops);
+      load.utilization = static_cast<float>(util);
+      congested        = load.drops != reported || load.backlog > opts.backlog_high ||
+                         load.utilization > opts.max_utilization;
+      reported         = load.drops;
+      blocked_ms       = 0;
+      // the joins that didn't fit last time go first
+      decided.swap(joins);
+      controller.update(now, load, on_change);
+      apply();
+    }
+  }
+  for (int p = 0; p < 3; ++p) {
+    res.phases[p].allowed = best_total(sensors, capacity_at(cfg, p * phase_ms), opts.max_utilization);
+  }
+  res.stats = controller.stats();
+  return res;
+}
+}
+
+int main(int argc, char **argv) {
+  auto cfg = Config{};
+  int opt  = 0;
+  while ((opt = ::getopt(argc, argv, "n:C:Q:M:w:W:p:s:")) != -1) {
+    switch (opt) {
+      case 'n': cfg.sensors = std::clamp(std::atoi(optarg), 2, static_cast<int>(rate::MAX_DEVICES)); break;
+      case 'C': cfg.capacity = std::atof(optarg); break;
+      case 'Q': cfg.queue = std::atof(optarg); break;
+      case 'M': cfg.max_hz = static_cast<float>(std::atof(optarg)); break;
+      case 'w': cfg.write_ms = std::max<int64_t>(TICK_MS, std::atoll(optarg)); break;
+      case 'W': cfg.write_queue = static_cast<size_t>(std::max(2, std::atoi(optarg))); break;
+      case 'p': cfg.period_ms = std::max<int64_t>(TICK_MS, std::atoll(optarg) / TICK_MS * TICK_MS); break;
+      case 's': cfg.seconds = std::max(30.0, std::atof(optarg)); break;
+      default:
+        std::fprintf(stderr,
+                     "usage: %s [-n sensors] [-C capacity_msg_s] [-Q queue_msgs] [-M max_hz]\n"
+                     "          [-w write_ms] [-W write_queue] [-p update_period_ms] [-s seconds]\n",
+                     argv[0]);
+        return 2;
+    }
+  }
+
+  auto pass = true;
+  std::printf("%d sensors, capacity %.0f msg/s (a quarter of it in the second third), queue %.0f, "
+              "%zu writes queued, %lld ms each, updates every %lld ms\n",
+              cfg.sensors, cfg.capacity, cfg.queue, cfg.write_queue, static_cast<long long>(cfg.write_ms),
+              static_cast<long long>(cfg.period_ms));
+  std::printf("%-12s %5s | %8s %8s %9s %9s | %9s %9s %8s\n", "", "third", "capacity", "allowed", "offered",
+              "delivered", "settled", "drops", "settled");
+  for (auto mode : {Mode::fixed_max, Mode::fixed_nominal, Mode::controlled}) {
+    auto r      = run(cfg, mode);
+    auto length = cfg.seconds / 3;
+    for (size_t p = 0; p < r.phases.size(); ++p) {
+      const auto &ph  = r.phases[p];
+      auto settled    = ph.settled_delivered / std::max(ph.settled_s, 1e-9);
+      auto ok         = true;
+      // with every sensor at its minimum the hub is still over; nothing to check
+      auto over       = ph.allowed > ph.capacity;
+      if (mode == Mode::controlled && !over) {
+        ok   = ph.settled_dropped < 1 && settled >= ph.allowed / 2;
+        pass = pass && ok;
+      }
+      std::printf("%-12s %5zu | %8.0f %8.0f %9.1f %9.1f | %9.1f %9.0f %8.0f%s\n", p == 0 ? to_str(mode) : "", p + 1,
+                  ph.capacity, ph.allowed, ph.produced / length, ph.delivered / length, settled, ph.dropped,
+                  ph.settled_dropped, over ? " (minimums over capacity)" : (ok ? "" : " FAIL"));
+    }
+    if (mode == Mode::controlled) {
+      pass = pass && r.violations == 0 && r.disagreements == 0;
+      std::printf("%u rate changes (%u cuts, %u steps up, %u probes), %u broke the law; controller %zu bytes\n",
+                  r.changes, r.stats.decreases, r.stats.increases, r.stats.probes, r.violations,
+                  sizeof(rate::Controller));
+      std::printf("%u didn't fit into the write queue (%u reverted), %u ticks with a sensor off its rate%s\n",
+                  r.refused, r.stats.reverts, r.disagreements, r.disagreements == 0 ? "" : " FAIL");
+    }
+  }
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+//
+// wit_ingest: subscribe to the hubs' data topics on a (local) broker and
+// append every device's samples to a memory-mapped column store.
+//
+// usage: wit_ingest [-h host] [-p port] [-t topic] [-d dir] [-b batch]
+//                   [-f flush_ms] [-r capture_file]
+//
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "capture.h"
+#include "ingestor.h"
+#include "mqtt_lite.h"
+
+namespace {
+std::atomic_bool running{true};
+
+int64_t realtime_us() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+int64_t steady_ms() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void usage(const char *self) {
+  std::fprintf(stderr,
+               "usage: %s [-h host] [-p port] [-t topic] [-d dir] [-b batch] [-f flush_ms] [-r capture_file]\n"
+               "  -h  broker host (default 127.0.0.1)\n"
+               "  -p  broker port (default 1883)\n"
+               "  -t  topic filter (default /wit/+/data)\n"
+               "  -d  output directory for <addr>.witc files (default .)\n"
+               "  -b  frames per device to decode at once (default 256)\n"
+               "  -f  max time a frame waits before it is written, ms (default 200)\n"
+               "  -r  also record every message to a capture file for replay\n",
+               self);
+}
+}
+
+int main(int argc, char **argv) {
+  auto host     = std::string{"127.0.0.1"};
+  uint16_t port = 1883;
+  auto topic    = std::string{"/wit/+/data"};
+  auto dir      = std::string{"."};
+  size_t batch  = 256;
+  int flush_ms  = 200;
+  auto record   = std::string{};
+  int opt       = 0;
+  while ((opt = ::getopt(argc, argv, "h:p:t:d:b:f:r:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = static_cast<uint16_t>(std::atoi(optarg)); break;
+      case 't': topic = optarg; break;
+      case 'd': dir = optarg; break;
+      case 'b': batch = std::strtoul(optarg, nullptr, 10); break;
+      case 'f': flush_ms = std::atoi(optarg); break;
+      case 'r': record = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  ::mkdir(dir.c_str(), 0755);
+  std::signal(SIGINT, [](int) { running = false; });
+  std::signal(SIGTERM, [](int) { running = false; });
+
+  auto ingestor = host::Ingestor{dir, host::ColumnStore::Options{}, batch};
+  auto capture  = host::CaptureWriter{};
+  if (!record.empty() && !capture.open(record)) {
+    return 1;
+  }
+  auto on_publish = [&](std::string_view t, const uint8_t *data, size_t len) {
+    auto ts = realtime_us();
+    ingestor.on_message(ts, t, data, len);
+    if (!record.empty()) {
+      capture.write(ts, t, data, len);
+    }
+  };
+
+  auto client    = host::MqttLite{};
+  auto client_id = "wit_ingest_" + std::to_string(::getpid());
+  auto backoff   = std::chrono::milliseconds(500);
+  auto last_log  = steady_ms();
+  auto last_sync = steady_ms();
+  while (running) {
+    if (!client.is_connected()) {
+      if (!client.connect(host, port, client_id) || !client.subscribe(topic)) {
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, std::chrono::milliseconds(10'000));
+        continue;
+      }
+      backoff = std::chrono::milliseconds(500);
+      std::fprintf(stderr, "subscribed to %s on %s:%u\n", topic.c_str(), host.c_str(), port);
+    }
+    client.poll(flush_ms, on_publish);
+    // bound the latency of devices that don't fill a batch
+    ingestor.flush();
+    auto now = steady_ms();
+    if (now - last_sync > 1000) {
+      ingestor.sync();
+      last_sync = now;
+    }
+    if (now - last_log > 10'000) {
+      const auto &s = ingestor.stats();
+      std::fprintf(stderr, "devices=%zu messages=%lu frames=%lu other=%lu dropped_bytes=%lu unknown_topics=%lu store_errors=%lu\n",
+                   ingestor.device_count(), s.messages, s.frames, s.other_frames, s.dropped_bytes, s.unknown_topics, s.store_errors);
+      last_log = now;
+    }
+  }
+  ingestor.flush();
+  client.close();
+  return 0;
+}
@@ -0,0 +1,300 @@
+//
+// wit_ingest_bench: replay captures from one or more hubs through the ingest
+// path and report throughput.
+//
+// usage: wit_ingest_bench [-d dir] [-b batch] [-k] capture_file...
+//        wit_ingest_bench [-n hubs] [-s seconds] [-r rate] [-w prefix] ...
+//
+// Without capture files a synthetic capture is generated: `hubs` hubs with
+// `MAX_DEVICE_NUM` (9) devices each, notifying at `rate` Hz, where some
+// notifications are split or coalesced the way the BLE stack does it. `-w`
+// writes the synthetic capture of each hub to `<prefix><hub>.witcap`.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "capture.h"
+#include "ingestor.h"
+
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+struct Message {
+  int64_t ts_us;
+  std::string_view topic;
+  const uint8_t *data;
+  size_t len;
+};
+
+struct Synthetic {
+  std::vector<std::string> topics;
+  std::vector<std::vector<uint8_t>> payloads;
+  // one per hub, in time order
+  std::vector<std::vector<Message>> hubs;
+};
+
+void put_frame(std::vector<uint8_t> &out, int64_t t_us, int device) {
+  out.push_back(wit::FRAME_HEADER);
+  out.push_back(wit::FLAG_DATA);
+  for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+    auto phase = static_cast<double>(t_us) * 1e-6 * (1.0 + 0.1 * f) + device;
+    auto v     = static_cast<int16_t>(std::sin(phase) * 16000.0);
+    out.push_back(static_cast<uint16_t>(v) & 0xff);
+    out.push_back(static_cast<uint16_t>(v) >> 8);
+  }
+}
+
+// `blue::MAX_DEVICE_NUM`
+constexpr int DEVICES = 9;
+
+Synthetic make_synthetic(int hubs, double seconds, double rate) {
+  auto res = Synthetic{};
+  res.hubs.resize(hubs);
+  res.topics.reserve(hubs * DEVICES);
+  for (int h = 0; h < hubs; ++h) {
+    for (int d = 0; d < DEVICES; ++d) {
+      auto addr = host::addr_t{0xc0, static_cast<uint8_t>(h), 0x57, 0x49, 0x54, static_cast<uint8_t>(d)};
+      res.topics.push_back("/wit/" + host::addr_to_hex(addr) + "/data");
+    }
+  }
+  auto samples = static_cast<int64_t>(seconds * rate);
+  auto period  = static_cast<int64_t>(1e6 / rate);
+  // payloads first, the messages point into them
+  for (int h = 0; h < hubs; ++h) {
+    for (int d = 0; d < DEVICES; ++d) {
+      auto offset = (h * DEVICES + d) * 37;
+      for (int64_t k = 0; k < samples; ++k) {
+        auto t     = k * period + offset;
+        auto frame = std::vector<uint8_t>{};
+        put_frame(frame, t, d);
+        if (k % 16 == 7) {
+          // split across two notifications
+          res.payloads.emplace_back(frame.begin(), frame.begin() + 7);
+          res.payloads.emplace_back(frame.begin() + 7, frame.end());
+        } else if (k % 16 == 11 && k + 1 < samples) {
+          // two frames in one notification
+          put_frame(frame, t + period, d);
+          res.payloads.push_back(std::move(frame));
+          ++k;
+        } else {
+          res.payloads.push_back(std::move(frame));
+        }
+      }
+    }
+  }
+  size_t p = 0;
+  for (int h = 0; h < hubs; ++h) {
+    auto &msgs = res.hubs[h];
+    for (int d = 0; d < DEVICES; ++d) {
+      auto offset      = (h * DEVICES + d) * 37;
+      std::string_view topic = res.topics[h * DEVICES + d];
+      for (int64_t k = 0; k < samples; ++k) {
+        auto t     = k * period + offset;
+        auto &body = res.payloads[p++];
+        msgs.push_back(Message{t, topic, body.data(), body.size()});
+        if (k % 16 == 7) {
+          auto &rest = res.payloads[p++];
+          msgs.push_back(Message{t + 1, topic, rest.data(), rest.size()});
+        } else if (k % 16 == 11 && k + 1 < samples) {
+          ++k;
+        }
+      }
+    }
+    std::stable_sort(msgs.begin(), msgs.end(), [](const auto &a, const auto &b) { return a.ts_us < b.ts_us; });
+  }
+  return res;
+}
+
+double seconds_since(clock_type::time_point start) {
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+void usage(const char *self) {
+  std::fprintf(stderr,
+               "usage: %s [-d dir] [-b batch] [-k] [capture_file...]\n"
+               "       %s [-n hubs] [-s seconds] [-r rate] [-w prefix]\n"
+               "  -d  directory for the column stores (default: a fresh temporary directory)\n"
+               "  -b  frames per device to decode at once (default 256)\n"
+               "  -k  keep the column stores\n"
+               "  -n  synthetic hubs (default 4)\n"
+               "  -s  synthetic capture length, s (default 60)\n"
+               "  -r  synthetic sample rate per device, Hz (default 100)\n"
+               "  -w  write each synthetic hub capture to <prefix><hub>.witcap\n",
+               self, self);
+}
+}
+
+int main(int argc, char **argv) {
+  auto dir      = std::string{};
+  size_t batch  = 256;
+  bool keep     = false;
+  int hubs      = 4;
+  double secs   = 60;
+  double rate   = 100;
+  auto prefix   = std::string{};
+  int opt       = 0;
+  while ((opt = ::getopt(argc, argv, "d:b:kn:s:r:w:")) != -1) {
+    switch (opt) {
+      case 'd': dir = optarg; break;
+      case 'b': batch = std::strtoul(optarg, nullptr, 10); break;
+      case 'k': keep = true; break;
+      case 'n': hubs = std::atoi(optarg); break;
+      case 's': secs = std::atof(optarg); break;
+      case 'r': rate = std::atof(optarg); break;
+      case 'w': prefix = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  // every hub is an ordered stream; interleave them by arrival time as one
+  // subscriber would see them
+  auto messages  = std::vector<Message>{};
+  auto readers   = std::vector<host::CaptureReader>{};
+  auto synthetic = Synthetic{};
+  if (optind < argc) {
+    for (int i = optind; i < argc; ++i) {
+      auto reader = host::CaptureReader{};
+      if (!reader.open(argv[i])) {
+        return 1;
+      }
+      auto rec = host::CaptureRecord{};
+      while (reader.next(rec)) {
+        messages.push_back(Message{rec.ts_us, rec.topic, rec.data, rec.len});
+      }
+      readers.push_back(std::move(reader));
+    }
+    std::printf("replaying %zu capture(s)\n", readers.size());
+  } else {
+    synthetic = make_synthetic(hubs, secs, rate);
+    for (size_t h = 0; h < synthetic.hubs.size(); ++h) {
+      auto &msgs = synthetic.hubs[h];
+      if (!prefix.empty()) {
+        auto writer = host::CaptureWriter{};
+        if (!writer.open(prefix + std::to_string(h) + ".witcap")) {
+          return 1;
+        }
+        for (const auto &m : msgs) {
+          writer.write(m.ts_us, m.topic, m.data, m.len);
+        }
+      }
+      messages.insert(messages.end(), msgs.begin(), msgs.end());
+    }
+    std::printf("synthetic capture: %d hub(s) x %d devices, %.0f s at %.0f Hz\n", hubs, DEVICES, secs, rate);
+  }
+  std::stable_sort(messages.begin(), messages.end(), [](const auto &a, const auto &b) { return a.ts_us < b.ts_us; });
+  size_t total_bytes = 0;
+  for (const auto &m : messages) {
+    total_bytes += m.len;
+  }
+  std::printf("%zu messages, %.1f MiB payload\n", messages.size(), total_bytes / 1048576.0);
+
+  // baseline: decode every message into row objects, like the backend subscriber
+  {
+    auto start = clock_type::now();
+    size_t rows = 0;
+    int64_t checksum = 0;
+    for (const auto &m : messages) {
+      auto decoded = std::vector<wit::DataFrame>{};
+      for (size_t i = 0; i + wit::FRAME_SIZE <= m.len; i += wit::FRAME_SIZE) {
+        if (m.data[i] == wit::FRAME_HEADER && m.data[i + 1] == wit::FLAG_DATA) {
+          decoded.push_back(wit::decode_data_frame(m.data + i));
+        }
+      }
+      rows += decoded.size();
+      for (const auto &d : decoded) {
+        checksum += d.fields[0];
+      }
+    }
+    auto elapsed = seconds_since(start);
+    std::printf("row decode:    %10.0f frames/s %8.1f MiB/s (%zu frames, checksum %ld, no reassembly)\n",
+                rows / elapsed, total_bytes / 1048576.0 / elapsed, rows, checksum);
+  }
+
+  auto tmp = dir.empty();
+  if (tmp) {
+    char templ[] = "/tmp/wit_ingest_bench.XXXXXX";
+    if (::mkdtemp(templ) == nullptr) {
+      std::perror("mkdtemp");
+      return 1;
+    }
+    dir = templ;
+  } else {
+    std::filesystem::create_directories(dir);
+  }
+
+  auto store_opts = host::ColumnStore::Options{};
+  {
+    auto ingestor = host::Ingestor{dir, store_opts, batch};
+    auto start    = clock_type::now();
+    for (const auto &m : messages) {
+      ingestor.on_message(m.ts_us, m.topic, m.data, m.len);
+    }
+    ingestor.flush();
+    auto elapsed = seconds_since(start);
+    const auto &s = ingestor.stats();
+    std::printf("column ingest: %10.0f frames/s %8.1f MiB/s (%lu frames, %zu devices, dropped %lu bytes, batch %zu)\n",
+                s.frames / elapsed, total_bytes / 1048576.0 / elapsed, s.frames, ingestor.device_count(),
+                s.dropped_bytes, batch);
+  }
+
+  // range scan over the middle half of the time range of every device
+  {
+    auto start      = clock_type::now();
+    size_t rows     = 0;
+    size_t blocks   = 0;
+    size_t skipped  = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+      if (entry.path().extension() != ".witc") {
+        continue;
+      }
+      auto store = host::ColumnStore{};
+      if (!store.open_readonly(entry.path())) {
+        continue;
+      }
+      auto n = store.block_count();
+      if (n == 0) {
+        continue;
+      }
+      auto t0   = store.block(0).t_min;
+      auto t1   = store.block(n - 1).t_max;
+      auto from = t0 + (t1 - t0) / 4;
+      auto to   = t1 - (t1 - t0) / 4;
+      int16_t lo = INT16_MAX;
+      int16_t hi = INT16_MIN;
+      size_t visited = 0;
+      store.scan(from, to, [&](size_t b, size_t first, size_t last, bool whole) {
+        visited += 1;
+        rows += last - first;
+        if (whole) {
+          lo = std::min(lo, store.block(b).min[0]);
+          hi = std::max(hi, store.block(b).max[0]);
+          return;
+        }
+        const auto *col = store.block_col(b, 0);
+        for (auto i = first; i < last; ++i) {
+          lo = std::min(lo, col[i]);
+          hi = std::max(hi, col[i]);
+        }
+      });
+      blocks += visited;
+      skipped += n - visited;
+    }
+    auto elapsed = seconds_since(start);
+    std::printf("range scan:    %10.0f rows/s (%zu rows, %zu blocks visited, %zu skipped)\n",
+                rows / elapsed, rows, blocks, skipped);
+  }
+
+  if (tmp && !keep) {
+    std::filesystem::remove_all(dir);
+  } else {
+    std::printf("column stores kept in %s\n", dir.c_str());
+  }
+  return 0;
+}
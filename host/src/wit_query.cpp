@@ -0,0 +1,76 @@
+//
+// wit_query: summarize a column store, optionally over a time range.
+//
+// usage: wit_query file.witc [from_us to_us]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include "column_store.h"
+#include "ingestor.h"
+
+int main(int argc, char **argv) {
+  if (argc != 2 && argc != 4) {
+    std::fprintf(stderr, "usage: %s file.witc [from_us to_us]\n", argv[0]);
+    return 2;
+  }
+  auto store = host::ColumnStore{};
+  if (!store.open_readonly(argv[1])) {
+    return 1;
+  }
+  const auto &h = store.file_header();
+  auto n        = store.block_count();
+  std::printf("device %s, %zu block(s) of %u samples, chunk %ld us\n",
+              host::addr_to_hex(h.addr).c_str(), n, h.block_capacity, h.chunk_us);
+  if (n == 0) {
+    return 0;
+  }
+  auto from = std::numeric_limits<int64_t>::min();
+  auto to   = std::numeric_limits<int64_t>::max();
+  if (argc == 4) {
+    from = std::strtoll(argv[2], nullptr, 10);
+    to   = std::strtoll(argv[3], nullptr, 10);
+  }
+
+  auto lo      = std::array<int16_t, host::COLUMNS>{};
+  auto hi      = std::array<int16_t, host::COLUMNS>{};
+  auto sum     = std::array<double, host::COLUMNS>{};
+  size_t rows  = 0;
+  auto t_first = std::numeric_limits<int64_t>::max();
+  auto t_last  = std::numeric_limits<int64_t>::min();
+  lo.fill(std::numeric_limits<int16_t>::max());
+  hi.fill(std::numeric_limits<int16_t>::min());
+  store.scan(from, to, [&](size_t b, size_t first, size_t last, bool whole) {
+    const auto *ts = store.block_ts(b);
+    t_first        = std::min(t_first, ts[first]);
+    t_last         = std::max(t_last, ts[last - 1]);
+    rows += last - first;
+    for (size_t c = 0; c < host::COLUMNS; ++c) {
+      const auto *col = store.block_col(b, c);
+      for (auto i = first; i < last; ++i) {
+        sum[c] += col[i];
+      }
+      if (whole) {
+        lo[c] = std::min(lo[c], store.block(b).min[c]);
+        hi[c] = std::max(hi[c], store.block(b).max[c]);
+        continue;
+      }
+      for (auto i = first; i < last; ++i) {
+        lo[c] = std::min(lo[c], col[i]);
+        hi[c] = std::max(hi[c], col[i]);
+      }
+    }
+  });
+  if (rows == 0) {
+    std::printf("no samples in range\n");
+    return 0;
+  }
+  std::printf("%zu samples in [%ld, %ld]\n", rows, t_first, t_last);
+  constexpr const char *NAMES[] = {"acc_x", "acc_y", "acc_z", "gyro_x", "gyro_y", "gyro_z", "roll", "pitch", "yaw"};
+  for (size_t c = 0; c < host::COLUMNS; ++c) {
+    auto scale = wit::field_scale(c);
+    std::printf("%-7s min %10.3f max %10.3f mean %10.3f\n", NAMES[c], lo[c] * scale, hi[c] * scale, sum[c] / rows * scale);
+  }
+  return 0;
+}
@@ -0,0 +1,277 @@
+//
+// wit_udp: reference receiver (and test sender) of the hub's UDP stream transport.
+//
+// usage: wit_udp recv [-p port] [-i interval_s] [-r capture_file]
+//        wit_udp send [-h host] [-p port] [-n devices] [-R rate] [-s seconds]
+//                     [-f flush_ms] [-l loss] [-o reorder]
+//
+// `recv` reports loss, reordering and jitter per hub (source address) every
+// interval. `send` streams synthetic sensor data in the same datagram format
+// as the firmware, optionally dropping or swapping datagrams, so the receiver
+// can be checked end to end over loopback:
+//
+//   wit_udp recv -p 9000 &
+//   wit_udp send -p 9000 -l 0.02 -o 0.01
+//
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <netinet/in.h>
+#include <optional>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "capture.h"
+#include "ingestor.h"
+#include "seq_tracker.h"
+#include "stream_frame.h"
+
+namespace {
+std::atomic_bool running{true};
+
+int64_t monotonic_us() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t realtime_us() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+struct Source {
+  host::SeqTracker tracker{};
+  host::SeqTracker::Stats last{};
+  uint64_t records      = 0;
+  uint64_t last_records = 0;
+  uint64_t malformed    = 0;
+};
+
+int recv_main(int argc, char **argv) {
+  uint16_t port  = 9000;
+  int interval_s = 5;
+  auto record    = std::string{};
+  int opt        = 0;
+  while ((opt = ::getopt(argc, argv, "p:i:r:")) != -1) {
+    switch (opt) {
+      case 'p': port = static_cast<uint16_t>(std::atoi(optarg)); break;
+      case 'i': interval_s = std::max(1, std::atoi(optarg)); break;
+      case 'r': record = optarg; break;
+      default: return 2;
+    }
+  }
+  auto capture = host::CaptureWriter{};
+  if (!record.empty() && !capture.open(record)) {
+    return 1;
+  }
+  auto fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  auto addr = sockaddr_in{};
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    std::perror("bind");
+    return 1;
+  }
+  int rcvbuf = 4 << 20;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  timeval tv{.tv_sec = 0, .tv_usec = 200'000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  std::fprintf(stderr, "listening on udp port %u\n", port);
+
+  auto sources  = std::map<std::string, Source>{};
+  auto buf      = std::vector<uint8_t>(65536);
+  auto last_log = monotonic_us();
+  auto report   = [&](bool final) {
+    for (auto &[name, src] : sources) {
+      const auto &s   = src.tracker.stats();
+      auto received   = s.received - src.last.received;
+      auto expected   = s.expected - src.last.expected;
+      auto lost       = s.lost() - src.last.lost();
+      auto loss_pct   = expected == 0 ? 0.0 : 100.0 * lost / expected;
+      std::printf("%s %s: datagrams %lu, records %lu, lost %ld (%.2f%%), reordered %lu, duplicates %lu, gaps %lu, jitter %.3f ms\n",
+                  final ? "total" : "interval", name.c_str(),
+                  final ? s.received : received,
+                  final ? src.records : src.records - src.last_records,
+                  final ? s.lost() : lost,
+                  final ? (s.expected == 0 ? 0.0 : 100.0 * s.lost() / s.expected) : loss_pct,
+                  final ? s.reordered : s.reordered - src.last.reordered,
+                  final ? s.duplicates : s.duplicates - src.last.duplicates,
+                  final ? s.gaps : s.gaps - src.last.gaps,
+                  s.jitter_us / 1000.0);
+      src.last         = s;
+      src.last_records = src.records;
+    }
+    std::fflush(stdout);
+  };
+
+  std::signal(SIGINT, [](int) { running = false; });
+  std::signal(SIGTERM, [](int) { running = false; });
+  while (running) {
+    auto from     = sockaddr_in{};
+    auto from_len = socklen_t{sizeof(from)};
+    auto n        = ::recvfrom(fd, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+    auto now      = monotonic_us();
+    if (n > 0) {
+      char ip[INET_ADDRSTRLEN];
+      ::inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+      auto &src   = sources[std::string{ip} + ":" + std::to_string(ntohs(from.sin_port))];
+      auto header = stream::Header{};
+      auto stamp  = realtime_us();
+      auto ok     = stream::parse(buf.data(), n, header, [&](std::string_view topic, const uint8_t *data, size_t len) {
+        src.records += 1;
+        if (!record.empty()) {
+          capture.write(stamp, topic, data, len);
+        }
+      });
+      if (!ok) {
+        src.malformed += 1;
+      } else {
+        src.tracker.on_datagram(header.seq, static_cast<int64_t>(header.ts_us), now);
+      }
+    }
+    if (now - last_log >= interval_s * 1'000'000LL) {
+      report(false);
+      last_log = now;
+    }
+  }
+  report(true);
+  ::close(fd);
+  return 0;
+}
+
+int send_main(int argc, char **argv) {
+  auto host      = std::string{"127.0.0.1"};
+  uint16_t port  = 9000;
+  int devices    = 12;
+  double rate    = 100;
+  double seconds = 10;
+  int flush_ms   = 5;
+  double loss    = 0;
+  double reorder = 0;
+  int opt        = 0;
+  while ((opt = ::getopt(argc, argv, "h:p:n:R:s:f:l:o:")) != -1) {
+    switch (opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = static_cast<uint16_t>(std::atoi(optarg)); break;
+      case 'n': devices = std::atoi(optarg); break;
+      case 'R': rate = std::atof(optarg); break;
+      case 's': seconds = std::atof(optarg); break;
+      case 'f': flush_ms = std::atoi(optarg); break;
+      case 'l': loss = std::atof(optarg); break;
+      case 'o': reorder = std::atof(optarg); break;
+      default: return 2;
+    }
+  }
+  auto fd   = ::socket(AF_INET, SOCK_DGRAM, 0);
+  auto addr = sockaddr_in{};
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(port);
+  if (fd < 0 || ::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+    std::fprintf(stderr, "bad collector address %s\n", host.c_str());
+    return 1;
+  }
+
+  auto topics = std::vector<std::string>{};
+  for (int d = 0; d < devices; ++d) {
+    auto a = host::addr_t{0xc0, 0xff, 0x57, 0x49, 0x54, static_cast<uint8_t>(d)};
+    topics.push_back("/wit/" + host::addr_to_hex(a) + "/data");
+  }
+  auto rng        = std::mt19937{42};
+  auto uniform    = std::uniform_real_distribution<double>{0.0, 1.0};
+  auto batch      = stream::Batcher<>{};
+  uint32_t seq    = 0;
+  uint64_t sent   = 0;
+  uint64_t dropped = 0;
+  uint64_t swapped = 0;
+  auto held       = std::optional<std::vector<uint8_t>>{};
+  auto transmit   = [&](const uint8_t *data, size_t len) {
+    ::sendto(fd, data, len, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+  };
+  auto flush = [&]() {
+    if (batch.empty()) {
+      return;
+    }
+    const auto *data = batch.finish(seq++, monotonic_us());
+    auto len         = batch.size();
+    if (uniform(rng) < loss) {
+      dropped += 1;
+    } else if (!held && uniform(rng) < reorder) {
+      // send it after the next one
+      held = std::vector<uint8_t>{data, data + len};
+      swapped += 1;
+    } else {
+      transmit(data, len);
+      if (held) {
+        transmit(held->data(), held->size());
+        held.reset();
+      }
+    }
+    sent += 1;
+    batch.reset();
+  };
+
+  auto period      = static_cast<int64_t>(1e6 / rate);
+  auto start       = monotonic_us();
+  auto next_sample = start;
+  auto last_flush  = start;
+  uint64_t k       = 0;
+  std::signal(SIGINT, [](int) { running = false; });
+  while (running && next_sample - start < static_cast<int64_t>(seconds * 1e6)) {
+    auto now = monotonic_us();
+    if (now < next_sample) {
+      std::this_thread::sleep_for(std::chrono::microseconds(std::min<int64_t>(next_sample - now, flush_ms * 1000 + 1)));
+    }
+    for (int d = 0; d < devices; ++d) {
+      uint8_t frame[wit::FRAME_SIZE] = {wit::FRAME_HEADER, wit::FLAG_DATA};
+      for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+        auto v                       = static_cast<uint16_t>(k * (f + 1) + d);
+        frame[wit::DATA_OFFSET + 2 * f]     = v & 0xff;
+        frame[wit::DATA_OFFSET + 2 * f + 1] = v >> 8;
+      }
+      if (!batch.append(topics[d], frame, sizeof(frame))) {
+        flush();
+        batch.append(topics[d], frame, sizeof(frame));
+      }
+    }
+    k += 1;
+    next_sample += period;
+    now = monotonic_us();
+    if (flush_ms == 0 || now - last_flush >= flush_ms * 1000) {
+      flush();
+      last_flush = now;
+    }
+  }
+  flush();
+  if (held) {
+    transmit(held->data(), held->size());
+  }
+  std::printf("sent %lu datagrams (%lu dropped, %lu reordered on purpose), %lu samples per device\n",
+              sent, dropped, swapped, k);
+  ::close(fd);
+  return 0;
+}
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || (std::strcmp(argv[1], "recv") != 0 && std::strcmp(argv[1], "send") != 0)) {
+    std::fprintf(stderr,
+                 "usage: %s recv [-p port] [-i interval_s] [-r capture_file]\n"
+                 "       %s send [-h host] [-p port] [-n devices] [-R rate] [-s seconds] [-f flush_ms] [-l loss] [-o reorder]\n",
+                 argv[0], argv[0]);
+    return 2;
+  }
+  if (std::strcmp(argv[1], "recv") == 0) {
+    return recv_main(argc - 1, argv + 1);
+  }
+  return send_main(argc - 1, argv + 1);
+}
@@ -0,0 +1,523 @@
+//
+// Connection flow to the sensors as a state machine driven by the
+// completions of the BLE stack, instead of a task blocking on every step.
+//
+// Time is passed in by the caller (monotonic milliseconds).
+//
+// Every sensor has a `Flow` going through
+//
+//   idle -> queued -> connecting -> exchanging_mtu -> discovering_services
+//        -> discovering_chars -> discovering_dscs -> subscribing -> ready
+//
+// where each step is started through the `Driver` and ends with the event the
+// stack reports for it. The states group into
+//
+//  - pending (`queued`): the stack has one connection attempt in flight at a
+//    time, so requests wait for it, first come first served;
+//  - attempt (`connecting`, `cancelling`): the flow holds the connection
+//    attempt; cancelling waits for the stack to confirm;
+//  - linked (`exchanging_mtu` ... `ready`): a connection is up; a disconnection
+//    ends the flow, a failure, a timeout or a cancellation terminates it;
+//  - `disconnecting`: terminated, waiting for the stack to confirm.
+//
+// Events a state has no use for are counted and dropped, as are completions of
+// a flow that has since been closed (the callbacks carry a generation). Every
+// state but `idle` and `ready` has a deadline; `next_deadline` tells when
+// `tick` has to be called.
+//
+
+#ifndef WIT_HUB_CONNECT_FLOW_H
+#define WIT_HUB_CONNECT_FLOW_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace flow {
+using addr_t = std::array<uint8_t, 6>;
+
+constexpr uint16_t NO_CONN = 0xffff;
+
+enum class State : uint8_t {
+  idle,
+  queued,
+  connecting,
+  cancelling,
+  exchanging_mtu,
+  discovering_services,
+  discovering_chars,
+  discovering_dscs,
+  subscribing,
+  ready,
+  disconnecting,
+};
+
+enum class Event : uint8_t {
+  connected,
+  connect_failed,
+  // the step of the current state is over
+  done,
+  failed,
+  disconnected,
+  cancel,
+};
+
+/**
+ * @brief why a flow ended
+ */
+enum class Reason : uint8_t {
+  none,
+  cancelled,
+  timeout,
+  connect_failed,
+  setup_failed,
+  disconnected,
+};
+
+constexpr const char *to_str(State s) {
+  switch (s) {
+    case State::idle: return "idle";
+    case State::queued: return "queued";
+    case State::connecting: return "connecting";
+    case State::cancelling: return "cancelling";
+    case State::exchanging_mtu: return "exchanging_mtu";
+    case State::discovering_services: return "discovering_services";
+    case State::discovering_chars: return "discovering_chars";
+    case State::discovering_dscs: return "discovering_dscs";
+    case State::subscribing: return "subscribing";
+    case State::ready: return "ready";
+    case State::disconnecting: return "disconnecting";
+  }
+  return "?";
+}
+
+constexpr const char *to_str(Reason r) {
+  switch (r) {
+    case Reason::none: return "none";
+    case Reason::cancelled: return "cancelled";
+    case Reason::timeout: return "timeout";
+    case Reason::connect_failed: return "connect_failed";
+    case Reason::setup_failed: return "setup_failed";
+    case Reason::disconnected: return "disconnected";
+  }
+  return "?";
+}
+
+constexpr bool is_linked(State s) {
+  return s >= State::exchanging_mtu && s <= State::ready;
+}
+
+struct Options {
+  // how long a request may wait for the connection attempt
+  uint32_t queue_ms = 30'000;
+  // the stack is asked to give up after this; the deadline is a bit later
+  uint32_t connect_ms = 5'000;
+  // per step of the setup
+  uint32_t step_ms = 5'000;
+  // for the stack to confirm a cancellation or a termination
+  uint32_t close_ms = 3'000;
+};
+
+/**
+ * @brief one sensor's way to a subscribed connection
+ * @note the driver fills in the handles as the discovery goes
+ */
+struct Flow {
+  addr_t addr{};
+  uint8_t addr_type = 0;
+  State state       = State::idle;
+  // why the flow is being closed, then why it was
+  Reason reason = Reason::none;
+  // bumped when the flow is closed, to tell stale completions apart
+  uint8_t gen = 0;
+  bool up     = false;
+  // got to `ready`, i.e. the owner has been told it's connected
+  bool subscribed        = false;
+  uint16_t conn          = NO_CONN;
+  uint16_t service_start = 0;
+  uint16_t service_end   = 0;
+  uint16_t read_handle   = 0;
+  uint16_t write_handle  = 0;
+  uint16_t cccd_handle   = 0;
+  uint32_t seq           = 0;
+  int64_t deadline_ms    = 0;
+};
+
+struct Stats {
+  uint32_t requests = 0;
+  uint32_t ready    = 0;
+  uint32_t closed   = 0;
+  uint32_t timeouts = 0;
+  // events no state had a use for, or of a closed flow
+  uint32_t stray = 0;
+};
+
+/**
+ * @brief the flows of up to `N` sensors
+ *
+ * `Driver` starts the steps and hears about the outcomes:
+ *
+ *     int start_connect(const Flow &, uint32_t timeout_ms);
+ *     int cancel_connect(const Flow &);
+ *     int exchange_mtu(const Flow &);
+ *     int discover_services(const Flow &);
+ *     int discover_chars(const Flow &);
+ *     int discover_dscs(const Flow &);
+ *     int subscribe(const Flow &);
+ *     int terminate(const Flow &);
+ *     void on_ready(const Flow &);
+ *     void on_closed(const Flow &, Reason);
+ *
+ * A step returning non zero failed to start, as if it completed with an
+ * error. The callbacks must not call back into the machine.
+ * @note not thread safe; feed it from one task (NimBLE's host task)
+ */
+template <typename Driver, size_t N>
+class Machine {
+  Driver &_driver;
+  Options _opts{};
+  std::array<Flow, N> _flows{};
+  // the flow holding the connection attempt, N if none
+  size_t _attempt = N;
+  uint32_t _seq   = 0;
+  Stats _stats{};
+
+  void _close(size_t i, Reason reason) {
+    auto &f = _flows[i];
+    if (reason != Reason::none && f.reason == Reason::none) {
+      f.reason = reason;
+    }
+    f.state = State::idle;
+    f.gen += 1;
+    if (_attempt == i) {
+      _attempt = N;
+    }
+    _stats.closed += 1;
+    _driver.on_closed(f, f.reason);
+    f.up         = false;
+    f.subscribed = false;
+    f.conn       = NO_CONN;
+  }
+
+  void _terminate(size_t i, Reason reason, int64_t now) {
+    auto &f = _flows[i];
+    if (f.reason == Reason::none) {
+      f.reason = reason;
+    }
+    f.state       = State::disconnecting;
+    f.deadline_ms = now + _opts.close_ms;
+    if (_driver.terminate(f) != 0) {
+      // nothing to wait for
+      _close(i, reason);
+    }
+  }
+
+  /**
+   * @brief enter a setup step and start it
+   */
+  void _step(size_t i, State s, int64_t now) {
+    auto &f       = _flows[i];
+    f.state       = s;
+    f.deadline_ms = now + _opts.step_ms;
+    int rc        = 0;
+    switch (s) {
+      case State::exchanging_mtu: rc = _driver.exchange_mtu(f); break;
+      case State::discovering_services: rc = _driver.discover_services(f); break;
+      case State::discovering_chars: rc = _driver.discover_chars(f); break;
+      case State::discovering_dscs: rc = _driver.discover_dscs(f); break;
+      case State::subscribing: rc = _driver.subscribe(f); break;
+      case State::ready:
+        f.subscribed = true;
+        _stats.ready += 1;
+        _driver.on_ready(f);
+        return;
+      default: return;
+    }
+    if (rc != 0) {
+      _terminate(i, Reason::setup_failed, now);
+    }
+  }
+
+  /**
+   * @brief give the connection attempt to the oldest queued flow
+   */
+  void _next_attempt(int64_t now) {
+    while (_attempt == N) {
+      auto best = N;
+      for (size_t i = 0; i < N; ++i) {
+        if (_flows[i].state == State::queued && (best == N || _flows[i].seq < _flows[best].seq)) {
+          best = i;
+        }
+      }
+      if (best == N) {
+        return;
+      }
+      auto &f       = _flows[best];
+      _attempt      = best;
+      f.state       = State::connecting;
+      f.deadline_ms = now + _opts.connect_ms + _opts.close_ms;
+      if (_driver.start_connect(f, _opts.connect_ms) != 0) {
+        _close(best, Reason::connect_failed);
+      }
+    }
+  }
+
+  void _dispatch(size_t i, Event e, int64_t now) {
+    auto &f = _flows[i];
+    switch (f.state) {
+      case State::idle:
+        break;
+      case State::queued:
+        if (e == Event::cancel) {
+          _close(i, Reason::cancelled);
+          return;
+        }
+        break;
+      case State::connecting:
+        switch (e) {
+          case Event::connected:
+            _attempt = N;
+            f.up     = true;
+            _step(i, State::exchanging_mtu, now);
+            return;
+          case Event::connect_failed:
+            _close(i, Reason::connect_failed);
+            return;
+          case Event::cancel:
+            f.reason      = Reason::cancelled;
+            f.state       = State::cancelling;
+            f.deadline_ms = now + _opts.close_ms;
+            if (_driver.cancel_connect(f) != 0) {
+              _close(i, Reason::cancelled);
+            }
+            return;
+          default:
+            break;
+        }
+        break;
+      case State::cancelling:
+        switch (e) {
+          case Event::connected:
+            // too late to cancel
+            _attempt = N;
+            f.up     = true;
+            _terminate(i, Reason::cancelled, now);
+            return;
+          case Event::connect_failed:
+            _close(i, Reason::cancelled);
+            return;
+          default:
+            break;
+        }
+        break;
+      case State::disconnecting:
+        if (e == Event::disconnected) {
+          _close(i, Reason::none);
+          return;
+        }
+        break;
+      default:
+        // linked
+        switch (e) {
+          case Event::done:
+            if (f.state != State::ready) {
+              _step(i, static_cast<State>(static_cast<uint8_t>(f.state) + 1), now);
+              return;
+            }
+            break;
+          case Event::failed:
+            if (f.state != State::ready) {
+              _terminate(i, Reason::setup_failed, now);
+              return;
+            }
+            break;
+          case Event::disconnected:
+            _close(i, Reason::disconnected);
+            return;
+          case Event::cancel:
+            _terminate(i, Reason::cancelled, now);
+            return;
+          default:
+            break;
+        }
+        break;
+    }
+    _stats.stray += 1;
+  }
+
+  void _timeout(size_t i, int64_t now) {
+    auto &f = _flows[i];
+    _stats.timeouts += 1;
+    switch (f.state) {
+      case State::queued:
+        _close(i, Reason::timeout);
+        break;
+      case State::connecting:
+        f.reason      = Reason::timeout;
+        f.state       = State::cancelling;
+        f.deadline_ms = now + _opts.close_ms;
+        if (_driver.cancel_connect(f) != 0) {
+          _close(i, Reason::timeout);
+        }
+        break;
+      case State::cancelling:
+      case State::disconnecting:
+        // the stack didn't confirm; give up on it
+        _close(i, Reason::timeout);
+        break;
+      default:
+        _terminate(i, Reason::timeout, now);
+        break;
+    }
+  }
+
+public:
+  explicit Machine(Driver &driver) : _driver(driver) {}
+
+  Machine(Driver &driver, const Options &opts) : _driver(driver), _opts(opts) {}
+
+  [[nodiscard]] const Options &options() const {
+    return _opts;
+  }
+
+  void set_options(const Options &opts) {
+    _opts = opts;
+  }
+
+  [[nodiscard]] const Stats &stats() const {
+    return _stats;
+  }
+
+  [[nodiscard]] const Flow &flow(size_t i) const {
+    return _flows[i];
+  }
+
+  /**
+   * @brief for the driver to fill in the handles
+   */
+  Flow &flow(size_t i) {
+    return _flows[i];
+  }
+
+  [[nodiscard]] size_t find(const addr_t &addr) const {
+    for (size_t i = 0; i < N; ++i) {
+      if (_flows[i].state != State::idle && _flows[i].addr == addr) {
+        return i;
+      }
+    }
+    return N;
+  }
+
+  /**
+   * @brief the index of a flow the driver is given, for the callbacks of its
+   * step to pass to `on_event`
+   */
+  [[nodiscard]] size_t index_of(const Flow &f) const {
+    return static_cast<size_t>(&f - _flows.data());
+  }
+
+  [[nodiscard]] size_t find_conn(uint16_t conn) const {
+    for (size_t i = 0; i < N; ++i) {
+      if (_flows[i].state != State::idle && _flows[i].conn == conn) {
+        return i;
+      }
+    }
+    return N;
+  }
+
+  /**
+   * @brief the flow holding the connection attempt, `N` if none
+   */
+  [[nodiscard]] size_t attempt() const {
+    return _attempt;
+  }
+
+  /**
+   * @brief connect to a sensor and subscribe to it; nothing happens if it's
+   * already on its way
+   * @return the flow, `N` if all of them are taken
+   */
+  size_t request(const addr_t &addr, uint8_t addr_type, int64_t now) {
+    auto i = find(addr);
+    if (i != N) {
+      return i;
+    }
+    for (i = 0; i < N; ++i) {
+      if (_flows[i].state == State::idle) {
+        break;
+      }
+    }
+    if (i == N) {
+      return N;
+    }
+    auto &f     = _flows[i];
+    auto gen    = f.gen;
+    f           = Flow{};
+    f.gen       = gen;
+    f.addr      = addr;
+    f.addr_type = addr_type;
+    f.seq       = _seq++;
+    f.state     = State::queued;
+    // queued for longer than this it's better to wait for the next advertisement
+    f.deadline_ms = now + _opts.queue_ms;
+    _stats.requests += 1;
+    _next_attempt(now);
+    return i;
+  }
+
+  /**
+   * @brief the outcome of the current step of flow `i`
+   * @param gen the generation of the flow when the step was started
+   */
+  void on_event(size_t i, uint8_t gen, Event e, int64_t now) {
+    if (i >= N || _flows[i].gen != gen) {
+      _stats.stray += 1;
+      return;
+    }
+    _dispatch(i, e, now);
+    _next_attempt(now);
+  }
+
+  /**
+   * @brief drop the connection to a sensor, or give up on getting one
+   * @return whether there was a flow to cancel
+   */
+  bool cancel(const addr_t &addr, int64_t now) {
+    auto i = find(addr);
+    if (i == N) {
+      return false;
+    }
+    on_event(i, _flows[i].gen, Event::cancel, now);
+    return true;
+  }
+
+  /**
+   * @brief expire the deadlines up to `now`
+   */
+  void tick(int64_t now) {
+    for (size_t i = 0; i < N; ++i) {
+      const auto &f = _flows[i];
+      if (f.state != State::idle && f.state != State::ready && f.deadline_ms <= now) {
+        _timeout(i, now);
+      }
+    }
+    _next_attempt(now);
+  }
+
+  /**
+   * @return when `tick` is due next, `INT64_MAX` if never
+   */
+  [[nodiscard]] int64_t next_deadline() const {
+    auto res = std::numeric_limits<int64_t>::max();
+    for (const auto &f : _flows) {
+      if (f.state != State::idle && f.state != State::ready && f.deadline_ms < res) {
+        res = f.deadline_ms;
+      }
+    }
+    return res;
+  }
+};
+}
+
+#endif // WIT_HUB_CONNECT_FLOW_H
@@ -0,0 +1,450 @@
+//
+// Coordination of several hubs sharing the same sensors, over MQTT.
+//
+// Time is passed in by the caller (monotonic milliseconds).
+//
+// Every hub publishes an announcement to `/wit/fleet/<hub id>` periodically and
+// sets an "offline" announcement as its MQTT last will:
+//
+//   magic u16 | version u8 | flags u8 | hub_id [6] | capacity u8 | load u8 | count u8 | reserved [3]
+//   addr [6] | rssi i8 | flags u8      (repeated `count` times)
+//
+// The entries are the sensors the hub holds (`ENTRY_CLAIMED`) followed by the
+// ones it recently saw advertising, with the RSSI it measured.
+//
+// A claim is a lease: it's valid as long as announcements of its hub keep
+// arriving within `lease_ms`. Every hub evaluates the same rule on the same
+// announcements, so they agree on who takes an unclaimed sensor without
+// another round trip:
+//
+//  - a claimed sensor is left alone;
+//  - an unclaimed one goes to the live hub with free capacity that scores best
+//    (RSSI minus a penalty per held sensor, ties to the lower hub id). A hub
+//    scores itself with the RSSI and load it last announced, not the latest
+//    ones, so that everyone compares the same numbers; it also waits until
+//    its sighting of a new sensor was announced before claiming it;
+//  - if the preferred hub doesn't take it within `claim_timeout_ms` (e.g. it
+//    lost sight of it), any hub with free capacity may;
+//  - when two hubs claim the same sensor anyway, the one that saw it stronger
+//    keeps it and the other releases it.
+//
+// A hub that goes offline (last will or lease expiry) drops its claims, and the
+// sensors, which advertise again once disconnected, are redistributed. A full
+// hub is never preferred, so the sensors it sees go to the next best hub.
+//
+
+#ifndef WIT_HUB_FLEET_H
+#define WIT_HUB_FLEET_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace fleet {
+constexpr uint16_t MAGIC        = 0x4657; // "WF"
+constexpr uint8_t VERSION       = 1;
+constexpr size_t HEADER_SIZE    = 16;
+constexpr size_t ENTRY_SIZE     = 8;
+constexpr size_t MAX_HUBS       = 8;
+constexpr size_t MAX_SENSORS    = 24;
+constexpr size_t MAX_ANNOUNCE   = HEADER_SIZE + MAX_SENSORS * ENTRY_SIZE;
+constexpr uint8_t FLAG_ONLINE   = 0x01;
+constexpr uint8_t ENTRY_CLAIMED = 0x01;
+constexpr auto TOPIC_PREFIX     = "/wit/fleet/";
+constexpr size_t ID_SIZE        = 6;
+
+using hub_id_t = std::array<uint8_t, ID_SIZE>;
+// BLE address of a sensor, in the same byte order as `WitDevice::addr_t`
+using addr_t   = std::array<uint8_t, ID_SIZE>;
+
+struct Options {
+  // max sensors this hub holds at once
+  uint8_t capacity          = 12;
+  uint32_t announce_ms      = 3'000;
+  // a hub (and its claims) is gone if nothing is heard from it for this long
+  uint32_t lease_ms         = 10'000;
+  // how long a sensor must have been seen advertising unclaimed before any
+  // hub, not only the preferred one, may take it
+  uint32_t claim_timeout_ms = 15'000;
+  // sightings older than this are not announced
+  uint32_t sighting_ms      = 15'000;
+  // how much a held sensor weighs against a hub, in dB
+  uint8_t load_penalty_db   = 3;
+};
+
+struct Entry {
+  addr_t addr{};
+  int8_t rssi   = 0;
+  uint8_t flags = 0;
+};
+
+struct Announcement {
+  hub_id_t hub_id{};
+  uint8_t flags    = 0;
+  uint8_t capacity = 0;
+  uint8_t load     = 0;
+  uint8_t count    = 0;
+  std::array<Entry, MAX_SENSORS> entries{};
+
+  [[nodiscard]] bool online() const {
+    return (flags & FLAG_ONLINE) != 0;
+  }
+};
+
+/**
+ * @return encoded size, 0 if `cap` is too small
+ */
+inline size_t encode(const Announcement &a, uint8_t *out, size_t cap) {
+  size_t size = HEADER_SIZE + a.count * ENTRY_SIZE;
+  if (a.count > MAX_SENSORS || cap < size) {
+    return 0;
+  }
+  std::memset(out, 0, HEADER_SIZE);
+  out[0] = MAGIC & 0xff;
+  out[1] = MAGIC >> 8;
+  out[2] = VERSION;
+  out[3] = a.flags;
+  std::memcpy(out + 4, a.hub_id.data(), ID_SIZE);
+  out[10] = a.capacity;
+  out[11] = a.load;
+  out[12] = a.count;
+  auto *p = out + HEADER_SIZE;
+  for (size_t i = 0; i < a.count; ++i, p += ENTRY_SIZE) {
+    std::memcpy(p, a.entries[i].addr.data(), ID_SIZE);
+    p[6] = static_cast<uint8_t>(a.entries[i].rssi);
+    p[7] = a.entries[i].flags;
+  }
+  return size;
+}
+
+/**
+ * @return false if the payload is not a (complete) announcement
+ */
+inline bool decode(const uint8_t *data, size_t len, Announcement &a) {
+  if (len < HEADER_SIZE || (data[0] | data[1] << 8) != MAGIC || data[2] != VERSION) {
+    return false;
+  }
+  a.flags = data[3];
+  std::memcpy(a.hub_id.data(), data + 4, ID_SIZE);
+  a.capacity = data[10];
+  a.load     = data[11];
+  a.count    = data[12];
+  if (a.count > MAX_SENSORS || len < HEADER_SIZE + a.count * ENTRY_SIZE) {
+    return false;
+  }
+  const auto *p = data + HEADER_SIZE;
+  for (size_t i = 0; i < a.count; ++i, p += ENTRY_SIZE) {
+    std::memcpy(a.entries[i].addr.data(), p, ID_SIZE);
+    a.entries[i].rssi  = static_cast<int8_t>(p[6]);
+    a.entries[i].flags = p[7];
+  }
+  return true;
+}
+
+/**
+ * @brief one hub's view of the fleet and its decisions
+ * @note not thread safe
+ */
+class Coordinator {
+  struct Sensor {
+    addr_t addr{};
+    int8_t rssi             = 0;
+    // what the peers know of our sighting
+    bool announced          = false;
+    int8_t announced_rssi   = 0;
+    bool held               = false;
+    int64_t last_seen_ms    = 0;
+    // since when it has been seen advertising without a live claim; -1 if claimed
+    int64_t unclaimed_since = -1;
+  };
+  struct Peer {
+    bool used           = false;
+    int64_t last_ms     = 0;
+    Announcement latest = {};
+  };
+
+  hub_id_t _self{};
+  Options _opts{};
+  int64_t _started_ms     = 0;
+  uint8_t _announced_load = 0;
+  std::array<Sensor, MAX_SENSORS> _sensors{};
+  size_t _sensor_count = 0;
+  std::array<Peer, MAX_HUBS> _peers{};
+
+  Sensor *_find(const addr_t &addr) {
+    for (size_t i = 0; i < _sensor_count; ++i) {
+      if (_sensors[i].addr == addr) {
+        return &_sensors[i];
+      }
+    }
+    return nullptr;
+  }
+
+  [[nodiscard]] bool _live(const Peer &p, int64_t now_ms) const {
+    return p.used && p.latest.online() && now_ms - p.last_ms <= _opts.lease_ms;
+  }
+
+  static const Entry *_entry(const Announcement &a, const addr_t &addr) {
+    for (size_t i = 0; i < a.count; ++i) {
+      if (a.entries[i].addr == addr) {
+        return &a.entries[i];
+      }
+    }
+    return nullptr;
+  }
+
+  [[nodiscard]] int _score(int8_t rssi, uint8_t load) const {
+    return rssi - static_cast<int>(_opts.load_penalty_db) * load;
+  }
+
+  /**
+   * @return whether `a` beats `b`, hub ids break ties
+   */
+  static bool _better(int score_a, const hub_id_t &a, int score_b, const hub_id_t &b) {
+    return score_a != score_b ? score_a > score_b : a < b;
+  }
+
+  [[nodiscard]] bool _claimed_by_peer(const addr_t &addr, int64_t now_ms) const {
+    for (const auto &p : _peers) {
+      if (!_live(p, now_ms)) {
+        continue;
+      }
+      const auto *e = _entry(p.latest, addr);
+      if (e != nullptr && (e->flags & ENTRY_CLAIMED) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  Coordinator() = default;
+
+  Coordinator(const hub_id_t &self, const Options &opts, int64_t now_ms) : _self(self), _opts(opts), _started_ms(now_ms) {}
+
+  [[nodiscard]] const hub_id_t &self() const {
+    return _self;
+  }
+
+  [[nodiscard]] const Options &options() const {
+    return _opts;
+  }
+
+  [[nodiscard]] uint8_t load() const {
+    uint8_t n = 0;
+    for (size_t i = 0; i < _sensor_count; ++i) {
+      n += _sensors[i].held ? 1 : 0;
+    }
+    return n;
+  }
+
+  [[nodiscard]] bool full() const {
+    return load() >= _opts.capacity;
+  }
+
+  /**
+   * @brief the sensor was seen advertising with `rssi`
+   */
+  void observe(const addr_t &addr, int8_t rssi, int64_t now_ms) {
+    auto *s = _find(addr);
+    if (s == nullptr) {
+      if (_sensor_count < MAX_SENSORS) {
+        s = &_sensors[_sensor_count++];
+      } else {
+        // replace the stalest sighting that isn't held
+        for (auto &c : _sensors) {
+          if (!c.held && (s == nullptr || c.last_seen_ms < s->last_seen_ms)) {
+            s = &c;
+          }
+        }
+        if (s == nullptr) {
+          return;
+        }
+      }
+      *s = Sensor{.addr = addr};
+    }
+    s->rssi         = rssi;
+    s->last_seen_ms = now_ms;
+    if (_claimed_by_peer(addr, now_ms)) {
+      s->unclaimed_since = -1;
+    } else if (s->unclaimed_since < 0) {
+      s->unclaimed_since = now_ms;
+    }
+  }
+
+  /**
+   * @brief this hub connected to (`held`) or lost the sensor
+   */
+  void set_held(const addr_t &addr, bool held, int64_t now_ms) {
+    auto *s = _find(addr);
+    if (s == nullptr) {
+      if (!held) {
+        return;
+      }
+      observe(addr, INT8_MIN, now_ms);
+      s = _find(addr);
+      if (s == nullptr) {
+        return;
+      }
+    }
+    s->held            = held;
+    s->unclaimed_since = -1;
+  }
+
+  /**
+   * @brief whether this hub should connect to a sensor it sees advertising
+   * @note call `observe` first
+   */
+  [[nodiscard]] bool should_connect(const addr_t &addr, int64_t now_ms) {
+    auto *s = _find(addr);
+    if (s == nullptr) {
+      return false;
+    }
+    if (s->held) {
+      return true;
+    }
+    // hear from the others before claiming anything
+    if (full() || now_ms - _started_ms < _opts.announce_ms) {
+      return false;
+    }
+    if (_claimed_by_peer(addr, now_ms)) {
+      return false;
+    }
+    if (live_peers(now_ms) == 0) {
+      return true;
+    }
+    if (!s->announced) {
+      return false;
+    }
+    if (s->unclaimed_since >= 0 && now_ms - s->unclaimed_since >= _opts.claim_timeout_ms) {
+      return true;
+    }
+    auto own = _score(s->announced_rssi, _announced_load);
+    for (const auto &p : _peers) {
+      if (!_live(p, now_ms) || p.latest.load >= p.latest.capacity) {
+        continue;
+      }
+      const auto *e = _entry(p.latest, addr);
+      if (e != nullptr && _better(_score(e->rssi, p.latest.load), p.latest.hub_id, own, _self)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief take in an announcement (or a last will) of a peer
+   * @return false if it's malformed; own announcements are ignored
+   */
+  bool on_announcement(const uint8_t *data, size_t len, int64_t now_ms) {
+    auto a = Announcement{};
+    if (!decode(data, len, a)) {
+      return false;
+    }
+    if (a.hub_id == _self) {
+      return true;
+    }
+    Peer *slot = nullptr;
+    for (auto &p : _peers) {
+      if (p.used && p.latest.hub_id == a.hub_id) {
+        slot = &p;
+        break;
+      }
+      // a free or expired slot
+      if (slot == nullptr && !_live(p, now_ms)) {
+        slot = &p;
+      }
+    }
+    if (slot == nullptr) {
+      return true;
+    }
+    slot->used    = true;
+    slot->last_ms = now_ms;
+    slot->latest  = a;
+    return true;
+  }
+
+  [[nodiscard]] size_t live_peers(int64_t now_ms) const {
+    size_t n = 0;
+    for (const auto &p : _peers) {
+      n += _live(p, now_ms) ? 1 : 0;
+    }
+    return n;
+  }
+
+  /**
+   * @brief call `fn(addr)` for every held sensor a peer claims too and has a
+   * better right to; the caller should disconnect from them
+   */
+  template <typename F>
+  void for_each_conflict(int64_t now_ms, F &&fn) const {
+    for (size_t i = 0; i < _sensor_count; ++i) {
+      const auto &s = _sensors[i];
+      if (!s.held) {
+        continue;
+      }
+      for (const auto &p : _peers) {
+        if (!_live(p, now_ms)) {
+          continue;
+        }
+        const auto *e = _entry(p.latest, s.addr);
+        if (e != nullptr && (e->flags & ENTRY_CLAIMED) != 0 &&
+            _better(e->rssi, p.latest.hub_id, s.announced_rssi, _self)) {
+          fn(s.addr);
+          break;
+        }
+      }
+    }
+  }
+
+  /**
+   * @brief this hub's state: held sensors first, then recent sightings
+   * @note it's what the peers base their decisions on; once it's sent, pass
+   * it to `mark_announced`
+   */
+  [[nodiscard]] Announcement announcement(int64_t now_ms) const {
+    auto a    = Announcement{.hub_id = _self, .flags = FLAG_ONLINE, .capacity = _opts.capacity, .load = load()};
+    auto push = [&a](const Sensor &s) {
+      a.entries[a.count++] = Entry{.addr = s.addr, .rssi = s.rssi, .flags = static_cast<uint8_t>(s.held ? ENTRY_CLAIMED : 0)};
+    };
+    for (size_t i = 0; i < _sensor_count; ++i) {
+      if (_sensors[i].held) {
+        push(_sensors[i]);
+      }
+    }
+    for (size_t i = 0; i < _sensor_count; ++i) {
+      if (!_sensors[i].held && now_ms - _sensors[i].last_seen_ms <= _opts.sighting_ms) {
+        push(_sensors[i]);
+      }
+    }
+    return a;
+  }
+
+  /**
+   * @brief the peers have got `a`, from `announcement`; score this hub with
+   * its numbers from now on
+   * @note only for an announcement that was sent, so that this hub doesn't
+   * decide on numbers nobody else has
+   */
+  void mark_announced(const Announcement &a) {
+    _announced_load = a.load;
+    for (size_t i = 0; i < a.count; ++i) {
+      auto *s = _find(a.entries[i].addr);
+      if (s != nullptr) {
+        s->announced      = true;
+        s->announced_rssi = a.entries[i].rssi;
+      }
+    }
+  }
+
+  /**
+   * @brief the last will: no entries, not online
+   */
+  [[nodiscard]] Announcement offline() const {
+    return Announcement{.hub_id = _self, .flags = 0, .capacity = _opts.capacity};
+  }
+};
+}
+
+#endif // WIT_HUB_FLEET_H
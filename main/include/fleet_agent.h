@@ -0,0 +1,76 @@
+//
+// Runs the fleet coordinator on the hub: announcements over MQTT and the
+// decisions of whether to connect to a sensor.
+//
+
+#ifndef WIT_HUB_FLEET_AGENT_H
+#define WIT_HUB_FLEET_AGENT_H
+
+#include <functional>
+#include <string_view>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include "fleet.h"
+#include "static_alloc.h"
+#include "wlan_manager.h"
+
+namespace fleet {
+/**
+ * @brief thread safe wrapper of `Coordinator`
+ *
+ * Advertisements come from the BLE host task, connections from the connect
+ * task and announcements of the peers from the MQTT subscription task. Our own
+ * announcements are published from a task of their own, since a publish may
+ * block.
+ * @sa fleet.h for the protocol
+ */
+class FleetAgent {
+  Coordinator _coordinator{};
+  wlan::WlanManager *_manager = nullptr;
+  utils::StaticMutex _mutex{};
+  utils::PeriodicTask<3072> _announce_task{};
+  // TOPIC_PREFIX + 12 hex chars
+  char _topic[24]{};
+  uint8_t _will[HEADER_SIZE]{};
+  // only touched by the announce task
+  Announcement _announcement{};
+  uint8_t _buf[MAX_ANNOUNCE]{};
+
+  static void announce(void *arg);
+
+public:
+  /**
+   * @brief called for a sensor this hub should let go of, because another hub
+   * claimed it with a better right
+   */
+  std::function<void(const addr_t &addr)> on_release = nullptr;
+
+  /**
+   * @brief identify the hub by its station MAC, set the last will and subscribe
+   * to the other hubs
+   * @note call it before `WlanManager::mqtt_init`
+   */
+  esp_err_t init(wlan::WlanManager &manager, const Options &opts);
+
+  /**
+   * @brief start announcing periodically
+   */
+  esp_err_t start();
+
+  /**
+   * @brief record the sighting and decide whether to connect to the sensor
+   */
+  bool should_connect(const addr_t &addr, int8_t rssi);
+
+  void set_held(const addr_t &addr, bool held);
+
+  /**
+   * @return false if the message isn't for the fleet
+   */
+  bool on_message(std::string_view topic, const uint8_t *data, size_t len);
+
+  [[nodiscard]] uint8_t load();
+};
+}
+
+#endif // WIT_HUB_FLEET_AGENT_H
@@ -0,0 +1,160 @@
+//
+// The data path of the hub, composed from the `WitHub` → `Data pipeline`
+// options at compile time.
+//
+
+#ifndef WIT_HUB_HUB_PIPELINE_H
+#define WIT_HUB_HUB_PIPELINE_H
+
+#include <type_traits>
+#include <sdkconfig.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include "pipeline.h"
+#include "static_alloc.h"
+#include "udp_transport.h"
+#include "wit_device.h"
+#include "wlan_manager.h"
+#if CONFIG_WITHUB_SYNC
+#include "sync_stage.h"
+#endif
+
+namespace pipeline {
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+constexpr bool STREAM_UDP = true;
+#else
+constexpr bool STREAM_UDP = false;
+#endif
+
+/**
+ * @brief publishes the messages over MQTT
+ */
+class MqttPublish {
+  wlan::WlanManager *_manager = nullptr;
+
+public:
+  void init(wlan::WlanManager &manager) {
+    _manager = &manager;
+  }
+
+  template <typename Next>
+  void push(const Message &in, Next &) {
+    auto msg = wlan::MqttPubMsg{
+        .topic  = in.topic,
+        .data   = {in.data, in.len},
+        .stream = true,
+    };
+    // don't care about the result
+    auto _ = _manager->publish(msg);
+  }
+};
+
+/**
+ * @brief sends the messages to the UDP collector, see `WlanManager::udp`
+ */
+class UdpPublish {
+  wlan::UdpTransport *_udp = nullptr;
+
+public:
+  void init(wlan::UdpTransport &udp) {
+    _udp = &udp;
+  }
+
+  template <typename Next>
+  void push(const Message &in, Next &) {
+    // its losses are counted by the transport
+    auto _ = _udp->send(in.topic, in.data, in.len);
+  }
+};
+
+#if CONFIG_WITHUB_SYNC
+/**
+ * @brief feeds the notifications to the time alignment as they come
+ */
+class Sync {
+  align::SyncStage *_stage = nullptr;
+
+public:
+  void init(align::SyncStage &stage) {
+    _stage = &stage;
+  }
+
+  template <typename Next>
+  void push(const Chunk &in, Next &next) {
+    _stage->on_data(in.addr, in.data, in.len);
+    next.push(in);
+  }
+
+  template <typename Next>
+  void disconnect(const addr_t &addr, Next &) {
+    _stage->on_disconnect(addr);
+  }
+};
+using tap_t = Sync;
+#else
+using tap_t = Skip;
+#endif
+
+constexpr auto HUB_CONFIG = Config{
+#if CONFIG_WITHUB_PIPELINE_REASSEMBLE
+    .reassemble = true,
+    .decimate   = CONFIG_WITHUB_PIPELINE_DECIMATE,
+#endif
+#if CONFIG_WITHUB_PIPELINE_BATCH
+    .batch_bytes = CONFIG_WITHUB_PIPELINE_BATCH_BYTES,
+    .batch_ms    = CONFIG_WITHUB_PIPELINE_BATCH_MS,
+#endif
+};
+using publish_t = std::conditional_t<STREAM_UDP, UdpPublish, MqttPublish>;
+#if CONFIG_WITHUB_PIPELINE_BATCH
+// a sensor fills about a batch per `poll`; the ones that are due, and those
+// that filled up since
+using outbox_t = Outbox<2 * MAX_DEVICES, HUB_CONFIG.batch_bytes>;
+using hub_t    = Hub<HUB_CONFIG, tap_t, outbox_t>;
+#else
+using hub_t = Hub<HUB_CONFIG, tap_t, publish_t>;
+#endif
+
+/**
+ * @brief runs `hub_t` on the notifications of the sensors
+ *
+ * Notifications and disconnections come from the BLE host task. When a stage
+ * holds data back (batching), the pipeline is behind a mutex and ends in an
+ * `Outbox`: a task of its own, woken periodically, passes on what is due and
+ * publishes what the outbox holds once it let go of the mutex (a publish may
+ * block, so not from the esp_timer task, and not holding up the host task).
+ * Otherwise there is neither, and the host task publishes.
+ * @sa pipeline.h for the stages
+ */
+class HubPipeline {
+  using addr_t = blue::WitDevice::addr_t;
+
+  hub_t _pipeline{};
+#if CONFIG_WITHUB_PIPELINE_BATCH
+  publish_t _publish{};
+  Pipeline<> _end{};
+  // `outbox_t::dropped` as last logged
+  size_t _dropped = 0;
+  utils::StaticMutex _mutex{};
+  utils::PeriodicTask<3072> _task{};
+
+  static void tick(void *arg);
+#endif
+
+public:
+#if CONFIG_WITHUB_SYNC
+  esp_err_t init(wlan::WlanManager &manager, align::SyncStage &sync);
+#else
+  esp_err_t init(wlan::WlanManager &manager);
+#endif
+
+  /**
+   * @brief bytes notified by a sensor; may hold partial frames
+   */
+  void on_data(const blue::WitDevice &device, const uint8_t *data, size_t len);
+
+  void on_disconnect(const addr_t &addr);
+};
+}
+
+#endif // WIT_HUB_HUB_PIPELINE_H
@@ -0,0 +1,405 @@
+//
+// Connection parameters of the BLE links to the sensors: ATT MTU, LL data
+// length (DLE) and the connection interval, from the number of sensors and
+// what each of them sends.
+//
+// The hub is the central of every link and its radio serves one connection
+// event per link per connection interval. Every notification costs an
+// exchange of LL PDUs (the central's empty PDU and the sensor's data PDU, two
+// inter frame spaces apart), so the airtime of a link is set by how many
+// notifications it sends and how they are fragmented; the interval only
+// amortizes the fixed cost of an event. All links get the same interval,
+// which lets the controller spread their anchors evenly. The plan starts from
+// the shortest sample period of the links, so that a sample waits for at most
+// one period on its sensor, and lengthens the interval (trading delay for
+// fewer events) until
+//
+//  - all events together take at most `max_utilization` of the radio time,
+//    the rest being left to scanning and Wi-Fi coexistence, and
+//  - every event fits in its share of the interval.
+//
+// A bigger MTU lets a sensor put several frames in a notification and DLE
+// lets a notification travel in one PDU; a 20 byte WitMotion frame fits the
+// defaults, so they only pay off for sensors that batch their frames.
+//
+
+#ifndef WIT_HUB_LINK_POLICY_H
+#define WIT_HUB_LINK_POLICY_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include "wit_protocol.h"
+
+namespace radio {
+constexpr size_t MAX_LINKS = 12;
+
+// Bluetooth Core units and limits
+constexpr uint32_t INTERVAL_UNIT_US  = 1'250;
+constexpr uint16_t INTERVAL_MIN      = 6;    // 7.5 ms
+constexpr uint16_t INTERVAL_MAX      = 3200; // 4 s
+constexpr uint32_t TIMEOUT_UNIT_MS   = 10;
+constexpr uint16_t TIMEOUT_MIN       = 10;   // 100 ms
+constexpr uint16_t TIMEOUT_MAX       = 3200; // 32 s
+constexpr uint16_t LATENCY_MAX       = 499;
+constexpr uint16_t DEFAULT_MTU       = 23;
+constexpr uint16_t MAX_MTU           = 517;
+constexpr uint16_t DEFAULT_TX_OCTETS = 27;
+constexpr uint16_t MAX_TX_OCTETS     = 251;
+// airtime on the LE 1M PHY
+constexpr uint32_t US_PER_BYTE = 8;
+// preamble, access address, PDU header and CRC
+constexpr uint32_t LL_OVERHEAD       = 10;
+constexpr uint32_t T_IFS_US          = 150;
+constexpr uint32_t L2CAP_HEADER      = 4;
+constexpr uint32_t ATT_NOTIFY_HEADER = 3;
+
+// BLE address of a sensor, in the same byte order as `WitDevice::addr_t`
+using addr_t = std::array<uint8_t, 6>;
+
+struct Options {
+  // what the hub asks for; every sensor may agree to less
+  uint16_t mtu       = 247;
+  uint16_t tx_octets = MAX_TX_OCTETS;
+  // share of the radio time the connection events may take
+  float max_utilization = 0.5f;
+  // samples wait up to an interval on the sensor, so this bounds the delay
+  uint32_t max_interval_us = 50'000;
+  // per event cost besides the PDUs: scheduling, window widening, ramp up
+  uint32_t event_overhead_us = 500;
+  uint16_t latency           = 0;
+  // supervision timeout in intervals, but no less than `min_timeout_ms`
+  uint16_t timeout_intervals = 6;
+  uint32_t min_timeout_ms    = 2'000;
+};
+
+/**
+ * @brief what a sensor sends
+ */
+struct Demand {
+  // data frames per second (the RRATE of the sensor)
+  float rate_hz = 10;
+  // bytes per notification; more than a frame if the sensor batches them
+  uint16_t notify_bytes = wit::FRAME_SIZE;
+};
+
+/**
+ * @brief what to ask every link for
+ */
+struct Params {
+  uint16_t mtu       = DEFAULT_MTU;
+  uint16_t tx_octets = DEFAULT_TX_OCTETS;
+  // connection interval range, in 1.25 ms
+  uint16_t interval_min = INTERVAL_MIN;
+  uint16_t interval_max = INTERVAL_MIN;
+  uint16_t latency      = 0;
+  // supervision timeout, in 10 ms
+  uint16_t timeout = TIMEOUT_MIN;
+  // expected share of the radio time at `interval_min`
+  float utilization = 0;
+  // false if even the longest interval allowed can't carry the demand
+  bool feasible = true;
+
+  /**
+   * @brief the connection parameters (not the MTU/DLE) differ, i.e. the links
+   * have to be updated
+   */
+  [[nodiscard]] bool differs(const Params &other) const {
+    return interval_min != other.interval_min || interval_max != other.interval_max ||
+           latency != other.latency || timeout != other.timeout;
+  }
+};
+
+/**
+ * @brief what a link agreed to, as far as the hub knows
+ */
+struct Agreed {
+  uint16_t mtu       = DEFAULT_MTU;
+  uint16_t tx_octets = DEFAULT_TX_OCTETS;
+  // 0 until known
+  uint16_t interval = 0;
+  uint16_t latency  = 0;
+  uint16_t timeout  = 0;
+
+  bool operator==(const Agreed &) const = default;
+};
+
+/**
+ * @brief airtime of the exchange of a data PDU carrying `payload` bytes from
+ * the sensor for an empty one from the hub
+ */
+constexpr uint32_t exchange_us(uint32_t payload) {
+  return (2 * LL_OVERHEAD + payload) * US_PER_BYTE + 2 * T_IFS_US;
+}
+
+/**
+ * @brief airtime of a notification of `notify_bytes`, fragmented into PDUs of
+ * up to `tx_octets`
+ */
+constexpr uint32_t notify_us(uint32_t notify_bytes, uint16_t tx_octets) {
+  auto len  = notify_bytes + ATT_NOTIFY_HEADER + L2CAP_HEADER;
+  auto full = len / tx_octets;
+  auto rest = len % tx_octets;
+  return full * exchange_us(tx_octets) + (rest != 0 ? exchange_us(rest) : 0);
+}
+
+/**
+ * @brief airtime of a connection event of a link
+ * @note a sensor can't notify more than `mtu - 3` bytes at once
+ */
+inline uint32_t event_us(const Demand &demand, const Agreed &agreed, uint32_t interval_us, uint32_t overhead_us) {
+  auto notify_bytes = std::max<uint32_t>(1, std::min<uint32_t>(demand.notify_bytes, agreed.mtu - ATT_NOTIFY_HEADER));
+  // whole notifications per event, rounded up: the event has to take a burst
+  auto bytes    = static_cast<double>(demand.rate_hz) * wit::FRAME_SIZE * interval_us / 1e6;
+  auto notifies = static_cast<uint32_t>(std::ceil(bytes / notify_bytes - 1e-9));
+  if (notifies == 0) {
+    // an empty exchange keeps the link alive
+    return overhead_us + exchange_us(0);
+  }
+  return overhead_us + notifies * notify_us(notify_bytes, agreed.tx_octets);
+}
+
+/**
+ * @brief keeps the links' demands and what they agreed to, and plans the
+ * parameters to ask for
+ *
+ * `join`, `leave` and `set_demand` replan and tell whether the connection
+ * parameters changed, i.e. whether the connected links have to be updated.
+ */
+class Policy {
+  struct Link {
+    addr_t addr{};
+    bool used = false;
+    Demand demand{};
+    Agreed agreed{};
+  };
+
+  Options _opts{};
+  std::array<Link, MAX_LINKS> _links{};
+  Params _params{};
+  uint32_t _replans = 0;
+
+  Link *_find(const addr_t &addr) {
+    for (auto &l : _links) {
+      if (l.used && l.addr == addr) {
+        return &l;
+      }
+    }
+    return nullptr;
+  }
+
+  [[nodiscard]] const Link *_find(const addr_t &addr) const {
+    return const_cast<Policy *>(this)->_find(addr);
+  }
+
+  /**
+   * @return the share of the radio time at `interval` (in 1.25 ms) and whether
+   * every event fits in its share of the interval
+   */
+  [[nodiscard]] std::pair<float, bool> _load(uint16_t interval) const {
+    auto interval_us = static_cast<uint32_t>(interval) * INTERVAL_UNIT_US;
+    auto slot_us     = interval_us / std::max<size_t>(1, count());
+    uint64_t sum_us  = 0;
+    auto fits        = true;
+    for (const auto &l : _links) {
+      if (!l.used) {
+        continue;
+      }
+      auto e = event_us(l.demand, l.agreed, interval_us, _opts.event_overhead_us);
+      sum_us += e;
+      fits = fits && e <= slot_us;
+    }
+    return {static_cast<float>(sum_us) / static_cast<float>(interval_us), fits};
+  }
+
+  bool _replan() {
+    auto res      = Params{};
+    res.mtu       = std::clamp(_opts.mtu, DEFAULT_MTU, MAX_MTU);
+    res.tx_octets = std::clamp(_opts.tx_octets, DEFAULT_TX_OCTETS, MAX_TX_OCTETS);
+    res.latency   = std::min(_opts.latency, LATENCY_MAX);
+    auto longest  = static_cast<uint16_t>(std::clamp<uint32_t>(_opts.max_interval_us / INTERVAL_UNIT_US,
+                                                               INTERVAL_MIN, INTERVAL_MAX));
+    // a shorter interval than the fastest sensor's period only adds empty events
+    float rate_hz = 0;
+    for (const auto &l : _links) {
+      rate_hz = l.used ? std::max(rate_hz, l.demand.rate_hz) : rate_hz;
+    }
+    auto shortest = rate_hz <= 0 ? longest
+                                 : static_cast<uint16_t>(std::clamp<double>(1e6 / rate_hz / INTERVAL_UNIT_US,
+                                                                            INTERVAL_MIN, longest));
+    res.feasible  = false;
+    for (auto i = shortest; i <= longest; ++i) {
+      auto [utilization, fits] = _load(i);
+      res.interval_min         = i;
+      res.utilization          = utilization;
+      if (fits && utilization <= _opts.max_utilization) {
+        res.feasible = true;
+        break;
+      }
+    }
+    // a longer interval only loads the radio less; leave the controller some room
+    res.interval_max = std::max(res.interval_min, std::min<uint16_t>(res.interval_min + res.interval_min / 4, longest));
+    // the spec wants more than (1 + latency) * interval_max * 2
+    auto timeout_ms  = std::max<uint64_t>(_opts.min_timeout_ms,
+                                          static_cast<uint64_t>(std::max<uint16_t>(_opts.timeout_intervals, 3)) *
+                                              (1 + res.latency) * res.interval_max * INTERVAL_UNIT_US / 1000);
+    res.timeout      = static_cast<uint16_t>(std::clamp<uint64_t>((timeout_ms + TIMEOUT_UNIT_MS - 1) / TIMEOUT_UNIT_MS,
+                                                                  TIMEOUT_MIN, TIMEOUT_MAX));
+    auto changed     = res.differs(_params);
+    _params          = res;
+    if (changed) {
+      _replans += 1;
+    }
+    return changed;
+  }
+
+public:
+  Policy() {
+    _replan();
+    _replans = 0;
+  }
+
+  explicit Policy(const Options &opts) : _opts(opts) {
+    _replan();
+    _replans = 0;
+  }
+
+  /**
+   * @brief reinitialize in place
+   */
+  void reset(const Options &opts) {
+    _opts = opts;
+    for (auto &l : _links) {
+      l = Link{};
+    }
+    _replan();
+    _replans = 0;
+  }
+
+  [[nodiscard]] const Options &options() const {
+    return _opts;
+  }
+
+  /**
+   * @brief the parameters to ask every link for
+   */
+  [[nodiscard]] const Params &params() const {
+    return _params;
+  }
+
+  /**
+   * @brief times the connection parameters changed
+   */
+  [[nodiscard]] uint32_t replans() const {
+    return _replans;
+  }
+
+  [[nodiscard]] size_t count() const {
+    return std::count_if(_links.begin(), _links.end(), [](const Link &l) { return l.used; });
+  }
+
+  /**
+   * @brief a link is about to be made, or was
+   * @return whether the connection parameters changed; false as well if there
+   * is no room for the link
+   */
+  bool join(const addr_t &addr, const Demand &demand) {
+    auto *link = _find(addr);
+    if (link == nullptr) {
+      auto free = std::find_if(_links.begin(), _links.end(), [](const Link &l) { return !l.used; });
+      if (free == _links.end()) {
+        return false;
+      }
+      link       = &*free;
+      *link      = Link{};
+      link->used = true;
+      link->addr = addr;
+    }
+    link->demand = demand;
+    return _replan();
+  }
+
+  /**
+   * @return whether the connection parameters changed
+   */
+  bool leave(const addr_t &addr) {
+    auto *link = _find(addr);
+    if (link == nullptr) {
+      return false;
+    }
+    *link = Link{};
+    return _replan();
+  }
+
+  /**
+   * @brief e.g. the output rate of the sensor changed
+   * @return whether the connection parameters changed
+   */
+  bool set_demand(const addr_t &addr, const Demand &demand) {
+    auto *link = _find(addr);
+    if (link == nullptr) {
+      return false;
+    }
+    link->demand = demand;
+    return _replan();
+  }
+
+  /**
+   * @brief record what a link agreed to; the MTU and the data length weigh in
+   * the plan
+   * @return whether the connection parameters changed
+   */
+  bool on_agreed(const addr_t &addr, const Agreed &agreed) {
+    auto *link = _find(addr);
+    if (link == nullptr) {
+      return false;
+    }
+    link->agreed = agreed;
+    return _replan();
+  }
+
+  [[nodiscard]] const Agreed *agreed(const addr_t &addr) const {
+    const auto *link = _find(addr);
+    return link == nullptr ? nullptr : &link->agreed;
+  }
+
+  [[nodiscard]] const Demand *demand(const addr_t &addr) const {
+    const auto *link = _find(addr);
+    return link == nullptr ? nullptr : &link->demand;
+  }
+
+  /**
+   * @brief expected share of the radio time with the links as they are, at
+   * their agreed intervals (or the planned one if not known)
+   */
+  [[nodiscard]] float utilization() const {
+    double res = 0;
+    for (const auto &l : _links) {
+      if (!l.used) {
+        continue;
+      }
+      auto interval_us = static_cast<uint32_t>(l.agreed.interval != 0 ? l.agreed.interval : _params.interval_min) *
+                         INTERVAL_UNIT_US;
+      res += static_cast<double>(event_us(l.demand, l.agreed, interval_us, _opts.event_overhead_us)) / interval_us;
+    }
+    return static_cast<float>(res);
+  }
+
+  /**
+   * @param fn `void(const addr_t &, const Demand &, const Agreed &)`
+   */
+  template <typename F>
+  void for_each(F &&fn) const {
+    for (const auto &l : _links) {
+      if (l.used) {
+        fn(l.addr, l.demand, l.agreed);
+      }
+    }
+  }
+};
+}
+
+#endif // WIT_HUB_LINK_POLICY_H
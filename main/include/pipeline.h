@@ -0,0 +1,512 @@
+//
+// Stages of the data path, from the notifications of the sensors to the
+// transport, composed at compile time.
+//
+// A stage is a class with
+//
+//   template <typename Next> void push(const In &in, Next &next);
+//
+// handing whatever it makes of `in` to `next.push(...)`, any number of times.
+// It may also have `poll(now_us, next)`, if it holds data back for a while,
+// and `disconnect(addr, next)`, if it keeps state per sensor. `Pipeline`
+// chains stages into one object: every call is a direct call the compiler can
+// inline, and `Compose` leaves out the stages that are `Skip`, so a stage
+// that isn't configured costs neither code nor RAM.
+//
+// What flows between stages:
+//
+//  - `Chunk`: bytes of one sensor in the order they were notified;
+//  - `Frame`: a `Chunk` holding exactly one frame, out of `Reassemble`;
+//  - `Message`: a topic and its payload, out of `Encode`.
+//
+// A stage only takes what it can handle (e.g. `Decimate` takes frames), so a
+// chain in the wrong order doesn't compile.
+//
+
+#ifndef WIT_HUB_PIPELINE_H
+#define WIT_HUB_PIPELINE_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include "wit_protocol.h"
+
+namespace pipeline {
+constexpr size_t MAX_DEVICES = 12;
+// BLE address of a sensor, in the same byte order as `WitDevice::addr_t`
+using addr_t = std::array<uint8_t, 6>;
+
+struct Chunk {
+  addr_t addr{};
+  const uint8_t *data = nullptr;
+  size_t len          = 0;
+  // when the first byte was received (monotonic microseconds)
+  int64_t ts_us = 0;
+};
+
+/**
+ * @brief `wit::FRAME_SIZE` bytes starting with `wit::FRAME_HEADER`
+ */
+struct Frame : Chunk {};
+
+struct Message {
+  std::string_view topic;
+  const uint8_t *data = nullptr;
+  size_t len          = 0;
+};
+
+/**
+ * @brief state of every sensor a stage has seen, until it disconnects
+ */
+template <typename T>
+class PerDevice {
+  struct Slot {
+    addr_t addr{};
+    bool used = false;
+    T value{};
+  };
+
+  std::array<Slot, MAX_DEVICES> _slots{};
+  // the frames of a notification are of the same sensor
+  size_t _last = 0;
+
+public:
+  /**
+   * @return nullptr if there is no room for another sensor
+   */
+  T *get(const addr_t &addr) {
+    if (_slots[_last].used && _slots[_last].addr == addr) {
+      return &_slots[_last].value;
+    }
+    Slot *free = nullptr;
+    for (auto &s : _slots) {
+      if (s.used && s.addr == addr) {
+        _last = &s - _slots.data();
+        return &s.value;
+      }
+      if (!s.used && free == nullptr) {
+        free = &s;
+      }
+    }
+    if (free == nullptr) {
+      return nullptr;
+    }
+    *free = Slot{addr, true, T{}};
+    _last = free - _slots.data();
+    return &free->value;
+  }
+
+  T *find(const addr_t &addr) {
+    for (auto &s : _slots) {
+      if (s.used && s.addr == addr) {
+        return &s.value;
+      }
+    }
+    return nullptr;
+  }
+
+  void erase(const addr_t &addr) {
+    for (auto &s : _slots) {
+      if (s.used && s.addr == addr) {
+        s.used = false;
+      }
+    }
+  }
+
+  /**
+   * @param fn called as `fn(const addr_t &, T &)` for every sensor
+   */
+  template <typename F>
+  void for_each(F &&fn) {
+    for (auto &s : _slots) {
+      if (s.used) {
+        fn(s.addr, s.value);
+      }
+    }
+  }
+};
+
+/**
+ * @brief cut the notifications into frames
+ * @note a frame split across two notifications is carried over, so it costs
+ * a copy; the others point into the notification
+ * @sa wit::FrameReassembler
+ */
+class Reassemble {
+  PerDevice<wit::FrameReassembler> _streams{};
+  size_t _lost = 0;
+
+public:
+  /**
+   * @brief chunks of the sensors there was no room for
+   */
+  [[nodiscard]] size_t lost() const {
+    return _lost;
+  }
+
+  template <typename Next>
+  void push(const Chunk &in, Next &next) {
+    auto *stream = _streams.get(in.addr);
+    if (stream == nullptr) {
+      _lost += 1;
+      return;
+    }
+    stream->feed(in.data, in.len, [&](const uint8_t *frame) {
+      next.push(Frame{{in.addr, frame, wit::FRAME_SIZE, in.ts_us}});
+    });
+  }
+
+  template <typename Next>
+  void disconnect(const addr_t &addr, Next &) {
+    _streams.erase(addr);
+  }
+};
+
+/**
+ * @brief forward one of every `N` data frames of a sensor
+ * @note the replies to register reads (`wit::FLAG_REGISTER`) all go through
+ */
+template <uint32_t N>
+class Decimate {
+  static_assert(N > 0);
+  PerDevice<uint32_t> _seen{};
+
+public:
+  template <typename Next>
+  void push(const Frame &in, Next &next) {
+    if (in.data[1] != wit::FLAG_DATA) {
+      next.push(in);
+      return;
+    }
+    auto *seen = _seen.get(in.addr);
+    // a sensor there is no room for isn't decimated rather than lost
+    if (seen == nullptr || (*seen)++ % N == 0) {
+      next.push(in);
+    }
+  }
+
+  template <typename Next>
+  void disconnect(const addr_t &addr, Next &) {
+    _seen.erase(addr);
+  }
+};
+
+/**
+ * @brief put the chunks of a sensor together, up to `Bytes`
+ *
+ * A batch goes on once the next chunk doesn't fit, it's full or its first
+ * byte is `MaxAgeMs` old, by `push` or by `poll`, whichever comes first. Chunks
+ * of a sensor stay in order; one larger than `Bytes` goes on by itself.
+ * @note frames stay whole as long as only frames are batched
+ */
+template <size_t Bytes, uint32_t MaxAgeMs>
+class Batch {
+  static_assert(Bytes >= wit::FRAME_SIZE);
+  struct Buffer {
+    std::array<uint8_t, Bytes> data{};
+    size_t len       = 0;
+    int64_t since_us = 0;
+  };
+
+  PerDevice<Buffer> _buffers{};
+
+  template <typename Next>
+  static void _flush(const addr_t &addr, Buffer &b, Next &next) {
+    if (b.len == 0) {
+      return;
+    }
+    auto len = b.len;
+    b.len    = 0;
+    next.push(Chunk{addr, b.data.data(), len, b.since_us});
+  }
+
+public:
+  template <typename Next>
+  void push(const Chunk &in, Next &next) {
+    auto *b = _buffers.get(in.addr);
+    if (b == nullptr || in.len > Bytes) {
+      if (b != nullptr) {
+        _flush(in.addr, *b, next);
+      }
+      next.push(in);
+      return;
+    }
+    if (b->len + in.len > Bytes) {
+      _flush(in.addr, *b, next);
+    }
+    if (b->len == 0) {
+      b->since_us = in.ts_us;
+    }
+    std::memcpy(b->data.data() + b->len, in.data, in.len);
+    b->len += in.len;
+    if (b->len == Bytes || in.ts_us - b->since_us >= MaxAgeMs * 1000LL) {
+      _flush(in.addr, *b, next);
+    }
+  }
+
+  template <typename Next>
+  void poll(int64_t now_us, Next &next) {
+    _buffers.for_each([&](const addr_t &addr, Buffer &b) {
+      if (b.len > 0 && now_us - b.since_us >= MaxAgeMs * 1000LL) {
+        _flush(addr, b, next);
+      }
+    });
+  }
+
+  template <typename Next>
+  void disconnect(const addr_t &addr, Next &next) {
+    auto *b = _buffers.find(addr);
+    if (b != nullptr) {
+      _flush(addr, *b, next);
+    }
+    _buffers.erase(addr);
+  }
+};
+
+/**
+ * @brief publish the bytes of a sensor on `/wit/<addr>/data`
+ * @note what the payload holds (notifications, frames, batches of either) is
+ * the same byte stream to a receiver that reassembles frames
+ */
+class Encode {
+  static constexpr auto PREFIX = std::string_view{"/wit/"};
+  static constexpr auto SUFFIX = std::string_view{"/data"};
+
+public:
+  static constexpr size_t TOPIC_SIZE = PREFIX.size() + addr_t{}.size() * 2 + SUFFIX.size();
+
+private:
+  char _topic[TOPIC_SIZE]{};
+  addr_t _addr{};
+  bool _has_addr = false;
+
+public:
+  template <typename Next>
+  void push(const Chunk &in, Next &next) {
+    // consecutive chunks are often of the same sensor
+    if (!_has_addr || _addr != in.addr) {
+      constexpr char HEX[] = "0123456789abcdef";
+      auto *p              = _topic;
+      std::memcpy(p, PREFIX.data(), PREFIX.size());
+      p += PREFIX.size();
+      for (auto b : in.addr) {
+        *p++ = HEX[b >> 4];
+        *p++ = HEX[b & 0x0f];
+      }
+      std::memcpy(p, SUFFIX.data(), SUFFIX.size());
+      _addr     = in.addr;
+      _has_addr = true;
+    }
+    next.push(Message{std::string_view{_topic, TOPIC_SIZE}, in.data, in.len});
+  }
+};
+
+/**
+ * @brief hold the messages back, in order, for another task to pass on
+ *
+ * Ends a chain that is behind a lock while its transport may block: `push`
+ * only copies, and the messages are passed on with `peek` once the lock is
+ * let go, then `pop`ped under it again. A message longer than `Bytes` takes
+ * several slots, the same byte stream to a receiver that reassembles frames;
+ * one that doesn't fit anymore is dropped and counted.
+ * @note `push`, `held` and `pop` under the lock; `peek` from the task that
+ * pops, without it, as `push` doesn't touch the slots held
+ */
+template <size_t Slots, size_t Bytes>
+class Outbox {
+  struct Slot {
+    std::array<char, Encode::TOPIC_SIZE> topic{};
+    size_t topic_len = 0;
+    std::array<uint8_t, Bytes> data{};
+    size_t len = 0;
+  };
+
+  std::array<Slot, Slots> _slots{};
+  // slots pushed and popped so far; the next one is `_tail % Slots`
+  size_t _head    = 0;
+  size_t _tail    = 0;
+  size_t _dropped = 0;
+
+public:
+  template <typename Next>
+  void push(const Message &in, Next &) {
+    auto n = (in.len + Bytes - 1) / Bytes;
+    if (in.topic.size() > Encode::TOPIC_SIZE || held() + n > Slots) {
+      _dropped += 1;
+      return;
+    }
+    for (size_t offset = 0; offset < in.len; offset += Bytes) {
+      auto &s     = _slots[_tail++ % Slots];
+      s.topic_len = in.topic.size();
+      s.len       = std::min(Bytes, in.len - offset);
+      std::memcpy(s.topic.data(), in.topic.data(), s.topic_len);
+      std::memcpy(s.data.data(), in.data + offset, s.len);
+    }
+  }
+
+  [[nodiscard]] size_t held() const {
+    return _tail - _head;
+  }
+
+  static constexpr size_t capacity() {
+    return Slots;
+  }
+
+  /**
+   * @brief messages that didn't fit so far
+   */
+  [[nodiscard]] size_t dropped() const {
+    return _dropped;
+  }
+
+  /**
+   * @brief the first `n` slots held, as `fn(const Message &)`; they stay held
+   * until `pop`
+   */
+  template <typename F>
+  void peek(size_t n, F &&fn) const {
+    for (auto i = _head; i < _head + n; ++i) {
+      const auto &s = _slots[i % Slots];
+      fn(Message{std::string_view{s.topic.data(), s.topic_len}, s.data.data(), s.len});
+    }
+  }
+
+  void pop(size_t n) {
+    _head += n;
+  }
+};
+
+/**
+ * @brief a stage that isn't there; see `Compose`
+ */
+struct Skip {};
+
+template <bool On, typename Stage>
+using when = std::conditional_t<On, Stage, Skip>;
+
+template <typename... Stages>
+class Pipeline;
+
+/**
+ * @brief the end of a chain; takes anything and does nothing with it
+ */
+template <>
+class Pipeline<> {
+public:
+  static constexpr bool polled = false;
+
+  template <typename In>
+  void push(const In &) {}
+
+  void poll(int64_t) {}
+
+  void disconnect(const addr_t &) {}
+};
+
+template <typename Head, typename... Tail>
+class Pipeline<Head, Tail...> {
+  using tail_t = Pipeline<Tail...>;
+  [[no_unique_address]] Head _head{};
+  [[no_unique_address]] tail_t _tail{};
+
+  static constexpr bool head_polled = requires(Head &h, tail_t &t) { h.poll(int64_t{}, t); };
+  static constexpr bool head_keeps = requires(Head &h, tail_t &t, const addr_t &a) { h.disconnect(a, t); };
+
+public:
+  /**
+   * @brief whether any stage holds data back until `poll`
+   */
+  static constexpr bool polled = head_polled || tail_t::polled;
+
+  template <typename In>
+  void push(const In &in) {
+    _head.push(in, _tail);
+  }
+
+  void poll(int64_t now_us) {
+    if constexpr (head_polled) {
+      _head.poll(now_us, _tail);
+    }
+    _tail.poll(now_us);
+  }
+
+  /**
+   * @brief drop what is kept of a sensor, after passing on what is held back
+   */
+  void disconnect(const addr_t &addr) {
+    if constexpr (head_keeps) {
+      _head.disconnect(addr, _tail);
+    }
+    _tail.disconnect(addr);
+  }
+
+  /**
+   * @return the first stage of type `S`, e.g. to set it up
+   */
+  template <typename S>
+  S &stage() {
+    if constexpr (std::is_same_v<S, Head>) {
+      return _head;
+    } else {
+      return _tail.template stage<S>();
+    }
+  }
+};
+
+namespace detail {
+  template <typename Chain, typename... Rest>
+  struct compose;
+
+  template <typename... Done>
+  struct compose<Pipeline<Done...>> {
+    using type = Pipeline<Done...>;
+  };
+
+  template <typename... Done, typename... Rest>
+  struct compose<Pipeline<Done...>, Skip, Rest...> : compose<Pipeline<Done...>, Rest...> {};
+
+  template <typename... Done, typename Stage, typename... Rest>
+  struct compose<Pipeline<Done...>, Stage, Rest...> : compose<Pipeline<Done..., Stage>, Rest...> {};
+}
+
+/**
+ * @brief `Pipeline` of the stages that aren't `Skip`
+ */
+template <typename... Stages>
+using Compose = typename detail::compose<Pipeline<>, Stages...>::type;
+
+/**
+ * @brief what the hub does with the notifications
+ * @note without any of them the notifications are published as they come
+ * (raw passthrough)
+ */
+struct Config {
+  // forward whole frames rather than notifications
+  bool reassemble = false;
+  // forward one of every `decimate` data frames; needs `reassemble`
+  uint32_t decimate = 1;
+  // put up to `batch_bytes` of a sensor into one message; 0 for none
+  size_t batch_bytes = 0;
+  uint32_t batch_ms  = 100;
+};
+
+/**
+ * @brief the data path of the hub
+ * @tparam Tap sees the notifications before anything else, or `Skip`
+ * @tparam Transport takes the `Message`s; pass one per transport with `when`,
+ * the one configured is the one that isn't `Skip`
+ */
+template <Config C, typename Tap, typename... Transport>
+using Hub = Compose<Tap,
+                    when<C.reassemble, Reassemble>,
+                    when<(C.decimate > 1), Decimate<C.decimate>>,
+                    when<(C.batch_bytes > 0), Batch<C.batch_bytes, C.batch_ms>>,
+                    Encode,
+                    Transport...>;
+}
+
+#endif // WIT_HUB_PIPELINE_H
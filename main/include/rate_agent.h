@@ -0,0 +1,114 @@
+//
+// Runs the output rate controller on the hub: samples the load, and writes
+// the rates it decides to the sensors.
+//
+
+#ifndef WIT_HUB_RATE_AGENT_H
+#define WIT_HUB_RATE_AGENT_H
+
+#include <functional>
+#include <string_view>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include "rate_control.h"
+#include "static_alloc.h"
+#include "wlan_manager.h"
+
+namespace rate {
+/**
+ * @brief thread safe wrapper of `Controller`
+ *
+ * Connections come from the BLE host task, limits from the MQTT subscription
+ * task and the load is sampled by a task of its own, woken periodically. The
+ * changes are applied through `on_change` outside of the lock, and every one
+ * of them is logged and published to `/wit/<addr>/rate` as
+ * `<from_hz> <to_hz> <cause>`. Publishing blocks, so it's only done from that
+ * task: the rate of a sensor that connects is recorded on the host task and
+ * applied by the next tick.
+ *
+ * The backlog is the share of a period the stream publishes spent blocked on
+ * the uplink (`PublishMetrics::blocked_us`); over UDP they don't block, what
+ * the uplink can't take counts as dropped instead.
+ *
+ * A change `on_change` can't write is reverted in the controller, or written
+ * again by the next tick for a sensor that just connected, so the controller,
+ * the links and the sensors agree.
+ *
+ * The limits of a sensor come from `/wit/<addr>/control/rate` as
+ * `<min_hz> <max_hz>`, the defaults otherwise. They are kept for sensors that
+ * aren't connected, for when they are.
+ * @sa rate_control.h for the control law
+ */
+class RateAgent {
+  struct Override {
+    addr_t addr{};
+    bool used = false;
+    Limits limits{};
+  };
+
+  Controller _controller{};
+  Limits _limits{};
+  float _initial_hz = 10;
+  uint32_t _period_us = 0;
+  // `PublishMetrics::blocked_us` of the last tick
+  uint32_t _blocked_us = 0;
+  std::array<Override, MAX_DEVICES> _overrides{};
+  // of the sensors that connected since the last tick
+  std::array<Change, MAX_DEVICES> _joins{};
+  size_t _join_count = 0;
+  wlan::WlanManager *_manager = nullptr;
+  utils::StaticMutex _mutex{};
+  utils::PeriodicTask<3072> _task{};
+
+  static void tick(void *arg);
+
+  /**
+   * @note must hold `_mutex`
+   */
+  Limits _limits_of(const addr_t &addr) const;
+
+  /**
+   * @note must hold `_mutex`
+   */
+  void _add_join(const Change &change);
+
+  /**
+   * @brief write, log and publish the changes
+   * @note without `_mutex`, `on_change` may take other locks
+   */
+  void _apply(const Change *changes, size_t n);
+
+public:
+  /**
+   * @brief write the RRATE register of a sensor (`Change::code`) and plan its
+   * link for the new rate
+   * @return false if it couldn't be written, e.g. the write queue is full;
+   * the link plan isn't to be touched then
+   */
+  std::function<bool(const Change &change)> on_change = nullptr;
+  /**
+   * @brief expected share of the radio time of the links
+   */
+  std::function<float()> utilization = nullptr;
+
+  /**
+   * @param limits of the sensors without their own
+   * @param initial_hz what a sensor is set to when it connects
+   * @param period_ms how often the load is sampled; the backlog is the share
+   * of it the stream publishes spent blocked
+   */
+  esp_err_t init(wlan::WlanManager &manager, const Options &opts, const Limits &limits, float initial_hz,
+                 uint32_t period_ms);
+
+  void on_connection(const addr_t &addr, bool connected);
+
+  /**
+   * @return false if the message isn't for the rate control
+   */
+  bool on_message(std::string_view topic, const uint8_t *data, size_t len);
+
+  [[nodiscard]] Stats stats();
+};
+}
+
+#endif // WIT_HUB_RATE_AGENT_H
@@ -0,0 +1,436 @@
+//
+// Output rate of the sensors driven by the load of the hub.
+//
+// Time is passed in by the caller (monotonic milliseconds).
+//
+// A sensor's rate is one of `wit::RATES` (its RRATE register), within limits
+// set per sensor. `update` is called periodically with the load of the hub:
+//
+//  - congested: messages were dropped since the last update, the backlog is
+//    above `backlog_high` or the radio above `max_utilization`. The total
+//    rate is cut to `decrease` of what it was, fastest sensors first, and
+//    remembered as the ceiling. The next cut waits `settle_ms`, for the
+//    sensors to apply it and the backlog to drain;
+//  - headroom: the backlog is below `backlog_low` and nothing changed for
+//    `hold_ms`. The slowest sensor that may go faster is stepped up. A step
+//    to the ceiling or past it waits for `probe_ms` of calm (a probe); if the
+//    hub takes it until the next step up, the ceiling is dropped;
+//  - anything in between: nothing changes.
+//
+// The radio isn't predicted: the link policy lengthens the connection interval
+// to keep its utilization within the limit as long as it can, so it's only
+// over the limit once the rates are really too much for it.
+//
+// So the rates settle a step below where the hub last congested and, now and
+// then, check whether it can take more, e.g. once the Wi-Fi got better. Every
+// change is handed to the caller to be written to the sensor and logged.
+//
+
+#ifndef WIT_HUB_RATE_CONTROL_H
+#define WIT_HUB_RATE_CONTROL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include "wit_protocol.h"
+
+namespace rate {
+constexpr size_t MAX_DEVICES = 12;
+// BLE address of a sensor, in the same byte order as `WitDevice::addr_t`
+using addr_t = std::array<uint8_t, 6>;
+
+struct Limits {
+  float min_hz = 1;
+  float max_hz = 50;
+};
+
+/**
+ * @brief what the hub is up against, as of an `update`
+ */
+struct Load {
+  // how long getting the messages out was held up by the uplink since the
+  // last update, as a share of that time; meanwhile the next ones wait
+  float backlog = 0;
+  // messages the hub couldn't get out so far; cumulative
+  uint32_t drops = 0;
+  // expected share of the radio time of the links
+  float utilization = 0;
+};
+
+struct Options {
+  float backlog_high    = 0.5f;
+  float backlog_low     = 0.1f;
+  float max_utilization = 0.5f;
+  // on congestion the total rate is cut to at most this share of it
+  float decrease = 0.7f;
+  // after a cut, before the next one
+  uint32_t settle_ms = 2'000;
+  // after any change, before stepping up
+  uint32_t hold_ms = 3'000;
+  // calm before going past the ceiling, per step
+  uint32_t probe_ms = 30'000;
+};
+
+enum class Cause : uint8_t {
+  // a sensor connected, its rate is set whatever it was
+  join,
+  // its limits changed
+  limits,
+  drops,
+  backlog,
+  radio,
+  headroom,
+  // headroom, past the ceiling
+  probe,
+};
+
+constexpr const char *to_str(Cause c) {
+  switch (c) {
+    case Cause::join: return "join";
+    case Cause::limits: return "limits";
+    case Cause::drops: return "drops";
+    case Cause::backlog: return "backlog";
+    case Cause::radio: return "radio";
+    case Cause::headroom: return "headroom";
+    case Cause::probe: return "probe";
+  }
+  return "?";
+}
+
+/**
+ * @brief a sensor is to be set to another rate
+ * @note `from` and `to` index `wit::RATES`; on `Cause::join` they are the same
+ */
+struct Change {
+  addr_t addr{};
+  uint8_t from = 0;
+  uint8_t to   = 0;
+  Cause cause  = Cause::join;
+
+  [[nodiscard]] float from_hz() const {
+    return wit::RATES[from].hz;
+  }
+
+  [[nodiscard]] float to_hz() const {
+    return wit::RATES[to].hz;
+  }
+
+  /**
+   * @brief the value of the RRATE register
+   */
+  [[nodiscard]] uint8_t code() const {
+    return wit::RATES[to].code;
+  }
+};
+
+struct Stats {
+  uint32_t changes   = 0;
+  uint32_t decreases = 0;
+  uint32_t increases = 0;
+  uint32_t probes    = 0;
+  uint32_t reverts   = 0;
+};
+
+/**
+ * @brief the slowest rate not below `hz`, the fastest one if all are
+ */
+constexpr uint8_t rate_at_least(float hz) {
+  for (size_t i = 0; i < wit::RATES.size(); ++i) {
+    if (wit::RATES[i].hz >= hz) {
+      return static_cast<uint8_t>(i);
+    }
+  }
+  return static_cast<uint8_t>(wit::RATES.size() - 1);
+}
+
+class Controller {
+  struct Device {
+    addr_t addr{};
+    bool used    = false;
+    uint8_t min  = 0;
+    uint8_t max  = 0;
+    uint8_t step = 0;
+  };
+
+  Options _opts{};
+  std::array<Device, MAX_DEVICES> _devices{};
+  bool _has_drops  = false;
+  uint32_t _drops  = 0;
+  int64_t _changed = std::numeric_limits<int64_t>::min() / 2;
+  int64_t _cut     = std::numeric_limits<int64_t>::min() / 2;
+  // last cut or probe
+  int64_t _calm_since = std::numeric_limits<int64_t>::min() / 2;
+  float _ceiling_hz   = std::numeric_limits<float>::infinity();
+  bool _probing       = false;
+  Stats _stats{};
+
+  Device *_find(const addr_t &addr) {
+    for (auto &d : _devices) {
+      if (d.used && d.addr == addr) {
+        return &d;
+      }
+    }
+    return nullptr;
+  }
+
+  static void _limit(Device &d, const Limits &limits) {
+    d.max = static_cast<uint8_t>(wit::rate_index(limits.max_hz));
+    d.min = rate_at_least(limits.min_hz);
+    if (d.min > d.max) {
+      d.min = d.max;
+    }
+  }
+
+  template <typename F>
+  void _emit(const Device &d, uint8_t from, Cause cause, int64_t now, F &on_change) {
+    _stats.changes += 1;
+    _changed = now;
+    on_change(Change{d.addr, from, d.step, cause});
+  }
+
+  template <typename F>
+  void _decrease(Cause cause, int64_t now, F &on_change) {
+    auto total  = total_hz();
+    auto target = total * _opts.decrease;
+    _ceiling_hz = total;
+    _probing    = false;
+    _cut        = now;
+    _calm_since = now;
+    auto from   = std::array<uint8_t, MAX_DEVICES>{};
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+      from[i] = _devices[i].step;
+    }
+    while (total > target) {
+      Device *fastest = nullptr;
+      for (auto &d : _devices) {
+        if (d.used && d.step > d.min && (fastest == nullptr || d.step > fastest->step)) {
+          fastest = &d;
+        }
+      }
+      if (fastest == nullptr) {
+        break;
+      }
+      total -= wit::RATES[fastest->step].hz - wit::RATES[fastest->step - 1].hz;
+      fastest->step -= 1;
+    }
+    auto any = false;
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+      if (_devices[i].used && _devices[i].step != from[i]) {
+        any = true;
+        _emit(_devices[i], from[i], cause, now, on_change);
+      }
+    }
+    _stats.decreases += any ? 1 : 0;
+  }
+
+  template <typename F>
+  void _increase(int64_t now, F &on_change) {
+    Device *slowest = nullptr;
+    for (auto &d : _devices) {
+      if (d.used && d.step < d.max && (slowest == nullptr || d.step < slowest->step)) {
+        slowest = &d;
+      }
+    }
+    if (_probing) {
+      // the hub took the probe
+      _probing    = false;
+      _ceiling_hz = std::numeric_limits<float>::infinity();
+    }
+    if (slowest == nullptr) {
+      return;
+    }
+    auto next  = total_hz() + wit::RATES[slowest->step + 1].hz - wit::RATES[slowest->step].hz;
+    auto cause = Cause::headroom;
+    if (next >= _ceiling_hz) {
+      if (now - _calm_since < _opts.probe_ms) {
+        return;
+      }
+      cause       = Cause::probe;
+      _calm_since = now;
+      _probing    = true;
+      _stats.probes += 1;
+    }
+    auto from = slowest->step;
+    slowest->step += 1;
+    _stats.increases += 1;
+    _emit(*slowest, from, cause, now, on_change);
+  }
+
+public:
+  Controller() = default;
+
+  explicit Controller(const Options &opts) : _opts(opts) {}
+
+  void reset(const Options &opts) {
+    *this = Controller{opts};
+  }
+
+  [[nodiscard]] const Options &options() const {
+    return _opts;
+  }
+
+  [[nodiscard]] const Stats &stats() const {
+    return _stats;
+  }
+
+  /**
+   * @brief a sensor connected; its rate is set to `initial_hz` within
+   * `limits`, since what it runs at is unknown
+   * @param on_change called as `on_change(const Change &)`
+   * @return false if there is no room for it
+   */
+  template <typename F>
+  bool join(const addr_t &addr, const Limits &limits, float initial_hz, int64_t now, F &&on_change) {
+    auto *d = _find(addr);
+    if (d == nullptr) {
+      for (auto &free : _devices) {
+        if (!free.used) {
+          d = &free;
+          break;
+        }
+      }
+    }
+    if (d == nullptr) {
+      return false;
+    }
+    *d = Device{.addr = addr, .used = true};
+    _limit(*d, limits);
+    auto s  = static_cast<uint8_t>(wit::rate_index(initial_hz));
+    d->step = s < d->min ? d->min : (s > d->max ? d->max : s);
+    _emit(*d, d->step, Cause::join, now, on_change);
+    return true;
+  }
+
+  bool leave(const addr_t &addr) {
+    auto *d = _find(addr);
+    if (d == nullptr) {
+      return false;
+    }
+    d->used = false;
+    return true;
+  }
+
+  /**
+   * @brief the rate moves into the new limits if it's out of them
+   * @return false if the sensor isn't known
+   */
+  template <typename F>
+  bool set_limits(const addr_t &addr, const Limits &limits, int64_t now, F &&on_change) {
+    auto *d = _find(addr);
+    if (d == nullptr) {
+      return false;
+    }
+    _limit(*d, limits);
+    auto from = d->step;
+    d->step   = from < d->min ? d->min : (from > d->max ? d->max : from);
+    if (d->step != from) {
+      _emit(*d, from, Cause::limits, now, on_change);
+    }
+    return true;
+  }
+
+  /**
+   * @brief a change couldn't be written to the sensor, so it stays where it
+   * was; call it for every change that isn't applied
+   * @note a `Cause::join` can't be undone, its sensor runs at an unknown rate;
+   * write it again instead
+   * @return false if the sensor isn't known or has moved on since
+   */
+  bool revert(const Change &change) {
+    auto *d = _find(change.addr);
+    if (d == nullptr || d->step != change.to || change.cause == Cause::join) {
+      return false;
+    }
+    d->step = change.from;
+    if (change.cause == Cause::probe) {
+      _probing = false;
+    }
+    _stats.reverts += 1;
+    return true;
+  }
+
+  /**
+   * @param on_change called as `on_change(const Change &)` for every sensor
+   * whose rate changes
+   */
+  template <typename F>
+  void update(int64_t now, const Load &load, F &&on_change) {
+    uint32_t drops = _has_drops ? load.drops - _drops : 0;
+    _has_drops     = true;
+    _drops         = load.drops;
+    auto congested = true;
+    auto cause     = Cause::drops;
+    if (drops > 0) {
+      cause = Cause::drops;
+    } else if (load.backlog > _opts.backlog_high) {
+      cause = Cause::backlog;
+    } else if (load.utilization > _opts.max_utilization) {
+      cause = Cause::radio;
+    } else {
+      congested = false;
+    }
+    if (congested) {
+      if (now - _cut >= _opts.settle_ms) {
+        _decrease(cause, now, on_change);
+      }
+      return;
+    }
+    if (load.backlog <= _opts.backlog_low && now - _changed >= _opts.hold_ms) {
+      _increase(now, on_change);
+    }
+  }
+
+  /**
+   * @return the rate of a sensor in Hz, 0 if it isn't known
+   */
+  [[nodiscard]] float rate_hz(const addr_t &addr) const {
+    for (const auto &d : _devices) {
+      if (d.used && d.addr == addr) {
+        return wit::RATES[d.step].hz;
+      }
+    }
+    return 0;
+  }
+
+  /**
+   * @brief sum of the rates of the sensors, i.e. frames per second
+   */
+  [[nodiscard]] float total_hz() const {
+    float res = 0;
+    for (const auto &d : _devices) {
+      res += d.used ? wit::RATES[d.step].hz : 0;
+    }
+    return res;
+  }
+
+  /**
+   * @brief the total rate at the last congestion, infinity if none yet
+   */
+  [[nodiscard]] float ceiling_hz() const {
+    return _ceiling_hz;
+  }
+
+  [[nodiscard]] size_t count() const {
+    size_t res = 0;
+    for (const auto &d : _devices) {
+      res += d.used ? 1 : 0;
+    }
+    return res;
+  }
+
+  /**
+   * @param fn called as `fn(const addr_t &, float rate_hz)`
+   */
+  template <typename F>
+  void for_each(F &&fn) const {
+    for (const auto &d : _devices) {
+      if (d.used) {
+        fn(d.addr, wit::RATES[d.step].hz);
+      }
+    }
+  }
+};
+}
+
+#endif // WIT_HUB_RATE_CONTROL_H
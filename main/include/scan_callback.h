@@ -5,189 +5,777 @@
 #ifndef WIT_HUB_SCAN_CALLBACK_H
 #define WIT_HUB_SCAN_CALLBACK_H
 
-#include <etl/vector.h>
-#include <etl/map.h>
 #include <etl/algorithm.h>
-#include <etl/flat_map.h>
 #include <NimBLEDevice.h>
+#include <host/ble_hs.h>
+#include <nimble/nimble_port.h>
+#include <esp_check.h>
+#include <freertos/FreeRTOS.h>
 #include "wifi_entity.h"
 #include "wit_device.h"
 #include "utils.h"
+#include "static_alloc.h"
+#include "link_policy.h"
+#include "connect_flow.h"
 
 namespace blue {
-const auto TARGET         = "WT901BLE67";
-const int MAX_DEVICE_NUM  = 12;
-const int MAX_SERVICE_NUM = 4;
-const int MAX_CHAR_NUM    = 4;
+const auto TARGET        = "WT901BLE67";
+// a link each, as many as NimBLE is configured for
+const int MAX_DEVICE_NUM = CONFIG_BT_NIMBLE_MAX_CONNECTIONS;
+static_assert(MAX_DEVICE_NUM <= radio::MAX_LINKS);
 
 // who define these UUIDs? so stupid
-const char *SERVICE_UUID = "0000ffe5-0000-1000-8000-00805f9a34fb";
-const char *READ_CHAR    = "0000ffe4-0000-1000-8000-00805f9a34fb";
-const char *WRITE_CHAR   = "0000ffe9-0000-1000-8000-00805f9a34fb";
-
-void print_services_chars(NimBLEClient &client) {
-  const auto TAG = "client";
-  auto pServices = client.getServices(true);
-  if (!pServices) {
-    ESP_LOGE(TAG, "Failed to get services");
-    return;
-  }
-  auto &services = *pServices;
-  if (services.empty()) {
-    ESP_LOGW(TAG, "No services found");
-  }
-  for (auto *pService : services) {
-    auto pChars = pService->getCharacteristics(true);
-    if (!pChars) {
-      ESP_LOGE(TAG, "Failed to get characteristics");
+// (almost the Bluetooth base UUID, but with 9a instead of 9b, so they are
+// compared as 128 bit; little endian)
+// 0000ffe5-0000-1000-8000-00805f9a34fb
+const ble_uuid128_t SERVICE_UUID = BLE_UUID128_INIT(0xfb, 0x34, 0x9a, 0x5f, 0x80, 0x00, 0x00, 0x80,
+                                                    0x00, 0x10, 0x00, 0x00, 0xe5, 0xff, 0x00, 0x00);
+// 0000ffe4-0000-1000-8000-00805f9a34fb
+const ble_uuid128_t READ_CHAR = BLE_UUID128_INIT(0xfb, 0x34, 0x9a, 0x5f, 0x80, 0x00, 0x00, 0x80,
+                                                 0x00, 0x10, 0x00, 0x00, 0xe4, 0xff, 0x00, 0x00);
+// 0000ffe9-0000-1000-8000-00805f9a34fb
+const ble_uuid128_t WRITE_CHAR = BLE_UUID128_INIT(0xfb, 0x34, 0x9a, 0x5f, 0x80, 0x00, 0x00, 0x80,
+                                                  0x00, 0x10, 0x00, 0x00, 0xe9, 0xff, 0x00, 0x00);
+const ble_uuid16_t CHR_DECLARATION = BLE_UUID16_INIT(BLE_ATT_UUID_CHARACTERISTIC);
+const ble_uuid16_t CCCD            = BLE_UUID16_INIT(BLE_GATT_DSC_CLT_CFG_UUID16);
+
+/**
+ * @brief connects to the sensors it's told about by the scan and forwards
+ * their notifications
+ *
+ * Every connection goes through a `flow::Machine`: each step is a NimBLE
+ * procedure whose completion callback, on NimBLE's host task, moves the flow
+ * on. Deadlines are a NimBLE callout on the same task, and the requests from
+ * other tasks (cancellations, writes) are posted to it, so the flows are only
+ * ever touched from there and a sensor on its way costs its `flow::Flow`
+ * rather than a task stack.
+ *
+ * @tparam Sink takes the notifications, as
+ * `on_data(const WitDevice &, const uint8_t *, size_t)`, and
+ * `on_disconnect(const addr_t &)` once a subscribed sensor is gone; both
+ * called directly from the host task
+ * @sa pipeline::HubPipeline
+ */
+template <typename Sink>
+class ScanCallback : public NimBLEScanCallbacks {
+  using addr_t = WitDevice::addr_t;
+  using machine_t = flow::Machine<ScanCallback, MAX_DEVICE_NUM>;
+  friend machine_t;
+
+  static constexpr size_t MAX_WRITE_SIZE = 64;
+  struct WriteRequest {
+    addr_t addr;
+    uint8_t length;
+    uint8_t data[MAX_WRITE_SIZE];
+  };
+
+  machine_t _machine{*this};
+  Sink *_sink = nullptr;
+  ble_npl_callout _deadline{};
+  // posted by other tasks, see `disconnect` and `toDevice`
+  utils::StaticQueue<addr_t, MAX_DEVICE_NUM> _cancels{};
+  ble_npl_event _cancel_event{};
+  // a rate change of every sensor is two writes each (unlock, RRATE)
+  utils::StaticQueue<WriteRequest, 2 * MAX_DEVICE_NUM> _writes{};
+  ble_npl_event _write_event{};
+  // the plan changed outside of the host task, see `set_rate`
+  ble_npl_event _replan_event{};
+  // per flow: our connection update is under way, and the link isn't on the
+  // current plan (the update failed or couldn't be asked for); see `update_link`
+  std::array<bool, MAX_DEVICE_NUM> _updating{};
+  std::array<bool, MAX_DEVICE_NUM> _stale{};
+  // one write in flight at a time
+  bool _writing = false;
+  WriteRequest _write{};
+  uint8_t _notify_buf[radio::MAX_MTU]{};
+
+  /**
+   * @note the policy is touched from the host task and read by `link_metrics`
+   * and `link_plan` from others, hence the mutex
+   */
+  radio::Policy _links{};
+  radio::Demand _demand{};
+  utils::StaticMutex _links_mutex{};
+
+  // the GAP and GATT callbacks get the flow and its generation when the step
+  // was started as their argument, so a completion of a flow since closed
+  // doesn't move on the next one, even on a reused connection handle; NimBLE
+  // has one host, so there is one instance to find them on
+  static inline ScanCallback *_self = nullptr;
+
+  struct Step {
+    size_t i;
+    uint8_t gen;
+  };
+
+  void *to_arg(const flow::Flow &f) const {
+    return reinterpret_cast<void *>(_machine.index_of(f) << 8 | f.gen);
+  }
+
+  static Step to_step(void *arg) {
+    auto v = reinterpret_cast<uintptr_t>(arg);
+    return Step{.i = v >> 8, .gen = static_cast<uint8_t>(v & 0xff)};
+  }
+
+  /**
+   * @param addr a `flow::addr_t` or an `addr_t`, the same bytes
+   */
+  template <typename A>
+  static radio::addr_t to_link(const A &addr) {
+    auto res = radio::addr_t{};
+    std::copy(addr.begin(), addr.end(), res.begin());
+    return res;
+  }
+
+  static flow::addr_t to_flow(const addr_t &addr) {
+    auto res = flow::addr_t{};
+    std::copy(addr.begin(), addr.end(), res.begin());
+    return res;
+  }
+
+  static addr_t to_device(const flow::addr_t &addr) {
+    auto res = addr_t{};
+    std::copy(addr.begin(), addr.end(), res.begin());
+    return res;
+  }
+
+  /**
+   * @brief run `fn(radio::Policy &)` under the lock
+   * @return what `fn` returns
+   */
+  template <typename F>
+  auto with_links(F &&fn) {
+    auto lock = utils::Lock{_links_mutex};
+    return fn(_links);
+  }
+
+  /**
+   * @brief arm the callout for the next deadline of the flows
+   */
+  void arm() {
+    auto next = _machine.next_deadline();
+    if (next == std::numeric_limits<int64_t>::max()) {
+      ble_npl_callout_stop(&_deadline);
       return;
     }
-    auto &chars = *pChars;
-    if (chars.empty()) {
-      ESP_LOGW(TAG, "No characteristics found for service %s", pService->getUUID().toString().c_str());
+    auto delay = std::max<int64_t>(0, next - utils::now_ms());
+    ble_npl_callout_reset(&_deadline, ble_npl_time_ms_to_ticks32(static_cast<uint32_t>(delay)) + 1);
+  }
+
+  /**
+   * @brief the flow of `step`, if it's still that generation and in state `s`
+   */
+  flow::Flow *flow_in(const Step &step, flow::State s) {
+    if (step.i >= MAX_DEVICE_NUM) {
+      return nullptr;
     }
-    for (auto *pChar : chars) {
-      const auto TAG = "SCAN_RESULT";
-      ESP_LOGI(TAG, "service=%s, char=%s [%s%s%s%s%s]",
-               pService->getUUID().toString().c_str(),
-               pChar->getUUID().toString().c_str(),
-               pChar->canNotify() ? "n" : "",
-               pChar->canRead() ? "r" : "",
-               pChar->canWrite() ? "w" : "",
-               pChar->canWriteNoResponse() ? "W" : "",
-               pChar->canIndicate() ? "i" : "");
+    auto &f = _machine.flow(step.i);
+    return f.gen == step.gen && f.state == s ? &f : nullptr;
+  }
+
+  void step_done(const Step &step, flow::Event e) {
+    _machine.on_event(step.i, step.gen, e, utils::now_ms());
+    arm();
+  }
+
+  static ble_gap_upd_params to_update(const radio::Params &p) {
+    return ble_gap_upd_params{
+        .itvl_min            = p.interval_min,
+        .itvl_max            = p.interval_max,
+        .latency             = p.latency,
+        .supervision_timeout = p.timeout,
+        .min_ce_len          = 0,
+        .max_ce_len          = 0,
+    };
+  }
+
+  /**
+   * @brief ask the sensor of flow `i` for `params`
+   *
+   * Only one update can be under way on a link (NimBLE says BLE_HS_EALREADY,
+   * also while the sensor's own is), so a link that can't take it now is
+   * marked stale and asked again once an update completes, see
+   * `BLE_GAP_EVENT_CONN_UPDATE`.
+   */
+  void update_link(size_t i, const ble_gap_upd_params &params) {
+    const auto &f = _machine.flow(i);
+    auto rc       = _updating[i] ? BLE_HS_EALREADY : ble_gap_update_params(f.conn, &params);
+    _updating[i]  = _updating[i] || rc == 0;
+    _stale[i]     = rc != 0;
+    if (rc != 0 && rc != BLE_HS_EALREADY) {
+      ESP_LOGW("ScanCallback::update_link", "ble_gap_update_params: %d", rc);
     }
   }
-}
 
-class ScanCallback : public NimBLEScanCallbacks {
-  using addr_t       = WitDevice::addr_t;
-  using device_map_t = etl::vector<WitDevice, MAX_DEVICE_NUM>;
-  device_map_t devices{};
+  /**
+   * @brief ask every connected sensor for the planned connection parameters
+   */
+  void renegotiate(const radio::Params &p) {
+    const auto TAG = "ScanCallback::renegotiate";
+    ESP_LOGI(TAG, "interval %.2f-%.2f ms, latency %u, timeout %lu ms; expected utilization %.0f%%%s",
+             p.interval_min * 1.25f, p.interval_max * 1.25f, p.latency, p.timeout * radio::TIMEOUT_UNIT_MS,
+             p.utilization * 100, p.feasible ? "" : " (over the limit)");
+    auto params = to_update(p);
+    for (size_t i = 0; i < MAX_DEVICE_NUM; ++i) {
+      const auto &f = _machine.flow(i);
+      if (f.up && flow::is_linked(f.state)) {
+        update_link(i, params);
+      }
+    }
+  }
 
-public:
-  std::function<void(WitDevice &device, uint8_t *, size_t)> on_data = nullptr;
-  void onResult(NimBLEAdvertisedDevice *advertisedDevice) override {
-    const auto TAG = "ScanCallback::onResult";
-    auto name      = advertisedDevice->getName();
+  /**
+   * @brief record what the link of `f` agreed to, as NimBLE has it
+   */
+  void refresh_link(const flow::Flow &f) {
+    auto desc = ble_gap_conn_desc{};
+    if (!f.up || ble_gap_conn_find(f.conn, &desc) != 0) {
+      return;
+    }
+    auto [changed, p] = with_links([&](radio::Policy &links) {
+      const auto *prev = links.agreed(to_link(f.addr));
+      auto agreed      = radio::Agreed{
+               .mtu = ble_att_mtu(f.conn),
+               // the data length isn't reported back, it's what was asked for
+               .tx_octets = prev == nullptr ? radio::DEFAULT_TX_OCTETS : prev->tx_octets,
+               .interval  = desc.conn_itvl,
+               .latency   = desc.conn_latency,
+               .timeout   = desc.supervision_timeout,
+      };
+      auto changed = links.on_agreed(to_link(f.addr), agreed);
+      return std::pair{changed, links.params()};
+    });
+    if (changed) {
+      renegotiate(p);
+    }
+  }
 
-    if (!name.empty()) {
-      ESP_LOGI(TAG, "name=%s; addr=%s; rssi=%d", name.c_str(), advertisedDevice->getAddress().toString().c_str(), advertisedDevice->getRSSI());
+  /******** flow::Machine driver ********/
+
+  int start_connect(const flow::Flow &f, uint32_t timeout_ms) {
+    const auto TAG = "ScanCallback::start_connect";
+    // plan with the new link in, and connect with the parameters the others
+    // are (about to be) on
+    auto [changed, p] = with_links([&](radio::Policy &links) {
+      auto changed = links.join(to_link(f.addr), _demand);
+      return std::pair{changed, links.params()};
+    });
+    if (changed) {
+      renegotiate(p);
     }
-    struct ConnectTaskParam {
-      TaskHandle_t task_handle;
-      std::function<void()> task;
+    auto params = ble_gap_conn_params{
+        .scan_itvl           = 16,
+        .scan_window         = 16,
+        .itvl_min            = p.interval_min,
+        .itvl_max            = p.interval_max,
+        .latency             = p.latency,
+        .supervision_timeout = p.timeout,
+        .min_ce_len          = 0,
+        .max_ce_len          = 0,
     };
+    auto peer = ble_addr_t{.type = f.addr_type};
+    std::copy(f.addr.begin(), f.addr.end(), peer.val);
+    uint8_t own_addr_type = BLE_OWN_ADDR_PUBLIC;
+    ble_hs_id_infer_auto(0, &own_addr_type);
+    // the connection keeps the callback, and with it the generation, for life
+    auto rc = ble_gap_connect(own_addr_type, &peer, timeout_ms, &params, gap_event, to_arg(f));
+    if (rc == BLE_HS_EBUSY) {
+      // still scanning; the scan loop starts it again
+      NimBLEDevice::getScan()->stop();
+      rc = ble_gap_connect(own_addr_type, &peer, timeout_ms, &params, gap_event, to_arg(f));
+    }
+    if (rc != 0) {
+      ESP_LOGE(TAG, "ble_gap_connect: %d", rc);
+    }
+    return rc;
+  }
 
-    if (name == TARGET) {
-      auto &self          = *this;
-      auto nimble_address = advertisedDevice->getAddress();
-      auto addr_native    = nimble_address.getNative();
-      auto addr           = addr_t{};
-      std::copy(addr_native, addr_native + WitDevice::ADDR_SIZE, addr.begin());
-      ESP_LOGI(TAG, "try to connect to %s (%s)", name.c_str(), nimble_address.toString().c_str());
-      // for some reason the connection would block the scan callback for a long time
-      // I have to create a new thread to do the connection
-      auto connect_task = [name, addr, nimble_address, &self]() {
-        const auto TAG = "connect";
-        auto &devices  = self.devices;
-        if (name == TARGET) {
-          NimBLEClient *pClient = nullptr;
-          auto found            = etl::find_if(devices.begin(), devices.end(), [&addr](const auto &device) {
-            return device.addr == addr;
+  int cancel_connect(const flow::Flow &) {
+    return ble_gap_conn_cancel();
+  }
+
+  int exchange_mtu(const flow::Flow &f) {
+    return ble_gattc_exchange_mtu(f.conn, on_mtu, to_arg(f));
+  }
+
+  int discover_services(const flow::Flow &f) {
+    return ble_gattc_disc_svc_by_uuid(f.conn, &SERVICE_UUID.u, on_service, to_arg(f));
+  }
+
+  int discover_chars(const flow::Flow &f) {
+    return ble_gattc_disc_all_chrs(f.conn, f.service_start, f.service_end, on_chr, to_arg(f));
+  }
+
+  int discover_dscs(const flow::Flow &f) {
+    return ble_gattc_disc_all_dscs(f.conn, f.read_handle, f.service_end, on_dsc, to_arg(f));
+  }
+
+  int subscribe(const flow::Flow &f) {
+    static constexpr uint8_t NOTIFY[] = {0x01, 0x00};
+    return ble_gattc_write_flat(f.conn, f.cccd_handle, NOTIFY, sizeof(NOTIFY), on_subscribed, to_arg(f));
+  }
+
+  int terminate(const flow::Flow &f) {
+    return ble_gap_terminate(f.conn, BLE_ERR_REM_USER_CONN_TERM);
+  }
+
+  void on_ready(const flow::Flow &f) {
+    const auto TAG = "ScanCallback::on_ready";
+    refresh_link(f);
+    auto agreed = with_links([&](radio::Policy &links) {
+      const auto *agreed = links.agreed(to_link(f.addr));
+      return agreed == nullptr ? radio::Agreed{} : *agreed;
+    });
+    char addr_str[WitDevice::ADDR_SIZE * 2 + 1];
+    utils::sprintHex(addr_str, sizeof(addr_str), f.addr.data(), f.addr.size());
+    ESP_LOGI(TAG, "%s: mtu %u, data length %u, interval %.2f ms, latency %u, timeout %lu ms",
+             addr_str, agreed.mtu, agreed.tx_octets, agreed.interval * 1.25f, agreed.latency,
+             agreed.timeout * radio::TIMEOUT_UNIT_MS);
+    if (on_connection != nullptr) {
+      on_connection(to_device(f.addr), true);
+    }
+  }
+
+  void on_closed(const flow::Flow &f, flow::Reason reason) {
+    char addr_str[WitDevice::ADDR_SIZE * 2 + 1];
+    utils::sprintHex(addr_str, sizeof(addr_str), f.addr.data(), f.addr.size());
+    ESP_LOGW("ScanCallback::on_closed", "%s: %s", addr_str, flow::to_str(reason));
+    auto [changed, p] = with_links([&](radio::Policy &links) {
+      auto changed = links.leave(to_link(f.addr));
+      return std::pair{changed, links.params()};
+    });
+    if (changed) {
+      renegotiate(p);
+    }
+    if (!f.subscribed) {
+      return;
+    }
+    _sink->on_disconnect(to_device(f.addr));
+    if (on_connection != nullptr) {
+      on_connection(to_device(f.addr), false);
+    }
+  }
+
+  /******** NimBLE callbacks, on the host task ********/
+
+  static int gap_event(ble_gap_event *event, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    switch (event->type) {
+      case BLE_GAP_EVENT_CONNECT: {
+        if (event->connect.status != 0) {
+          self.step_done(step, flow::Event::connect_failed);
+          return 0;
+        }
+        auto *fp = self.flow_in(step, flow::State::connecting);
+        if (fp == nullptr) {
+          fp = self.flow_in(step, flow::State::cancelling);
+        }
+        if (fp == nullptr) {
+          // an attempt given up on that completed anyway; nobody waits for it
+          ESP_LOGW("ScanCallback::gap_event", "connected after the attempt was closed; terminating");
+          ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+          self.step_done(step, flow::Event::connected);
+          return 0;
+        }
+        auto &f           = *fp;
+        auto i            = step.i;
+        f.conn            = event->connect.conn_handle;
+        self._updating[i] = false;
+        self._stale[i]    = false;
+        // the data length isn't negotiated like the MTU; ask the controller,
+        // it settles with the sensor
+        auto tx_octets = self.with_links([](radio::Policy &links) { return links.params().tx_octets; });
+        if (ble_gap_set_data_len(f.conn, tx_octets, (tx_octets + 14) * 8) == 0) {
+          auto [changed, p] = self.with_links([&](radio::Policy &links) {
+            const auto *prev = links.agreed(to_link(f.addr));
+            auto agreed      = prev == nullptr ? radio::Agreed{} : *prev;
+            agreed.tx_octets = tx_octets;
+            auto changed     = links.on_agreed(to_link(f.addr), agreed);
+            return std::pair{changed, links.params()};
           });
-          if (found != devices.end()) {
-            ESP_LOGW(TAG, "device already exists");
-            pClient = found->client;
-          } else {
-            ESP_LOGI(TAG, "device not found, creating a new one");
-            pClient     = NimBLEDevice::createClient();
-            auto device = WitDevice{.addr = addr, .client = pClient};
-            devices.emplace_back(std::move(device));
-            // might be race condition here
-            found = &devices.back();
-          }
-          auto &device = *found;
-          auto &client = *pClient;
-          if (client.isConnected()) {
-            ESP_LOGW(TAG, "client is already connected");
-            return;
-          }
-          auto ok = client.connect(nimble_address);
-          if (!ok) {
-            ESP_LOGE(TAG, "Failed to connect to the device");
-            return;
-          }
-          print_services_chars(client);
-          auto pService = client.getService(NimBLEUUID{SERVICE_UUID});
-          if (!pService) {
-            ESP_LOGE(TAG, "failed to get service");
-            return;
-          }
-          device.service = pService;
-          auto pReadChar = pService->getCharacteristic(NimBLEUUID{READ_CHAR});
-          if (!pReadChar) {
-            ESP_LOGE(TAG, "failed to get read char");
-            return;
+          if (changed) {
+            self.renegotiate(p);
           }
-          device.read_char = pReadChar;
-          auto pWriteChar =
-              pService->getCharacteristic(NimBLEUUID{WRITE_CHAR});
-          if (!pWriteChar) {
-            ESP_LOGE(TAG, "failed to get write char");
-            return;
-          }
-          device.write_char = pWriteChar;
-
-          auto on_notify = [&self, &device](NimBLERemoteCharacteristic *pChar, uint8_t *pData, size_t length, bool isNotify) {
-            const auto TAG = "on_notify";
-            ESP_LOGD(TAG, "%s", utils::toHex(pData, length).c_str());
-            if (self.on_data != nullptr) {
-              self.on_data(device, pData, length);
-            }
-          };
-          ok = device.read_char->subscribe(true, on_notify);
-          if (!ok) {
-            ESP_LOGE(TAG, "failed to subscribe");
+        }
+        self.step_done(step, flow::Event::connected);
+        return 0;
+      }
+      case BLE_GAP_EVENT_DISCONNECT:
+        ESP_LOGW("ScanCallback::gap_event", "disconnected, reason=%d", event->disconnect.reason);
+        self.step_done(step, flow::Event::disconnected);
+        return 0;
+      case BLE_GAP_EVENT_NOTIFY_RX: {
+        auto conn = event->notify_rx.conn_handle;
+        if (step.i >= MAX_DEVICE_NUM) {
+          return 0;
+        }
+        const auto *f = &self._machine.flow(step.i);
+        if (f->gen != step.gen || event->notify_rx.attr_handle != f->read_handle) {
+          return 0;
+        }
+        uint16_t length = 0;
+        if (ble_hs_mbuf_to_flat(event->notify_rx.om, self._notify_buf, sizeof(self._notify_buf), &length) != 0) {
+          return 0;
+        }
+        auto device = WitDevice{.addr = to_device(f->addr), .conn_handle = conn};
+        self._sink->on_data(device, self._notify_buf, length);
+        return 0;
+      }
+      case BLE_GAP_EVENT_CONN_UPDATE: {
+        auto i = step.i;
+        if (i >= MAX_DEVICE_NUM || self._machine.flow(i).gen != step.gen) {
+          return 0;
+        }
+        self._updating[i] = false;
+        if (event->conn_update.status == 0) {
+          self.refresh_link(self._machine.flow(i));
+        } else {
+          // asked again with the next update of another link, rather than
+          // right away from a sensor that just refused
+          self._stale[i] = true;
+        }
+        // the links the plan didn't get to, this one included unless it failed
+        auto params = to_update(self.with_links([](radio::Policy &links) { return links.params(); }));
+        for (size_t j = 0; j < MAX_DEVICE_NUM; ++j) {
+          const auto &f = self._machine.flow(j);
+          auto retry    = j != i || event->conn_update.status == 0;
+          if (retry && self._stale[j] && !self._updating[j] && f.up && flow::is_linked(f.state)) {
+            self.update_link(j, params);
           }
         }
-      };
-      auto param = new ConnectTaskParam{
-          .task_handle = nullptr,
-          .task        = connect_task,
-      };
-      xTaskCreate([](void *param) {
-        auto &p = *static_cast<ConnectTaskParam *>(param);
-        p.task();
-        auto handle = p.task_handle;
-        delete &p;
-        ESP_LOGI("connecting", "end");
-        vTaskDelete(handle);
-      },
-                  "connect", 4096, param, 5, &param->task_handle);
+        return 0;
+      }
+      case BLE_GAP_EVENT_CONN_UPDATE_REQ:
+      case BLE_GAP_EVENT_L2CAP_UPDATE_REQ: {
+        // only take what overlaps the plan, to keep the schedule of the other links
+        const auto *peer = event->conn_update_req.peer_params;
+        auto p           = self.with_links([](radio::Policy &links) { return links.params(); });
+        auto ok          = peer->itvl_max >= p.interval_min && peer->itvl_min <= p.interval_max;
+        ESP_LOGI("ScanCallback::gap_event", "update request, interval %.2f-%.2f ms, latency %u: %s",
+                 peer->itvl_min * 1.25f, peer->itvl_max * 1.25f, peer->latency, ok ? "accepted" : "rejected");
+        return ok ? 0 : BLE_ERR_CONN_PARMS;
+      }
+      default:
+        return 0;
+    }
+  }
+
+  static int on_mtu(uint16_t, const ble_gatt_error *error, uint16_t mtu, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    if (self.flow_in(step, flow::State::exchanging_mtu) == nullptr) {
+      return 0;
+    }
+    if (error->status != 0) {
+      // not fatal, the link stays at the default MTU
+      ESP_LOGW("ScanCallback::on_mtu", "MTU exchange failed: %d", error->status);
+    }
+    self.step_done(step, flow::Event::done);
+    return 0;
+  }
+
+  static int on_service(uint16_t, const ble_gatt_error *error, const ble_gatt_svc *service, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    auto *f    = self.flow_in(step, flow::State::discovering_services);
+    if (f == nullptr) {
+      return 0;
+    }
+    if (error->status == 0) {
+      f->service_start = service->start_handle;
+      f->service_end   = service->end_handle;
+      return 0;
+    }
+    auto ok = error->status == BLE_HS_EDONE && f->service_start != 0;
+    self.step_done(step, ok ? flow::Event::done : flow::Event::failed);
+    return 0;
+  }
+
+  static int on_chr(uint16_t, const ble_gatt_error *error, const ble_gatt_chr *chr, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    auto *f    = self.flow_in(step, flow::State::discovering_chars);
+    if (f == nullptr) {
+      return 0;
+    }
+    if (error->status == 0) {
+      if (ble_uuid_cmp(&chr->uuid.u, &READ_CHAR.u) == 0) {
+        f->read_handle = chr->val_handle;
+      } else if (ble_uuid_cmp(&chr->uuid.u, &WRITE_CHAR.u) == 0) {
+        f->write_handle = chr->val_handle;
+      }
+      return 0;
+    }
+    auto ok = error->status == BLE_HS_EDONE && f->read_handle != 0 && f->write_handle != 0;
+    self.step_done(step, ok ? flow::Event::done : flow::Event::failed);
+    return 0;
+  }
+
+  static int on_dsc(uint16_t, const ble_gatt_error *error, uint16_t, const ble_gatt_dsc *dsc, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    auto *f    = self.flow_in(step, flow::State::discovering_dscs);
+    if (f == nullptr) {
+      return 0;
+    }
+    if (error->status == 0) {
+      // the range runs to the end of the service; the CCCD of the read
+      // characteristic is the first one before the next characteristic
+      if (f->cccd_handle == 0) {
+        if (ble_uuid_cmp(&dsc->uuid.u, &CHR_DECLARATION.u) == 0) {
+          f->cccd_handle = flow::NO_CONN;
+        } else if (ble_uuid_cmp(&dsc->uuid.u, &CCCD.u) == 0) {
+          f->cccd_handle = dsc->handle;
+        }
+      }
+      return 0;
+    }
+    auto ok = error->status == BLE_HS_EDONE && f->cccd_handle != 0 && f->cccd_handle != flow::NO_CONN;
+    self.step_done(step, ok ? flow::Event::done : flow::Event::failed);
+    return 0;
+  }
+
+  static int on_subscribed(uint16_t, const ble_gatt_error *error, ble_gatt_attr *, void *arg) {
+    auto &self = *_self;
+    auto step  = to_step(arg);
+    if (self.flow_in(step, flow::State::subscribing) == nullptr) {
+      return 0;
+    }
+    self.step_done(step, error->status == 0 ? flow::Event::done : flow::Event::failed);
+    return 0;
+  }
+
+  static void on_deadline(ble_npl_event *ev) {
+    auto &self = *static_cast<ScanCallback *>(ble_npl_event_get_arg(ev));
+    self._machine.tick(utils::now_ms());
+    self.arm();
+  }
+
+  static void on_cancel(ble_npl_event *ev) {
+    auto &self = *static_cast<ScanCallback *>(ble_npl_event_get_arg(ev));
+    auto addr  = addr_t{};
+    while (self._cancels.receive(addr, 0)) {
+      self._machine.cancel(to_flow(addr), utils::now_ms());
+    }
+    self.arm();
+  }
+
+  /**
+   * @brief start the next queued write, if none is in flight
+   */
+  void next_write() {
+    const auto TAG = "ScanCallback::write";
+    while (!_writing && _writes.receive(_write, 0)) {
+      auto i = _machine.find(to_flow(_write.addr));
+      if (i == MAX_DEVICE_NUM || _machine.flow(i).state != flow::State::ready) {
+        ESP_LOGE(TAG, "device not ready");
+        continue;
+      }
+      const auto &f = _machine.flow(i);
+      auto rc       = ble_gattc_write_flat(f.conn, f.write_handle, _write.data, _write.length, on_written, this);
+      if (rc != 0) {
+        ESP_LOGE(TAG, "failed to write: %d", rc);
+        continue;
+      }
+      _writing = true;
+    }
+  }
+
+  static void on_replan(ble_npl_event *ev) {
+    auto &self = *static_cast<ScanCallback *>(ble_npl_event_get_arg(ev));
+    self.renegotiate(self.with_links([](radio::Policy &links) { return links.params(); }));
+  }
+
+  static void on_write(ble_npl_event *ev) {
+    static_cast<ScanCallback *>(ble_npl_event_get_arg(ev))->next_write();
+  }
+
+  static int on_written(uint16_t conn, const ble_gatt_error *error, ble_gatt_attr *, void *arg) {
+    auto &self = *static_cast<ScanCallback *>(arg);
+    if (error->status != 0) {
+      ESP_LOGE("ScanCallback::write", "failed to write: %d", error->status);
+    }
+    self._writing = false;
+    self.next_write();
+    return 0;
+  }
+
+public:
+  /**
+   * @brief decide whether to connect to an advertising sensor; connect to all
+   * of them if not set
+   */
+  std::function<bool(const addr_t &addr, int rssi)> should_connect = nullptr;
+  /**
+   * @brief a sensor is subscribed to (`true`) or got disconnected (`false`)
+   * @note called from NimBLE's host task
+   */
+  std::function<void(const addr_t &addr, bool connected)> on_connection = nullptr;
+
+  /**
+   * @brief set up the deadlines and the queues of the requests from other tasks
+   * @param sink takes the notifications; must outlive the callback
+   * @param flow_opts timeouts of the connection flow
+   * @param link_opts what to negotiate with the sensors; see `radio::Policy`
+   * @param demand what a sensor is expected to send
+   * @note after `NimBLEDevice::init`
+   */
+  esp_err_t begin(Sink &sink, const flow::Options &flow_opts = {}, const radio::Options &link_opts = {},
+                  const radio::Demand &demand = {}) {
+    const auto TAG = "ScanCallback::begin";
+    ESP_RETURN_ON_FALSE(_self == nullptr, ESP_ERR_INVALID_STATE, TAG, "Already begun");
+    ESP_RETURN_ON_ERROR(_links_mutex.init(), TAG, "Failed to create mutex");
+    _self = this;
+    _sink = &sink;
+    _machine.set_options(flow_opts);
+    _links.reset(link_opts);
+    _demand = demand;
+    ESP_RETURN_ON_FALSE(NimBLEDevice::setMTU(link_opts.mtu) == 0, ESP_ERR_INVALID_ARG, TAG, "Failed to set MTU");
+    ESP_RETURN_ON_ERROR(_cancels.init("cancel_queue"), TAG, "Failed to create cancel queue");
+    ESP_RETURN_ON_ERROR(_writes.init("write_queue"), TAG, "Failed to create write queue");
+    auto *queue = nimble_port_get_dflt_eventq();
+    ble_npl_callout_init(&_deadline, queue, on_deadline, this);
+    ble_npl_event_init(&_cancel_event, on_cancel, this);
+    ble_npl_event_init(&_write_event, on_write, this);
+    ble_npl_event_init(&_replan_event, on_replan, this);
+    utils::budget::add("connect_flows", sizeof(_machine));
+    utils::budget::add("link_policy", sizeof(_links));
+    return ESP_OK;
+  }
+
+  void onResult(NimBLEAdvertisedDevice *advertisedDevice) override {
+    const auto TAG      = "ScanCallback::onResult";
+    const auto &name    = advertisedDevice->getName();
+    auto nimble_address = advertisedDevice->getAddress();
+    const auto *native  = nimble_address.getNative();
+    // NimBLEAddress::toString allocates
+    char addr_str[WitDevice::ADDR_SIZE * 2 + 1];
+    utils::sprintHex(addr_str, sizeof(addr_str), native, WitDevice::ADDR_SIZE);
+
+    if (!name.empty()) {
+      ESP_LOGI(TAG, "name=%s; addr=%s; rssi=%d", name.c_str(), addr_str, advertisedDevice->getRSSI());
+    }
+
+    if (name == TARGET) {
+      auto addr = addr_t{};
+      std::copy(native, native + WitDevice::ADDR_SIZE, addr.begin());
+      if (should_connect != nullptr && !should_connect(addr, advertisedDevice->getRSSI())) {
+        ESP_LOGI(TAG, "%s (%s) left to another hub", name.c_str(), addr_str);
+        return;
+      }
+      // on the host task like the callbacks of the flows, so straight in
+      auto i = _machine.request(to_flow(addr), nimble_address.getType(), utils::now_ms());
+      if (i == MAX_DEVICE_NUM) {
+        ESP_LOGW(TAG, "no room for %s", addr_str);
+        return;
+      }
+      if (_machine.flow(i).state == flow::State::queued || _machine.flow(i).state == flow::State::connecting) {
+        ESP_LOGI(TAG, "%s (%s) %s", name.c_str(), addr_str, flow::to_str(_machine.flow(i).state));
+      }
+      arm();
     }
   };
-  bool toDevice(addr_t &addr, uint8_t *data, size_t length) {
-    const auto TAG = "ScanCallback::toDevice";
-    auto found     = etl::find_if(devices.begin(), devices.end(), [&addr](const auto &device) {
-      return device.addr == addr;
-    });
-    if (found == devices.end()) {
-      ESP_LOGE(TAG, "device not found");
+
+  /**
+   * @brief drop the connection to a sensor (or stop getting one), e.g. to hand
+   * it over to another hub
+   * @note any task
+   */
+  bool disconnect(const addr_t &addr) {
+    if (!_cancels.send(addr)) {
       return false;
     }
-    auto &device = *found;
-    if (!device.write_char) {
-      ESP_LOGE(TAG, "write char not found");
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &_cancel_event);
+    return true;
+  }
+
+  /**
+   * @brief queue a write to the write characteristic of a sensor; writes go
+   * out one at a time, with response
+   * @note any task; `false` if the write can't be queued, a failure later on
+   * is logged
+   */
+  bool toDevice(addr_t &addr, uint8_t *data, size_t length) {
+    const auto TAG = "ScanCallback::toDevice";
+    if (length == 0 || length > MAX_WRITE_SIZE) {
+      ESP_LOGE(TAG, "bad length %d", length);
       return false;
     }
-    auto ok = device.write_char->writeValue(data, length, true);
-    if (!ok) {
-      ESP_LOGE(TAG, "failed to write");
+    auto req   = WriteRequest{.addr = addr, .length = static_cast<uint8_t>(length)};
+    std::copy(data, data + length, req.data);
+    if (!_writes.send(req)) {
+      ESP_LOGE(TAG, "write queue full");
       return false;
     }
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &_write_event);
     return true;
   }
+
+  struct LinkMetrics {
+    radio::addr_t addr{};
+    radio::Agreed agreed{};
+  };
+  using link_metrics_t = std::array<LinkMetrics, MAX_DEVICE_NUM>;
+
+  /**
+   * @brief the parameters every link agreed to, as last reported by NimBLE
+   * @return the number of links written to `out`
+   * @note any task
+   */
+  size_t link_metrics(link_metrics_t &out) {
+    return with_links([&](radio::Policy &links) {
+      size_t n = 0;
+      links.for_each([&](const radio::addr_t &addr, const radio::Demand &, const radio::Agreed &agreed) {
+        if (n < out.size()) {
+          out[n++] = LinkMetrics{addr, agreed};
+        }
+      });
+      return n;
+    });
+  }
+
+  /**
+   * @brief the output rate of a sensor changed; its link is planned for it
+   * and the links are renegotiated if the plan changed
+   * @note any task
+   */
+  void set_rate(const addr_t &addr, float rate_hz) {
+    auto changed = with_links([&](radio::Policy &links) {
+      const auto *demand = links.demand(to_link(addr));
+      if (demand == nullptr) {
+        return false;
+      }
+      auto d    = *demand;
+      d.rate_hz = rate_hz;
+      return links.set_demand(to_link(addr), d);
+    });
+    if (changed) {
+      ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &_replan_event);
+    }
+  }
+
+  struct LinkPlan {
+    // what is asked of every link
+    radio::Params params{};
+    // expected share of the radio time of the links as they are
+    float utilization = 0;
+    // times the links were renegotiated
+    uint32_t replans = 0;
+  };
+
+  LinkPlan link_plan() {
+    return with_links([](radio::Policy &links) {
+      return LinkPlan{links.params(), links.utilization(), links.replans()};
+    });
+  }
+
+  /**
+   * @brief counters of the connection flows
+   */
+  [[nodiscard]] const flow::Stats &flow_stats() const {
+    return _machine.stats();
+  }
 };
 }
 
@@ -0,0 +1,254 @@
+//
+// Tasks (one-off or periodic), queues and mutexes that are statically
+// allocated in the static allocation mode (`CONFIG_WITHUB_STATIC_ALLOCATION`)
+// and heap allocated otherwise, plus the boot memory budget and the check for
+// heap allocations after boot.
+//
+
+#ifndef WIT_HUB_STATIC_ALLOC_H
+#define WIT_HUB_STATIC_ALLOC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+namespace utils {
+namespace budget {
+  /**
+   * @brief account `bytes` of long-lived memory to `what` in the boot report
+   * @note `what` must be a string literal (or otherwise outlive the program)
+   */
+  void add(const char *what, size_t bytes);
+
+  /**
+   * @brief log what was accounted with `add` and the state of the heap
+   */
+  void report();
+}
+
+namespace alloc_guard {
+  /**
+   * @brief mark the end of boot; every `operator new` from now on is flagged
+   * @note only effective in the static allocation mode
+   */
+  void seal();
+
+  /**
+   * @return number of allocations since `seal`
+   */
+  uint32_t count();
+
+  /**
+   * @brief log a warning if there were allocations since the last check
+   * @return allocations since the last check
+   */
+  uint32_t check();
+}
+
+/**
+ * @tparam StackSize stack depth in bytes (`StackType_t` is a byte on ESP-IDF)
+ */
+template <size_t StackSize>
+class StaticTask {
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+  StackType_t _stack[StackSize]{};
+  StaticTask_t _tcb{};
+#endif
+  TaskHandle_t _handle = nullptr;
+
+public:
+  /**
+   * @note a task may only be started once; it's expected to live forever
+   */
+  esp_err_t start(TaskFunction_t fn, const char *name, void *param, UBaseType_t priority) {
+    if (_handle != nullptr) {
+      return ESP_ERR_INVALID_STATE;
+    }
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+    _handle = xTaskCreateStatic(fn, name, StackSize, param, priority, _stack, &_tcb);
+#else
+    if (xTaskCreate(fn, name, StackSize, param, priority, &_handle) != pdPASS) {
+      _handle = nullptr;
+    }
+#endif
+    if (_handle == nullptr) {
+      return ESP_FAIL;
+    }
+    budget::add(name, StackSize);
+    return ESP_OK;
+  }
+
+  [[nodiscard]] TaskHandle_t handle() const {
+    return _handle;
+  }
+};
+
+/**
+ * @brief a task of its own that runs `fn(param)` every `period_us`, woken by
+ * an esp_timer
+ *
+ * For periodic work that may block, e.g. a publish: esp_timer callbacks all
+ * run in the one esp_timer task, and one that blocks delays every other timer.
+ * @note periods that pass while `fn` runs are folded into one run
+ */
+template <size_t StackSize>
+class PeriodicTask {
+  StaticTask<StackSize> _task{};
+  esp_timer_handle_t _timer = nullptr;
+  TaskFunction_t _fn        = nullptr;
+  void *_param              = nullptr;
+
+  static void _wake(void *arg) {
+    xTaskNotifyGive(static_cast<PeriodicTask *>(arg)->_task.handle());
+  }
+
+  static void _run(void *arg) {
+    auto &self = *static_cast<PeriodicTask *>(arg);
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      self._fn(self._param);
+    }
+  }
+
+public:
+  /**
+   * @note a task may only be started once; it's expected to live forever
+   */
+  esp_err_t start(TaskFunction_t fn, const char *name, void *param, UBaseType_t priority, uint64_t period_us) {
+    if (_timer != nullptr || fn == nullptr) {
+      return ESP_ERR_INVALID_STATE;
+    }
+    _fn    = fn;
+    _param = param;
+    if (auto err = _task.start(_run, name, this, priority); err != ESP_OK) {
+      return err;
+    }
+    esp_timer_create_args_t args{};
+    args.callback = _wake;
+    args.arg      = this;
+    args.name     = name;
+    if (auto err = esp_timer_create(&args, &_timer); err != ESP_OK) {
+      return err;
+    }
+    return esp_timer_start_periodic(_timer, period_us);
+  }
+
+  /**
+   * @brief run `fn` now rather than at the next period
+   */
+  void wake() {
+    _wake(this);
+  }
+};
+
+/**
+ * @tparam T must be trivially copyable, FreeRTOS copies it byte by byte
+ */
+template <typename T, size_t Length>
+class StaticQueue {
+  static_assert(std::is_trivially_copyable_v<T>);
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+  uint8_t _storage[Length * sizeof(T)]{};
+  StaticQueue_t _queue{};
+#endif
+  QueueHandle_t _handle = nullptr;
+
+public:
+  /**
+   * @param what name in the boot memory report
+   */
+  esp_err_t init(const char *what) {
+    if (_handle != nullptr) {
+      return ESP_ERR_INVALID_STATE;
+    }
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+    _handle = xQueueCreateStatic(Length, sizeof(T), _storage, &_queue);
+#else
+    _handle = xQueueCreate(Length, sizeof(T));
+#endif
+    if (_handle == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+    budget::add(what, Length * sizeof(T));
+    return ESP_OK;
+  }
+
+  bool send(const T &item, TickType_t timeout = 0) {
+    return _handle != nullptr && xQueueSend(_handle, &item, timeout) == pdTRUE;
+  }
+
+  bool receive(T &item, TickType_t timeout = portMAX_DELAY) {
+    return _handle != nullptr && xQueueReceive(_handle, &item, timeout) == pdTRUE;
+  }
+
+  [[nodiscard]] size_t size() const {
+    return _handle == nullptr ? 0 : uxQueueMessagesWaiting(_handle);
+  }
+
+  static constexpr size_t capacity() {
+    return Length;
+  }
+};
+
+/**
+ * @brief a FreeRTOS mutex; hold it with `Lock`
+ * @note in the budget of its owner
+ */
+class StaticMutex {
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+  StaticSemaphore_t _buffer{};
+#endif
+  SemaphoreHandle_t _handle = nullptr;
+
+public:
+  esp_err_t init() {
+    if (_handle != nullptr) {
+      return ESP_ERR_INVALID_STATE;
+    }
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+    _handle = xSemaphoreCreateMutexStatic(&_buffer);
+#else
+    _handle = xSemaphoreCreateMutex();
+#endif
+    return _handle == nullptr ? ESP_ERR_NO_MEM : ESP_OK;
+  }
+
+  [[nodiscard]] bool is_initialized() const {
+    return _handle != nullptr;
+  }
+
+  void take() {
+    xSemaphoreTake(_handle, portMAX_DELAY);
+  }
+
+  void give() {
+    xSemaphoreGive(_handle);
+  }
+};
+
+/**
+ * @brief holds a `StaticMutex` for its scope
+ */
+class Lock {
+  StaticMutex &_mutex;
+
+public:
+  explicit Lock(StaticMutex &mutex) : _mutex(mutex) {
+    _mutex.take();
+  }
+  ~Lock() {
+    _mutex.give();
+  }
+  Lock(const Lock &)            = delete;
+  Lock &operator=(const Lock &) = delete;
+};
+}
+
+#endif // WIT_HUB_STATIC_ALLOC_H
@@ -0,0 +1,173 @@
+//
+// Datagram format of the UDP stream transport.
+//
+// A datagram is a header followed by `count` records:
+//
+//   magic u16 | version u8 | flags u8 | seq u32 | ts_us u64 | count u16 | reserved u16
+//   topic_len u8 | topic | payload_len u16 | payload      (repeated `count` times)
+//
+// All integers are little endian. `seq` increases by one per datagram, so the
+// receiver finds lost and reordered datagrams from gaps. `ts_us` is the hub's
+// monotonic clock when the datagram was sent.
+//
+
+#ifndef WIT_HUB_STREAM_FRAME_H
+#define WIT_HUB_STREAM_FRAME_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace stream {
+constexpr uint16_t MAGIC          = 0x5357; // "WS"
+constexpr uint8_t VERSION         = 1;
+constexpr size_t HEADER_SIZE      = 20;
+constexpr size_t MAX_DATAGRAM     = 1472; // 1500 MTU - IPv4 - UDP
+constexpr size_t MAX_TOPIC_LENGTH = UINT8_MAX;
+
+struct Header {
+  uint8_t version = VERSION;
+  uint8_t flags   = 0;
+  uint32_t seq    = 0;
+  uint64_t ts_us  = 0;
+  uint16_t count  = 0;
+};
+
+namespace detail {
+  inline void put_le(uint8_t *p, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      p[i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+  }
+
+  inline uint64_t get_le(const uint8_t *p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+      v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return v;
+  }
+}
+
+/**
+ * @brief accumulate records into one datagram
+ * @tparam Capacity max datagram size in bytes
+ */
+template <size_t Capacity = MAX_DATAGRAM>
+class Batcher {
+  static_assert(Capacity > HEADER_SIZE);
+  std::array<uint8_t, Capacity> _buf{};
+  size_t _size    = HEADER_SIZE;
+  uint16_t _count = 0;
+
+public:
+  [[nodiscard]] bool empty() const {
+    return _count == 0;
+  }
+
+  [[nodiscard]] uint16_t count() const {
+    return _count;
+  }
+
+  [[nodiscard]] size_t size() const {
+    return _size;
+  }
+
+  static constexpr size_t record_size(size_t topic_len, size_t payload_len) {
+    return 1 + topic_len + 2 + payload_len;
+  }
+
+  /**
+   * @brief whether a record could ever fit, even into an empty datagram
+   */
+  static constexpr bool fits_empty(size_t topic_len, size_t payload_len) {
+    return topic_len <= MAX_TOPIC_LENGTH && HEADER_SIZE + record_size(topic_len, payload_len) <= Capacity;
+  }
+
+  /**
+   * @return false if the record doesn't fit into what is left of the datagram
+   */
+  bool append(std::string_view topic, const uint8_t *payload, size_t len) {
+    if (topic.size() > MAX_TOPIC_LENGTH || len > UINT16_MAX || _count == UINT16_MAX) {
+      return false;
+    }
+    auto need = record_size(topic.size(), len);
+    if (_size + need > Capacity) {
+      return false;
+    }
+    auto *p = _buf.data() + _size;
+    p[0]    = static_cast<uint8_t>(topic.size());
+    std::memcpy(p + 1, topic.data(), topic.size());
+    detail::put_le(p + 1 + topic.size(), len, 2);
+    std::memcpy(p + 3 + topic.size(), payload, len);
+    _size += need;
+    _count += 1;
+    return true;
+  }
+
+  /**
+   * @brief write the header; the datagram is `data()` with `size()` bytes
+   */
+  const uint8_t *finish(uint32_t seq, uint64_t ts_us, uint8_t flags = 0) {
+    auto *p = _buf.data();
+    detail::put_le(p, MAGIC, 2);
+    p[2] = VERSION;
+    p[3] = flags;
+    detail::put_le(p + 4, seq, 4);
+    detail::put_le(p + 8, ts_us, 8);
+    detail::put_le(p + 16, _count, 2);
+    detail::put_le(p + 18, 0, 2);
+    return p;
+  }
+
+  [[nodiscard]] const uint8_t *data() const {
+    return _buf.data();
+  }
+
+  void reset() {
+    _size  = HEADER_SIZE;
+    _count = 0;
+  }
+};
+
+/**
+ * @brief parse a datagram
+ * @param on_record `on_record(std::string_view topic, const uint8_t *payload, size_t len)`
+ * @return false if the datagram is malformed; records before the error have
+ * been delivered already
+ */
+template <typename F>
+bool parse(const uint8_t *data, size_t len, Header &header, F &&on_record) {
+  if (len < HEADER_SIZE || detail::get_le(data, 2) != MAGIC || data[2] != VERSION) {
+    return false;
+  }
+  header.version = data[2];
+  header.flags   = data[3];
+  header.seq     = static_cast<uint32_t>(detail::get_le(data + 4, 4));
+  header.ts_us   = detail::get_le(data + 8, 8);
+  header.count   = static_cast<uint16_t>(detail::get_le(data + 16, 2));
+  size_t pos     = HEADER_SIZE;
+  for (uint16_t i = 0; i < header.count; ++i) {
+    if (pos + 1 > len) {
+      return false;
+    }
+    size_t topic_len = data[pos];
+    if (pos + 1 + topic_len + 2 > len) {
+      return false;
+    }
+    auto topic       = std::string_view{reinterpret_cast<const char *>(data + pos + 1), topic_len};
+    auto payload_len = static_cast<size_t>(detail::get_le(data + pos + 1 + topic_len, 2));
+    auto payload     = pos + 3 + topic_len;
+    if (payload + payload_len > len) {
+      return false;
+    }
+    on_record(topic, data + payload, payload_len);
+    pos = payload + payload_len;
+  }
+  return true;
+}
+}
+
+#endif // WIT_HUB_STREAM_FRAME_H
@@ -0,0 +1,63 @@
+//
+// Publishes synchronized frames of all the connected sensors at a fixed rate.
+//
+
+#ifndef WIT_HUB_SYNC_STAGE_H
+#define WIT_HUB_SYNC_STAGE_H
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include "static_alloc.h"
+#include "time_align.h"
+#include "wlan_manager.h"
+
+namespace align {
+/**
+ * @brief runs an `Aligner` on the notifications of the sensors
+ *
+ * Notifications come from the BLE host task and frames are taken by a task
+ * of their own, woken at the frame rate, so the aligner is behind a mutex.
+ * Frames go to `/wit/sync/<hub>` through the stream transport, which may
+ * block, hence not from the esp_timer task.
+ * @sa time_align.h for the frame format
+ */
+class SyncStage {
+  struct Stream {
+    addr_t addr{};
+    bool used = false;
+    wit::FrameReassembler reassembler{};
+  };
+
+  Aligner _aligner{};
+  std::array<Stream, MAX_DEVICES> _streams{};
+  wlan::WlanManager *_manager = nullptr;
+  utils::StaticMutex _mutex{};
+  utils::PeriodicTask<3072> _task{};
+  // "/wit/sync/" + 12 hex chars
+  char _topic[23]{};
+  Frame _frame{};
+  uint8_t _buf[MAX_FRAME]{};
+
+  static void tick(void *arg);
+
+  Stream *_stream(const addr_t &addr);
+
+public:
+  /**
+   * @param rate_hz frames per second
+   * @param latency_ms how far behind real time frames are; see `Aligner::Options`
+   */
+  esp_err_t init(wlan::WlanManager &manager, uint32_t rate_hz, uint32_t latency_ms);
+
+  /**
+   * @brief bytes notified by a sensor; may hold partial frames
+   */
+  void on_data(const addr_t &addr, const uint8_t *data, size_t len);
+
+  void on_disconnect(const addr_t &addr);
+
+  [[nodiscard]] Aligner::Stats stats();
+};
+}
+
+#endif // WIT_HUB_SYNC_STAGE_H
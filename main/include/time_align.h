@@ -0,0 +1,559 @@
+//
+// Alignment of several sensors' samples onto the hub's timebase, into
+// synchronized frames with one interpolated sample per sensor.
+//
+// The data frames of the sensors carry no timestamp; a sensor samples at its
+// own (drifting) rate and the samples arrive in bursts, one per BLE connection
+// event. `ClockTracker` fits the arrival times against the sample count, which
+// gives a regular hub timestamp for every sample, and follows their lower
+// envelope for the drift of the sensor's clock. `Aligner` keeps the last
+// `HISTORY` timestamped samples per sensor and, for a frame at time `t`,
+// interpolates every sensor at `t - latency`.
+//
+// A synchronized frame on the wire:
+//
+//   magic u16 | version u8 | flags u8 | seq u32 | t_us u64 | count u8 | reserved [3]
+//   addr [6] | status u8 | reserved u8 | drift_ppm i16 | fields i16 [9]   (repeated `count` times)
+//
+// All integers are little endian, `t_us` is the hub's monotonic clock and the
+// fields are raw values as in `wit::DataFrame`. `drift_ppm` is `DRIFT_UNKNOWN`
+// until it is known to within `ClockTracker::Options::drift_bound_ppm`.
+//
+
+#ifndef WIT_HUB_TIME_ALIGN_H
+#define WIT_HUB_TIME_ALIGN_H
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "wit_protocol.h"
+
+namespace align {
+constexpr uint16_t MAGIC       = 0x4157; // "WA"
+constexpr uint8_t VERSION      = 2;
+constexpr size_t HEADER_SIZE   = 20;
+constexpr size_t ENTRY_SIZE    = 10 + wit::DATA_FIELDS * 2;
+constexpr size_t MAX_DEVICES   = 12;
+constexpr size_t MAX_FRAME     = HEADER_SIZE + MAX_DEVICES * ENTRY_SIZE;
+// samples kept per sensor; bounds the latency to about HISTORY - 2 sample periods
+constexpr size_t HISTORY       = 16;
+// any sensor in the frame isn't `Status::ok`
+constexpr uint8_t FLAG_PARTIAL = 0x01;
+// `Entry::drift_ppm` of a sensor whose drift isn't known well enough yet
+constexpr int16_t DRIFT_UNKNOWN = INT16_MIN;
+
+using addr_t   = std::array<uint8_t, 6>;
+using fields_t = std::array<int16_t, wit::DATA_FIELDS>;
+
+enum class Status : uint8_t {
+  // interpolated between two samples
+  ok = 0,
+  // nothing newer than the frame time yet; the latest sample is repeated
+  late = 1,
+  // no sample within `Aligner::Options::stale_us`, or disconnected
+  missing = 2,
+};
+
+/**
+ * @brief hub time of every sample of a sensor, from an exponentially weighted
+ * least squares fit of arrival time against sample count
+ *
+ * The fit averages out the bursts of the BLE connection events. A sample
+ * arriving more than `resync_us` off the fit (e.g. after samples were lost)
+ * restarts it.
+ *
+ * The fit is no good for the drift: the arrival times are quantized to the
+ * connection events, which against the sample count is a sawtooth of up to a
+ * sample period that only wraps around every `period / drift` (100 s at
+ * 100 ppm), and a fit over a shorter window follows the sawtooth. The drift
+ * comes from the lower envelope instead: no sample arrives before it was
+ * taken, and before a connection event there is one taken less than a sample
+ * period earlier, so the lowest `arrival - k * nominal period` of a block is
+ * less than a sample period off the sensor's clock (plus a constant latency).
+ * The slope between the first block and the last one is the drift, off by
+ * less than a sample period over the samples in between; see
+ * `drift_bound_ppm`.
+ * @note uses double precision; at 12 sensors x 100 Hz the cost stays far
+ * below a percent of a core even with software floating point
+ */
+class ClockTracker {
+public:
+  struct Options {
+    // samples before the fit is trusted; arrival times are used until then
+    uint32_t warmup   = 8;
+    // effective number of samples in the fit
+    uint32_t window   = 8192;
+    int64_t resync_us = 250'000;
+    // samples per block of the lower envelope
+    uint32_t envelope = 256;
+    // `Entry::drift_ppm` is `DRIFT_UNKNOWN` until `drift_bound_ppm` is below this
+    double drift_bound_ppm = 20;
+  };
+
+private:
+  Options _opts{};
+  uint32_t _count   = 0;
+  uint32_t _resyncs = 0;
+  // sample index and arrival time relative to the first sample
+  int64_t _base_us = 0;
+  double _weight   = 0;
+  double _mean_k   = 0;
+  double _mean_t   = 0;
+  double _c_kt     = 0;
+  double _c_kk     = 0;
+  // lowest `t - k * _env_period` of the current block, of the first block and
+  // of the last complete one
+  struct Low {
+    double k = 0;
+    double r = 0;
+  };
+  double _env_period   = 0;
+  uint32_t _env_n      = 0;
+  uint8_t _env_blocks  = 0;
+  Low _env_block{};
+  Low _env_first{};
+  Low _env_last{};
+
+  [[nodiscard]] double _estimate(double k) const {
+    return _mean_t + period_us() * (k - _mean_k);
+  }
+
+  void _envelope(double k, double t) {
+    auto p = nominal_period_us();
+    // the sensor's rate was changed
+    if (p != _env_period) {
+      _env_period = p;
+      _env_n      = 0;
+      _env_blocks = 0;
+    }
+    auto low = Low{k, t - k * p};
+    if (_env_n == 0 || low.r < _env_block.r) {
+      _env_block = low;
+    }
+    if (++_env_n < _opts.envelope) {
+      return;
+    }
+    (_env_blocks == 0 ? _env_first : _env_last) = _env_block;
+    _env_blocks = _env_blocks == 0 ? 1 : 2;
+    _env_n      = 0;
+  }
+
+public:
+  ClockTracker() = default;
+
+  explicit ClockTracker(const Options &opts) : _opts(opts) {}
+
+  void reset() {
+    auto resyncs = _resyncs;
+    *this        = ClockTracker{_opts};
+    _resyncs     = resyncs;
+  }
+
+  [[nodiscard]] bool locked() const {
+    return _count >= _opts.warmup;
+  }
+
+  [[nodiscard]] uint32_t resyncs() const {
+    return _resyncs;
+  }
+
+  /**
+   * @return sample period in µs, 0 until there are two samples
+   */
+  [[nodiscard]] double period_us() const {
+    return _c_kk > 0 ? _c_kt / _c_kk : 0;
+  }
+
+  /**
+   * @brief the standard output rate (WitMotion RRATE) closest to the estimate
+   */
+  [[nodiscard]] double nominal_period_us() const {
+    constexpr double PERIODS[] = {5'000, 10'000, 20'000, 50'000, 100'000, 200'000, 500'000, 1'000'000, 2'000'000, 5'000'000};
+    auto p                     = period_us();
+    auto best                  = PERIODS[0];
+    for (auto c : PERIODS) {
+      if (std::fabs(std::log(p / c)) < std::fabs(std::log(p / best))) {
+        best = c;
+      }
+    }
+    return best;
+  }
+
+  /**
+   * @return how much faster (positive) the sensor's clock runs than nominal,
+   * relative to the hub's clock, on average since the fit started; 0 until
+   * there are two blocks
+   */
+  [[nodiscard]] double drift_ppm() const {
+    if (_env_blocks < 2) {
+      return 0;
+    }
+    auto period = _env_period + (_env_last.r - _env_first.r) / (_env_last.k - _env_first.k);
+    return (_env_period / period - 1) * 1e6;
+  }
+
+  /**
+   * @return how far `drift_ppm` may be off, a sample period over the samples
+   * between the first and the last block; infinity until there are two blocks
+   */
+  [[nodiscard]] double drift_bound_ppm() const {
+    if (_env_blocks < 2) {
+      return HUGE_VAL;
+    }
+    auto period = _env_period + (_env_last.r - _env_first.r) / (_env_last.k - _env_first.k);
+    return _env_period / period / (_env_last.k - _env_first.k) * 1e6;
+  }
+
+  /**
+   * @param arrival_us hub time the sample arrived
+   * @return hub time of the sample
+   */
+  int64_t on_sample(int64_t arrival_us) {
+    if (_count == 0) {
+      _base_us = arrival_us;
+    }
+    auto t = static_cast<double>(arrival_us - _base_us);
+    auto k = static_cast<double>(_count);
+    if (locked() && std::fabs(t - _estimate(k)) > static_cast<double>(_opts.resync_us)) {
+      _resyncs += 1;
+      reset();
+      return on_sample(arrival_us);
+    }
+    // exponentially weighted mean and co-moments, Welford style
+    auto lambda = 1.0 - 1.0 / _opts.window;
+    _weight     = lambda * _weight + 1;
+    auto dk     = k - _mean_k;
+    auto dt     = t - _mean_t;
+    _mean_k += dk / _weight;
+    _mean_t += dt / _weight;
+    _c_kk = lambda * _c_kk + dk * (k - _mean_k);
+    _c_kt = lambda * _c_kt + dk * (t - _mean_t);
+    _count += 1;
+    if (!locked()) {
+      return arrival_us;
+    }
+    _envelope(k, t);
+    return _base_us + static_cast<int64_t>(std::llround(_estimate(k)));
+  }
+};
+
+struct Entry {
+  addr_t addr{};
+  Status status     = Status::missing;
+  int16_t drift_ppm = DRIFT_UNKNOWN;
+  fields_t fields{};
+};
+
+struct Frame {
+  uint8_t flags = 0;
+  uint32_t seq  = 0;
+  uint64_t t_us = 0;
+  uint8_t count = 0;
+  std::array<Entry, MAX_DEVICES> entries{};
+};
+
+namespace detail {
+  inline void put_le(uint8_t *p, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      p[i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+  }
+
+  inline uint64_t get_le(const uint8_t *p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+      v |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return v;
+  }
+}
+
+/**
+ * @return encoded size, 0 if `cap` is too small
+ */
+inline size_t encode(const Frame &frame, uint8_t *out, size_t cap) {
+  auto size = HEADER_SIZE + frame.count * ENTRY_SIZE;
+  if (frame.count > MAX_DEVICES || cap < size) {
+    return 0;
+  }
+  std::memset(out, 0, HEADER_SIZE);
+  detail::put_le(out, MAGIC, 2);
+  out[2] = VERSION;
+  out[3] = frame.flags;
+  detail::put_le(out + 4, frame.seq, 4);
+  detail::put_le(out + 8, frame.t_us, 8);
+  out[16] = frame.count;
+  auto *p = out + HEADER_SIZE;
+  for (size_t i = 0; i < frame.count; ++i, p += ENTRY_SIZE) {
+    const auto &e = frame.entries[i];
+    std::memcpy(p, e.addr.data(), e.addr.size());
+    p[6] = static_cast<uint8_t>(e.status);
+    p[7] = 0;
+    detail::put_le(p + 8, static_cast<uint16_t>(e.drift_ppm), 2);
+    for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+      detail::put_le(p + 10 + f * 2, static_cast<uint16_t>(e.fields[f]), 2);
+    }
+  }
+  return size;
+}
+
+/**
+ * @return false if the payload is not a (complete) frame
+ */
+inline bool parse(const uint8_t *data, size_t len, Frame &frame) {
+  if (len < HEADER_SIZE || detail::get_le(data, 2) != MAGIC || data[2] != VERSION) {
+    return false;
+  }
+  frame.flags = data[3];
+  frame.seq   = static_cast<uint32_t>(detail::get_le(data + 4, 4));
+  frame.t_us  = detail::get_le(data + 8, 8);
+  frame.count = data[16];
+  if (frame.count > MAX_DEVICES || len < HEADER_SIZE + frame.count * ENTRY_SIZE) {
+    return false;
+  }
+  const auto *p = data + HEADER_SIZE;
+  for (size_t i = 0; i < frame.count; ++i, p += ENTRY_SIZE) {
+    auto &e = frame.entries[i];
+    std::memcpy(e.addr.data(), p, e.addr.size());
+    e.status    = static_cast<Status>(p[6]);
+    e.drift_ppm = static_cast<int16_t>(detail::get_le(p + 8, 2));
+    for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+      e.fields[f] = wit::load_i16(p + 10 + f * 2);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief `a + (b - a) * frac`; angles take the short way around ±180°, which is
+ * the int16 wrap around of the raw value
+ */
+inline int16_t interpolate(int16_t a, int16_t b, double frac, bool angle) {
+  if (angle) {
+    auto diff = static_cast<int16_t>(static_cast<uint16_t>(b) - static_cast<uint16_t>(a));
+    auto v    = static_cast<int32_t>(a) + static_cast<int32_t>(std::lround(diff * frac));
+    return static_cast<int16_t>(static_cast<uint16_t>(v));
+  }
+  return static_cast<int16_t>(std::lround(a + (b - a) * frac));
+}
+
+/**
+ * @note not thread safe
+ */
+class Aligner {
+public:
+  struct Options {
+    // how far behind `now` frames are interpolated; has to cover the burst
+    // delay of a connection event
+    int64_t latency_us = 60'000;
+    // a sensor whose latest sample is older than this is missing; one that
+    // disconnected longer ago than this is left out of the frames
+    int64_t stale_us   = 200'000;
+    ClockTracker::Options clock{};
+  };
+
+  struct Stats {
+    uint32_t frames  = 0;
+    uint32_t late    = 0;
+    uint32_t missing = 0;
+  };
+
+private:
+  struct Sample {
+    int64_t t_us = 0;
+    fields_t fields{};
+  };
+  struct Device {
+    bool used = false;
+    addr_t addr{};
+    ClockTracker clock{};
+    std::array<Sample, HISTORY> history{};
+    // index of the oldest sample
+    size_t head          = 0;
+    size_t count         = 0;
+    int64_t last_used_us = 0;
+    // when it disconnected, -1 while connected
+    int64_t disconnected_us = -1;
+
+    [[nodiscard]] const Sample &at(size_t i) const {
+      return history[(head + i) % HISTORY];
+    }
+  };
+
+  Options _opts{};
+  std::array<Device, MAX_DEVICES> _devices{};
+  uint32_t _seq = 0;
+  Stats _stats{};
+
+  Device *_find(const addr_t &addr) {
+    for (auto &d : _devices) {
+      if (d.used && d.addr == addr) {
+        return &d;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief a free slot, or the one of the sensor without samples for the longest
+   */
+  Device *_slot(const addr_t &addr) {
+    Device *slot = nullptr;
+    for (auto &d : _devices) {
+      if (!d.used) {
+        slot = &d;
+        break;
+      }
+      if (d.count == 0 && (slot == nullptr || d.last_used_us < slot->last_used_us)) {
+        slot = &d;
+      }
+    }
+    if (slot != nullptr) {
+      *slot = Device{.used = true, .addr = addr, .clock = ClockTracker{_opts.clock}};
+    }
+    return slot;
+  }
+
+  [[nodiscard]] Entry _sample(const Device &d, int64_t t_us) const {
+    auto e = Entry{.addr = d.addr, .status = Status::missing};
+    if (d.count == 0) {
+      return e;
+    }
+    if (d.clock.drift_bound_ppm() <= _opts.clock.drift_bound_ppm) {
+      e.drift_ppm = static_cast<int16_t>(std::lround(std::fmax(-32767.0, std::fmin(32767.0, d.clock.drift_ppm()))));
+    }
+    const auto &newest = d.at(d.count - 1);
+    if (newest.t_us < t_us) {
+      if (t_us - newest.t_us <= _opts.stale_us) {
+        e.status = Status::late;
+        e.fields = newest.fields;
+      }
+      return e;
+    }
+    e.status = Status::ok;
+    // the newest sample before `t_us`; before the history starts the oldest
+    // one stands in
+    size_t i = d.count - 1;
+    while (i > 0 && d.at(i).t_us > t_us) {
+      i -= 1;
+    }
+    const auto &a = d.at(i);
+    if (a.t_us >= t_us || i + 1 >= d.count) {
+      e.fields = a.fields;
+      return e;
+    }
+    const auto &b = d.at(i + 1);
+    auto frac     = static_cast<double>(t_us - a.t_us) / static_cast<double>(b.t_us - a.t_us);
+    for (size_t f = 0; f < wit::DATA_FIELDS; ++f) {
+      e.fields[f] = interpolate(a.fields[f], b.fields[f], frac, f >= static_cast<size_t>(wit::Field::Roll));
+    }
+    return e;
+  }
+
+public:
+  Aligner() = default;
+
+  explicit Aligner(const Options &opts) : _opts(opts) {}
+
+  [[nodiscard]] const Options &options() const {
+    return _opts;
+  }
+
+  /**
+   * @brief forget every sensor and start over with `opts`
+   */
+  void reset(const Options &opts) {
+    _opts = opts;
+    for (auto &d : _devices) {
+      d.used  = false;
+      d.head  = 0;
+      d.count = 0;
+    }
+    _seq   = 0;
+    _stats = Stats{};
+  }
+
+  [[nodiscard]] const Stats &stats() const {
+    return _stats;
+  }
+
+  /**
+   * @brief add a data frame of a sensor that arrived at `arrival_us`
+   * @return false if there's no room for another sensor
+   */
+  bool push(const addr_t &addr, int64_t arrival_us, const fields_t &fields) {
+    auto *d = _find(addr);
+    if (d == nullptr) {
+      d = _slot(addr);
+      if (d == nullptr) {
+        return false;
+      }
+    }
+    auto t = d->clock.on_sample(arrival_us);
+    // a restarted fit may step backwards; keep the history monotonic
+    if (d->count > 0 && t <= d->at(d->count - 1).t_us) {
+      d->head  = 0;
+      d->count = 0;
+    }
+    if (d->count == HISTORY) {
+      d->head = (d->head + 1) % HISTORY;
+      d->count -= 1;
+    }
+    d->history[(d->head + d->count) % HISTORY] = Sample{t, fields};
+    d->count += 1;
+    d->last_used_us    = arrival_us;
+    d->disconnected_us = -1;
+    return true;
+  }
+
+  /**
+   * @brief forget the samples of a disconnected sensor; it's reported missing
+   * for `stale_us`, then left out of the frames and its slot freed
+   */
+  void disconnect(const addr_t &addr, int64_t now_us) {
+    auto *d = _find(addr);
+    if (d != nullptr) {
+      d->clock.reset();
+      d->head            = 0;
+      d->count           = 0;
+      d->disconnected_us = now_us;
+    }
+  }
+
+  [[nodiscard]] const ClockTracker *clock(const addr_t &addr) {
+    auto *d = _find(addr);
+    return d == nullptr ? nullptr : &d->clock;
+  }
+
+  /**
+   * @brief the synchronized frame for `now_us - latency_us`
+   */
+  void frame(int64_t now_us, Frame &out) {
+    auto t    = now_us - _opts.latency_us;
+    out.flags = 0;
+    out.seq   = _seq++;
+    out.t_us  = static_cast<uint64_t>(t);
+    out.count = 0;
+    for (auto &d : _devices) {
+      if (d.used && d.disconnected_us >= 0 && now_us - d.disconnected_us > _opts.stale_us) {
+        d.used = false;
+      }
+      if (!d.used) {
+        continue;
+      }
+      auto e = _sample(d, t);
+      if (e.status != Status::ok) {
+        out.flags |= FLAG_PARTIAL;
+        _stats.late += e.status == Status::late ? 1 : 0;
+        _stats.missing += e.status == Status::missing ? 1 : 0;
+      }
+      out.entries[out.count++] = e;
+    }
+    _stats.frames += 1;
+  }
+};
+}
+
+#endif // WIT_HUB_TIME_ALIGN_H
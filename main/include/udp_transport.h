@@ -0,0 +1,91 @@
+//
+// Sequence-numbered, batched UDP datagrams to a collector on the local network.
+//
+
+#ifndef WIT_HUB_UDP_TRANSPORT_H
+#define WIT_HUB_UDP_TRANSPORT_H
+
+#include <string_view>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include "stream_frame.h"
+#include "static_alloc.h"
+
+namespace wlan {
+/**
+ * @brief low latency alternative to MQTT for sensor data
+ *
+ * Records are appended to a datagram which is sent when it is full or at the
+ * latest after `flush_interval_ms`. Nothing is retransmitted; the receiver
+ * detects loss from gaps in the sequence number.
+ * @sa stream_frame.h for the datagram format
+ */
+class UdpTransport {
+  int _sock = -1;
+  sockaddr_in _collector{};
+  const char *_host           = nullptr;
+  uint16_t _port              = 0;
+  uint32_t _flush_interval_ms = 0;
+  stream::Batcher<> _batch{};
+  uint32_t _seq = 0;
+  /**
+   * @brief guards the batch and the socket; `send` is called from the BLE
+   * host task while the flush task and the event loop touch them too
+   */
+  utils::StaticMutex _mutex{};
+  utils::StaticTask<2048> _flush_task{};
+  uint32_t _sent    = 0;
+  uint32_t _dropped = 0;
+
+  esp_err_t _resolve();
+
+  /**
+   * @note must hold `_mutex`
+   */
+  esp_err_t _flush();
+
+  /**
+   * @param pvParameters a pointer to a UdpTransport instance
+   */
+  static void flush_task(void *pvParameters);
+
+public:
+  UdpTransport() = default;
+
+  /**
+   * @param host IPv4 address or host name of the collector; must outlive the transport
+   * @param flush_interval_ms 0 to send every record in its own datagram
+   */
+  esp_err_t init(const char *host, uint16_t port, uint32_t flush_interval_ms);
+
+  [[nodiscard]] bool is_initialized() const {
+    return _mutex.is_initialized();
+  }
+
+  /**
+   * @brief (re)create the socket
+   * @note call it whenever the station gets a (new) IP address
+   */
+  esp_err_t open();
+
+  void close();
+
+  /**
+   * @return ESP_ERR_INVALID_STATE if the socket isn't open,
+   * ESP_ERR_INVALID_SIZE if the record can never fit into a datagram
+   */
+  esp_err_t send(std::string_view topic, const uint8_t *data, size_t len);
+
+  [[nodiscard]] uint32_t sent() const {
+    return _sent;
+  }
+
+  [[nodiscard]] uint32_t dropped() const {
+    return _dropped;
+  }
+};
+}
+
+#endif // WIT_HUB_UDP_TRANSPORT_H
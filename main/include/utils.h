@@ -6,8 +6,16 @@
 #define WIT_HUB_UTILS_H
 
 #include "string"
+#include <cstdint>
+#include <esp_timer.h>
 
 namespace utils {
+/**
+ * @brief monotonic milliseconds, the time the state machines of the hub take
+ */
+inline int64_t now_ms() {
+  return esp_timer_get_time() / 1000;
+}
 
 size_t sprintHex(char *out, size_t outSize, const uint8_t *bytes, size_t size);
 
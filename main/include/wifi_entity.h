@@ -4,31 +4,104 @@
 
 #ifndef WIT_HUB_WIFI_ENTITY_H
 #define WIT_HUB_WIFI_ENTITY_H
-#include<string>
-#include<vector>
-#include<msd/channel.hpp>
+#include <string_view>
+#include <etl/span.h>
+#include <etl/string.h>
+#include "static_alloc.h"
 
 namespace wlan {
 const auto BROKER_URL = "mqtt://weihua-iot.cn:1883";
+
+constexpr size_t MAX_TOPIC_LENGTH    = 64;
+// fits a fleet announcement (fleet::MAX_ANNOUNCE)
+constexpr size_t MAX_SUB_DATA_LENGTH = 224;
+constexpr size_t SUB_MSG_QUEUE_SIZE  = 8;
+
+using topic_t = etl::string<MAX_TOPIC_LENGTH>;
+
+/**
+ * @note doesn't own the topic or the data; they only have to stay valid during
+ * `WlanManager::publish`, which copies them
+ */
 struct MqttPubMsg {
-  std::string topic;
-  std::vector<uint8_t> data;
+  std::string_view topic;
+  etl::span<const uint8_t> data;
   int qos = 0;
   // retain flag
   int retain = 0;
+  /**
+   * @brief sensor data rather than control/metadata
+   * @note stream messages may go through the stream transport instead of MQTT
+   * @sa WlanManager::set_stream_transport
+   */
+  bool stream = false;
 };
 
+/**
+ * @note plain arrays so that it can be copied through a FreeRTOS queue;
+ * longer messages are dropped
+ */
 struct MqttSubMsg {
-  std::string topic;
-  std::vector<uint8_t> data;
+  char topic_buf[MAX_TOPIC_LENGTH];
+  size_t topic_len;
+  uint8_t data_buf[MAX_SUB_DATA_LENGTH];
+  size_t data_len;
+
+  [[nodiscard]] std::string_view topic() const {
+    return {topic_buf, topic_len};
+  }
+  [[nodiscard]] etl::span<const uint8_t> data() const {
+    return {data_buf, data_len};
+  }
 };
 
 struct AP {
-  std::string ssid;
-  std::string password;
+  etl::string<32> ssid;
+  etl::string<64> password;
+};
+
+/**
+ * @brief the last access point we got an IP from, kept in NVS
+ * @note the IP lease itself is restored by lwIP (`CONFIG_LWIP_DHCP_RESTORE_LAST_IP`)
+ */
+struct FastConnectCache {
+  static constexpr uint8_t VERSION = 1;
+  uint8_t version                  = VERSION;
+  uint8_t channel                  = 0;
+  uint8_t bssid[6]{};
+  // null terminated
+  char ssid[33]{};
+};
+
+struct ReconnectMetrics {
+  // times the station got an IP address
+  uint32_t connects = 0;
+  // connect attempts with the cached BSSID/channel that did (not) associate
+  uint32_t fast_connect_hits   = 0;
+  uint32_t fast_connect_misses = 0;
+  // times we moved to a stronger AP
+  uint32_t roams = 0;
+  // from losing the link (or boot) to the last IP/MQTT connection, -1 if not yet
+  int64_t time_to_ip_ms   = -1;
+  int64_t time_to_mqtt_ms = -1;
+};
+
+/**
+ * @brief how the sensor data gets out; what the rate control looks at
+ */
+struct PublishMetrics {
+  // stream messages the transport refused or lost while it was up
+  uint32_t failed = 0;
+  // time stream publishes spent blocked on the uplink; cumulative, wraps
+  uint32_t blocked_us = 0;
+};
+
+enum class StreamTransport {
+  mqtt,
+  udp,
 };
 
-using sub_msg_chan_t = msd::channel<MqttSubMsg>;
+using sub_msg_chan_t = utils::StaticQueue<MqttSubMsg, SUB_MSG_QUEUE_SIZE>;
 }
 
 
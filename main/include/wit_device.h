@@ -5,16 +5,17 @@
 #ifndef WIT_HUB_WIT_DEVICE_H
 #define WIT_HUB_WIT_DEVICE_H
 
+#include <cstdint>
+#include <etl/array.h>
+
 namespace blue {
 struct WitDevice {
   static const int ADDR_SIZE = 6;
   using addr_t               = etl::array<uint8_t, ADDR_SIZE>;
 
   addr_t addr{0};
-  NimBLEClient *client             = nullptr;
-  NimBLERemoteService *service           = nullptr;
-  NimBLERemoteCharacteristic *read_char  = nullptr;
-  NimBLERemoteCharacteristic *write_char = nullptr;
+  // NimBLE's handle of the connection
+  uint16_t conn_handle = 0xffff;
 };
 }
 
@@ -0,0 +1,221 @@
+//
+// WitMotion BLE 5.0 wire format.
+//
+
+#ifndef WIT_HUB_WIT_PROTOCOL_H
+#define WIT_HUB_WIT_PROTOCOL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace wit {
+/**
+ * @sa https://wit-motion.yuque.com/wumwnr/docs/gpare3
+ * @note a notification may carry one or more frames, and a frame might be
+ * split across two notifications
+ */
+constexpr uint8_t FRAME_HEADER  = 0x55;
+constexpr uint8_t FLAG_DATA     = 0x61;
+constexpr uint8_t FLAG_REGISTER = 0x71;
+constexpr size_t FRAME_SIZE     = 20;
+// acc xyz, gyro xyz, angle xyz; all int16 little endian
+constexpr size_t DATA_FIELDS = 9;
+// offset of the first field in a data frame
+constexpr size_t DATA_OFFSET = 2;
+
+enum class Field : uint8_t {
+  AccX = 0,
+  AccY,
+  AccZ,
+  GyroX,
+  GyroY,
+  GyroZ,
+  Roll,
+  Pitch,
+  Yaw,
+};
+
+// raw value * scale = physical value
+constexpr float ACC_SCALE   = 16.0f / 32768.0f;   // g
+constexpr float GYRO_SCALE  = 2000.0f / 32768.0f; // deg/s
+constexpr float ANGLE_SCALE = 180.0f / 32768.0f;  // deg
+
+constexpr float field_scale(size_t field) {
+  return field < 3 ? ACC_SCALE : (field < 6 ? GYRO_SCALE : ANGLE_SCALE);
+}
+
+inline int16_t load_i16(const uint8_t *p) {
+  return static_cast<int16_t>(static_cast<uint16_t>(p[0]) | static_cast<uint16_t>(p[1]) << 8);
+}
+
+inline bool is_frame_flag(uint8_t flag) {
+  return flag == FLAG_DATA || flag == FLAG_REGISTER;
+}
+
+/**
+ * @brief decoded data frame (0x55 0x61) in raw units
+ */
+struct DataFrame {
+  std::array<int16_t, DATA_FIELDS> fields{};
+};
+
+inline DataFrame decode_data_frame(const uint8_t *frame) {
+  auto res = DataFrame{};
+  for (size_t f = 0; f < DATA_FIELDS; ++f) {
+    res.fields[f] = load_i16(frame + DATA_OFFSET + f * 2);
+  }
+  return res;
+}
+
+/**
+ * @brief decode `count` contiguous data frames into columns (struct of arrays)
+ * @param frames `count * FRAME_SIZE` bytes, every frame must be a data frame
+ * @param cols `DATA_FIELDS` pointers, each with room for `count` values
+ * @note the loop is laid out field-major with a constant stride so that the
+ * compiler can vectorize it; keep it branch free.
+ */
+inline void decode_data_columns(const uint8_t *__restrict frames, size_t count, int16_t *const *cols) {
+  for (size_t f = 0; f < DATA_FIELDS; ++f) {
+    int16_t *__restrict out = cols[f];
+    const uint8_t *p        = frames + DATA_OFFSET + f * 2;
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = static_cast<int16_t>(p[i * FRAME_SIZE] | p[i * FRAME_SIZE + 1] << 8);
+    }
+  }
+}
+
+/**
+ * @brief register writes go to the write characteristic as
+ * `0xff 0xaa <reg> <lo> <hi>`
+ * @note a write only takes effect within 10 s of an unlock; it's lost on
+ * power off unless followed by a save, which wears the flash
+ */
+constexpr size_t COMMAND_SIZE = 5;
+using command_t               = std::array<uint8_t, COMMAND_SIZE>;
+constexpr uint8_t REG_SAVE    = 0x00;
+// output rate, see `RATES`
+constexpr uint8_t REG_RRATE   = 0x03;
+constexpr uint8_t REG_KEY     = 0x69;
+constexpr uint16_t KEY_UNLOCK = 0xb588;
+
+constexpr command_t write_register(uint8_t reg, uint16_t value) {
+  return {0xff, 0xaa, reg, static_cast<uint8_t>(value & 0xff), static_cast<uint8_t>(value >> 8)};
+}
+
+constexpr command_t UNLOCK = write_register(REG_KEY, KEY_UNLOCK);
+constexpr command_t SAVE   = write_register(REG_SAVE, 0);
+
+/**
+ * @brief an RRATE value and the output rate it stands for
+ */
+struct Rate {
+  uint8_t code;
+  float hz;
+};
+
+// slowest first; 0x0a doesn't exist and 0x0c/0x0d (single shot, off) aren't rates
+constexpr std::array<Rate, 10> RATES{{
+    {0x01, 0.1f},
+    {0x02, 0.5f},
+    {0x03, 1.0f},
+    {0x04, 2.0f},
+    {0x05, 5.0f},
+    {0x06, 10.0f},
+    {0x07, 20.0f},
+    {0x08, 50.0f},
+    {0x09, 100.0f},
+    {0x0b, 200.0f},
+}};
+
+/**
+ * @return the index in `RATES` of the fastest rate not above `hz`, the
+ * slowest one if all are
+ */
+constexpr size_t rate_index(float hz) {
+  size_t res = 0;
+  for (size_t i = 0; i < RATES.size(); ++i) {
+    if (RATES[i].hz <= hz) {
+      res = i;
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief reassemble frames from a byte stream of notifications
+ *
+ * Frames are matched by header and flag only (the BLE protocol has no
+ * checksum). Bytes that can't start a frame are skipped and counted in
+ * `dropped()`. At most one partial frame is carried between calls.
+ */
+class FrameReassembler {
+  std::array<uint8_t, FRAME_SIZE> _carry{};
+  size_t _carry_len = 0;
+  size_t _dropped   = 0;
+
+  // a partial frame may only start at a header byte followed by a known flag
+  static bool can_start(const uint8_t *p, size_t len) {
+    if (p[0] != FRAME_HEADER) {
+      return false;
+    }
+    return len < 2 || is_frame_flag(p[1]);
+  }
+
+public:
+  [[nodiscard]] size_t dropped() const {
+    return _dropped;
+  }
+
+  void reset() {
+    _carry_len = 0;
+  }
+
+  /**
+   * @param on_frame called as `on_frame(const uint8_t *frame)` with `FRAME_SIZE` bytes;
+   * the pointer is only valid during the call
+   */
+  template <typename F>
+  void feed(const uint8_t *data, size_t len, F &&on_frame) {
+    size_t i = 0;
+    if (_carry_len > 0) {
+      auto need = FRAME_SIZE - _carry_len;
+      auto n    = len < need ? len : need;
+      std::memcpy(_carry.data() + _carry_len, data, n);
+      if (_carry_len == 1 && n > 0 && !is_frame_flag(_carry[1])) {
+        // the carried header byte was noise
+        _carry_len = 0;
+        _dropped += 1;
+      } else {
+        _carry_len += n;
+        i = n;
+        if (_carry_len < FRAME_SIZE) {
+          return;
+        }
+        on_frame(static_cast<const uint8_t *>(_carry.data()));
+        _carry_len = 0;
+      }
+    }
+    while (i + FRAME_SIZE <= len) {
+      if (data[i] == FRAME_HEADER && is_frame_flag(data[i + 1])) {
+        on_frame(data + i);
+        i += FRAME_SIZE;
+      } else {
+        i += 1;
+        _dropped += 1;
+      }
+    }
+    while (i < len && !can_start(data + i, len - i)) {
+      i += 1;
+      _dropped += 1;
+    }
+    if (i < len) {
+      _carry_len = len - i;
+      std::memcpy(_carry.data(), data + i, _carry_len);
+    }
+  }
+};
+}
+
+#endif // WIT_HUB_WIT_PROTOCOL_H
@@ -5,15 +5,37 @@
 #ifndef WIT_HUB_WLAN_MANAGER_H
 #define WIT_HUB_WLAN_MANAGER_H
 
+#include <atomic>
+#include <sdkconfig.h>
 #include <esp_check.h>
 #include <mqtt_client.h>
 #include <esp_wifi.h>
+#include <esp_timer.h>
 #include <etl/optional.h>
+#include <etl/vector.h>
 #include <nvs_flash.h>
 #include "wifi_entity.h"
-#include <msd/channel.hpp>
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+#include "udp_transport.h"
+#endif
 
 namespace wlan {
+ESP_EVENT_DECLARE_BASE(WLAN_MANAGER_EVENT);
+
+enum {
+  // the backoff timer of a failed connect attempt fired
+  WLAN_MANAGER_EVENT_RETRY,
+  // `start_connect` was called
+  WLAN_MANAGER_EVENT_START,
+};
+
+constexpr size_t MAX_AP_NUM            = 4;
+constexpr uint16_t MAX_SCAN_RECORDS    = 12;
+constexpr size_t MAX_SUBSCRIBED_TOPICS = 8;
+// "/wit/hub/<hub MAC>/..." carries the state of the hub itself
+constexpr auto STATUS_TOPIC_PREFIX     = "/wit/hub/";
+constexpr size_t ADDR_HEX              = 12;
+
 // https://github.com/espressif/arduino-esp32/blob/master/libraries/WiFi/src/WiFi.h
 class WlanManager {
   /**
@@ -37,27 +59,94 @@ class WlanManager {
    * @sa https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/protocols/mqtt.html
    */
   esp_mqtt_client_handle_t mqtt_handle = nullptr;
-  etl::optional<AP> _ap                = etl::nullopt;
-  std::vector<std::string> subscribed_topics{"/wit/+/control/#"};
-  sub_msg_chan_t _sub_msg_chan{8};
-  TaskHandle_t _connect_task_handle = nullptr;
+  etl::vector<topic_t, MAX_SUBSCRIBED_TOPICS> subscribed_topics{topic_t{"/wit/+/control/#"}};
+  sub_msg_chan_t _sub_msg_chan{};
+  StreamTransport _stream_transport = StreamTransport::mqtt;
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  UdpTransport _udp{};
+#endif
+  const char *_will_topic = nullptr;
+  const uint8_t *_will    = nullptr;
+  size_t _will_len        = 0;
+
+  /**
+   * @brief what the connection flow is waiting for
+   * @note only touched from the default event loop task
+   */
+  enum class ConnectPhase {
+    idle,
+    // connecting to the cached BSSID/channel, without a scan
+    fast,
+    scanning,
+    connecting,
+    connected,
+    // scanning for a stronger AP while still connected
+    roam_scanning,
+    // disconnecting from the current AP to connect to `_target`
+    roaming,
+  };
+  struct Target {
+    size_t ap_index = 0;
+    uint8_t bssid[6]{};
+    uint8_t channel = 0;
+  };
+  etl::vector<AP, MAX_AP_NUM> _aps{};
+  ConnectPhase _phase = ConnectPhase::idle;
+  Target _target{};
+  etl::optional<FastConnectCache> _cache = etl::nullopt;
+  // failed attempts since the last time we got an IP
+  uint32_t _attempt               = 0;
+  esp_timer_handle_t _retry_timer = nullptr;
+  // when the current (re)connection started, `esp_timer_get_time`
+  int64_t _reconnect_start_us = 0;
+  bool _waiting_mqtt          = false;
+  ReconnectMetrics _metrics{};
+  // "/wit/hub/<hub MAC>/wlan"
+  char _status_topic[9 + ADDR_HEX + 5 + 1]{};
+  // `publish` is called from several tasks
+  std::atomic<uint32_t> _stream_failures{0};
+  std::atomic<uint32_t> _stream_blocked_us{0};
+  // too large for the event loop task stack
+  wifi_ap_record_t _scan_records[MAX_SCAN_RECORDS]{};
 
 private:
   esp_err_t _register_wifi_handlers();
 
   esp_err_t _register_mqtt_handlers();
 
-  static esp_err_t _connect(const AP &access_point);
+  /**
+   * @param bssid connect to this BSSID on `channel` only, skipping the scan;
+   * nullptr to let the driver pick
+   */
+  static esp_err_t _connect(const AP &access_point, const uint8_t *bssid = nullptr, uint8_t channel = 0);
 
   static esp_err_t _disconnect();
 
   esp_err_t do_subscribe();
 
+  esp_err_t _load_cache();
+
+  esp_err_t _save_cache();
+
   /**
-   * @param pvParameters a pointer to a WlanManager instance, passed by the caller of xTaskCreate
-   * @effect delete the task itself and set [WlanManager::_connect_task_handle] to nullptr
+   * @brief fast connect with the cache on the first attempt, otherwise scan
    */
-  static void connect_task(void *pvParameters);
+  void _next_attempt();
+
+  esp_err_t _start_scan(bool roam);
+
+  void _on_scan_done();
+
+  /**
+   * @brief retry after a jittered exponential backoff
+   */
+  void _schedule_retry();
+
+  /**
+   * @brief publish `_metrics` to `_status_topic`, retained
+   * @note on every MQTT connection, from the MQTT task
+   */
+  void _publish_reconnect_metrics();
 
 public:
   WlanManager() = default;
@@ -90,29 +179,89 @@ public:
    */
   esp_err_t wifi_init();
 
+  /**
+   * @note once connected, the reconnect metrics are published (retained) to
+   * `/wit/hub/<hub MAC>/wlan` as `connects=<n> fast_hits=<n> fast_misses=<n>
+   * roams=<n> time_to_ip_ms=<ms> time_to_mqtt_ms=<ms>`
+   */
   esp_err_t mqtt_init();
 
-  esp_err_t start_connect_task();
+  /**
+   * @brief the message the broker publishes for us when the connection is lost
+   * @note call it before `mqtt_init`; `topic` and `msg` must outlive the manager
+   */
+  esp_err_t set_last_will(const char *topic, const uint8_t *msg, size_t len);
+
+  /**
+   * @brief start connecting to the configured APs
+   * @note the connection flow runs on the default event loop only, so this
+   * posts an event for it to start; reconnection is driven by wifi events from
+   * then on, there is no polling task
+   */
+  esp_err_t start_connect();
 
+  /**
+   * @brief replace the configured APs with `new_ap`
+   */
   esp_err_t set_ap(AP new_ap);
 
+  /**
+   * @brief add an AP to choose from; the strongest one in range is used
+   * @return ESP_ERR_NO_MEM if there are already `MAX_AP_NUM` APs
+   */
+  esp_err_t add_ap(AP new_ap);
+
+  /**
+   * @brief the AP currently used (or last tried)
+   */
   etl::optional<AP> ap() {
-    return _ap;
+    if (_target.ap_index < _aps.size()) {
+      return _aps[_target.ap_index];
+    }
+    return etl::nullopt;
   };
 
-  esp_err_t subscribe(const std::string &topic);
 
-  esp_err_t unsubscribe(const std::string &topic);
+  /**
+   * @return ESP_ERR_NO_MEM if there are already `MAX_SUBSCRIBED_TOPICS` topics,
+   * ESP_ERR_INVALID_SIZE if the topic is longer than `MAX_TOPIC_LENGTH`
+   */
+  esp_err_t subscribe(std::string_view topic);
 
-  esp_err_t connect();
+  esp_err_t unsubscribe(std::string_view topic);
+
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  /**
+   * @brief initialize the UDP stream transport
+   * @note the socket is opened once the station has an IP address
+   * @sa UdpTransport::init
+   */
+  esp_err_t udp_init(const char *host, uint16_t port, uint32_t flush_interval_ms);
+
+  /**
+   * @brief the UDP stream transport, for the data path to send to directly
+   * @sa pipeline::UdpPublish
+   */
+  [[nodiscard]] UdpTransport &udp() {
+    return _udp;
+  }
+#endif
+
+  /**
+   * @brief select where messages with `MqttPubMsg::stream` set go
+   * @note control and metadata always go through MQTT
+   * @return ESP_ERR_INVALID_STATE if UDP is selected before `udp_init`,
+   * ESP_ERR_NOT_SUPPORTED without `CONFIG_WITHUB_STREAM_TRANSPORT_UDP`
+   */
+  esp_err_t set_stream_transport(StreamTransport transport);
+
+  [[nodiscard]] StreamTransport stream_transport() const {
+    return _stream_transport;
+  }
 
   esp_err_t publish(const MqttPubMsg &msg);
-  ;
-};
 
-struct WifiScanTaskParam {
-  wlan::WlanManager *pManager = nullptr;
-  TaskHandle_t task_handle    = nullptr;
+  [[nodiscard]] PublishMetrics publish_metrics() const;
 };
 }
 
@@ -5,16 +5,28 @@
 #include <esp_wifi.h>
 #include <esp_spi_flash.h>
 #include <etl/random.h>
-#include <msd/channel.hpp>
 #include <memory>
 #include <nvs_handle.hpp>
 #include <NimBLEDevice.h>
-#include <iostream>
 #include <utility>
-#include <sstream>
+#include <string_view>
+#include <algorithm>
 #include <charconv>
+#include <cstdio>
+#include <cstring>
 #include "scan_callback.h"
 #include "wlan_manager.h"
+#include "hub_pipeline.h"
+#include "static_alloc.h"
+#if CONFIG_WITHUB_FLEET
+#include "fleet_agent.h"
+#endif
+#if CONFIG_WITHUB_SYNC
+#include "sync_stage.h"
+#endif
+#if CONFIG_WITHUB_RATE_CONTROL
+#include "rate_agent.h"
+#endif
 
 #define stringify_literal(x)     #x
 #define stringify_expanded(x)    stringify_literal(x)
@@ -32,111 +44,257 @@
 const char *WLAN_SSID     = stringify_expanded(WLAN_AP_SSID);
 const char *WLAN_PASSWORD = stringify_expanded(WLAN_AP_PASSWORD);
 
+// `WitHub` → `Wi-Fi reconnect`; an empty SSID is unused
+constexpr std::pair<const char *, const char *> OTHER_APS[] = {
+    {CONFIG_WITHUB_WLAN_AP2_SSID, CONFIG_WITHUB_WLAN_AP2_PASSWORD},
+    {CONFIG_WITHUB_WLAN_AP3_SSID, CONFIG_WITHUB_WLAN_AP3_PASSWORD},
+    {CONFIG_WITHUB_WLAN_AP4_SSID, CONFIG_WITHUB_WLAN_AP4_PASSWORD},
+};
+static_assert(std::size(OTHER_APS) < wlan::MAX_AP_NUM);
+
 const auto BLE_NAME = "WitHub";
 
+/**
+ * @brief parse the device address out of "/wit/<addr>/control..."
+ */
+etl::optional<blue::WitDevice::addr_t> parse_topic(std::string_view topic) {
+  constexpr auto ADDR_HEX_SIZE = blue::WitDevice::ADDR_SIZE * 2;
+  // skip the leading "/" and the first level
+  auto first = topic.find('/', 1);
+  if (first == std::string_view::npos) {
+    return etl::nullopt;
+  }
+  auto addr = topic.substr(first + 1, topic.find('/', first + 1) - first - 1);
+  if (addr.size() != ADDR_HEX_SIZE) {
+    return etl::nullopt;
+  }
+  // https://stackoverflow.com/questions/55455591/hex-string-to-uint8-t-msg
+  auto addr_bytes = blue::WitDevice::addr_t{};
+  for (auto i = 0; i < blue::WitDevice::ADDR_SIZE; ++i) {
+    auto [ptr, ec] = std::from_chars(addr.data() + i * 2, addr.data() + i * 2 + 2, addr_bytes[i], 16);
+    if (ec != std::errc{}) {
+      return etl::nullopt;
+    }
+  }
+  return etl::make_optional(addr_bytes);
+}
+
+/**
+ * @brief publish the parameters a link agreed to (`radio::Agreed`) to
+ * `/wit/<addr>/link`, retained, whenever they changed
+ * @note blocks on the publish, so not from the host task
+ */
+template <typename Scan>
+void publish_links(wlan::WlanManager &manager, Scan &scan) {
+  using metrics_t = typename Scan::link_metrics_t;
+  // the last ones that got out, and those of now
+  static auto published     = metrics_t{};
+  static size_t published_n = 0;
+  static auto current       = metrics_t{};
+  auto n                    = scan.link_metrics(current);
+  size_t kept               = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const auto &m = current[i];
+    // nothing to tell until NimBLE has reported the connection
+    if (m.agreed.interval == 0) {
+      continue;
+    }
+    auto same = std::any_of(published.begin(), published.begin() + published_n, [&m](const auto &p) {
+      return p.addr == m.addr && p.agreed == m.agreed;
+    });
+    if (!same) {
+      // "/wit/" + hex address + "/link"
+      char topic[5 + blue::WitDevice::ADDR_SIZE * 2 + 5 + 1] = "/wit/";
+      utils::sprintHex(topic + 5, sizeof(topic) - 5, m.addr.data(), m.addr.size());
+      std::strcat(topic, "/link");
+      char payload[96];
+      auto len = std::snprintf(payload, sizeof(payload), "mtu=%u data_length=%u interval_ms=%.2f latency=%u timeout_ms=%lu",
+                               m.agreed.mtu, m.agreed.tx_octets, m.agreed.interval * 1.25f, m.agreed.latency,
+                               m.agreed.timeout * radio::TIMEOUT_UNIT_MS);
+      auto msg = wlan::MqttPubMsg{
+          .topic  = topic,
+          .data   = {reinterpret_cast<const uint8_t *>(payload), static_cast<size_t>(len)},
+          .retain = 1,
+      };
+      // tried again next time
+      if (manager.publish(msg) != ESP_OK) {
+        continue;
+      }
+    }
+    current[kept++] = m;
+  }
+  published   = current;
+  published_n = kept;
+}
+
 extern "C" [[noreturn]] void app_main();
 
 [[noreturn]] void app_main() {
   const auto TAG = "main";
   auto ap        = wlan::AP{WLAN_SSID, WLAN_PASSWORD};
   ESP_LOGI(TAG, "ssid=%s; password=%s;", ap.ssid.c_str(), ap.password.c_str());
-  auto manager = wlan::WlanManager();
+  // the manager holds the datagram buffer of the stream transport, which is
+  // too large for the main task stack
+  static auto manager = wlan::WlanManager();
+  utils::budget::add("wlan_manager", sizeof(manager));
   manager.set_ap(std::move(ap));
+  // other APs (or SSIDs) to roam to
+  for (const auto &[ssid, password] : OTHER_APS) {
+    if (*ssid != '\0') {
+      ESP_ERROR_CHECK(manager.add_ap(wlan::AP{ssid, password}));
+    }
+  }
   ESP_ERROR_CHECK(manager.wifi_init());
-  ESP_ERROR_CHECK(manager.start_connect_task());
+  ESP_ERROR_CHECK(manager.start_connect());
+#if CONFIG_WITHUB_FLEET
+  // sets the last will, so before the MQTT client is created
+  static auto fleet_agent = fleet::FleetAgent();
+  auto fleet_opts         = fleet::Options{};
+  fleet_opts.capacity     = CONFIG_WITHUB_FLEET_CAPACITY;
+  fleet_opts.announce_ms  = CONFIG_WITHUB_FLEET_ANNOUNCE_MS;
+  fleet_opts.lease_ms     = CONFIG_WITHUB_FLEET_LEASE_MS;
+  ESP_ERROR_CHECK(fleet_agent.init(manager, fleet_opts));
+#endif
   ESP_ERROR_CHECK(manager.mqtt_init());
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  ESP_ERROR_CHECK(manager.udp_init(CONFIG_WITHUB_UDP_COLLECTOR_HOST,
+                                   CONFIG_WITHUB_UDP_COLLECTOR_PORT,
+                                   CONFIG_WITHUB_UDP_FLUSH_INTERVAL_MS));
+  ESP_ERROR_CHECK(manager.set_stream_transport(wlan::StreamTransport::udp));
+#endif
+
+#if CONFIG_WITHUB_SYNC
+  static auto sync_stage = align::SyncStage();
+  ESP_ERROR_CHECK(sync_stage.init(manager, CONFIG_WITHUB_SYNC_RATE_HZ, CONFIG_WITHUB_SYNC_LATENCY_MS));
+#endif
+  // the stages are picked in `menuconfig`, see hub_pipeline.h
+  static auto hub_pipeline = pipeline::HubPipeline();
+#if CONFIG_WITHUB_SYNC
+  ESP_ERROR_CHECK(hub_pipeline.init(manager, sync_stage));
+#else
+  ESP_ERROR_CHECK(hub_pipeline.init(manager));
+#endif
 
   /******** Bluetooth LE init ********/
   NimBLEDevice::init(BLE_NAME);
-  auto &scan    = *NimBLEDevice::getScan();
-  auto &scan_cb = *new blue::ScanCallback();
+  auto &scan          = *NimBLEDevice::getScan();
+  static auto scan_cb = blue::ScanCallback<pipeline::HubPipeline>();
+  static_assert(pipeline::MAX_DEVICES >= blue::MAX_DEVICE_NUM);
+  utils::budget::add("scan_callback", sizeof(scan_cb));
+  auto link_opts            = radio::Options{};
+  link_opts.mtu             = CONFIG_WITHUB_LINK_MTU;
+  link_opts.tx_octets       = CONFIG_WITHUB_LINK_DATA_LENGTH;
+  link_opts.max_interval_us = CONFIG_WITHUB_LINK_MAX_INTERVAL_MS * 1000;
+  link_opts.max_utilization = CONFIG_WITHUB_LINK_MAX_UTILIZATION / 100.0f;
+  auto flow_opts            = flow::Options{};
+  flow_opts.connect_ms      = CONFIG_WITHUB_CONNECT_TIMEOUT_MS;
+  flow_opts.step_ms         = CONFIG_WITHUB_CONNECT_STEP_TIMEOUT_MS;
+  ESP_ERROR_CHECK(scan_cb.begin(hub_pipeline, flow_opts, link_opts,
+                                radio::Demand{.rate_hz = CONFIG_WITHUB_LINK_SAMPLE_RATE_HZ}));
   scan.setScanCallbacks(&scan_cb);
   scan.setInterval(1349);
   scan.setWindow(449);
   scan.setActiveScan(true);
 
   /******** Task and callbacks ********/
-  scan_cb.on_data = [&manager](const blue::WitDevice &device, uint8_t *data, size_t length) {
-    const auto TAG = "on_data";
-    auto pub_msg   = wlan::MqttPubMsg{
-          .topic = "/wit/" + utils::toHex(device.addr.data(), device.addr.size()) + "/data",
-          .data  = std::vector<uint8_t>{data, data + length},
-    };
-    ESP_LOGI(TAG, "%s (%d) to %s",
-             utils::toHex(pub_msg.data.data(), pub_msg.data.size()).c_str(),
-             pub_msg.data.size(),
-             pub_msg.topic.c_str());
-    // don't care about the result
-    auto _ = manager.publish(pub_msg);
+#if CONFIG_WITHUB_FLEET
+  static_assert(CONFIG_WITHUB_FLEET_CAPACITY <= blue::MAX_DEVICE_NUM);
+  static_assert(CONFIG_WITHUB_FLEET_CAPACITY <= CONFIG_BT_NIMBLE_MAX_CONNECTIONS);
+  scan_cb.should_connect = [](const blue::WitDevice::addr_t &addr, int rssi) {
+    auto id = fleet::addr_t{};
+    std::copy(addr.begin(), addr.end(), id.begin());
+    return fleet_agent.should_connect(id, static_cast<int8_t>(rssi));
   };
-
-  struct PollChanParam {
-    TaskHandle_t task_handle;
-    std::function<void()> task;
+  fleet_agent.on_release = [](const fleet::addr_t &id) {
+    auto addr = blue::WitDevice::addr_t{};
+    std::copy(id.begin(), id.end(), addr.begin());
+    scan_cb.disconnect(addr);
+  };
+  ESP_ERROR_CHECK(fleet_agent.start());
+#endif
+#if CONFIG_WITHUB_RATE_CONTROL
+  static_assert(CONFIG_WITHUB_RATE_MIN_HZ <= CONFIG_WITHUB_RATE_MAX_HZ);
+  static auto rate_agent = rate::RateAgent();
+  rate_agent.on_change   = [](const rate::Change &change) {
+    auto addr = blue::WitDevice::addr_t{};
+    std::copy(change.addr.begin(), change.addr.end(), addr.begin());
+    // both go through the write queue, in order; an unlock without the write
+    // that should follow it changes nothing
+    auto unlock = wit::UNLOCK;
+    auto rrate  = wit::write_register(wit::REG_RRATE, change.code());
+    if (!scan_cb.toDevice(addr, unlock.data(), unlock.size()) || !scan_cb.toDevice(addr, rrate.data(), rrate.size())) {
+      return false;
+    }
+    scan_cb.set_rate(addr, change.to_hz());
+    return true;
   };
+  rate_agent.utilization = [] { return scan_cb.link_plan().utilization; };
+  auto rate_opts            = rate::Options{};
+  rate_opts.max_utilization = CONFIG_WITHUB_LINK_MAX_UTILIZATION / 100.0f;
+  ESP_ERROR_CHECK(rate_agent.init(manager, rate_opts,
+                                  rate::Limits{.min_hz = CONFIG_WITHUB_RATE_MIN_HZ, .max_hz = CONFIG_WITHUB_RATE_MAX_HZ},
+                                  CONFIG_WITHUB_LINK_SAMPLE_RATE_HZ, CONFIG_WITHUB_RATE_PERIOD_MS));
+#endif
+#if CONFIG_WITHUB_FLEET || CONFIG_WITHUB_RATE_CONTROL
+  // `WitDevice::addr_t`, `fleet::addr_t` and `rate::addr_t` are the same bytes
+  // in the same order
+  scan_cb.on_connection = [](const blue::WitDevice::addr_t &addr, bool connected) {
+#if CONFIG_WITHUB_FLEET
+    auto id = fleet::addr_t{};
+    std::copy(addr.begin(), addr.end(), id.begin());
+    fleet_agent.set_held(id, connected);
+#endif
+#if CONFIG_WITHUB_RATE_CONTROL
+    auto sensor = rate::addr_t{};
+    std::copy(addr.begin(), addr.end(), sensor.begin());
+    rate_agent.on_connection(sensor, connected);
+#endif
+  };
+#endif
 
-  auto chan      = manager.sub_msg_chan();
-  auto poll_task = [chan, &scan_cb]() {
-    // the topic should be "/wit/<topic>/control"
-    auto TAG         = "poll_task";
-    auto parse_topic = [](const std::string &topic) -> etl::optional<etl::array<uint8_t, 6>> {
-      std::vector<std::string> tokens;
-      std::stringstream ss{topic};
-      std::string item;
-      while (std::getline(ss, item, '/')) {
-        tokens.push_back(item);
-      }
-      if (tokens.size() < 2) {
-        return etl::nullopt;
+  static auto poll_task = utils::StaticTask<4096>();
+  ESP_ERROR_CHECK(poll_task.start([](void *pvParameters) {
+    // the topic should be "/wit/<addr>/control" (or "/wit/fleet/<hub>",
+    // "/wit/<addr>/control/rate")
+    const auto TAG = "poll_task";
+    auto &chan     = *static_cast<wlan::sub_msg_chan_t *>(pvParameters);
+    auto item      = wlan::MqttSubMsg{};
+    for (;;) {
+      if (!chan.receive(item)) {
+        continue;
       }
-      auto addr = tokens[1];
-      if (addr.size() != 12) {
-        return etl::nullopt;
+      auto topic    = item.topic();
+      auto payload  = item.data();
+#if CONFIG_WITHUB_FLEET
+      if (fleet_agent.on_message(topic, payload.data(), payload.size())) {
+        continue;
       }
-      // https://stackoverflow.com/questions/55455591/hex-string-to-uint8-t-msg
-      auto addr_bytes = etl::array<uint8_t, 6>{};
-      for (auto i = 0; i < 6; ++i) {
-        auto byte_str  = addr.substr(i * 2, 2);
-        auto [ptr, ec] = std::from_chars(byte_str.data(), byte_str.data() + byte_str.size(), addr_bytes[i], 16);
-        if (ec != std::errc{}) {
-          return etl::nullopt;
-        }
+#endif
+#if CONFIG_WITHUB_RATE_CONTROL
+      if (rate_agent.on_message(topic, payload.data(), payload.size())) {
+        continue;
       }
-      return etl::make_optional(addr_bytes);
-    };
-    for (auto item : *chan) {
-      auto payload  = item.data;
-      auto addr_opt = parse_topic(item.topic);
+#endif
+      auto addr_opt = parse_topic(topic);
       if (!addr_opt.has_value()) {
-        ESP_LOGW(TAG, "invalid topic %s", item.topic.c_str());
+        ESP_LOGW(TAG, "invalid topic %.*s", static_cast<int>(topic.size()), topic.data());
         continue;
       }
       auto addr = *addr_opt;
-      auto ok   = scan_cb.toDevice(addr, payload.data(), payload.size());
+      auto ok   = scan_cb.toDevice(addr, const_cast<uint8_t *>(payload.data()), payload.size());
       if (!ok) {
-        ESP_LOGW(TAG, "%s (%d) to %s failed",
-                 utils::toHex(payload.data(), payload.size()).c_str(), payload.size(),
-                 utils::toHex(addr.data(), addr.size()).c_str());
+        char addr_str[blue::WitDevice::ADDR_SIZE * 2 + 1];
+        utils::sprintHex(addr_str, sizeof(addr_str), addr.data(), addr.size());
+        ESP_LOGW(TAG, "(%d) to %s failed", payload.size(), addr_str);
       }
     }
-  };
-
-  auto param = new PollChanParam{
-      .task_handle = nullptr,
-      .task        = poll_task,
-  };
-  xTaskCreate([](void *pvParameters) {
-    auto param = static_cast<PollChanParam *>(pvParameters);
-    auto &task = param->task;
-    task();
-    // should be unreachable
-    // just in case
-    ESP_LOGE("poll_task", "end");
-    auto handle = param->task_handle;
-    delete param;
-    vTaskDelete(handle);
   },
-              "poll_task", 4096, param, 1, &param->task_handle);
+                                  "poll_task", manager.sub_msg_chan(), 1));
+
+  utils::budget::report();
+  // everything long-lived is in place; any heap allocation from here on is a leak
+  // or a hidden cost on the data path
+  utils::alloc_guard::seal();
 
   /********* Bluetooth LE scan loop *********/
   constexpr auto scanTime = std::chrono::milliseconds(2500);
@@ -150,5 +308,7 @@ extern "C" [[noreturn]] void app_main();
       ESP_LOGW(TAG, "bad scan");
     }
     vTaskDelay(scanTotalTime.count() / portTICK_PERIOD_MS);
+    utils::alloc_guard::check();
+    publish_links(manager, scan_cb);
   }
 }
@@ -0,0 +1,117 @@
+//
+// Runs the fleet coordinator on the hub: announcements over MQTT and the
+// decisions of whether to connect to a sensor.
+//
+
+#include <cstring>
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include "fleet_agent.h"
+#include "utils.h"
+
+namespace fleet {
+static_assert(wlan::MAX_SUB_DATA_LENGTH >= MAX_ANNOUNCE, "an announcement must fit a subscription message");
+
+esp_err_t FleetAgent::init(wlan::WlanManager &manager, const Options &opts) {
+  const auto TAG = "FleetAgent::init";
+  if (_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  auto id = hub_id_t{};
+  ESP_RETURN_ON_ERROR(esp_read_mac(id.data(), ESP_MAC_WIFI_STA), TAG, "Failed to read MAC");
+  ESP_RETURN_ON_ERROR(_mutex.init(), TAG, "Failed to create mutex");
+  _manager     = &manager;
+  _coordinator = Coordinator{id, opts, utils::now_ms()};
+
+  std::strcpy(_topic, TOPIC_PREFIX);
+  utils::sprintHex(_topic + std::strlen(TOPIC_PREFIX), sizeof(_topic) - std::strlen(TOPIC_PREFIX), id.data(), id.size());
+  encode(_coordinator.offline(), _will, sizeof(_will));
+  ESP_RETURN_ON_ERROR(manager.set_last_will(_topic, _will, sizeof(_will)), TAG, "Failed to set last will");
+
+  char filter[sizeof(_topic)];
+  std::strcpy(filter, TOPIC_PREFIX);
+  std::strcat(filter, "+");
+  auto err = manager.subscribe(filter);
+  // without a client yet the topic is kept and subscribed once connected
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG, "Failed to subscribe to %s (%s)", filter, esp_err_to_name(err));
+    return err;
+  }
+  ESP_LOGI(TAG, "hub %s, capacity %d", _topic + std::strlen(TOPIC_PREFIX), opts.capacity);
+  return ESP_OK;
+}
+
+esp_err_t FleetAgent::start() {
+  const auto TAG = "FleetAgent::start";
+  if (!_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  ESP_RETURN_ON_ERROR(_announce_task.start(announce, "fleet_announce", this, 5, _coordinator.options().announce_ms * 1000ULL),
+                      TAG, "Failed to start announce task");
+  return ESP_OK;
+}
+
+void FleetAgent::announce(void *arg) {
+  const auto TAG = "FleetAgent::announce";
+  auto &self     = *static_cast<FleetAgent *>(arg);
+  auto now       = utils::now_ms();
+  auto releases  = std::array<addr_t, MAX_SENSORS>{};
+  size_t n       = 0;
+  {
+    auto lock          = utils::Lock{self._mutex};
+    self._announcement = self._coordinator.announcement(now);
+    self._coordinator.for_each_conflict(now, [&](const addr_t &addr) {
+      releases[n++] = addr;
+    });
+  }
+  // outside of the lock, since `on_release` may end up in `set_held`
+  for (size_t i = 0; i < n; ++i) {
+    ESP_LOGI(TAG, "releasing a sensor claimed by another hub");
+    if (self.on_release != nullptr) {
+      self.on_release(releases[i]);
+    }
+  }
+  auto len = encode(self._announcement, self._buf, sizeof(self._buf));
+  auto msg = wlan::MqttPubMsg{
+      .topic = self._topic,
+      .data  = {self._buf, len},
+  };
+  auto err = self._manager->publish(msg);
+  if (err != ESP_OK) {
+    // the peers still go by the last one that got out, so do we
+    ESP_LOGW(TAG, "failed to publish (%s)", esp_err_to_name(err));
+    return;
+  }
+  auto lock = utils::Lock{self._mutex};
+  self._coordinator.mark_announced(self._announcement);
+}
+
+bool FleetAgent::should_connect(const addr_t &addr, int8_t rssi) {
+  auto lock = utils::Lock{_mutex};
+  auto now  = utils::now_ms();
+  _coordinator.observe(addr, rssi, now);
+  return _coordinator.should_connect(addr, now);
+}
+
+void FleetAgent::set_held(const addr_t &addr, bool held) {
+  auto lock = utils::Lock{_mutex};
+  _coordinator.set_held(addr, held, utils::now_ms());
+}
+
+bool FleetAgent::on_message(std::string_view topic, const uint8_t *data, size_t len) {
+  if (topic.substr(0, std::strlen(TOPIC_PREFIX)) != TOPIC_PREFIX) {
+    return false;
+  }
+  auto lock = utils::Lock{_mutex};
+  if (!_coordinator.on_announcement(data, len, utils::now_ms())) {
+    ESP_LOGW("FleetAgent::on_message", "malformed announcement on %.*s", static_cast<int>(topic.size()), topic.data());
+  }
+  return true;
+}
+
+uint8_t FleetAgent::load() {
+  auto lock = utils::Lock{_mutex};
+  return _coordinator.load();
+}
+}
@@ -0,0 +1,102 @@
+//
+// The data path of the hub, composed from the `WitHub` → `Data pipeline`
+// options at compile time.
+//
+
+#include <algorithm>
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "hub_pipeline.h"
+#include "static_alloc.h"
+
+namespace pipeline {
+namespace {
+  addr_t to_sensor(const blue::WitDevice::addr_t &addr) {
+    auto res = addr_t{};
+    std::copy(addr.begin(), addr.end(), res.begin());
+    return res;
+  }
+}
+
+#if CONFIG_WITHUB_SYNC
+esp_err_t HubPipeline::init(wlan::WlanManager &manager, align::SyncStage &sync) {
+  _pipeline.stage<Sync>().init(sync);
+#else
+esp_err_t HubPipeline::init(wlan::WlanManager &manager) {
+#endif
+  const auto TAG = "HubPipeline::init";
+#if CONFIG_WITHUB_PIPELINE_BATCH
+  auto &publish = _publish;
+#else
+  auto &publish = _pipeline.stage<publish_t>();
+#endif
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  publish.init(manager.udp());
+#else
+  publish.init(manager);
+#endif
+  utils::budget::add("hub_pipeline", sizeof(*this));
+#if CONFIG_WITHUB_PIPELINE_BATCH
+  static_assert(hub_t::polled);
+  if (_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  ESP_RETURN_ON_ERROR(_mutex.init(), TAG, "Failed to create mutex");
+  // a batch waits at most half of `batch_ms` longer than it should
+  constexpr uint64_t period_us = std::max<uint32_t>(HUB_CONFIG.batch_ms * 1000 / 2, 1000);
+  ESP_RETURN_ON_ERROR(_task.start(tick, "pipeline", this, 5, period_us), TAG, "Failed to start flush task");
+#else
+  static_assert(!hub_t::polled);
+#endif
+  ESP_LOGI(TAG, "reassemble=%d decimate=%lu batch=%u bytes/%lu ms (%u bytes)", HUB_CONFIG.reassemble,
+           HUB_CONFIG.decimate, HUB_CONFIG.batch_bytes, HUB_CONFIG.batch_ms, sizeof(_pipeline));
+  return ESP_OK;
+}
+
+#if CONFIG_WITHUB_PIPELINE_BATCH
+void HubPipeline::tick(void *arg) {
+  auto &self     = *static_cast<HubPipeline *>(arg);
+  auto &outbox   = self._pipeline.stage<outbox_t>();
+  size_t held    = 0;
+  size_t dropped = 0;
+  {
+    auto lock = utils::Lock{self._mutex};
+    self._pipeline.poll(esp_timer_get_time());
+    held    = outbox.held();
+    dropped = outbox.dropped();
+  }
+  // the notifications go on into the outbox meanwhile
+  outbox.peek(held, [&](const Message &msg) { self._publish.push(msg, self._end); });
+  {
+    auto lock = utils::Lock{self._mutex};
+    outbox.pop(held);
+  }
+  if (dropped != self._dropped) {
+    ESP_LOGW("HubPipeline::tick", "outbox full, %u messages dropped", dropped - self._dropped);
+    self._dropped = dropped;
+  }
+}
+#endif
+
+void HubPipeline::on_data(const blue::WitDevice &device, const uint8_t *data, size_t len) {
+  auto chunk = Chunk{to_sensor(device.addr), data, len, esp_timer_get_time()};
+#if CONFIG_WITHUB_PIPELINE_BATCH
+  auto lock = utils::Lock{_mutex};
+  _pipeline.push(chunk);
+  // batches fill up faster than they are due
+  if (_pipeline.stage<outbox_t>().held() >= outbox_t::capacity() / 2) {
+    _task.wake();
+  }
+#else
+  _pipeline.push(chunk);
+#endif
+}
+
+void HubPipeline::on_disconnect(const addr_t &addr) {
+#if CONFIG_WITHUB_PIPELINE_BATCH
+  auto lock = utils::Lock{_mutex};
+#endif
+  _pipeline.disconnect(to_sensor(addr));
+}
+}
@@ -0,0 +1,216 @@
+//
+// Runs the output rate controller on the hub: samples the load, and writes
+// the rates it decides to the sensors.
+//
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <esp_check.h>
+#include <esp_log.h>
+#include "rate_agent.h"
+#include "utils.h"
+
+namespace rate {
+namespace {
+  constexpr auto TOPIC_PREFIX = "/wit/";
+  constexpr auto LIMITS_TOPIC = "/control/rate";
+  constexpr size_t ADDR_HEX   = 12;
+
+  /**
+   * @brief the changes of one tick: the joins since the last one, and what
+   * the controller decides
+   */
+  struct Changes {
+    std::array<Change, 2 * MAX_DEVICES> items{};
+    size_t count = 0;
+
+    void operator()(const Change &c) {
+      if (count < items.size()) {
+        items[count++] = c;
+      }
+    }
+  };
+}
+
+esp_err_t RateAgent::init(wlan::WlanManager &manager, const Options &opts, const Limits &limits, float initial_hz,
+                          uint32_t period_ms) {
+  const auto TAG = "RateAgent::init";
+  if (period_ms == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  ESP_RETURN_ON_ERROR(_mutex.init(), TAG, "Failed to create mutex");
+  _manager    = &manager;
+  _limits     = limits;
+  _initial_hz = initial_hz;
+  _period_us  = period_ms * 1000;
+  _blocked_us = manager.publish_metrics().blocked_us;
+  _controller.reset(opts);
+  utils::budget::add("rate_agent", sizeof(*this));
+
+  ESP_RETURN_ON_ERROR(_task.start(tick, "rate_control", this, 5, period_ms * 1000ULL), TAG, "Failed to start control task");
+  ESP_LOGI(TAG, "%.1f-%.1f Hz, %.1f Hz at first, every %lu ms", limits.min_hz, limits.max_hz, initial_hz, period_ms);
+  return ESP_OK;
+}
+
+Limits RateAgent::_limits_of(const addr_t &addr) const {
+  for (const auto &o : _overrides) {
+    if (o.used && o.addr == addr) {
+      return o.limits;
+    }
+  }
+  return _limits;
+}
+
+void RateAgent::_add_join(const Change &change) {
+  for (size_t i = 0; i < _join_count; ++i) {
+    if (_joins[i].addr == change.addr) {
+      _joins[i] = change;
+      return;
+    }
+  }
+  // one per connected sensor, so there is room
+  if (_join_count < _joins.size()) {
+    _joins[_join_count++] = change;
+  }
+}
+
+void RateAgent::_apply(const Change *changes, size_t n) {
+  const auto TAG = "RateAgent::change";
+  for (size_t i = 0; i < n; ++i) {
+    const auto &c = changes[i];
+    // "/wit/" + hex address + "/rate"
+    char topic[5 + ADDR_HEX + 5 + 1] = "/wit/";
+    utils::sprintHex(topic + 5, sizeof(topic) - 5, c.addr.data(), c.addr.size());
+    if (on_change != nullptr && !on_change(c)) {
+      auto lock = utils::Lock{_mutex};
+      if (c.cause == Cause::join) {
+        // unless it's gone since
+        if (_controller.rate_hz(c.addr) > 0) {
+          _add_join(c);
+        }
+      } else {
+        _controller.revert(c);
+      }
+      ESP_LOGW(TAG, "%s: %.1f -> %.1f Hz (%s) not written", topic + 5, c.from_hz(), c.to_hz(), to_str(c.cause));
+      continue;
+    }
+    ESP_LOGI(TAG, "%s: %.1f -> %.1f Hz (%s)", topic + 5, c.from_hz(), c.to_hz(), to_str(c.cause));
+    std::strcat(topic, "/rate");
+    char payload[32];
+    auto len = std::snprintf(payload, sizeof(payload), "%.1f %.1f %s", c.from_hz(), c.to_hz(), to_str(c.cause));
+    auto msg = wlan::MqttPubMsg{
+        .topic = topic,
+        .data  = {reinterpret_cast<const uint8_t *>(payload), static_cast<size_t>(len)},
+    };
+    // don't care about the result
+    auto _ = _manager->publish(msg);
+  }
+}
+
+void RateAgent::tick(void *arg) {
+  auto &self       = *static_cast<RateAgent *>(arg);
+  auto metrics     = self._manager->publish_metrics();
+  auto load        = Load{};
+  load.backlog     = static_cast<float>(metrics.blocked_us - self._blocked_us) / static_cast<float>(self._period_us);
+  load.drops       = metrics.failed;
+  self._blocked_us = metrics.blocked_us;
+  load.utilization = self.utilization != nullptr ? self.utilization() : 0;
+  auto changes     = Changes{};
+  {
+    auto lock = utils::Lock{self._mutex};
+    for (size_t i = 0; i < self._join_count; ++i) {
+      changes(self._joins[i]);
+    }
+    self._join_count = 0;
+    self._controller.update(utils::now_ms(), load, changes);
+  }
+  self._apply(changes.items.data(), changes.count);
+}
+
+void RateAgent::on_connection(const addr_t &addr, bool connected) {
+  auto lock = utils::Lock{_mutex};
+  if (!connected) {
+    _controller.leave(addr);
+    for (size_t i = 0; i < _join_count; ++i) {
+      if (_joins[i].addr == addr) {
+        _joins[i] = _joins[--_join_count];
+        break;
+      }
+    }
+    return;
+  }
+  // on the host task, which mustn't block on a publish; see `tick`
+  auto join = [this](const Change &c) { _add_join(c); };
+  if (!_controller.join(addr, _limits_of(addr), _initial_hz, utils::now_ms(), join)) {
+    ESP_LOGW("RateAgent::on_connection", "no room for another sensor");
+  }
+}
+
+bool RateAgent::on_message(std::string_view topic, const uint8_t *data, size_t len) {
+  const auto TAG = "RateAgent::on_message";
+  // "/wit/<addr>/control/rate"
+  if (topic.size() != std::strlen(TOPIC_PREFIX) + ADDR_HEX + std::strlen(LIMITS_TOPIC) ||
+      topic.substr(0, std::strlen(TOPIC_PREFIX)) != TOPIC_PREFIX ||
+      topic.substr(std::strlen(TOPIC_PREFIX) + ADDR_HEX) != LIMITS_TOPIC) {
+    return false;
+  }
+  auto hex  = topic.substr(std::strlen(TOPIC_PREFIX), ADDR_HEX);
+  auto addr = addr_t{};
+  for (size_t i = 0; i < addr.size(); ++i) {
+    auto [ptr, ec] = std::from_chars(hex.data() + i * 2, hex.data() + i * 2 + 2, addr[i], 16);
+    if (ec != std::errc{}) {
+      ESP_LOGW(TAG, "invalid address in %.*s", static_cast<int>(topic.size()), topic.data());
+      return true;
+    }
+  }
+  // "<min_hz> <max_hz>"
+  char text[32];
+  auto n = std::min(len, sizeof(text) - 1);
+  std::memcpy(text, data, n);
+  text[n]       = '\0';
+  char *min_end = nullptr;
+  char *max_end = nullptr;
+  auto limits   = Limits{};
+  limits.min_hz = std::strtof(text, &min_end);
+  limits.max_hz = std::strtof(min_end, &max_end);
+  if (min_end == text || max_end == min_end || !(limits.min_hz > 0) || !(limits.max_hz >= limits.min_hz)) {
+    ESP_LOGW(TAG, "expected \"<min_hz> <max_hz>\", got \"%s\"", text);
+    return true;
+  }
+
+  auto changes = Changes{};
+  {
+    auto lock      = utils::Lock{_mutex};
+    Override *slot = nullptr;
+    for (auto &o : _overrides) {
+      if (o.used && o.addr == addr) {
+        slot = &o;
+        break;
+      }
+      if (!o.used && slot == nullptr) {
+        slot = &o;
+      }
+    }
+    if (slot == nullptr) {
+      ESP_LOGW(TAG, "no room for the limits of another sensor");
+      return true;
+    }
+    *slot = Override{addr, true, limits};
+    _controller.set_limits(addr, limits, utils::now_ms(), changes);
+  }
+  ESP_LOGI(TAG, "%.*s: %.1f-%.1f Hz", static_cast<int>(hex.size()), hex.data(), limits.min_hz, limits.max_hz);
+  _apply(changes.items.data(), changes.count);
+  return true;
+}
+
+Stats RateAgent::stats() {
+  auto lock = utils::Lock{_mutex};
+  return _controller.stats();
+}
+}
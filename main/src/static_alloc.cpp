@@ -0,0 +1,111 @@
+//
+// Boot memory budget and the check for heap allocations after boot.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_rom_sys.h>
+#include "static_alloc.h"
+
+namespace utils {
+namespace budget {
+  namespace {
+    struct Entry {
+      const char *what;
+      size_t bytes;
+    };
+    constexpr size_t MAX_ENTRIES = 24;
+    Entry entries[MAX_ENTRIES]{};
+    size_t entry_count = 0;
+    portMUX_TYPE lock  = portMUX_INITIALIZER_UNLOCKED;
+  }
+
+  void add(const char *what, size_t bytes) {
+    portENTER_CRITICAL(&lock);
+    if (entry_count < MAX_ENTRIES) {
+      entries[entry_count++] = Entry{what, bytes};
+    }
+    portEXIT_CRITICAL(&lock);
+  }
+
+  void report() {
+    const auto TAG = "budget";
+    size_t total   = 0;
+    for (size_t i = 0; i < entry_count; ++i) {
+      ESP_LOGI(TAG, "%-16s %6u bytes", entries[i].what, entries[i].bytes);
+      total += entries[i].bytes;
+    }
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+    ESP_LOGI(TAG, "%u bytes of tasks, queues and buffers, statically allocated", total);
+#else
+    ESP_LOGI(TAG, "%u bytes of tasks, queues and buffers, on the heap", total);
+#endif
+    ESP_LOGI(TAG, "heap free %u, min free %u, largest free block %u, internal free %u",
+             heap_caps_get_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+             heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+             heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+  }
+}
+
+namespace alloc_guard {
+  namespace {
+    // how many allocations after boot are printed one by one
+    constexpr uint32_t MAX_PRINTED = 16;
+    std::atomic_bool sealed{false};
+    std::atomic<uint32_t> allocations{0};
+    std::atomic<uint32_t> allocated_bytes{0};
+    std::atomic<uint32_t> last_checked{0};
+  }
+
+  void on_alloc(size_t size) {
+    if (!sealed.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto n = allocations.fetch_add(1, std::memory_order_relaxed) + 1;
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (n <= MAX_PRINTED) {
+      // ESP_LOG may lock or allocate itself; the ROM printf does neither
+      esp_rom_printf("alloc_guard: %u bytes allocated after boot in task %s\n", size, pcTaskGetName(nullptr));
+    }
+  }
+
+  void seal() {
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+    sealed = true;
+#endif
+  }
+
+  uint32_t count() {
+    return allocations;
+  }
+
+  uint32_t check() {
+    auto n    = allocations.load();
+    // may be called from several tasks; each allocation is reported once
+    auto prev = last_checked.load();
+    while (prev < n && !last_checked.compare_exchange_weak(prev, n)) {}
+    auto delta = prev < n ? n - prev : 0;
+    if (delta > 0) {
+      ESP_LOGW("alloc_guard", "%lu heap allocation(s) since the last check, %lu total (%lu bytes)",
+               delta, n, allocated_bytes.load());
+    }
+    return delta;
+  }
+}
+}
+
+#if CONFIG_WITHUB_STATIC_ALLOCATION
+// the other forms of `new` (array, nothrow) end up here in libstdc++
+void *operator new(std::size_t size) {
+  utils::alloc_guard::on_alloc(size);
+  auto p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+#endif
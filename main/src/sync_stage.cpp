@@ -0,0 +1,107 @@
+//
+// Publishes synchronized frames of all the connected sensors at a fixed rate.
+//
+
+#include <cstring>
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include "sync_stage.h"
+#include "utils.h"
+
+namespace align {
+esp_err_t SyncStage::init(wlan::WlanManager &manager, uint32_t rate_hz, uint32_t latency_ms) {
+  const auto TAG = "SyncStage::init";
+  if (rate_hz == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  uint8_t mac[6];
+  ESP_RETURN_ON_ERROR(esp_read_mac(mac, ESP_MAC_WIFI_STA), TAG, "Failed to read MAC");
+  ESP_RETURN_ON_ERROR(_mutex.init(), TAG, "Failed to create mutex");
+  _manager        = &manager;
+  auto opts       = Aligner::Options{};
+  opts.latency_us = static_cast<int64_t>(latency_ms) * 1000;
+  // in place, an `Aligner` is too large for the stack
+  _aligner.reset(opts);
+  std::strcpy(_topic, "/wit/sync/");
+  utils::sprintHex(_topic + std::strlen(_topic), sizeof(_topic) - std::strlen(_topic), mac, sizeof(mac));
+  utils::budget::add("sync_stage", sizeof(*this));
+
+  ESP_RETURN_ON_ERROR(_task.start(tick, "sync_frame", this, 5, 1'000'000 / rate_hz), TAG, "Failed to start frame task");
+  ESP_LOGI(TAG, "%lu frames/s, %lu ms behind, to %s", rate_hz, latency_ms, _topic);
+  return ESP_OK;
+}
+
+SyncStage::Stream *SyncStage::_stream(const addr_t &addr) {
+  Stream *free = nullptr;
+  for (auto &s : _streams) {
+    if (s.used && s.addr == addr) {
+      return &s;
+    }
+    if (!s.used && free == nullptr) {
+      free = &s;
+    }
+  }
+  if (free != nullptr) {
+    free->used = true;
+    free->addr = addr;
+    free->reassembler.reset();
+  }
+  return free;
+}
+
+void SyncStage::on_data(const addr_t &addr, const uint8_t *data, size_t len) {
+  auto now     = esp_timer_get_time();
+  auto lock    = utils::Lock{_mutex};
+  auto *stream = _stream(addr);
+  if (stream != nullptr) {
+    stream->reassembler.feed(data, len, [this, &addr, now](const uint8_t *frame) {
+      if (frame[1] != wit::FLAG_DATA) {
+        return;
+      }
+      _aligner.push(addr, now, wit::decode_data_frame(frame).fields);
+    });
+  }
+}
+
+void SyncStage::on_disconnect(const addr_t &addr) {
+  auto now  = esp_timer_get_time();
+  auto lock = utils::Lock{_mutex};
+  _aligner.disconnect(addr, now);
+  // for the next sensor to connect
+  for (auto &s : _streams) {
+    if (s.used && s.addr == addr) {
+      s.used = false;
+    }
+  }
+}
+
+Aligner::Stats SyncStage::stats() {
+  auto lock = utils::Lock{_mutex};
+  return _aligner.stats();
+}
+
+void SyncStage::tick(void *arg) {
+  auto &self = *static_cast<SyncStage *>(arg);
+  size_t len = 0;
+  {
+    auto lock = utils::Lock{self._mutex};
+    self._aligner.frame(esp_timer_get_time(), self._frame);
+    len = encode(self._frame, self._buf, sizeof(self._buf));
+  }
+  if (self._frame.count == 0) {
+    return;
+  }
+  auto msg = wlan::MqttPubMsg{
+      .topic  = self._topic,
+      .data   = {self._buf, len},
+      .stream = true,
+  };
+  // don't care about the result
+  auto _ = self._manager->publish(msg);
+}
+}
@@ -0,0 +1,140 @@
+//
+// Sequence-numbered, batched UDP datagrams to a collector on the local network.
+//
+
+#include <esp_check.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <unistd.h>
+#include "udp_transport.h"
+
+namespace wlan {
+esp_err_t UdpTransport::init(const char *host, uint16_t port, uint32_t flush_interval_ms) {
+  const auto TAG = "UdpTransport::init";
+  if (host == nullptr || port == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  _host              = host;
+  _port              = port;
+  _flush_interval_ms = flush_interval_ms;
+  ESP_RETURN_ON_ERROR(_mutex.init(), TAG, "Failed to create mutex");
+  utils::budget::add("udp_datagram", sizeof(_batch));
+  if (_flush_interval_ms > 0) {
+    ESP_RETURN_ON_ERROR(_flush_task.start(flush_task, "udp_flush", this, 5), TAG, "Failed to create flush task");
+  }
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::_resolve() {
+  const auto TAG        = "UdpTransport::resolve";
+  _collector            = sockaddr_in{};
+  _collector.sin_family = AF_INET;
+  _collector.sin_port   = htons(_port);
+  if (inet_pton(AF_INET, _host, &_collector.sin_addr) == 1) {
+    return ESP_OK;
+  }
+  addrinfo hints{};
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo *res     = nullptr;
+  auto err          = getaddrinfo(_host, nullptr, &hints, &res);
+  if (err != 0 || res == nullptr) {
+    ESP_LOGE(TAG, "failed to resolve %s (%d)", _host, err);
+    return ESP_FAIL;
+  }
+  _collector.sin_addr = reinterpret_cast<sockaddr_in *>(res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::open() {
+  const auto TAG = "UdpTransport::open";
+  if (!_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  close();
+  ESP_RETURN_ON_ERROR(_resolve(), TAG, "Failed to resolve collector");
+  auto sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ESP_RETURN_ON_FALSE(sock >= 0, ESP_FAIL, TAG, "Failed to create socket; errno %d", errno);
+  {
+    auto lock = utils::Lock{_mutex};
+    _sock     = sock;
+  }
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &_collector.sin_addr, ip, sizeof(ip));
+  ESP_LOGI(TAG, "streaming to %s:%d", ip, _port);
+  return ESP_OK;
+}
+
+void UdpTransport::close() {
+  if (!_mutex.is_initialized()) {
+    return;
+  }
+  auto lock = utils::Lock{_mutex};
+  if (_sock >= 0) {
+    ::close(_sock);
+    _sock = -1;
+  }
+  _dropped += _batch.count();
+  _batch.reset();
+}
+
+esp_err_t UdpTransport::_flush() {
+  if (_batch.empty()) {
+    return ESP_OK;
+  }
+  auto *data = _batch.finish(_seq, esp_timer_get_time());
+  auto n     = sendto(_sock, data, _batch.size(), MSG_DONTWAIT,
+                      reinterpret_cast<const sockaddr *>(&_collector), sizeof(_collector));
+  // the sequence number advances even if the datagram didn't leave, so the
+  // receiver accounts for it as lost
+  _seq += 1;
+  auto count = _batch.count();
+  _batch.reset();
+  if (n < 0) {
+    ESP_LOGD("UdpTransport::flush", "sendto failed; errno %d", errno);
+    _dropped += count;
+    return ESP_FAIL;
+  }
+  _sent += count;
+  return ESP_OK;
+}
+
+esp_err_t UdpTransport::send(std::string_view topic, const uint8_t *data, size_t len) {
+  if (!_mutex.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!stream::Batcher<>::fits_empty(topic.size(), len)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  auto lock = utils::Lock{_mutex};
+  auto err  = ESP_OK;
+  if (_sock < 0) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    if (!_batch.append(topic, data, len)) {
+      err = _flush();
+      _batch.append(topic, data, len);
+    }
+    if (_flush_interval_ms == 0) {
+      err = _flush();
+    }
+  }
+  return err;
+}
+
+void UdpTransport::flush_task(void *pvParameters) {
+  auto &self = *static_cast<UdpTransport *>(pvParameters);
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(self._flush_interval_ms));
+    auto lock = utils::Lock{self._mutex};
+    if (self._sock >= 0) {
+      self._flush();
+    }
+  }
+}
+}
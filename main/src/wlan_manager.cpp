@@ -2,10 +2,25 @@
 // Created by Kurosu Chan on 2023/10/27.
 //
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <esp_mac.h>
+#include <esp_random.h>
 #include "utils.h"
 #include "wlan_manager.h"
 
 namespace wlan {
+ESP_EVENT_DEFINE_BASE(WLAN_MANAGER_EVENT);
+
+namespace {
+  const auto NVS_NAMESPACE        = "wlan";
+  const auto NVS_FAST_CONNECT_KEY = "fast";
+  // when the event queue is full, how long until the retry is posted again
+  constexpr uint64_t RETRY_POST_US = 100'000;
+  constexpr auto WLAN_STATUS_TOPIC = "/wlan";
+}
+
 esp_err_t WlanManager::_register_wifi_handlers() {
   auto TAG   = "WlanManager::register_wifi_handlers";
   auto &self = *this;
@@ -14,7 +29,12 @@ esp_err_t WlanManager::_register_wifi_handlers() {
         auto &self         = *static_cast<WlanManager *>(arg);
         auto TAG           = "WlanManager::connect::wifi_event";
         self._is_connected = true;
-        ESP_LOGI(TAG, "Connected to AP");
+        auto &event        = *static_cast<wifi_event_sta_connected_t *>(event_data);
+        ESP_LOGI(TAG, "Connected to AP " MACSTR " on channel %d", MAC2STR(event.bssid), event.channel);
+        if (self._phase == ConnectPhase::fast) {
+          self._metrics.fast_connect_hits += 1;
+        }
+        self._phase = ConnectPhase::connected;
         // connection has been established but somehow the connection is lost
         if (self._has_ip) {
           if (self.mqtt_handle != nullptr) {
@@ -35,11 +55,97 @@ esp_err_t WlanManager::_register_wifi_handlers() {
         auto &self         = *static_cast<WlanManager *>(arg);
         self._is_connected = false;
         auto TAG           = "WlanManager::connect::wifi_event";
-        ESP_LOGI(TAG, "Disconnected from AP");
+        auto &event        = *static_cast<wifi_event_sta_disconnected_t *>(event_data);
+        ESP_LOGI(TAG, "Disconnected from AP; reason %d", event.reason);
+        switch (self._phase) {
+          case ConnectPhase::roaming: {
+            // we left on purpose; go straight to the stronger AP
+            self._metrics.roams += 1;
+            self._reconnect_start_us = esp_timer_get_time();
+            self._phase              = ConnectPhase::connecting;
+            const auto &t            = self._target;
+            auto err                 = _connect(self._aps[t.ap_index], t.bssid, t.channel);
+            if (err != ESP_OK) {
+              self._schedule_retry();
+            }
+            break;
+          }
+          case ConnectPhase::fast:
+            // the cached AP is gone or moved; fall back to a scan right away
+            self._metrics.fast_connect_misses += 1;
+            self._attempt += 1;
+            self._next_attempt();
+            break;
+          case ConnectPhase::connected:
+          case ConnectPhase::roam_scanning:
+            // lost the link; the first attempt is a fast one without delay
+            self._reconnect_start_us = esp_timer_get_time();
+            self._attempt            = 0;
+            self._waiting_mqtt       = false;
+            self._next_attempt();
+            break;
+          case ConnectPhase::connecting:
+            self._attempt += 1;
+            self._schedule_retry();
+            break;
+          case ConnectPhase::idle:
+          case ConnectPhase::scanning:
+            break;
+        }
       },
       &self);
   ESP_RETURN_ON_ERROR(err, TAG, "Failed to register wifi event handler");
 
+  err = esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_SCAN_DONE, [](void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+        auto &self = *static_cast<WlanManager *>(arg);
+        self._on_scan_done();
+      },
+      &self);
+  ESP_RETURN_ON_ERROR(err, TAG, "Failed to register wifi event handler");
+
+  // fired once each time the RSSI drops below the threshold set by `esp_wifi_set_rssi_threshold`
+  err = esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_STA_BSS_RSSI_LOW, [](void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+        auto &self  = *static_cast<WlanManager *>(arg);
+        auto TAG    = "WlanManager::connect::wifi_event";
+        auto &event = *static_cast<wifi_event_bss_rssi_low_t *>(event_data);
+        if (self._phase != ConnectPhase::connected) {
+          return;
+        }
+        ESP_LOGI(TAG, "RSSI %ld below threshold; looking for a stronger AP", event.rssi);
+        auto err = self._start_scan(true);
+        if (err != ESP_OK) {
+          ESP_LOGW(TAG, "Failed to start roam scan; Reason %s", esp_err_to_name(err));
+        }
+      },
+      &self);
+  ESP_RETURN_ON_ERROR(err, TAG, "Failed to register wifi event handler");
+
+  err = esp_event_handler_register(
+      WLAN_MANAGER_EVENT, WLAN_MANAGER_EVENT_RETRY, [](void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+        auto &self = *static_cast<WlanManager *>(arg);
+        // a retry posted before `start_connect` or before we got an IP can't
+        // be taken back; only a flow that is waiting for it goes on
+        if (self._phase != ConnectPhase::idle) {
+          return;
+        }
+        self._next_attempt();
+      },
+      &self);
+  ESP_RETURN_ON_ERROR(err, TAG, "Failed to register retry event handler");
+
+  err = esp_event_handler_register(
+      WLAN_MANAGER_EVENT, WLAN_MANAGER_EVENT_START, [](void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
+        auto &self = *static_cast<WlanManager *>(arg);
+        esp_timer_stop(self._retry_timer);
+        self._reconnect_start_us = esp_timer_get_time();
+        self._attempt            = 0;
+        self._next_attempt();
+      },
+      &self);
+  ESP_RETURN_ON_ERROR(err, TAG, "Failed to register start event handler");
+
   // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#ip-event-sta-got-ip
   // Upon receiving this event,
   // the application needs to close all sockets and recreate the application when the IPV4 changes to a valid one.
@@ -48,19 +154,33 @@ esp_err_t WlanManager::_register_wifi_handlers() {
         auto &self   = *static_cast<WlanManager *>(arg);
         self._has_ip = true;
         auto TAG     = "WlanManager::connect::ip_event";
-        // stop the connect task if it is running
-        if (self._connect_task_handle != nullptr) {
-          auto old                  = self._connect_task_handle;
-          self._connect_task_handle = nullptr;
-          vTaskDelete(old);
-        }
         // data, aside from event data, that is passed to the handler when it is called
         // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/system/esp_event.html#_CPPv426esp_event_handler_register16esp_event_base_t7int32_t19esp_event_handler_tPv
         // Event structure for IP_EVENT_STA_GOT_IP, IP_EVENT_ETH_GOT_IP events
         // https://docs.espressif.com/projects/esp-idf/en/v4.0.3/api-reference/network/tcpip_adapter.html
         auto *event   = (ip_event_got_ip_t *)event_data;
         auto &ip_info = event->ip_info;
-        ESP_LOGI(TAG, "Got ip: %d.%d.%d.%d", IP2STR(&ip_info.ip));
+        auto elapsed  = (esp_timer_get_time() - self._reconnect_start_us) / 1000;
+        self._metrics.connects += 1;
+        self._metrics.time_to_ip_ms = elapsed;
+        self._waiting_mqtt          = true;
+        self._attempt               = 0;
+        esp_timer_stop(self._retry_timer);
+        ESP_LOGI(TAG, "Got ip: %d.%d.%d.%d (time to ip %lld ms)", IP2STR(&ip_info.ip), elapsed);
+        auto err = self._save_cache();
+        if (err != ESP_OK) {
+          ESP_LOGW(TAG, "Failed to save fast connect cache; Reason %s", esp_err_to_name(err));
+        }
+        // re-armed after every connection, since it only fires once
+        esp_wifi_set_rssi_threshold(CONFIG_WITHUB_WLAN_ROAM_RSSI_THRESHOLD);
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+        if (self._udp.is_initialized()) {
+          auto err = self._udp.open();
+          if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to open udp transport; Reason %s", esp_err_to_name(err));
+          }
+        }
+#endif
         if (self.mqtt_handle != nullptr) {
           ESP_LOGI(TAG, "Connecting to mqtt broker");
           auto err = esp_mqtt_client_start(self.mqtt_handle);
@@ -81,10 +201,9 @@ esp_err_t WlanManager::_register_wifi_handlers() {
         self._has_ip = false;
         auto TAG     = "WlanManager::connect::ip_event";
         ESP_LOGI(TAG, "Lost ip");
-        auto err = self.start_connect_task();
-        if (err != ESP_OK) {
-          ESP_LOGE(TAG, "Failed to start connect task");
-        }
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+        self._udp.close();
+#endif
         if (self.mqtt_handle != nullptr) {
           ESP_LOGI(TAG, "Disconnecting from mqtt broker");
           esp_mqtt_client_stop(self.mqtt_handle);
@@ -127,10 +246,33 @@ esp_err_t WlanManager::wifi_init() { // NOLINT(*-make-member-function-const)
   ESP_RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_STA), TAG, "Failed to set wifi mode");
   ESP_RETURN_ON_ERROR(esp_wifi_start(), TAG, "Failed to start wifi");
   ESP_RETURN_ON_ERROR(_register_wifi_handlers(), TAG, "Failed to register wifi handlers");
+  esp_timer_create_args_t timer_args{
+      .callback = [](void *arg) {
+        auto &self = *static_cast<WlanManager *>(arg);
+        // hop onto the event loop, where the rest of the connection flow runs;
+        // the esp_timer task mustn't wait for room in its queue, so a retry
+        // that doesn't fit is posted again a bit later rather than lost
+        auto err = esp_event_post(WLAN_MANAGER_EVENT, WLAN_MANAGER_EVENT_RETRY, nullptr, 0, 0);
+        if (err != ESP_OK) {
+          ESP_LOGW("WlanManager::retry", "failed to post retry, reason %s (%d)", esp_err_to_name(err), err);
+          // unless the connection flow has re-armed it in the meantime
+          esp_timer_start_once(self._retry_timer, RETRY_POST_US);
+        }
+      },
+      .arg                   = this,
+      .dispatch_method       = ESP_TIMER_TASK,
+      .name                  = "wlan_retry",
+      .skip_unhandled_events = true,
+  };
+  ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &_retry_timer), TAG, "Failed to create retry timer");
+  auto err = _load_cache();
+  if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+    ESP_LOGW(TAG, "Failed to load fast connect cache; Reason %s", esp_err_to_name(err));
+  }
   return ESP_OK;
 }
 
-esp_err_t WlanManager::_connect(const AP &access_point) {
+esp_err_t WlanManager::_connect(const AP &access_point, const uint8_t *bssid, uint8_t channel) {
   const auto TAG = "WlanManager::connect";
   wifi_config_t wifi_config{};
 
@@ -147,6 +289,15 @@ esp_err_t WlanManager::_connect(const AP &access_point) {
   }
   std::fill(wifi_config.sta.password, wifi_config.sta.password + 64, 0x00);
   std::copy(access_point.password.begin(), access_point.password.end(), wifi_config.sta.password);
+  if (bssid != nullptr) {
+    // with both set the driver only probes this channel instead of scanning all of them
+    wifi_config.sta.bssid_set = true;
+    std::copy(bssid, bssid + 6, wifi_config.sta.bssid);
+    wifi_config.sta.channel = channel;
+  } else {
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+  }
   ESP_RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), TAG, "Failed to set wifi config");
   ESP_RETURN_ON_ERROR(esp_wifi_connect(), TAG, "Failed to connect to wifi");
 
@@ -158,13 +309,26 @@ esp_err_t WlanManager::set_ap(AP new_ap) {
   if (new_ap.ssid.empty()) {
     return ESP_ERR_INVALID_ARG;
   }
-  this->_ap = std::move(new_ap);
+  _aps.clear();
+  _aps.emplace_back(std::move(new_ap));
+  _target = Target{};
   if (_is_connected) {
     ESP_RETURN_ON_ERROR(_disconnect(), TAG, "Failed to disconnect from wifi");
   }
   return ESP_OK;
 }
 
+esp_err_t WlanManager::add_ap(AP new_ap) {
+  if (new_ap.ssid.empty()) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (_aps.full()) {
+    return ESP_ERR_NO_MEM;
+  }
+  _aps.emplace_back(std::move(new_ap));
+  return ESP_OK;
+}
+
 esp_err_t WlanManager::_disconnect() {
   const auto TAG = "WlanManager::disconnect";
   ESP_RETURN_ON_ERROR(esp_wifi_disconnect(), TAG, "Failed to disconnect from wifi");
@@ -172,20 +336,38 @@ esp_err_t WlanManager::_disconnect() {
 }
 
 esp_err_t WlanManager::mqtt_init() {
+  ESP_RETURN_ON_ERROR(_sub_msg_chan.init("mqtt_sub_queue"), "WlanManager::mqtt_init", "Failed to create subscription queue");
+  uint8_t mac[6];
+  ESP_RETURN_ON_ERROR(esp_read_mac(mac, ESP_MAC_WIFI_STA), "WlanManager::mqtt_init", "Failed to read MAC");
+  std::strcpy(_status_topic, STATUS_TOPIC_PREFIX);
+  utils::sprintHex(_status_topic + std::strlen(STATUS_TOPIC_PREFIX), ADDR_HEX + 1, mac, sizeof(mac));
+  std::strcat(_status_topic, WLAN_STATUS_TOPIC);
   esp_mqtt_client_config_t mqtt_cfg{};
   // uri have precedence over other fields
   mqtt_cfg.broker.address.uri     = BROKER_URL;
+  if (_will_topic != nullptr) {
+    mqtt_cfg.session.last_will.topic   = _will_topic;
+    mqtt_cfg.session.last_will.msg     = reinterpret_cast<const char *>(_will);
+    mqtt_cfg.session.last_will.msg_len = static_cast<int>(_will_len);
+  }
   esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
   this->mqtt_handle               = client;
   ESP_RETURN_ON_ERROR(_register_mqtt_handlers(), "WlanManager::mqtt_init", "Failed to register mqtt handlers");
   return ESP_OK;
 }
 
-esp_err_t WlanManager::connect() {
-  if (_ap == etl::nullopt) {
+esp_err_t WlanManager::set_last_will(const char *topic, const uint8_t *msg, size_t len) {
+  if (mqtt_handle != nullptr) {
     return ESP_ERR_INVALID_STATE;
   }
-  return _connect(_ap.value());
+  // the client would take the message for a C string
+  if (topic == nullptr || msg == nullptr || len == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  _will_topic = topic;
+  _will       = msg;
+  _will_len   = len;
+  return ESP_OK;
 }
 
 esp_err_t WlanManager::do_subscribe() {
@@ -204,32 +386,43 @@ esp_err_t WlanManager::do_subscribe() {
   }
   return ESP_OK;
 }
-esp_err_t WlanManager::subscribe(const std::string &topic) {
-  auto existed = std::find_if(subscribed_topics.begin(), subscribed_topics.end(), [&topic](const std::string &t) {
-    return t == topic;
+esp_err_t WlanManager::subscribe(std::string_view topic) {
+  auto existed = std::find_if(subscribed_topics.begin(), subscribed_topics.end(), [&topic](const topic_t &t) {
+    return std::string_view{t.data(), t.size()} == topic;
   });
   // already subscribed
   if (existed != subscribed_topics.end()) {
     return ESP_OK;
   }
-  subscribed_topics.push_back(topic);
+  if (topic.size() > MAX_TOPIC_LENGTH) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (subscribed_topics.full()) {
+    return ESP_ERR_NO_MEM;
+  }
+  subscribed_topics.push_back(topic_t{topic.data(), topic.size()});
+  const auto &t = subscribed_topics.back();
   if (mqtt_handle == nullptr) {
     return ESP_ERR_INVALID_STATE;
   }
   if (!_has_ip) {
     return ESP_ERR_INVALID_STATE;
   }
-  ESP_LOGI("WlanManager::subscribe", "subscribing to %s", topic.c_str());
-  auto msg_id = esp_mqtt_client_subscribe(mqtt_handle, topic.c_str(), 0);
+  ESP_LOGI("WlanManager::subscribe", "subscribing to %s", t.c_str());
+  auto msg_id = esp_mqtt_client_subscribe(mqtt_handle, t.c_str(), 0);
   if (msg_id < 0) {
     return ESP_FAIL;
   }
   return ESP_OK;
 }
 
-esp_err_t WlanManager::unsubscribe(const std::string &topic) {
-  subscribed_topics.erase(std::remove(subscribed_topics.begin(), subscribed_topics.end(), topic), subscribed_topics.end());
-  return esp_mqtt_client_unsubscribe(mqtt_handle, topic.c_str());
+esp_err_t WlanManager::unsubscribe(std::string_view topic) {
+  if (topic.size() > MAX_TOPIC_LENGTH) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  auto t = topic_t{topic.data(), topic.size()};
+  subscribed_topics.erase(std::remove(subscribed_topics.begin(), subscribed_topics.end(), t), subscribed_topics.end());
+  return esp_mqtt_client_unsubscribe(mqtt_handle, t.c_str());
 }
 
 esp_err_t WlanManager::_register_mqtt_handlers() {
@@ -238,7 +431,13 @@ esp_err_t WlanManager::_register_mqtt_handlers() {
       mqtt_handle, MQTT_EVENT_CONNECTED,
       [](void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
         auto &manager = *static_cast<WlanManager *>(arg);
+        if (manager._waiting_mqtt) {
+          manager._waiting_mqtt            = false;
+          manager._metrics.time_to_mqtt_ms = (esp_timer_get_time() - manager._reconnect_start_us) / 1000;
+          ESP_LOGI("mqtt", "connected; time to mqtt %lld ms", manager._metrics.time_to_mqtt_ms);
+        }
         manager.do_subscribe();
+        manager._publish_reconnect_metrics();
       },
       this);
   ESP_RETURN_ON_ERROR(err, TAG, "register MQTT_EVENT_CONNECTED handler");
@@ -248,71 +447,304 @@ esp_err_t WlanManager::_register_mqtt_handlers() {
         const auto TAG = "mqtt::MQTT_EVENT_DATA";
         auto &manager  = *static_cast<WlanManager *>(arg);
         auto &event    = *static_cast<esp_mqtt_event_handle_t>(event_data);
-        auto sub_data  = std::vector<uint8_t>(event.data, event.data + event.data_len);
-        auto sub_topic = std::string(event.topic, event.topic_len);
-        ESP_LOGI(TAG, "topic=%s (%d), data=%s (%d)", sub_topic.c_str(), sub_topic.size(),
-                 utils::toHex(sub_data.data(), sub_data.size()).c_str(), sub_data.size());
-        auto sub_msg = MqttSubMsg{.topic = std::move(sub_topic), .data = std::move(sub_data)};
-        manager._sub_msg_chan << std::move(sub_msg);
+        ESP_LOGI(TAG, "topic=%.*s (%d), data (%d)", event.topic_len, event.topic, event.topic_len, event.data_len);
+        // a message larger than the MQTT buffer comes in chunks; only take complete ones
+        if (event.topic_len <= 0 || event.topic_len > MAX_TOPIC_LENGTH ||
+            event.data_len > MAX_SUB_DATA_LENGTH || event.data_len != event.total_data_len) {
+          ESP_LOGW(TAG, "message too long, dropped");
+          return;
+        }
+        auto sub_msg      = MqttSubMsg{};
+        sub_msg.topic_len = event.topic_len;
+        sub_msg.data_len  = event.data_len;
+        std::copy(event.topic, event.topic + event.topic_len, sub_msg.topic_buf);
+        std::copy(event.data, event.data + event.data_len, sub_msg.data_buf);
+        // don't block the mqtt task when the consumer is behind
+        if (!manager._sub_msg_chan.send(sub_msg)) {
+          ESP_LOGW(TAG, "subscription queue full, dropped");
+        }
       },
       this);
   ESP_RETURN_ON_ERROR(err, TAG, "register MQTT_EVENT_DATA handler");
   return ESP_OK;
 }
 
-void WlanManager::connect_task(void *pvParameters) {
-  auto &self     = *static_cast<WlanManager *>(pvParameters);
-  const auto TAG = "connect_task";
-  for (;;) {
-    if (self._ap.has_value()) {
-      auto err = self.connect();
+void WlanManager::_publish_reconnect_metrics() {
+  const auto &m = _metrics;
+  char payload[128];
+  auto len      = std::snprintf(payload, sizeof(payload),
+                                "connects=%lu fast_hits=%lu fast_misses=%lu roams=%lu time_to_ip_ms=%lld time_to_mqtt_ms=%lld",
+                                m.connects, m.fast_connect_hits, m.fast_connect_misses, m.roams,
+                                m.time_to_ip_ms, m.time_to_mqtt_ms);
+  auto msg      = MqttPubMsg{
+           .topic  = _status_topic,
+           .data   = {reinterpret_cast<const uint8_t *>(payload), static_cast<size_t>(len)},
+           .retain = 1,
+  };
+  auto err = publish(msg);
+  if (err != ESP_OK) {
+    ESP_LOGW("WlanManager::reconnect_metrics", "failed to publish, reason %s (%d)", esp_err_to_name(err), err);
+  }
+}
+
+esp_err_t WlanManager::_load_cache() {
+  nvs_handle_t handle;
+  ESP_RETURN_ON_ERROR(nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle), "WlanManager::load_cache", "Failed to open nvs");
+  auto cache = FastConnectCache{};
+  size_t len = sizeof(cache);
+  auto err   = nvs_get_blob(handle, NVS_FAST_CONNECT_KEY, &cache, &len);
+  nvs_close(handle);
+  if (err != ESP_OK) {
+    return err;
+  }
+  if (len != sizeof(cache) || cache.version != FastConnectCache::VERSION) {
+    return ESP_ERR_INVALID_VERSION;
+  }
+  cache.ssid[sizeof(cache.ssid) - 1] = '\0';
+  _cache                             = cache;
+  return ESP_OK;
+}
+
+esp_err_t WlanManager::_save_cache() {
+  const auto TAG = "WlanManager::save_cache";
+  wifi_ap_record_t info{};
+  ESP_RETURN_ON_ERROR(esp_wifi_sta_get_ap_info(&info), TAG, "Failed to get ap info");
+  auto cache    = FastConnectCache{};
+  cache.channel = info.primary;
+  std::copy(info.bssid, info.bssid + 6, cache.bssid);
+  std::copy(info.ssid, info.ssid + sizeof(cache.ssid) - 1, cache.ssid);
+  // don't wear the flash out when nothing changed
+  if (_cache.has_value() && std::memcmp(&_cache.value(), &cache, sizeof(cache)) == 0) {
+    return ESP_OK;
+  }
+  nvs_handle_t handle;
+  ESP_RETURN_ON_ERROR(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle), TAG, "Failed to open nvs");
+  auto err = nvs_set_blob(handle, NVS_FAST_CONNECT_KEY, &cache, sizeof(cache));
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  ESP_RETURN_ON_ERROR(err, TAG, "Failed to write nvs");
+  _cache = cache;
+  return ESP_OK;
+}
+
+void WlanManager::_next_attempt() {
+  const auto TAG = "WlanManager::next_attempt";
+  if (_aps.empty()) {
+    ESP_LOGW(TAG, "no ap to connect");
+    _phase = ConnectPhase::idle;
+    return;
+  }
+#if CONFIG_WITHUB_WLAN_FAST_CONNECT
+  if (_attempt == 0 && _cache.has_value()) {
+    const auto &cache = _cache.value();
+    auto found        = std::find_if(_aps.begin(), _aps.end(), [&cache](const AP &ap) {
+      return ap.ssid == cache.ssid;
+    });
+    if (found != _aps.end()) {
+      _target.ap_index = std::distance(_aps.begin(), found);
+      std::copy(cache.bssid, cache.bssid + 6, _target.bssid);
+      _target.channel = cache.channel;
+      ESP_LOGI(TAG, "fast connect to %s (" MACSTR ") on channel %d", cache.ssid, MAC2STR(cache.bssid), cache.channel);
+      _phase   = ConnectPhase::fast;
+      auto err = _connect(*found, _target.bssid, _target.channel);
       if (err == ESP_OK) {
-        auto old                  = self._connect_task_handle;
-        self._connect_task_handle = nullptr;
-        if (old != nullptr) {
-          vTaskDelete(old);
-        }
         return;
-      } else {
-        ESP_LOGE(TAG, "failed to connect to ap, reason %s (%d)", esp_err_to_name(err), err);
       }
-    } else {
-       ESP_LOGW(TAG, "no ap to connect");
+      ESP_LOGE(TAG, "failed to fast connect, reason %s (%d)", esp_err_to_name(err), err);
     }
-    vTaskDelay(pdMS_TO_TICKS(1000));
+  }
+#endif
+  auto err = _start_scan(false);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "failed to scan, reason %s (%d)", esp_err_to_name(err), err);
+    _attempt += 1;
+    _schedule_retry();
   }
 }
 
-esp_err_t WlanManager::start_connect_task() {
-  if (_connect_task_handle != nullptr) {
-    auto old             = _connect_task_handle;
-    _connect_task_handle = nullptr;
-    vTaskDelete(old);
+esp_err_t WlanManager::_start_scan(bool roam) {
+  wifi_scan_config_t config{};
+  config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+  if (roam) {
+    // keep the time off channel short, we are still carrying traffic
+    config.scan_time.active.min = 20;
+    config.scan_time.active.max = 40;
   }
-  auto ok = xTaskCreate(connect_task, "connect_task", 4096, this, 1, &_connect_task_handle);
-  if (ok != pdPASS) {
-    return ESP_FAIL;
+  _phase = roam ? ConnectPhase::roam_scanning : ConnectPhase::scanning;
+  return esp_wifi_scan_start(&config, false);
+}
+
+void WlanManager::_on_scan_done() {
+  const auto TAG = "WlanManager::scan_done";
+  auto roam      = _phase == ConnectPhase::roam_scanning;
+  if (!roam && _phase != ConnectPhase::scanning) {
+    // someone else's scan
+    return;
+  }
+  uint16_t n = MAX_SCAN_RECORDS;
+  auto err   = esp_wifi_scan_get_ap_records(&n, _scan_records);
+  if (err != ESP_OK) {
+    n = 0;
   }
+  // the strongest BSS of any configured SSID
+  const wifi_ap_record_t *best = nullptr;
+  size_t best_index            = 0;
+  for (uint16_t i = 0; i < n; ++i) {
+    const auto &record = _scan_records[i];
+    for (size_t j = 0; j < _aps.size(); ++j) {
+      if (_aps[j].ssid != reinterpret_cast<const char *>(record.ssid)) {
+        continue;
+      }
+      if (best == nullptr || record.rssi > best->rssi) {
+        best       = &record;
+        best_index = j;
+      }
+    }
+  }
+
+  if (roam) {
+    _phase = ConnectPhase::connected;
+    wifi_ap_record_t current{};
+    if (best == nullptr || esp_wifi_sta_get_ap_info(&current) != ESP_OK ||
+        std::equal(best->bssid, best->bssid + 6, current.bssid) ||
+        best->rssi < current.rssi + CONFIG_WITHUB_WLAN_ROAM_HYSTERESIS) {
+      ESP_LOGI(TAG, "no stronger ap to roam to");
+      esp_wifi_set_rssi_threshold(CONFIG_WITHUB_WLAN_ROAM_RSSI_THRESHOLD);
+      return;
+    }
+    ESP_LOGI(TAG, "roaming from " MACSTR " (%d) to " MACSTR " (%d)",
+             MAC2STR(current.bssid), current.rssi, MAC2STR(best->bssid), best->rssi);
+    _target.ap_index = best_index;
+    std::copy(best->bssid, best->bssid + 6, _target.bssid);
+    _target.channel = best->primary;
+    _phase          = ConnectPhase::roaming;
+    err             = _disconnect();
+    if (err != ESP_OK) {
+      _phase = ConnectPhase::connected;
+    }
+    return;
+  }
+
+  if (best == nullptr) {
+    ESP_LOGW(TAG, "no configured ap in range");
+    _attempt += 1;
+    _schedule_retry();
+    return;
+  }
+  ESP_LOGI(TAG, "connecting to %s (" MACSTR ") on channel %d, rssi %d",
+           _aps[best_index].ssid.c_str(), MAC2STR(best->bssid), best->primary, best->rssi);
+  _target.ap_index = best_index;
+  std::copy(best->bssid, best->bssid + 6, _target.bssid);
+  _target.channel = best->primary;
+  _phase          = ConnectPhase::connecting;
+  err             = _connect(_aps[best_index], _target.bssid, _target.channel);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "failed to connect to ap, reason %s (%d)", esp_err_to_name(err), err);
+    _attempt += 1;
+    _schedule_retry();
+  }
+}
+
+void WlanManager::_schedule_retry() {
+  const auto TAG = "WlanManager::schedule_retry";
+  _phase         = ConnectPhase::idle;
+  // full backoff for the attempt, then a random point in its upper half so a
+  // fleet of hubs doesn't hit the AP in lockstep after an outage
+  auto shift     = std::min<uint32_t>(_attempt, 16);
+  uint64_t delay = std::min<uint64_t>(static_cast<uint64_t>(CONFIG_WITHUB_WLAN_RETRY_BASE_MS) << shift,
+                                      CONFIG_WITHUB_WLAN_RETRY_MAX_MS);
+  delay          = delay / 2 + esp_random() % (delay / 2 + 1);
+  ESP_LOGI(TAG, "retry #%lu in %llu ms", _attempt, delay);
+  esp_timer_stop(_retry_timer);
+  auto err = esp_timer_start_once(_retry_timer, delay * 1000);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "failed to start retry timer, reason %s (%d)", esp_err_to_name(err), err);
+  }
+}
+
+esp_err_t WlanManager::start_connect() {
+  if (_retry_timer == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  // the caller's task can wait for room in the queue
+  return esp_event_post(WLAN_MANAGER_EVENT, WLAN_MANAGER_EVENT_START, nullptr, 0, portMAX_DELAY);
+}
+
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+esp_err_t WlanManager::udp_init(const char *host, uint16_t port, uint32_t flush_interval_ms) {
+  ESP_RETURN_ON_ERROR(_udp.init(host, port, flush_interval_ms), "WlanManager::udp_init", "Failed to init udp transport");
+  if (_has_ip) {
+    return _udp.open();
+  }
+  return ESP_OK;
+}
+#endif
+
+esp_err_t WlanManager::set_stream_transport(StreamTransport transport) {
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  if (transport == StreamTransport::udp && !_udp.is_initialized()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+#else
+  if (transport == StreamTransport::udp) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+#endif
+  _stream_transport = transport;
   return ESP_OK;
 }
 
 esp_err_t WlanManager::publish(const MqttPubMsg &msg) {
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  if (msg.stream && _stream_transport == StreamTransport::udp) {
+    // its losses are counted by the transport
+    return _udp.send(msg.topic, msg.data.data(), msg.data.size());
+  }
+#endif
   if (mqtt_handle == nullptr) {
     return ESP_ERR_INVALID_STATE;
   }
   if (!_has_ip) {
     return ESP_ERR_INVALID_STATE;
   }
-  auto id = esp_mqtt_client_publish(mqtt_handle,
-                                    msg.topic.c_str(),
-                                    reinterpret_cast<const char *>(msg.data.data()),
-                                    msg.data.size(),
-                                    msg.qos,
-                                    msg.retain);
+  if (msg.topic.size() > MAX_TOPIC_LENGTH) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  // the client wants a null terminated topic
+  auto topic = topic_t{msg.topic.data(), msg.topic.size()};
+  // at QoS 0 nothing waits in the outbox: the client writes to the socket
+  // right away and blocks while the uplink can't take more, and that's how
+  // long the data path is held up
+  auto start = esp_timer_get_time();
+  auto id    = esp_mqtt_client_publish(mqtt_handle,
+                                       topic.c_str(),
+                                       reinterpret_cast<const char *>(msg.data.data()),
+                                       msg.data.size(),
+                                       msg.qos,
+                                       msg.retain);
+  if (msg.stream) {
+    _stream_blocked_us += static_cast<uint32_t>(esp_timer_get_time() - start);
+  }
   if (id < 0) {
+    if (msg.stream) {
+      _stream_failures += 1;
+    }
     return ESP_FAIL;
   } else {
     return ESP_OK;
   }
 }
+
+PublishMetrics WlanManager::publish_metrics() const {
+  auto res   = PublishMetrics{};
+  res.failed = _stream_failures;
+#if CONFIG_WITHUB_STREAM_TRANSPORT_UDP
+  res.failed += _udp.dropped();
+#endif
+  // a UDP send doesn't block, what the uplink can't take is dropped
+  res.blocked_us = _stream_blocked_us;
+  return res;
+}
 }